@@ -5,14 +5,21 @@
  *
  *  Author:  Gene Myers
  *  Date  :  June 2014
+ *  Mod   :  Tracks are catenated in parallel, .data blocks are copied in-kernel
+ *             (copy_file_range) where available, and anno offsets are rebased a
+ *             block at a time.
  *
  ********************************************************************************************/
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "DB.h"
 
@@ -22,29 +29,493 @@
 #define PATHSEP "/"
 #endif
 
-static char *Usage = "[-vfd] <path:db|dam> <track:name> ...";
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 27)
+#define COPY_RANGE     //  copy_file_range is available (and will reflink on btrfs/xfs)
+#endif
+
+#define COPY_BUFFER 0x400000   //  Size of user-space buffer for .data copies if no copy_file_range
+
+static char *Usage = "[-vfd] [-T<int(4)>] <path:db|dam> <track:name> ...";
+
+static int   VERBOSE;
+static int   FORCE;
+static int   DELETE;
+
+static char *Prefix;    //  Path and root of DB, i.e. <pwd>/[.]<root>.
+static int   Nblocks;   //  # of blocks in the DB
+
+typedef struct
+  { char *track;    //  Name of track to catenate
+    char *oanno;    //  Names of the .anno and .data files of the catenated track
+    char *odata;
+    char *aname;    //  Name buffers for the files of the track, big enough for any block #
+    char *dname;
+    char *buffer;   //  Copy buffer (only allocated if needed)
+    int   status;   //  0 on success, 1 if the catenation was aborted
+    int   active;   //  The output .anno (and .data if dnew) exist but are not yet complete
+    int   dnew;
+  } Track_Arg;
+
+static Track_Arg *Tracks;    //  The work records of all the tracks, [0..Ntracks-1]
+static int        Ntracks;
+
+  //  A worker must not exit on an error as that would leave the tracks being catenated by
+  //    the other workers half-written, so the I/O error macros of DB.h instead abandon just
+  //    the track at hand by jumping to the error exit of catenate_track.
+
+#undef  SYSTEM_READ_ERROR
+#define SYSTEM_READ_ERROR						\
+  { fprintf(stderr,"%s: System error, read failed!\n",Prog_Name);	\
+    goto error;								\
+  }
+
+#undef  SYSTEM_WRITE_ERROR
+#define SYSTEM_WRITE_ERROR						\
+  { fprintf(stderr,"%s: System error, write failed!\n",Prog_Name);	\
+    goto error;								\
+  }
+
+#undef  SYSTEM_CLOSE_ERROR
+#define SYSTEM_CLOSE_ERROR						\
+  { fprintf(stderr,"%s: System error, file close failed!\n",Prog_Name);	\
+    goto error;								\
+  }
+
+#undef  FFREAD
+#define FFREAD(v,s,n,file)								\
+  { if (fread(v,s,n,file) != (size_t) n)						\
+      { if (ferror(file))								\
+          SYSTEM_READ_ERROR								\
+        else										\
+          { fprintf(stderr,"%s: The file %s is corrupted\n",Prog_Name,file ## _name);	\
+            goto error;									\
+          }										\
+      }											\
+  }
+
+  //  Remove the partial output of the track of parm
+
+static void remove_partial(Track_Arg *parm)
+{ parm->active = 0;
+  if (unlink(parm->oanno) != 0)
+    fprintf(stderr,"%s: [WARNING] Couldn't delete file %s during abort\n",Prog_Name,parm->oanno);
+  if (parm->dnew && unlink(parm->odata) != 0)
+    fprintf(stderr,"%s: [WARNING] Couldn't delete file %s during abort\n",Prog_Name,parm->odata);
+}
+
+  //  The DB.c routines called by a worker (e.g. Read_Extra) halt on an error, in which case
+  //    the partial output of every track still being catenated is removed on the way out
+
+static void abort_tracks()
+{ int c;
+
+  for (c = 0; c < Ntracks; c++)
+    if (Tracks[c].active)
+      remove_partial(Tracks+c);
+}
+
+  //  Free the extras [0..nextra] (the last is used to detect a surplus extra)
+
+static void free_extras(DAZZ_EXTRA *extra, int nextra)
+{ int i;
+
+  if (extra == NULL)
+    return;
+  for (i = 0; i <= nextra; i++)
+    { free(extra[i].name);
+      free(extra[i].value);
+    }
+  free(extra);
+}
+
+  //  Copy dlen bytes from the file descriptor din to dout, in the kernel if possible.
+  //    Return 0 on success, 1 if the input was short, -1 on a system error, and -2 if
+  //    the copy buffer could not be allocated (having reported it).
+
+static int copy_data(int din, int dout, int64 dlen, Track_Arg *parm)
+{ int64 n;
+
+  n = 0;
+#ifdef COPY_RANGE
+  while (dlen > 0)
+    { n = copy_file_range(din,NULL,dout,NULL,dlen,0);
+      if (n <= 0)
+        break;
+      dlen -= n;
+    }
+  if (dlen == 0)
+    return (0);
+  if (n == 0)
+    return (1);
+  if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP)
+    return (-1);
+#endif
+
+  if (parm->buffer == NULL)
+    { parm->buffer = (char *) Malloc(COPY_BUFFER,"Allocating copy buffer");
+      if (parm->buffer == NULL)
+        return (-2);
+    }
+  while (dlen > 0)
+    { n = dlen;
+      if (n > COPY_BUFFER)
+        n = COPY_BUFFER;
+      n = read(din,parm->buffer,n);
+      if (n < 0)
+        return (-1);
+      if (n == 0)
+        return (1);
+      if (write(dout,parm->buffer,n) != n)
+        return (-1);
+      dlen -= n;
+    }
+  return (0);
+}
+
+  //  Catenate the block tracks of parm->track, returning with parm->status set to 1
+  //    (and the partial output removed) if an error or inconsistency is found.
+
+static void *catenate_track(void *arg)
+{ Track_Arg *parm  = (Track_Arg *) arg;
+  char      *track = parm->track;
+  FILE      *aout;
+  int        dout;
+
+  int         nfiles;
+  int         tracktot, tracksiz;
+  int64       trackoff;
+  void       *anno;
+  int64       amax;
+  FILE       *lfile = NULL;
+  int         dfile = -1;
+  DAZZ_EXTRA *extra;
+  int         nextra;
+  int64       extail;
+
+  //  Open the output .anno for writing, and output header stub
+
+  if (VERBOSE)
+    { fprintf(stderr,"  Constructing %s%s\n",Prefix,track);
+      fflush(stderr);
+    }
+
+  extra    = NULL;
+  nextra   = 0;
+  anno     = NULL;
+  amax     = 0;
+  dout     = -1;
+
+  aout = Fopen(parm->oanno,"w");
+  if (aout == NULL)
+    goto error;
+  parm->active = 1;
+
+  trackoff = 0;
+  tracktot = tracksiz = 0;
+  FFWRITE(&tracktot,sizeof(int),1,aout)
+  FFWRITE(&tracksiz,sizeof(int),1,aout)
+
+  //  Open and catenate in each block .anno and .data file
+
+  nfiles = 0;
+  while (1)
+    { FILE *afile;
+      char *afile_name = parm->aname;
+      char *dfile_name = parm->dname;
+      int   i, size, esize, tracklen;
+      int64 apos, alen;
+
+      sprintf(afile_name,"%s%d.%s.anno",Prefix,nfiles+1,track);
+      sprintf(dfile_name,"%s%d.%s.data",Prefix,nfiles+1,track);
+
+      afile = fopen(afile_name,"r");
+      if (afile == NULL)
+        break;
+      dfile = open(dfile_name,O_RDONLY);
+      if (dfile < 0 && errno != ENOENT)
+        { fprintf(stderr,"%s: Cannot find/open data file %s\n",Prog_Name,dfile_name);
+          fclose(afile);
+          goto error;
+        }
+
+      if (nfiles > 0)
+        fclose(lfile);
+      lfile = afile;
+
+      if (VERBOSE)
+        { fprintf(stderr,"    Concatenating %s%d.%s ...\n",Prefix,nfiles+1,track);
+          fflush(stderr);
+        }
+
+      FFREAD(&tracklen,sizeof(int),1,afile)
+      FFREAD(&size,sizeof(int),1,afile)
+      if (size <= 0)
+        esize = 8;
+      else
+        esize = size;
+      if (nfiles == 0)
+        { tracksiz = size;
+          if (dfile >= 0)
+            { dout = open(parm->odata,O_WRONLY|O_CREAT|O_TRUNC,0666);
+              if (dout < 0)
+                { fprintf(stderr,"%s: Cannot open %s for 'w'\n",Prog_Name,parm->odata);
+                  goto error;
+                }
+              parm->dnew = 1;
+            }
+        }
+      else
+        { int escape = 1;
+          if (tracksiz != size)
+            { fprintf(stderr,"%s: Track block %d does not have the same annotation size (%d)",
+                             Prog_Name,nfiles+1,size);
+              fprintf(stderr," as previous blocks (%d)\n",tracksiz);
+            }
+          else if (dfile < 0 && dout >= 0)
+            fprintf(stderr,"%s: Track block %d does not have data but previous blocks do\n",
+                           Prog_Name,nfiles+1);
+          else if (dfile >= 0 && dout < 0)
+            fprintf(stderr,"%s: Track block %d has data but previous blocks do not\n",
+                           Prog_Name,nfiles+1);
+          else
+             escape = 0;
+          if (escape)
+            goto error;
+        }
+
+      //  Read the block's anno vector in one gulp, rebase it if it indexes a .data file,
+      //    and write it out in one gulp
+
+      if (dfile >= 0)
+        alen = tracklen+1;
+      else
+        alen = tracklen;
+      if (esize*alen > amax)
+        { amax = 1.2*esize*alen + 1024;
+          anno = Realloc(anno,amax,"Allocating annotation vector");
+          if (anno == NULL)
+            goto error;
+        }
+      if (alen > 0)
+        FFREAD(anno,esize,alen,afile)
+
+      if (dfile >= 0)
+        { int64 dlen;
+          int   ret;
+
+          if (esize == 4)
+            { int *anno4 = (int *) anno;
+              int  off4  = (int) trackoff;
+
+              dlen = anno4[tracklen];
+              for (i = 0; i < tracklen; i++)
+                anno4[i] += off4;
+            }
+          else
+            { int64 *anno8 = (int64 *) anno;
+
+              dlen = anno8[tracklen];
+              for (i = 0; i < tracklen; i++)
+                anno8[i] += trackoff;
+            }
+          FFWRITE(anno,esize,tracklen,aout)
+          trackoff += dlen;
+
+          ret = copy_data(dfile,dout,dlen,parm);
+          if (ret < -1)
+            goto error;
+          if (ret < 0)
+            SYSTEM_WRITE_ERROR
+          if (ret > 0)
+            { fprintf(stderr,"%s: The file %s is corrupted\n",Prog_Name,dfile_name);
+              goto error;
+            }
+          close(dfile);
+          dfile = -1;
+        }
+      else
+        FFWRITE(anno,esize,tracklen,aout)
+
+      FSEEKO(afile,0,SEEK_END)
+      FTELLO(apos,afile)
+      extail = apos - (esize*alen + 2*sizeof(int));
+      FSEEKO(afile,-extail,SEEK_END)
+
+      if (extail >= 20)
+        { if (nfiles == 0)
+            { nextra = 0;
+              while (1)
+                if (Read_Extra(afile,afile_name,NULL))
+                  break;
+                else
+                  nextra += 1;
+
+              extra = (DAZZ_EXTRA *) Malloc(sizeof(DAZZ_EXTRA)*(nextra+1),"Allocating extras");
+              if (extra == NULL)
+                goto error;
+              for (i = 0; i <= nextra; i++)
+                { extra[i].nelem = 0;
+                  extra[i].name  = NULL;
+                  extra[i].value = NULL;
+                }
+              FSEEKO(afile,-extail,SEEK_END)
+
+              for (i = 0; i < nextra; i++)
+                Read_Extra(afile,afile_name,extra+i);
+            }
+
+          else
+            { for (i = 0; i < nextra; i++)
+                if (Read_Extra(afile,afile_name,extra+i))
+                  { fprintf(stderr,"%s: File %s has fewer extras than previous .anno files\n",
+                                   Prog_Name,afile_name);
+                    goto error;
+                  }
+              if (Read_Extra(afile,afile_name,extra+nextra) == 0)
+                { fprintf(stderr,"%s: File %s has more extras than previous .anno files\n",
+                                 Prog_Name,afile_name);
+                  goto error;
+                }
+            }
+        }
+
+      tracktot += tracklen;
+      nfiles   += 1;
+    }
+
+  if (nfiles == 0)
+    { fprintf(stderr,"%s: Couldn't find first track block %s1.%s.anno\n",Prog_Name,Prefix,track);
+      goto error;
+    }
+  else
+    { char byte;
+
+      if (dout >= 0)
+        { if (tracksiz == 4)
+            { int anno4 = trackoff;
+              FFWRITE(&anno4,sizeof(int),1,aout)
+            }
+          else
+            { int64 anno8 = trackoff;
+              FFWRITE(&anno8,sizeof(int64),1,aout)
+            }
+        }
+
+      if (nextra == 0)
+        { while (fread(&byte,1,1,lfile) == 1)
+            FFWRITE(&byte,1,1,aout)
+        }
+      else
+        Write_Extras(aout,extra,nextra);
+      fclose(lfile);
+      lfile = NULL;
+
+      FSEEKO(aout,0,SEEK_SET)
+      FFWRITE(&tracktot,sizeof(int),1,aout)
+      FFWRITE(&tracksiz,sizeof(int),1,aout)
+    }
+
+  if (nfiles != Nblocks)
+    fprintf(stderr,"%s: Warning: Did not catenate all tracks of DB (nfiles %d != nblocks %d)\n",
+                   Prog_Name,nfiles,Nblocks);
+
+  if (fclose(aout) != 0)
+    { aout = NULL;
+      SYSTEM_CLOSE_ERROR
+    }
+  aout = NULL;
+  if (dout >= 0)
+    { if (close(dout) != 0)
+        { dout = -1;
+          SYSTEM_CLOSE_ERROR
+        }
+      dout = -1;
+    }
+  parm->active = 0;
+
+  if (DELETE)
+    { int   i;
+      char *name = parm->aname;
+
+      for (i = 1; i <= nfiles ;i++)
+        { sprintf(name,"%s%d.%s.anno",Prefix,i,track);
+          if (unlink(name) != 0)
+            fprintf(stderr,"%s: [WARNING] Couldn't delete file %s\n",Prog_Name,name);
+          if (parm->dnew)
+            { sprintf(name,"%s%d.%s.data",Prefix,i,track);
+              if (unlink(name) != 0)
+                fprintf(stderr,"%s: [WARNING] Couldn't delete file %s\n",Prog_Name,name);
+            }
+        }
+    }
+
+  free_extras(extra,nextra);
+  free(anno);
+  parm->status = 0;
+  return (NULL);
+
+error:
+  if (dfile >= 0)
+    close(dfile);
+  if (lfile != NULL)
+    fclose(lfile);
+  if (aout != NULL)
+    fclose(aout);
+  if (dout >= 0)
+    close(dout);
+  if (parm->active)
+    remove_partial(parm);
+
+  free_extras(extra,nextra);
+  free(anno);
+  parm->status = 1;
+  return (NULL);
+}
+
+  //  Thread t catenates tracks t, t+NTHREADS, t+2*NTHREADS, ...
+
+typedef struct
+  { Track_Arg *parm;
+    int        beg, end, step;
+  } Stride_Arg;
+
+static void *catenate_stride(void *arg)
+{ Stride_Arg *s = (Stride_Arg *) arg;
+  int         c;
+
+  for (c = s->beg; c < s->end; c += s->step)
+    catenate_track(s->parm+c);
+  return (NULL);
+}
 
 int main(int argc, char *argv[])
-{ char *prefix;
-  int   nblocks;
-  FILE *aout, *dout;
-  int   c;
+{ Track_Arg *parm;
+  int        ntracks;
+  int        c, fail;
 
-  int   VERBOSE;
-  int   FORCE;
-  int   DELETE;
+  int        NTHREADS;
 
   //  Process arguments
 
   { int   i, j, k;
     int   flags[128];
+    char *eptr;
 
     ARG_INIT("Catrack")
 
+    NTHREADS = 4;
+
     j = 1;
     for (i = 1; i < argc; i++)
       if (argv[i][0] == '-')
-        { ARG_FLAGS("vfd") }
+        switch (argv[i][1])
+        { default:
+            ARG_FLAGS("vfd")
+            break;
+          case 'T':
+            ARG_POSITIVE(NTHREADS,"Number of threads")
+            break;
+        }
       else
         argv[j++] = argv[i];
     argc = j;
@@ -59,6 +530,7 @@ int main(int argc, char *argv[])
         fprintf(stderr,"   -v: verbose\n");
         fprintf(stderr,"   -d: delete individual blocks after a successful concatenation\n");
         fprintf(stderr,"   -f: force overwrite of track if already present\n");
+        fprintf(stderr,"   -T: Number of tracks to catenate concurrently\n");
         exit (1);
       }
   }
@@ -87,317 +559,108 @@ int main(int argc, char *argv[])
           }
       }
 
-    nblocks = stub->nblocks;
+    Nblocks = stub->nblocks;
 
     Free_DB_Stub(stub);
 
-    prefix = Strdup(Catenate(pwd,PATHSEP,root,"."),"Allocating track name");
+    Prefix = Strdup(Catenate(pwd,PATHSEP,root,"."),"Allocating track name");
+    if (Prefix == NULL)
+      exit (1);
 
     free(pwd);
     free(root);
   }
 
-  //  For each track do
-
-  for (c = 2; c < argc; c++)
-    { int   nfiles;
-      int   tracktot, tracksiz;
-      int64 trackoff;
-      char  data[1024];
-      void *anno;
-      FILE *lfile = NULL;
-      DAZZ_EXTRA *extra;
-      int         nextra;
-      int64       extail;
-
-      //  Open the output .anno for writing, and output header stub
-
-      if (VERBOSE)
-        { fprintf(stderr,"\nConstructing %s%s:\n",prefix,argv[c]);
-          fflush(stderr);
-        }
-
-      aout = fopen(Catenate(prefix,argv[c],".","anno"),"r");
-      if (aout != NULL)
-        { if (!FORCE)
-            { fprintf(stderr,"%s: Track file %s%s.anno already exists!\n",Prog_Name,prefix,argv[c]);
-              exit (1);
-            }
-          fclose(aout);
-        }
-
-      dout = fopen(Catenate(prefix,argv[c],".","data"),"r");
-      if (dout != NULL)
-        { if (!FORCE)
-            { fprintf(stderr,"%s: Track file %s%s.data already exists!\n",Prog_Name,prefix,argv[c]);
-              exit (1);
-            }
-          fclose(dout);
-        }
-
-      aout = Fopen(Catenate(prefix,argv[c],".","anno"),"w");
-      if (aout == NULL)
+  //  Set up a work record for each track
+
+  ntracks = argc-2;
+  parm    = (Track_Arg *) Malloc(sizeof(Track_Arg)*ntracks,"Allocating track records");
+  if (parm == NULL)
+    exit (1);
+
+  for (c = 0; c < ntracks; c++)
+    { int len = strlen(Prefix) + strlen(argv[c+2]) + 30;
+
+      parm[c].track  = argv[c+2];
+      parm[c].oanno  = Strdup(Catenate(Prefix,parm[c].track,".anno",""),"Allocating track name");
+      parm[c].odata  = Strdup(Catenate(Prefix,parm[c].track,".data",""),"Allocating track name");
+      parm[c].aname  = (char *) Malloc(len,"Allocating track name");
+      parm[c].dname  = (char *) Malloc(len,"Allocating track name");
+      parm[c].buffer = NULL;
+      parm[c].status = 1;
+      parm[c].active = 0;
+      parm[c].dnew   = 0;
+      if (parm[c].oanno == NULL || parm[c].odata == NULL
+                                || parm[c].aname == NULL || parm[c].dname == NULL)
         exit (1);
-      dout = NULL;
-
-      extra    = NULL;
-      anno     = NULL;
-      trackoff = 0;
-      tracktot = tracksiz = 0;
-      if (fwrite(&tracktot,sizeof(int),1,aout) != 1)
-        SYSTEM_WRITE_ERROR
-      if (fwrite(&tracksiz,sizeof(int),1,aout) != 1)
-        SYSTEM_WRITE_ERROR
-
-      //  OPen and catenate in each block .anno and .data file
-
-      nextra = 0;
-      nfiles = 0;
-      while (1)
-        { FILE *dfile, *afile;
-          char *dfile_name, *afile_name;
-          int   i, apos, size, esize, tracklen;
-  
-          afile_name = Strdup(Numbered_Suffix(prefix,nfiles+1,Catenate(".",argv[c],".","anno")),
-                              "Allocating .anno file name");
-          dfile_name = Strdup(Numbered_Suffix(prefix,nfiles+1,Catenate(".",argv[c],".","data")),
-                              "Allocating .data file name");
-          if (afile_name == NULL || dfile_name == NULL)
-            goto error;
-  
-          afile = fopen(afile_name,"r");
-          if (afile == NULL)
-            { free(afile_name);
-              free(dfile_name);
-              break;
-            }
-          dfile = fopen(dfile_name,"r");
-          if (dfile == NULL && errno != ENOENT)
-            { fprintf(stderr,"%s: Cannot find/open data file %s\n",Prog_Name,dfile_name);
-              goto error;
-            }
-  
-          if (nfiles > 0)
-            fclose(lfile);
-          lfile = afile;
-  
-          if (VERBOSE)
-            { fprintf(stderr,"  Concatenating %s%d.%s ...\n",prefix,nfiles+1,argv[c]);
-              fflush(stderr);
-            }
+    }
 
-          FFREAD(&tracklen,sizeof(int),1,afile)
-          FFREAD(&size,sizeof(int),1,afile)
-          if (size == 0)
-            esize = 8;
-          else
-            esize = size;
-          if (nfiles == 0)
-            { tracksiz = size;
-              if (dfile != NULL)
-                { dout = Fopen(Catenate(prefix,argv[c],".","data"),"w");
-                  if (dout == NULL)
-                    goto error;
-                }
-              else
-                { anno = Malloc(esize,"Allocating annotation record");
-                  if (anno == NULL)
-                    goto error;
-                }
-            }
-          else
-            { int escape = 1;
-              if (tracksiz != size)
-                { fprintf(stderr,"%s: Track block %d does not have the same annotation size (%d)",
-                                 Prog_Name,nfiles+1,size);
-                  fprintf(stderr," as previous blocks (%d)\n",tracksiz);
-                }
-              else if (dfile == NULL && dout != NULL)
-                fprintf(stderr,"%s: Track block %d does not have data but previous blocks do\n",
-                               Prog_Name,nfiles+1);
-              else if (dfile != NULL && dout == NULL)
-                fprintf(stderr,"%s: Track block %d has data but previous blocks do not\n",
-                               Prog_Name,nfiles+1);
-              else
-                 escape = 0;
-              if (escape)
-                goto error;
-            }
-    
-          if (dfile != NULL)
-            { int64 dlen, d;
-  
-              if (esize == 4)
-                { int anno4;
-    
-                  for (i = 0; i < tracklen; i++)
-                    { FFREAD(&anno4,sizeof(int),1,afile)
-                      anno4 += trackoff;
-                      FFWRITE(&anno4,sizeof(int),1,aout)
-                    }
-                  FFREAD(&anno4,sizeof(int),1,afile)
-                  dlen = anno4;
-                }
-              else
-                { int64 anno8;
-    
-                  for (i = 0; i < tracklen; i++)
-                    { FFREAD(&anno8,sizeof(int64),1,afile)
-                      anno8 += trackoff;
-                      FFWRITE(&anno8,sizeof(int64),1,aout)
-                    }
-                  FFREAD(&anno8,sizeof(int64),1,afile)
-                  dlen = anno8;
-                }
-              trackoff += dlen;
+  //  Check that none of the tracks is already present (unless -f) or named twice before
+  //    any is written
 
-              for (d = 1024; d < dlen; d += 1024)
-                { FFREAD(data,1024,1,dfile)
-                  FFWRITE(data,1024,1,dout)
-                }
-              d -= 1024;
-              if (d < dlen)
-                { FFREAD(data,dlen-d,1,dfile)
-                  FFWRITE(data,dlen-d,1,dout)
-                }
-            }
-          else
-            { for (i = 0; i < tracklen; i++)
-                { FFREAD(anno,esize,1,afile)
-                  FFWRITE(anno,esize,1,aout)
-                }
-            }
-  
-          FSEEKO(afile,0,SEEK_END)
-          FTELLO(apos,afile)
-          if (dfile != NULL)
-            extail = apos - (esize*(tracklen+1) + 2*sizeof(int)); 
-          else
-            extail = apos - (esize*tracklen + 2*sizeof(int)); 
-          FSEEKO(afile,-extail,SEEK_END)
-
-          if (extail >= 20)
-            { if (nfiles == 0)
-                { nextra = 0;
-                  while (1)
-                    if (Read_Extra(afile,afile_name,NULL))
-                      break;
-                    else
-                      nextra += 1;
-  
-                  extra = (DAZZ_EXTRA *) Malloc(sizeof(DAZZ_EXTRA)*(nextra+1),"Allocating extras");
-                  if (extra == NULL)
-                    goto error;
-                  FSEEKO(afile,-extail,SEEK_END)
-  
-                  for (i = 0; i < nextra; i++)
-                    { extra[i].nelem = 0;
-                      Read_Extra(afile,afile_name,extra+i);
-                    }
-                }
-  
-              else
-                { for (i = 0; i < nextra; i++)
-                    if (Read_Extra(afile,afile_name,extra+i))
-                      { fprintf(stderr,"%s: File %s has fewer extras than previous .anno files\n",
-                                       Prog_Name,afile_name);
-                        goto error;
-                      }
-                  if (Read_Extra(afile,afile_name,extra+nextra) == 0)
-                    { fprintf(stderr,"%s: File %s has more extras than previous .anno files\n",
-                                     Prog_Name,afile_name);
-                      goto error;
-                    }
-                }
-            }
-    
-          tracktot += tracklen;
-          nfiles   += 1;
-          if (dfile != NULL)
-            fclose(dfile);
-          free(dfile_name);
-          free(afile_name);
-        }
+  for (c = 0; c < ntracks; c++)
+    { int k;
 
-      if (nfiles == 0)
-        { fprintf(stderr,"%s: Couldn't find first track block %s1.%s.anno\n",
-                         Prog_Name,prefix,argv[c]);
-          goto error;
+      if (access(parm[c].oanno,F_OK) == 0 && !FORCE)
+        { fprintf(stderr,"%s: Track file %s already exists!\n",Prog_Name,parm[c].oanno);
+          exit (1);
         }
-      else
-        { char *byte;
+      if (access(parm[c].odata,F_OK) == 0 && !FORCE)
+        { fprintf(stderr,"%s: Track file %s already exists!\n",Prog_Name,parm[c].odata);
+          exit (1);
+        }
+      for (k = 0; k < c; k++)
+        if (strcmp(parm[k].track,parm[c].track) == 0)
+          { fprintf(stderr,"%s: Track %s is given more than once\n",Prog_Name,parm[c].track);
+            exit (1);
+          }
+    }
 
-          if (dout != NULL)
-            { if (tracksiz == 4)
-                { int anno4 = trackoff;
-                  FFWRITE(&anno4,sizeof(int),1,aout)
-                }
-              else
-                { int64 anno8 = trackoff;
-                  FFWRITE(&anno8,sizeof(int64),1,aout)
-                }
-            }
-  
-          if (nextra == 0)
-            { while (fread(&byte,1,1,lfile) == 1)
-                FFWRITE(&byte,1,1,aout)
-            }
-          else
-            { int i;
-              for (i = 0; i < nextra; i++)
-                Write_Extra(aout,extra+i);
-            }
-          fclose(lfile);
+  Tracks  = parm;
+  Ntracks = ntracks;
+  atexit(abort_tracks);
 
-          FSEEKO(aout,0,SEEK_SET)
-          FFWRITE(&tracktot,sizeof(int),1,aout)
-          FFWRITE(&tracksiz,sizeof(int),1,aout)
-        }
+  if (VERBOSE)
+    { fprintf(stderr,"\nCatenating %d track%s of %d blocks:\n",ntracks,ntracks>1?"s":"",Nblocks);
+      fflush(stderr);
+    }
 
-      if (nfiles != nblocks)
-        fprintf(stderr,"%s: Warning: Did not catenate all tracks of DB (nfiles %d != nblocks %d)\n",
-                       Prog_Name,nfiles,nblocks);
-  
-      FCLOSE(aout);
-      if (dout != NULL)
-        FCLOSE(dout);
+  //  Catenate the tracks, up to NTHREADS at a time
 
-      if (DELETE)
-        { int   i;
-          char *name;
+  if (NTHREADS > ntracks)
+    NTHREADS = ntracks;
 
-          for (i = 1; i <= nfiles ;i++)
-            { name = Numbered_Suffix(prefix,i,Catenate(".",argv[c],".","anno"));
-              if (unlink(name) != 0)
-                fprintf(stderr,"%s: [WARNING] Couldn't delete file %s\n",Prog_Name,name);
-              if (dout != NULL)
-                { name = Numbered_Suffix(prefix,i,Catenate(".",argv[c],".","data"));
-                  if (unlink(name) != 0)
-                    fprintf(stderr,"%s: [WARNING] Couldn't delete file %s\n",Prog_Name,name);
-                }
-            }
+  if (NTHREADS <= 1)
+    { for (c = 0; c < ntracks; c++)
+        catenate_track(parm+c);
+    }
+  else
+    { pthread_t  threads[NTHREADS];
+      Stride_Arg stride[NTHREADS];
+
+      for (c = 0; c < NTHREADS; c++)
+        { stride[c].parm = parm;
+          stride[c].beg  = c;
+          stride[c].end  = ntracks;
+          stride[c].step = NTHREADS;
+          pthread_create(threads+c,NULL,catenate_stride,stride+c);
         }
-    
+      for (c = 0; c < NTHREADS; c++)
+        pthread_join(threads[c],NULL);
     }
 
-  free(prefix);
-  exit (0);
-
-error:
-  { char *name;
-
-    fclose(aout);
-    name = Catenate(prefix,argv[c],".","anno");
-    if (unlink(name) != 0)
-      fprintf(stderr,"%s: [WARNING] Couldn't delete file %s during abort\n",Prog_Name,name);
-    if (dout != NULL)
-      { fclose(dout);
-        name = Catenate(prefix,argv[c],".","data");
-        if (unlink(name) != 0)
-          fprintf(stderr,"%s: [WARNING] Couldn't delete file %s during abort\n",Prog_Name,name);
-      }
-  }
+  fail = 0;
+  for (c = 0; c < ntracks; c++)
+    { fail |= parm[c].status;
+      free(parm[c].buffer);
+      free(parm[c].dname);
+      free(parm[c].aname);
+      free(parm[c].odata);
+      free(parm[c].oanno);
+    }
+  Ntracks = 0;
+  free(parm);
+  free(Prefix);
 
-  free(prefix);
-  exit (1);
+  exit (fail);
 }
@@ -19,6 +19,7 @@
 #include <dirent.h>
 #include <limits.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 #include "DB.h"
 
@@ -686,6 +687,13 @@ void Free_DB_Stub(DAZZ_STUB *stub)
 
 static char *atrack_name = ".@arw";
 static char *qtrack_name = ".@qvs";
+static char *extra_index = ".@index";
+
+//  Trim_DB records which reads of the untrimmed DB (or block) it kept in a bit vector whose
+//    address is crammed into the coff field of the extra read record reads[-1] (see DB.h).
+
+#define TRIM_KEEP(db)   (*((uint64 **) &((db)->reads[-1].coff)))
+#define KEPT(keep,i)    (((keep)[(i) >> 6] >> ((i) & 0x3f)) & 0x1)
 
 int Open_DB(char* path, DAZZ_DB *db)
 { DAZZ_DB dbcopy;
@@ -865,6 +873,7 @@ int Open_DB(char* path, DAZZ_DB *db)
 
   ((int *) (db->reads))[-1] = ulast - ufirst;   //  Kludge, need these for DB part
   ((int *) (db->reads))[-2] = tlast - tfirst;
+  TRIM_KEEP(db) = NULL;
 
   db->nreads = nreads;
   db->path   = Strdup(MyCatenate(pwd,PATHSEP,root,""),"Allocating Open_DB path");
@@ -903,7 +912,8 @@ error:
 
 // Trim the DB or part thereof and all opened tracks according to the cuttof and all settings
 //   of the current DB partition.  Reallocate smaller memory blocks for the information kept
-//   for the retained reads.
+//   for the retained reads.  A bit vector of the untrimmed reads that were kept is retained
+//   so that tracks for the untrimmed DB can be trimmed in memory when opened later.
 
 void Trim_DB(DAZZ_DB *db)
 { int         i, j, r, f;
@@ -912,6 +922,7 @@ void Trim_DB(DAZZ_DB *db)
   int         maxlen, nreads;
   DAZZ_TRACK *record;
   DAZZ_READ  *reads;
+  uint64     *keep;
 
   if (db->trimmed) return;
 
@@ -944,14 +955,39 @@ void Trim_DB(DAZZ_DB *db)
   reads  = db->reads;
   nreads = db->nreads;
 
+  keep = (uint64 *) Malloc(sizeof(uint64)*((nreads+63) >> 6),"Allocating trim vector");
+  if (keep != NULL)
+    { for (i = 0; i < ((nreads+63) >> 6); i++)
+        keep[i] = 0;
+      for (i = 0; i < nreads; i++)
+        if ((reads[i].flags & DB_BEST) >= allflag && reads[i].rlen >= cutoff)
+          keep[i >> 6] |= (1ull << (i & 0x3f));
+    }
+
   for (record = db->tracks; record != NULL; record = record->next)
     if (record->name == qtrack_name)
-      { uint16 *table = ((DAZZ_QV *) record)->table;
+      { DAZZ_QV *qvtrk = (DAZZ_QV *) record;
+        uint16  *table = qvtrk->table;
+        int64   *aoff  = qvtrk->aoff;
+        int      h;
 
+        h = 0;
         j = 0;
         for (i = 0; i < db->nreads; i++)
-          if ((reads[i].flags & DB_BEST) >= allflag && reads[i].rlen >= cutoff)
-            table[j++] = table[i];
+          { while (h < qvtrk->ncodes && qvtrk->hread[h] < i)
+              h += 1;
+            if ((reads[i].flags & DB_BEST) >= allflag && reads[i].rlen >= cutoff)
+              { for ( ; h < qvtrk->ncodes && qvtrk->hread[h] == i; h++)
+                  qvtrk->hread[h] = j;
+                table[j] = table[i];
+                if (aoff != NULL)
+                  aoff[j] = aoff[i];
+                j += 1;
+              }
+            else
+              for ( ; h < qvtrk->ncodes && qvtrk->hread[h] == i; h++)
+                qvtrk->hread[h] = -1;
+          }
       }
     else if (record->name == atrack_name)
       { DAZZ_ARROW *atrack = (DAZZ_ARROW *) record;
@@ -1036,6 +1072,7 @@ void Trim_DB(DAZZ_DB *db)
     { db->reads = Realloc(reads-1,sizeof(DAZZ_READ)*(j+2),NULL);
       db->reads += 1;
     }
+  TRIM_KEEP(db) = keep;
 }
 
 
@@ -1188,16 +1225,18 @@ void Print_Read(char *s, int width)
 //   supplied it and so should free it).
 
 void Close_DB(DAZZ_DB *db)
-{ if (db->loaded)
+{ Close_QVs(db);   //  Before the reads are freed as it restores the coff of some
+
+  if (db->loaded)
     free(((char *) (db->bases)) - 1);
   else if (db->bases != NULL)
     fclose((FILE *) db->bases);
   if (db->reads != NULL)
-    free(db->reads-1);
+    { free(TRIM_KEEP(db));
+      free(db->reads-1);
+    }
   free(db->path);
 
-  Close_QVs(db);
-
   Close_Arrow(db);
 
   while (db->tracks != NULL)
@@ -1678,6 +1717,8 @@ int Check_Track(DAZZ_DB *db, char *track, int *kind)
     *kind = MASK_TRACK;
   else if (size > 0)
     *kind = CUSTOM_TRACK;
+  else if (size == BITMAP_ANNO)
+    *kind = BITMAP_TRACK;
   else
     { EPRINTF(EPLACE,"%s: track files for %s are corrupted\n",Prog_Name,track);
       fclose(afile);
@@ -1704,95 +1745,65 @@ int Check_Track(DAZZ_DB *db, char *track, int *kind)
 }
 
 // The DB has already been trimmed, but a track over the untrimmed DB needs to be opened.
-//   Trim the track by rereading the untrimmed DB index from the file system.
+//   Compact the track in place with the bit vector of kept reads recorded by Trim_DB.
 
-static int Late_Track_Trim(DAZZ_DB *db, DAZZ_TRACK *track, int ispart)
-{ int         i, j, r;
-  int         allflag, cutoff;
-  int         ureads;
-  char       *root;
-  DAZZ_READ   read;
-  FILE       *indx;
+static int Late_Track_Trim(DAZZ_DB *db, DAZZ_TRACK *track)
+{ int     i, j, size, ureads;
+  uint64 *keep;
 
   if (db->cutoff <= 0 && (db->allarr & DB_ALL) != 0) return (0);
 
-  cutoff = db->cutoff;
-  if ((db->allarr & DB_ALL) != 0)
-    allflag = 0;
-  else
-    allflag = DB_BEST;
+  keep   = TRIM_KEEP(db);
+  ureads = track->nreads;
+  if (keep == NULL || ureads != ((int *) (db->reads))[-1])
+    { EPRINTF(EPLACE,"%s: Cannot trim track %s to the trimmed DB (Late_Track_Trim)\n",
+                     Prog_Name,track->name);
+      EXIT(1);
+    }
 
-  root = rindex(db->path,'/') + 2;
-  indx = Fopen(MyCatenate(db->path,"","",".idx"),"r");
-  fseeko(indx,sizeof(DAZZ_DB) + sizeof(DAZZ_READ)*db->ufirst,SEEK_SET);
-  if (ispart)
-    ureads = ((int *) (db->reads))[-1];
-  else
-    ureads = db->ureads;
-
-  { int    size;
-
-    size = track->size;
-    if (track->data == NULL)
-      { char *anno = (char *) track->anno;
-        j = r = 0;
-        for (i = r = 0; i < ureads; i++, r += size)
-          { if (fread(&read,sizeof(DAZZ_READ),1,indx) != 1)
-              { EPRINTF(EPLACE,"%s: Index file (.idx) of %s is junk\n",Prog_Name,root);
-                fclose(indx);
-                EXIT(1);
-              }
-            if ((read.flags & DB_BEST) >= allflag && read.rlen >= cutoff)
-              { memmove(anno+j,anno+r,size);
-                j += size;
-              }
-            r += size;
-          }
-        track->anno = Realloc(track->anno,track->size*j,NULL);
-      }
-    else if (size == 4)
-      { int *anno4 = (int *) (track->anno);
-        int *alen  = track->alen;
+  size = track->size;
+  if (track->data == NULL)
+    { char *anno = (char *) track->anno;
 
-        j = 0;
-        for (i = 0; i < ureads; i++)
-          { if (fread(&read,sizeof(DAZZ_READ),1,indx) != 1)
-              { EPRINTF(EPLACE,"%s: Index file (.idx) of %s is junk\n",Prog_Name,root);
-                fclose(indx);
-                EXIT(1);
-              }
-            if ((read.flags & DB_BEST) >= allflag && read.rlen >= cutoff)
-              { anno4[j] = anno4[i];
-                alen[j]  = alen[i];
-                j += 1;
-              }
+      j = 0;
+      for (i = 0; i < ureads; i++)
+        if (KEPT(keep,i))
+          { if (i != j)
+              memcpy(anno+j*size,anno+i*size,size);
+            j += 1;
           }
-        track->alen = Realloc(track->alen,sizeof(int)*j,NULL);
-        track->anno = Realloc(track->anno,track->size*(j+1),NULL);
-      }
-    else // size == 8
-      { int64 *anno8 = (int64 *) (track->anno);
-        int   *alen  = track->alen;
-
-        j = 0;
-        for (i = 0; i < ureads; i++)
-          { if (fread(&read,sizeof(DAZZ_READ),1,indx) != 1)
-              { EPRINTF(EPLACE,"%s: Index file (.idx) of %s is junk\n",Prog_Name,root);
-                fclose(indx);
-                EXIT(1);
-              }
-            if ((read.flags & DB_BEST) >= allflag && read.rlen >= cutoff)
-              { anno8[j] = anno8[i];
-                alen[j]  = alen[i];
-                j += 1;
-              }
+      track->anno = Realloc(track->anno,size*j,NULL);
+    }
+  else if (size == 4)
+    { int *anno4 = (int *) (track->anno);
+      int *alen  = track->alen;
+
+      j = 0;
+      for (i = 0; i < ureads; i++)
+        if (KEPT(keep,i))
+          { anno4[j] = anno4[i];
+            alen[j]  = alen[i];
+            j += 1;
           }
-        track->alen = Realloc(track->alen,sizeof(int)*j,NULL);
-        track->anno = Realloc(track->anno,track->size*(j+1),NULL);
-      }
-  }
+      track->alen = Realloc(track->alen,sizeof(int)*j,NULL);
+      track->anno = Realloc(track->anno,size*(j+1),NULL);
+    }
+  else // size == 8
+    { int64 *anno8 = (int64 *) (track->anno);
+      int   *alen  = track->alen;
+
+      j = 0;
+      for (i = 0; i < ureads; i++)
+        if (KEPT(keep,i))
+          { anno8[j] = anno8[i];
+            alen[j]  = alen[i];
+            j += 1;
+          }
+      track->alen = Realloc(track->alen,sizeof(int)*j,NULL);
+      track->anno = Realloc(track->anno,size*(j+1),NULL);
+    }
+  track->nreads = j;
 
-  fclose(indx);
   return (0);
 }
 
@@ -1859,11 +1870,11 @@ DAZZ_TRACK *Open_Track(DAZZ_DB *db, char *track)
       goto error;
     }
 
-  if (size < 0)
+  if (size < 0 && size != BITMAP_ANNO)
     { EPRINTF(EPLACE,"%s: Track '%s' annotation file is junk\n",Prog_Name,track);
       goto error;
     }
-  if (size == 0)
+  if (size <= 0)
     size = 8;
 
   if (ispart)
@@ -1976,7 +1987,7 @@ DAZZ_TRACK *Open_Track(DAZZ_DB *db, char *track)
   record->dmax   = dmax;
 
   if (db->trimmed && tracklen != treads)
-    { if (Late_Track_Trim(db,record,ispart))
+    { if (Late_Track_Trim(db,record))
         goto error;
     }
 
@@ -2019,13 +2030,31 @@ void *New_Track_Buffer(DAZZ_TRACK *track)
   return (data);
 }
 
+// Read len bytes at offset off of the file with descriptor fd into data without moving the
+//   file's read pointer.  Return 0 on success and 1 on a failed or short read.
+
+static int pread_all(int fd, void *data, int64 len, int64 off)
+{ int64 n;
+
+  while (len > 0)
+    { n = pread(fd,data,len,off);
+      if (n <= 0)
+        return (1);
+      data = ((char *) data) + n;
+      len -= n;
+      off += n;
+    }
+  return (0);
+}
+
 // Load into 'data' the read data block for read i's "track" data.  Return the length of
 //   the data in bytes, unless an error occurs and INTERACTIVE is defined in which case
-//   return wtih -1.
+//   return wtih -1.  The data file is read with pread and so is never repositioned, thus
+//   any number of threads may load data from the same track at the same time provided
+//   each has its own buffer from New_Track_Buffer.
 
 int Load_Track_Data(DAZZ_TRACK *track, int i, void *data)
-{ FILE      *dfile;
-  int64      off;
+{ int64      off;
   int        len;
 
   if (i < 0 || i >= track->nreads)
@@ -2040,15 +2069,12 @@ int Load_Track_Data(DAZZ_TRACK *track, int i, void *data)
   len = track->alen[i];
 
   if (track->loaded)
-    { strncpy(data,(void *) track->data + off,len);
+    { memcpy(data,(void *) track->data + off,len);
       return (len);
     }
 
-  dfile = (FILE *) track->data;
-  if (ftello(dfile) != off)
-    fseeko(dfile,off,SEEK_SET);
   if (len > 0)
-    if (fread(data,len,1,dfile) != 1)
+    if (pread_all(fileno((FILE *) track->data),data,len,off))
       { EPRINTF(EPLACE,"%s: Failed read of .data file (Load_Track_Data)\n",Prog_Name);
         EXIT(-1);
       }
@@ -2167,25 +2193,36 @@ int Read_Extra(FILE *afile, char *aname, DAZZ_EXTRA *extra)
   EREAD(&accum,sizeof(int),1,afile,0)
   EREAD(&slen,sizeof(int),1,afile,0)
 
+  name = (char *) Malloc(slen+1,"Allocating extra name");
+  if (name == NULL)
+    EXIT(-1);
+  EREAD(name,1,slen,afile,0);
+  name[slen] = '\0';
+
+  if (strcmp(name,extra_index) == 0)     //  The directory of extras ends the list
+    { free(name);
+      if (fseeko(afile,0,SEEK_END) < 0)
+        { EPRINTF(EPLACE,"%s: System error, read failed!\n",Prog_Name);
+          EXIT(-1);
+        }
+      return (1);
+    }
+
   if (extra == NULL)
-    { if (fseeko(afile,slen+8*nelem,SEEK_CUR) < 0)
+    { free(name);
+      if (fseeko(afile,8*nelem,SEEK_CUR) < 0)
         { EPRINTF(EPLACE,"%s: System error, read failed!\n",Prog_Name);
           EXIT(-1);
         }
       return (0);
     }
 
-  name  = (char *) Malloc(slen+1,"Allocating extra name");
   value = Malloc(8*nelem,"Allocating extra value");
-  if (value == NULL || name == NULL)
+  if (value == NULL)
     { free(name);
-      free(value);
       EXIT(-1);
     }
-
-  EREAD(name,1,slen,afile,0);
   EREAD(value,8,nelem,afile,0);
-  name[slen] = '\0';
   
   if (extra->nelem == 0)
     { extra->vtype = vtype;
@@ -2286,6 +2323,209 @@ int Write_Extra(FILE *afile, DAZZ_EXTRA *extra)
   return (0);
 }
 
+//  Write the nextra extras in extra to the end of afile followed by a directory of them.
+//    The directory is itself an extra (named .@index so it cannot clash with a user name)
+//    whose values are the file offsets of each extra followed by the offset of the
+//    directory itself, so the last 8 bytes of the file locate it.
+
+int Write_Extras(FILE *afile, DAZZ_EXTRA *extra, int nextra)
+{ DAZZ_EXTRA index;
+  int64     *offs;
+  int        i;
+
+  if (nextra <= 0)
+    return (0);
+
+  offs = (int64 *) Malloc(sizeof(int64)*(nextra+1),"Allocating extra directory");
+  if (offs == NULL)
+    EXIT(1);
+
+  for (i = 0; i <= nextra; i++)
+    { offs[i] = ftello(afile);
+      if (offs[i] < 0)
+        { EPRINTF(EPLACE,"%s: System error, could not locate extra\n",Prog_Name);
+          free(offs);
+          EXIT(1);
+        }
+      if (i < nextra && Write_Extra(afile,extra+i))
+        { free(offs);
+          EXIT(1);
+        }
+    }
+
+  index.vtype = DB_INT;
+  index.nelem = nextra+1;
+  index.accum = DB_SUM;
+  index.name  = extra_index;
+  index.value = offs;
+  if (Write_Extra(afile,&index))
+    { free(offs);
+      EXIT(1);
+    }
+
+  free(offs);
+  return (0);
+}
+
+//  If afile ends with a valid directory of extras then return an array of the offsets of
+//    the extras and set *nextra to their number, otherwise return NULL.
+
+static int64 *read_extra_index(FILE *afile, int *nextra)
+{ int64  dpos, fend, *offs;
+  int    hdr[4];
+  char   name[16];
+  int    slen;
+
+  slen = strlen(extra_index);
+  if (fseeko(afile,0,SEEK_END) < 0)
+    return (NULL);
+  fend = ftello(afile);
+  if (fend < 16 + slen + 16)
+    return (NULL);
+
+  if (fseeko(afile,-8,SEEK_END) < 0 || fread(&dpos,8,1,afile) != 1)
+    return (NULL);
+  if (dpos < 8 || dpos + 16 + slen + 16 > fend)
+    return (NULL);
+
+  if (fseeko(afile,dpos,SEEK_SET) < 0 || fread(hdr,sizeof(int),4,afile) != 4)
+    return (NULL);
+  if (hdr[0] != DB_INT || hdr[1] < 2 || hdr[3] != slen || dpos + 16 + slen + 8*hdr[1] != fend)
+    return (NULL);
+  if (fread(name,1,slen,afile) != (size_t) slen || strncmp(name,extra_index,slen) != 0)
+    return (NULL);
+
+  offs = (int64 *) Malloc(8*hdr[1],"Allocating extra directory");
+  if (offs == NULL)
+    return (NULL);
+  if (fread(offs,8,hdr[1],afile) != (size_t) hdr[1] || offs[hdr[1]-1] != dpos)
+    { free(offs);
+      return (NULL);
+    }
+
+  *nextra = hdr[1]-1;
+  return (offs);
+}
+
+//  Find the extra called name of the given track of db and place it in extra (whose
+//    name and value are allocated and should be freed by the caller).  If the .anno
+//    file has a directory of extras, the extra is fetched directly, otherwise the list
+//    of extras is scanned.  Returns:
+//      0 if the extra was found,
+//      1 if the track has no such extra, and
+//     -1 if the track does not exist or an error occured (if interactive)
+
+int Fetch_Extra(DAZZ_DB *db, char *track, char *name, DAZZ_EXTRA *extra)
+{ FILE  *afile;
+  char  *aname, *dname;
+  int64 *offs;
+  int    nextra, ispart;
+  int    i, ret;
+
+  afile = NULL;
+  if (db->part > 0)
+    { aname  = MyCatenate(db->path,MyNumbered_Suffix(".",db->part,"."),track,".anno");
+      afile  = fopen(aname,"r");
+      ispart = 1;
+    }
+  if (afile == NULL)
+    { aname  = MyCatenate(db->path,".",track,".anno");
+      afile  = fopen(aname,"r");
+      ispart = 0;
+    }
+  if (afile == NULL)
+    { EPRINTF(EPLACE,"%s: Track '%s' does not exist\n",Prog_Name,track);
+      EXIT(-1);
+    }
+  aname = Strdup(aname,"Allocating track name");
+  if (aname == NULL)
+    { fclose(afile);
+      EXIT(-1);
+    }
+
+  offs = read_extra_index(afile,&nextra);
+  if (offs != NULL)
+    { int  hdr[4];
+      int  slen;
+      char *ename;
+
+      slen  = strlen(name);
+      ename = (char *) Malloc(slen+1,"Allocating extra name");
+      if (ename == NULL)
+        goto error;
+      for (i = 0; i < nextra; i++)
+        { if (fseeko(afile,offs[i],SEEK_SET) < 0 || fread(hdr,sizeof(int),4,afile) != 4)
+            break;
+          if (hdr[3] != slen)
+            continue;
+          if (fread(ename,1,slen,afile) != (size_t) slen)
+            break;
+          if (strncmp(ename,name,slen) == 0)
+            break;
+        }
+      free(ename);
+      if (i < nextra)
+        { fseeko(afile,offs[i],SEEK_SET);
+          extra->nelem = 0;
+          ret = Read_Extra(afile,aname,extra);
+          if (ret < 0)
+            goto error;
+          ret = 0;
+        }
+      else
+        ret = 1;
+      free(offs);
+    }
+
+  else
+    { int tracklen, size;
+
+      //  No directory, skip the header and anno vector and scan the extras
+
+      if (fseeko(afile,0,SEEK_SET) < 0 ||
+          fread(&tracklen,sizeof(int),1,afile) != 1 || fread(&size,sizeof(int),1,afile) != 1)
+        { EPRINTF(EPLACE,"%s: Track '%s' annotation file is junk\n",Prog_Name,track);
+          goto error;
+        }
+      if (size <= 0)
+        size = 8;
+      if (ispart)
+        dname = MyCatenate(db->path,MyNumbered_Suffix(".",db->part,"."),track,".data");
+      else
+        dname = MyCatenate(db->path,".",track,".data");
+      if (access(dname,F_OK) == 0)
+        tracklen += 1;
+      if (fseeko(afile,2*sizeof(int) + ((int64) size)*tracklen,SEEK_SET) < 0)
+        { EPRINTF(EPLACE,"%s: Track '%s' annotation file is junk\n",Prog_Name,track);
+          goto error;
+        }
+
+      while (1)
+        { extra->nelem = 0;
+          ret = Read_Extra(afile,aname,extra);
+          if (ret < 0)
+            goto error;
+          if (ret > 0)
+            break;
+          if (strcmp(extra->name,name) == 0)
+            break;
+          free(extra->name);
+          free(extra->value);
+        }
+    }
+
+  fclose(afile);
+  free(aname);
+  return (ret);
+
+error:
+  free(offs);
+  fclose(afile);
+  free(aname);
+  EXIT(-1);
+}
+
+
 void Close_Track(DAZZ_DB *db, DAZZ_TRACK *track)
 { DAZZ_TRACK *record, *prev;
 
@@ -2312,6 +2552,307 @@ void Close_Track(DAZZ_DB *db, DAZZ_TRACK *track)
 }
 
 
+/*******************************************************************************************
+ *
+ *  BITMAP TRACK CONTAINER ROUTINES
+ *
+ ********************************************************************************************/
+
+#define BWORDS(len)  (((len)+63) >> 6)
+
+// Return the largest number of bytes a container for a read of length rlen can occupy.
+
+int Bitmap_Max_Size(int rlen)
+{ return (8 + 8*BWORDS(rlen)); }
+
+// Encode the nint/2 ascending intervals in ints as a container for a read of length rlen
+//   in bmap and return its size in bytes.  Touching or overlapping intervals are merged.
+
+int Intervals_To_Bitmap(int *ints, int nint, int rlen, void *bmap)
+{ int64  *head = (int64 *) bmap;
+  int     i, m, b, e, nwords;
+
+  m = 0;
+  e = -1;
+  for (i = 0; i < nint; i += 2)
+    { if (ints[i+1] <= ints[i])
+        continue;
+      if (ints[i] > e)
+        m += 1;
+      if (ints[i+1] > e)
+        e = ints[i+1];
+    }
+
+  nwords = BWORDS(rlen);
+  if (nwords <= 2*m)
+    { uint64 *bits = (uint64 *) (head+1);
+      uint64  lmask, rmask;
+      int     lw, rw;
+
+      for (i = 0; i < nwords; i++)
+        bits[i] = 0;
+      for (i = 0; i < nint; i += 2)
+        { b = ints[i];
+          e = ints[i+1];
+          if (e > rlen)
+            e = rlen;
+          if (e <= b)
+            continue;
+          lw = (b >> 6);
+          rw = ((e-1) >> 6);
+          lmask = (~0ull) << (b & 0x3f);
+          rmask = (~0ull) >> (63 - ((e-1) & 0x3f));
+          if (lw == rw)
+            bits[lw] |= (lmask & rmask);
+          else
+            { bits[lw] |= lmask;
+              while (++lw < rw)
+                bits[lw] = ~0ull;
+              bits[rw] |= rmask;
+            }
+        }
+      *head = -nwords;
+      return (8 + 8*nwords);
+    }
+  else
+    { int *runs = (int *) (head+1);
+
+      m = 0;
+      e = -1;
+      for (i = 0; i < nint; i += 2)
+        { if (ints[i+1] <= ints[i])
+            continue;
+          if (ints[i] > e)
+            { runs[m++] = ints[i];
+              runs[m++] = ints[i+1];
+              e = ints[i+1];
+            }
+          else if (ints[i+1] > e)
+            runs[m-1] = e = ints[i+1];
+        }
+      *head = m/2;
+      return (8 + 4*m);
+    }
+}
+
+// Decode the container bmap into a list of maximal intervals placed in ints, and return
+//   the number of ints (2 per interval) placed in ints.
+
+int Bitmap_To_Intervals(void *bmap, int *ints)
+{ int b, e, n;
+
+  if (*((int64 *) bmap) >= 0)
+    { n = 2 * *((int64 *) bmap);
+      memcpy(ints,((int64 *) bmap)+1,sizeof(int)*n);
+      return (n);
+    }
+
+  n = 0;
+  for (b = Bitmap_Next(bmap,0,&e); b >= 0; b = Bitmap_Next(bmap,e,&e))
+    { ints[n++] = b;
+      ints[n++] = e;
+    }
+  return (n);
+}
+
+//  Return the index of the first interval in runs[0..n) that ends after pos (n if none)
+
+static int find_run(int *runs, int n, int pos)
+{ int l, r, m;
+
+  l = 0;
+  r = n;
+  while (l < r)
+    { m = (l+r) >> 1;
+      if (runs[2*m+1] <= pos)
+        l = m+1;
+      else
+        r = m;
+    }
+  return (l);
+}
+
+// Return 1 if position pos is masked in bmap, 0 otherwise.
+
+int Bitmap_Test(void *bmap, int pos)
+{ int64 h = *((int64 *) bmap);
+
+  if (pos < 0)
+    return (0);
+  if (h < 0)
+    { uint64 *bits = (uint64 *) (((int64 *) bmap)+1);
+
+      if ((pos >> 6) >= -h)
+        return (0);
+      return ((int) ((bits[pos >> 6] >> (pos & 0x3f)) & 0x1));
+    }
+  else
+    { int *runs = (int *) (((int64 *) bmap)+1);
+      int  k;
+
+      k = find_run(runs,h,pos);
+      return (k < h && runs[2*k] <= pos);
+    }
+}
+
+// Return the number of masked positions of bmap in [beg,end).
+
+int Bitmap_Count(void *bmap, int beg, int end)
+{ int64 h = *((int64 *) bmap);
+  int   cnt;
+
+  if (beg < 0)
+    beg = 0;
+  if (h < 0)
+    { uint64 *bits = (uint64 *) (((int64 *) bmap)+1);
+      uint64  lmask, rmask;
+      int     lw, rw;
+
+      if (end > 64*(-h))
+        end = 64*(-h);
+      if (end <= beg)
+        return (0);
+      lw = (beg >> 6);
+      rw = ((end-1) >> 6);
+      lmask = (~0ull) << (beg & 0x3f);
+      rmask = (~0ull) >> (63 - ((end-1) & 0x3f));
+      if (lw == rw)
+        return (__builtin_popcountll(bits[lw] & lmask & rmask));
+      cnt = __builtin_popcountll(bits[lw] & lmask) + __builtin_popcountll(bits[rw] & rmask);
+      while (++lw < rw)
+        cnt += __builtin_popcountll(bits[lw]);
+      return (cnt);
+    }
+  else
+    { int *runs = (int *) (((int64 *) bmap)+1);
+      int  k, b, e;
+
+      cnt = 0;
+      for (k = find_run(runs,h,beg); k < h; k++)
+        { b = runs[2*k];
+          if (b >= end)
+            break;
+          e = runs[2*k+1];
+          if (b < beg)
+            b = beg;
+          if (e > end)
+            e = end;
+          cnt += e-b;
+        }
+      return (cnt);
+    }
+}
+
+// Return the start of the first maximal masked interval that ends after pos, clipped to
+//   begin no earlier than pos, and set *end to the end of the interval, or return -1 if
+//   there is no such interval.
+
+int Bitmap_Next(void *bmap, int pos, int *end)
+{ int64 h = *((int64 *) bmap);
+
+  if (pos < 0)
+    pos = 0;
+  if (h < 0)
+    { uint64 *bits = (uint64 *) (((int64 *) bmap)+1);
+      uint64  w;
+      int     k, b, n;
+
+      n = -h;
+      k = (pos >> 6);
+      if (k >= n)
+        return (-1);
+      w = bits[k] & ((~0ull) << (pos & 0x3f));
+      while (w == 0)
+        { if (++k >= n)
+            return (-1);
+          w = bits[k];
+        }
+      b = (k << 6) + __builtin_ctzll(w);
+
+      w = ~bits[k] & ((~0ull) << (b & 0x3f));
+      while (w == 0)
+        { if (++k >= n)
+            { *end = (n << 6);
+              return (b);
+            }
+          w = ~bits[k];
+        }
+      *end = (k << 6) + __builtin_ctzll(w);
+      return (b);
+    }
+  else
+    { int *runs = (int *) (((int64 *) bmap)+1);
+      int  k;
+
+      k = find_run(runs,h,pos);
+      if (k >= h)
+        return (-1);
+      *end = runs[2*k+1];
+      if (runs[2*k] < pos)
+        return (pos);
+      return (runs[2*k]);
+    }
+}
+
+
+/*******************************************************************************************
+ *
+ *  QUALITY TRACK ROUTINES
+ *
+ ********************************************************************************************/
+
+int Encode_Quality(int len, uint8 *qv, uint8 *code)
+{ uint8 *c;
+  int    i, j, n;
+
+  c = code;
+  for (i = 0; i < len; i = j)
+    { for (j = i+1; j < len; j++)
+        if (qv[j] != qv[i])
+          break;
+      n = j-i;
+      if (n < 3)
+        { *c++ = qv[i];
+          j = i+1;
+        }
+      else
+        { *c++ = 0x80 | qv[i];
+          while (n >= 0x80)
+            { *c++ = 0x80 | (n & 0x7f);
+              n >>= 7;
+            }
+          *c++ = n;
+        }
+    }
+  return (c-code);
+}
+
+int Decode_Quality(uint8 *code, int clen, uint8 *qv)
+{ uint8 *c, *e, *q;
+  int    n, s, x;
+
+  q = qv;
+  e = code + clen;
+  for (c = code; c < e; )
+    { x = *c++;
+      if (x < 0x80)
+        *q++ = x;
+      else
+        { x &= 0x7f;
+          n  = 0;
+          s  = 0;
+          while (*c & 0x80)
+            { n |= (*c++ & 0x7f) << s;
+              s += 7;
+            }
+          n |= *c++ << s;
+          memset(q,x,n);
+          q += n;
+        }
+    }
+  return (q-qv);
+}
+
 /*******************************************************************************************
  *
  *  QV OPEN, BUFFER ALLOCATION, LOAD, & CLOSE ROUTINES
@@ -2322,11 +2863,14 @@ DAZZ_DB *Active_DB = NULL;  //  Last db/qv used by "Load_QVentry"
 DAZZ_QV *Active_QV;         //    Becomes invalid after closing
 
 int Open_QVs(DAZZ_DB *db)
-{ FILE        *quiva, *istub, *indx;
+{ FILE        *istub, *indx;
+  QVbuffer    *quiva;
   char        *root;
   uint16      *table;
   DAZZ_QV     *qvtrk;
   QVcoding    *coding, *nx;
+  int         *hread;
+  int64       *hoff;
   int          ncodes = 0;
 
   if (db->tracks != NULL && db->tracks->name == qtrack_name)
@@ -2350,14 +2894,24 @@ int Open_QVs(DAZZ_DB *db)
 
   //  Open .qvs, .idx, and .db files
 
-  quiva = Fopen(MyCatenate(db->path,"","",".qvs"),"r");
-  if (quiva == NULL)
-    return (-1);
+  { FILE *qfile;
+
+    qfile = Fopen(MyCatenate(db->path,"","",".qvs"),"r");
+    if (qfile == NULL)
+      return (-1);
+    quiva = New_QVbuffer(qfile);
+    if (quiva == NULL)
+      { fclose(qfile);
+        EXIT(1);
+      }
+  }
 
   istub  = NULL;
   indx   = NULL; 
   table  = NULL;
   coding = NULL;
+  hread  = NULL;
+  hoff   = NULL;
   qvtrk  = NULL;
 
   root = rindex(db->path,'/');
@@ -2415,7 +2969,9 @@ int Open_QVs(DAZZ_DB *db)
         ncodes = fend-fbeg;
         coding = (QVcoding *) Malloc(sizeof(QVcoding)*ncodes,"Allocating coding schemes");
         table  = (uint16 *) Malloc(sizeof(uint16)*db->nreads,"Allocating QV table indices");
-        if (indx == NULL || coding == NULL || table == NULL)
+        hread  = (int *) Malloc(sizeof(int)*ncodes,"Allocating QV header offsets");
+        hoff   = (int64 *) Malloc(sizeof(int64)*ncodes,"Allocating QV header offsets");
+        if (indx == NULL || coding == NULL || table == NULL || hread == NULL || hoff == NULL)
           { ncodes = 0;
             goto error;
           }
@@ -2446,23 +3002,28 @@ int Open_QVs(DAZZ_DB *db)
                     ncodes = i;
                     goto error;
                   }
-                fseeko(quiva,read.coff,SEEK_SET);
+                Seek_QVbuffer(quiva,read.coff);
                 nx = Read_QVcoding(quiva);
                 if (nx == NULL)
                   { ncodes = i;
                     goto error;
                   }
                 coding[i] = *nx;
+                free(nx);
+                hread[i] = -1;
               }
             else
-              { fseeko(quiva,db->reads[first-pfirst].coff,SEEK_SET);
+              { Seek_QVbuffer(quiva,db->reads[first-pfirst].coff);
                 nx = Read_QVcoding(quiva);
                 if (nx == NULL)
                   { ncodes = i;
                     goto error;
                   }
                 coding[i] = *nx;
-                db->reads[first-pfirst].coff = ftello(quiva);
+                free(nx);
+                hread[i] = first-pfirst;
+                hoff[i]  = db->reads[first-pfirst].coff;
+                db->reads[first-pfirst].coff = Tell_QVbuffer(quiva);
               }
 
             j = first-pfirst;
@@ -2488,7 +3049,9 @@ int Open_QVs(DAZZ_DB *db)
         ncodes = nfiles;
         coding = (QVcoding *) Malloc(sizeof(QVcoding)*nfiles,"Allocating coding schemes");
         table  = (uint16 *) Malloc(sizeof(uint16)*db->nreads,"Allocating QV table indices");
-        if (coding == NULL || table == NULL)
+        hread  = (int *) Malloc(sizeof(int)*nfiles,"Allocating QV header offsets");
+        hoff   = (int64 *) Malloc(sizeof(int64)*nfiles,"Allocating QV header offsets");
+        if (coding == NULL || table == NULL || hread == NULL || hoff == NULL)
           goto error;
   
         first = 0;
@@ -2498,14 +3061,17 @@ int Open_QVs(DAZZ_DB *db)
                 goto error;
               }
   
-            fseeko(quiva,db->reads[first].coff,SEEK_SET);
+            Seek_QVbuffer(quiva,db->reads[first].coff);
             nx = Read_QVcoding(quiva);
             if (nx == NULL)
               { ncodes = i;
                 goto error;
               }
             coding[i] = *nx;
-	    db->reads[first].coff = ftello(quiva);
+            free(nx);
+            hread[i] = first;
+            hoff[i]  = db->reads[first].coff;
+	    db->reads[first].coff = Tell_QVbuffer(quiva);
 
             for (j = first; j < last; j++)
               table[j] = (uint16) i;
@@ -2529,6 +3095,10 @@ int Open_QVs(DAZZ_DB *db)
     qvtrk->table  = table;
     qvtrk->coding = coding;
     qvtrk->quiva  = quiva;
+    qvtrk->hread  = hread;
+    qvtrk->hoff   = hoff;
+    qvtrk->arena  = NULL;
+    qvtrk->aoff   = NULL;
   }
 
   fclose(istub);
@@ -2539,6 +3109,8 @@ error:
     free(qvtrk);
   if (table != NULL)
     free(table);
+  free(hread);
+  free(hoff);
   if (coding != NULL)
     { int i;
       for (i = 0; i < ncodes; i++)
@@ -2549,7 +3121,8 @@ error:
     fclose(indx);
   if (istub != NULL)
     fclose(istub);
-  fclose(quiva);
+  fclose(quiva->file);
+  Free_QVbuffer(quiva);
   EXIT(1);
 }
 
@@ -2569,12 +3142,32 @@ char **New_QV_Buffer(DAZZ_DB *db)
   return (entry);
 }
 
+// Convert the len symbols of the DELTAG stream deltag as described for Load_Read
+
+static void Convert_Deltag(char *deltag, int len, int ascii)
+{ if (ascii != 1)
+    { if (ascii != 2)
+        { char x = deltag[len];
+          deltag[len] = '\0';
+          Number_Read(deltag);
+          deltag[len] = x;
+        }
+      else
+        { int j;
+          int u = 'A'-'a';
+
+          for (j = 0; j < len; j++)
+            deltag[j] = (char) (deltag[j]+u);
+        }
+    }
+}
+
 // Load into entry the QV streams for the i'th read from db.  The parameter ascii applies to
 //  the DELTAG stream as described for Load_Read.
 
 int Load_QVentry(DAZZ_DB *db, int i, char **entry, int ascii)
 { DAZZ_READ *reads;
-  FILE      *quiva;
+  QVbuffer  *quiva;
   int        rlen;
 
   if (db != Active_DB)
@@ -2595,28 +3188,247 @@ int Load_QVentry(DAZZ_DB *db, int i, char **entry, int ascii)
   quiva = Active_QV->quiva;
   rlen  = reads[i].rlen;
 
-  fseeko(quiva,reads[i].coff,SEEK_SET);
-  if (Uncompress_Next_QVentry(quiva,entry,Active_QV->coding+Active_QV->table[i],rlen))
-    EXIT(1);
+  if (Active_QV->arena != NULL)
+    { char *qvs = Active_QV->arena + Active_QV->aoff[i];
+      int   k;
 
-  if (ascii != 1)
-    { char *deltag = entry[1];
+      for (k = 0; k < 5; k++)
+        memcpy(entry[k],qvs+k*rlen,rlen);
+    }
+  else
+    { if (Seek_QVbuffer(quiva,reads[i].coff))
+        EXIT(1);
+      if (Uncompress_Next_QVentry(quiva,entry,Active_QV->coding+Active_QV->table[i],rlen))
+        EXIT(1);
+    }
 
-      if (ascii != 2)
-        { char x = deltag[rlen];
-          deltag[rlen] = '\0';
-          Number_Read(deltag);
-          deltag[rlen] = x;
+  Convert_Deltag(entry[1],rlen,ascii);
+  return (0);
+}
+
+// Load into entry the QV streams for the interval [beg,end) of the i'th read from db
+
+int Load_QVsubentry(DAZZ_DB *db, int i, int beg, int end, char **entry, int ascii)
+{ DAZZ_READ *reads;
+  QVbuffer  *quiva;
+
+  if (db != Active_DB)
+    { if (db->tracks == NULL || strcmp(db->tracks->name,".@qvs") != 0)
+        { EPRINTF(EPLACE,"%s: QV's have not been opened (Load_QVsubentry)\n",Prog_Name);
+          EXIT(1);
         }
-      else
-        { int j;
-          int u = 'A'-'a';
+      Active_QV = (DAZZ_QV *) db->tracks;
+      Active_DB = db;
+    }
 
-          for (j = 0; j < rlen; j++)
-            deltag[j] = (char) (deltag[j]+u);
+  if (i < 0 || i >= db->nreads)
+    { EPRINTF(EPLACE,"%s: Index out of bounds (Load_QVsubentry)\n",Prog_Name);
+      EXIT(1);
+    }
+
+  reads = db->reads;
+  quiva = Active_QV->quiva;
+
+  if (Active_QV->arena != NULL)
+    { char *qvs = Active_QV->arena + Active_QV->aoff[i];
+      int   k;
+
+      if (beg < 0 || end > reads[i].rlen || beg > end)
+        { EPRINTF(EPLACE,"%s: Interval [%d,%d] is not within read %d (Load_QVsubentry)\n",
+                         Prog_Name,beg,end,i);
+          EXIT(1);
         }
+      for (k = 0; k < 5; k++)
+        memcpy(entry[k],qvs+k*reads[i].rlen+beg,end-beg);
+    }
+  else
+    { if (Seek_QVbuffer(quiva,reads[i].coff))
+        EXIT(1);
+      if (Uncompress_QVsubentry(quiva,entry,Active_QV->coding+Active_QV->table[i],
+                                reads[i].rlen,beg,end))
+        EXIT(1);
     }
 
+  Convert_Deltag(entry[1],end-beg,ascii);
+  return (0);
+}
+
+//  Uncompress the QVs of reads [beg,end) from the in-memory .qvs span in buf into the arena
+
+typedef struct
+  { DAZZ_QV   *qvtrk;
+    DAZZ_READ *reads;
+    QVbuffer   buf;
+    char      *arena;
+    int64     *aoff;
+    int        beg, end;
+    int        error;
+  } QVload_Arg;
+
+static void *load_qvs_thread(void *arg)
+{ QVload_Arg *parm  = (QVload_Arg *) arg;
+  DAZZ_QV    *qvtrk = parm->qvtrk;
+  DAZZ_READ  *reads = parm->reads;
+  QVbuffer   *buf   = &(parm->buf);
+  char       *entry[5];
+  int         i, k, rlen;
+
+  for (i = parm->beg; i < parm->end; i++)
+    { rlen = reads[i].rlen;
+      for (k = 0; k < 5; k++)
+        entry[k] = parm->arena + parm->aoff[i] + k*rlen;
+      if (Seek_QVbuffer(buf,reads[i].coff) ||
+          Uncompress_Next_QVentry(buf,entry,qvtrk->coding+qvtrk->table[i],rlen))
+        { parm->error = 1;
+          break;
+        }
+    }
+  return (NULL);
+}
+
+// Read the span of the .qvs file holding the QVs of db's reads and uncompress them with
+//   nthreads threads into an arena, record the offset of each read in the arena, and close
+//   the .qvs file.
+
+int Load_All_QVs(DAZZ_DB *db, int nthreads)
+{ DAZZ_QV   *qvtrk;
+  DAZZ_READ *reads;
+  FILE      *qfile;
+  char      *span, *arena;
+  int64     *aoff;
+  int64      sbeg, send, total;
+  int        nreads;
+  int        i, t;
+
+  i = Open_QVs(db);
+  if (i != 0)
+    return (i);
+
+  qvtrk  = (DAZZ_QV *) db->tracks;
+  if (qvtrk->arena != NULL)
+    return (0);
+
+  reads  = db->reads;
+  nreads = db->nreads;
+  qfile  = qvtrk->quiva->file;
+  if (nthreads < 1)
+    nthreads = 1;
+  if (nthreads > nreads)
+    nthreads = nreads;
+
+  //  The QVs of the reads are in [sbeg,send): send is the offset of the first read after the
+  //    block in the .idx if it has QVs, or the end of the .qvs file otherwise.  If the DB has
+  //    been trimmed then this read follows the last untrimmed read of the block.
+
+  sbeg = reads[0].coff;
+  send = -1;
+  { FILE     *indx;
+    DAZZ_READ next;
+    int       ureads;
+
+    indx = Fopen(MyCatenate(db->path,"","",".idx"),"r");
+    if (indx == NULL)
+      EXIT(1);
+    ureads = ((int *) (db->reads))[-1];
+    if (fseeko(indx,sizeof(DAZZ_DB) + sizeof(DAZZ_READ)*(db->ufirst+ureads),SEEK_SET) == 0
+          && fread(&next,sizeof(DAZZ_READ),1,indx) == 1)
+      send = next.coff;
+    fclose(indx);
+  }
+  if (send < reads[nreads-1].coff)
+    { if (fseeko(qfile,0,SEEK_END) < 0)
+        { EPRINTF(EPLACE,"%s: Could not seek to end of .qvs file (Load_All_QVs)\n",Prog_Name);
+          EXIT(1);
+        }
+      send = ftello(qfile);
+    }
+
+  span  = (char *) Malloc((send-sbeg)+8,"Allocating QV span");
+  aoff  = (int64 *) Malloc(sizeof(int64)*(nreads+1),"Allocating QV arena offsets");
+  if (span == NULL || aoff == NULL)
+    { free(span);
+      EXIT(1);
+    }
+  if (fseeko(qfile,sbeg,SEEK_SET) < 0 || fread(span,send-sbeg,1,qfile) != 1)
+    { EPRINTF(EPLACE,"%s: Read of .qvs file failed (Load_All_QVs)\n",Prog_Name);
+      free(aoff);
+      free(span);
+      EXIT(1);
+    }
+  bzero(span+(send-sbeg),8);
+
+  //  Each read's 5 vectors are followed by 4 bytes of slack as uncompressing the deletion
+  //    tags writes a few bytes beyond them
+
+  total = 0;
+  for (i = 0; i < nreads; i++)
+    { aoff[i] = total;
+      total  += 5*((int64) reads[i].rlen) + 4;
+    }
+  aoff[nreads] = total;
+
+  arena = (char *) Malloc(total,"Allocating QV arena");
+  if (arena == NULL)
+    { free(aoff);
+      free(span);
+      EXIT(1);
+    }
+
+  //  Uncompress the reads with nthreads threads, each taking reads with about the same
+  //    number of QVs
+
+  { pthread_t  threads[nthreads];
+    QVload_Arg parm[nthreads];
+    int        error;
+
+    for (t = 0; t < nthreads; t++)
+      { parm[t].qvtrk = qvtrk;
+        parm[t].reads = reads;
+        parm[t].arena = arena;
+        parm[t].aoff  = aoff;
+        parm[t].error = 0;
+        parm[t].buf.file = NULL;
+        parm[t].buf.data = (unsigned char *) span;
+        parm[t].buf.size = send-sbeg;
+        parm[t].buf.ptr  = 0;
+        parm[t].buf.end  = send-sbeg;
+        parm[t].buf.off  = sbeg;
+      }
+    i = 0;
+    for (t = 0; t < nthreads; t++)
+      { parm[t].beg = i;
+        while (i < nreads && aoff[i] < (total*(t+1))/nthreads)
+          i += 1;
+        if (t == nthreads-1)
+          i = nreads;
+        parm[t].end = i;
+      }
+
+    for (t = 1; t < nthreads; t++)
+      pthread_create(threads+t,NULL,load_qvs_thread,parm+t);
+    load_qvs_thread(parm);
+    for (t = 1; t < nthreads; t++)
+      pthread_join(threads[t],NULL);
+
+    error = 0;
+    for (t = 0; t < nthreads; t++)
+      error |= parm[t].error;
+    if (error)
+      { free(arena);
+        free(aoff);
+        free(span);
+        EXIT(1);
+      }
+  }
+
+  free(span);
+
+  fclose(qfile);
+  Free_QVbuffer(qvtrk->quiva);
+  qvtrk->quiva = NULL;
+  qvtrk->arena = arena;
+  qvtrk->aoff  = aoff;
+
   return (0);
 }
 
@@ -2636,7 +3448,17 @@ void Close_QVs(DAZZ_DB *db)
         Free_QVcoding(qvtrk->coding+i);
       free(qvtrk->coding);
       free(qvtrk->table);
-      fclose(qvtrk->quiva);
+      for (i = qvtrk->ncodes-1; i >= 0; i--)
+        if (qvtrk->hread[i] >= 0)
+          db->reads[qvtrk->hread[i]].coff = qvtrk->hoff[i];
+      free(qvtrk->hread);
+      free(qvtrk->hoff);
+      if (qvtrk->quiva != NULL)
+        { fclose(qvtrk->quiva->file);
+          Free_QVbuffer(qvtrk->quiva);
+        }
+      free(qvtrk->arena);
+      free(qvtrk->aoff);
       db->tracks = track->next;
       free(track);
     }
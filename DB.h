@@ -276,6 +276,7 @@ void Number_Arrow(char *s);   //  Convert arrow pw string from letters to number
 #define DB_QV   0x03ff   //  Mask for 3-digit quality value
 #define DB_CCS  0x0400   //  This is the second or later of a group of subreads from a given insert
 #define DB_BEST 0x0800   //  This is the "best" subread of a given insert (may be the only 1)
+#define DB_DUP  0x1000   //  This read is an exact copy of an earlier read of the DB (fasta2DB -d)
 
 #define DB_ARROW 0x2     //  DB is an arrow DB
 #define DB_ALL   0x1     //  all wells are in the trimmed DB
@@ -349,7 +350,12 @@ typedef struct
     QVcoding      *coding;  //  array [0..ncodes-1] of coding schemes (see QV.h)
     uint16        *table;   //  for i in [0,db->nreads-1]: read i should be decompressed with
                             //    scheme coding[table[i]]
-    FILE          *quiva;   //  the open file pointer to the .qvs file
+    QVbuffer      *quiva;   //  buffered reader of the open .qvs file (NULL once all loaded)
+    int           *hread;   //  for c in [0,ncodes-1]: if hread[c] >= 0 then the coff of read
+    int64         *hoff;    //    hread[c] was advanced past the header of coding c from hoff[c]
+                            //    (restored by Close_QVs)
+    char          *arena;   //  if not NULL, the uncompressed QVs of all the reads (see
+    int64         *aoff;    //    Load_All_QVs) where those of read i begin at arena[aoff[i]]
   } DAZZ_QV;
 
 //  The information for accessing Arrow streams is in a DAZZ_ARW record that is a "pseudo-track"
@@ -409,7 +415,8 @@ typedef struct
        //    the addition of fields for the size of the actively loaded trimmed and untrimmed
        //    blocks, an additional read record is allocated in "reads" when a DB is loaded into
        //    memory (reads[-1]) and the two desired fields are crammed into the first two
-       //    integer spaces of the record.
+       //    integer spaces of the record.  Once the DB is trimmed, the coff field of this
+       //    record also holds a pointer to a bit vector of the untrimmed reads that were kept.
 
     char       *path;       //  Root name of DB for .bps, .qvs, and tracks
     int         loaded;     //  Are reads loaded in memory?
@@ -601,9 +608,11 @@ void Close_Arrow(DAZZ_DB *);
   //   the type of track as follows:
   //      CUSTOM  0 => a custom track
   //      MASK    1 => a mask track
+  //      BITMAP  2 => a bitmap track (see BITMAP TRACK ROUTINES below)
 
 #define CUSTOM_TRACK 0
 #define   MASK_TRACK 1
+#define BITMAP_TRACK 2
 
 int Check_Track(DAZZ_DB *db, char *track, int *kind);
 
@@ -624,7 +633,8 @@ void *New_Track_Buffer(DAZZ_TRACK *track);
 
   // Load into 'data' the read data block for read i's "track" data.  Return the length of
   //   the data in bytes, unless an error occurs and INTERACTIVE is defined in which case
-  //   return wtih -1.
+  //   return wtih -1.  The .data file is accessed with positional reads, so several threads
+  //   may share one opened track as long as each uses its own New_Track_Buffer.
 
 int Load_Track_Data(DAZZ_TRACK *track, int i, void *data);
 
@@ -655,12 +665,117 @@ int Read_Extra(FILE *afile, char *aname, DAZZ_EXTRA *extra);
 
 int Write_Extra(FILE *afile, DAZZ_EXTRA *extra);
 
+  //  Write the nextra extras in 'extra' to the end of afile followed by a small directory
+  //    of their offsets, so that any one of them can later be fetched by name in O(1)
+  //    seeks with Fetch_Extra.  The directory is itself encoded as an extra that Read_Extra
+  //    treats as the end of the list.  Error handling is as for Write_Extra.
+
+int Write_Extras(FILE *afile, DAZZ_EXTRA *extra, int nextra);
+
+  //  Find the extra called 'name' of the given track of db without loading the track and
+  //    place it in 'extra', whose name and value are allocated and should be freed by the
+  //    caller.  Uses the directory written by Write_Extras if present, otherwise scans the
+  //    extras of the .anno file.  Returns:
+  //      0 if the extra was found,
+  //      1 if the track has no such extra, and
+  //     -1 if the track does not exist or there was an error (if interactive)
+
+int Fetch_Extra(DAZZ_DB *db, char *track, char *name, DAZZ_EXTRA *extra);
+
   // If track is on the db's track list, then it is removed and all storage associated with it
   //   is freed.
 
 void Close_Track(DAZZ_DB *db, DAZZ_TRACK *track);
 
 
+/*******************************************************************************************
+ *
+ *  BITMAP TRACK ROUTINES
+ *
+ ********************************************************************************************/
+
+  // A bitmap track marks a set of positions in each read just as a mask track does, but is
+  //   designed for masks that cover much of a read in many small pieces.  Its .anno file has
+  //   the size field BITMAP_ANNO and int64 offsets into .data exactly like a mask track.  The
+  //   data for each read is a "container" that begins with an int64 h.  If h >= 0 then h
+  //   intervals follow as pairs of ints [beg,end), otherwise -h uint64 words follow where bit
+  //   p&0x3f of word p>>6 is set iff position p is masked.  A container is a bit vector when
+  //   that is no more than twice the size of the interval list, and containers are always a
+  //   multiple of 8 bytes long so a loaded track's containers are 8-byte aligned.
+
+#define BITMAP_ANNO -1
+
+  // Return the largest number of bytes a container for a read of length rlen can occupy.
+
+int Bitmap_Max_Size(int rlen);
+
+  // Encode the nint ints (nint/2 intervals in ascending order) of a mask interval list
+  //   for a read of length rlen as a container in bmap and return its size in bytes.
+
+int Intervals_To_Bitmap(int *ints, int nint, int rlen, void *bmap);
+
+  // Decode the container bmap into a list of maximal intervals placed in ints, and return
+  //   the number of ints (2 per interval) placed in ints.
+
+int Bitmap_To_Intervals(void *bmap, int *ints);
+
+  // Return 1 if position pos is masked in bmap, 0 otherwise.
+
+int Bitmap_Test(void *bmap, int pos);
+
+  // Return the number of masked positions of bmap in [beg,end).
+
+int Bitmap_Count(void *bmap, int beg, int end);
+
+  // Return the start of the first maximal masked interval of bmap that ends after pos,
+  //   clipped to begin no earlier than pos, and set *end to the end of the interval.
+  //   Return -1 if there is no such interval.  Iterate over all intervals with
+  //   for (b = Bitmap_Next(bmap,0,&e); b >= 0; b = Bitmap_Next(bmap,e,&e)) ...
+
+int Bitmap_Next(void *bmap, int pos, int *end);
+
+
+/*******************************************************************************************
+ *
+ *  QUALITY TRACK ROUTINES
+ *
+ ********************************************************************************************/
+
+  // fasta2DB can keep the QVs of .fastq input in the custom track QUAL_TRACK whose .anno has
+  //   int64 offsets into .data.  The data of a read is its QVs (0..QUAL_MAX) run-length coded:
+  //   a byte q < 0x80 is a single q, and a byte 0x80|q is followed by the length (>= 3) of a
+  //   run of q's as a varint of 7 bits per byte, least significant first, with the high bit
+  //   set on all but the last byte.  Reads imported from .fasta input have no data.  The
+  //   .anno ends with the extra QUAL_HISTOGRAM giving the # of bases with each QV.
+
+#define QUAL_TRACK      "qual"
+#define QUAL_HISTOGRAM  "QV histogram"
+#define QUAL_MAX        93
+
+  // Code the len QVs in qv into code (which needs no more than len bytes) and return the
+  //   length of the code.
+
+int Encode_Quality(int len, uint8 *qv, uint8 *code);
+
+  // Decode the clen bytes of code into qv and return the number of QVs.
+
+int Decode_Quality(uint8 *code, int clen, uint8 *qv);
+
+
+/*******************************************************************************************
+ *
+ *  PERMUTATION TRACK
+ *
+ ********************************************************************************************/
+
+  // DBsort reorders the reads of a DB into a copy and gives in the custom track PERM_TRACK
+  //   the index of each read of the copy in the source: its .anno has an int per read and
+  //   there is no .data.  The track of a source that was itself reordered is permuted along
+  //   with the reads, so the indices are always those of the DB as it was first built.
+
+#define PERM_TRACK  "perm"
+
+
 /*******************************************************************************************
  *
  *  QV ROUTINES
@@ -692,6 +807,21 @@ char **New_QV_Buffer(DAZZ_DB *db);
 
 int   Load_QVentry(DAZZ_DB *db, int i, char **entry, int ascii);
 
+  // As Load_QVentry but load into entry[0..4][0..end-beg-1] only the QVs of the interval
+  //   [beg,end) of the i'th read.  If the read was compressed in blocks (quiva2DB -b) then only
+  //   the blocks covering the interval are decompressed.
+
+int   Load_QVsubentry(DAZZ_DB *db, int i, int beg, int end, char **entry, int ascii);
+
+  // Open the QVs if they are not already, read the portion of the .qvs file for db's reads
+  //   in one go, and uncompress them with nthreads threads into a block that holds the 5
+  //   vectors of each read consecutively.  The .qvs file is then closed, after which
+  //   Load_QVentry and Load_QVsubentry simply copy from the block.  The 'coff' of each read
+  //   is left as is.  Return -1 if there is no .qvs file, 1 if an error (reported to
+  //   EPLACE) occured and INTERACTIVE is defined, and 0 otherwise.
+
+int   Load_All_QVs(DAZZ_DB *db, int nthreads);
+
   // Remove the QV pseudo track, all space associated with it, and close the .qvs file.
 
 void Close_QVs(DAZZ_DB *db);
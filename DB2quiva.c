@@ -93,12 +93,14 @@ int main(int argc, char *argv[])
     FILE       *ofile = NULL;
     int         f, first, last, ofirst, nfiles;
     QVcoding   *coding;
+    QVbuffer   *input;
     char      **entry;
 
     FSCANF(dbfile,DB_NFILE,&nfiles)
 
     reads = db->reads;
     entry = New_QV_Buffer(db);
+    input = New_QVbuffer(quiva);
     first = ofirst = 0;
     for (f = 0; f < nfiles; f++)
       { int   i;
@@ -145,7 +147,7 @@ int main(int argc, char *argv[])
         //   For the relevant range of reads, write the header for each to the file
         //     and then uncompress and write the quiva entry for each
 
-        coding = Read_QVcoding(quiva);
+        coding = Read_QVcoding(input);
 
         for (i = first; i < last; i++)
           { int        e, flags, qv, rlen;
@@ -160,7 +162,7 @@ int main(int argc, char *argv[])
               FPRINTF(ofile," RQ=0.%3d",qv)
             FPRINTF(ofile,"\n")
 
-            Uncompress_Next_QVentry(quiva,entry,coding,rlen);
+            Uncompress_Next_QVentry(input,entry,coding,rlen);
 
             if (UPPER)
               { char *deltag = entry[1];
@@ -174,6 +176,9 @@ int main(int argc, char *argv[])
               FPRINTF(ofile,"%.*s\n",rlen,entry[e])
           }
 
+        Free_QVcoding(coding);
+        free(coding);
+
         first = last;
       }
 
@@ -185,6 +190,8 @@ int main(int argc, char *argv[])
         else
           FCLOSE(ofile)
       }
+
+    Free_QVbuffer(input);
   }
 
   fclose(quiva);
@@ -0,0 +1,167 @@
+/*******************************************************************************************
+ *
+ *  Convert a mask track into a bitmap track or vice versa.
+ *
+ *  Date  :  October 2026
+ *
+ ********************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "DB.h"
+
+#ifdef HIDE_FILES
+#define PATHSEP "/."
+#else
+#define PATHSEP "/"
+#endif
+
+static char *Usage = "[-v] <path:db|dam> <source:track> <target:track>";
+
+int main(int argc, char *argv[])
+{ DAZZ_DB     _db, *db = &_db;
+  DAZZ_TRACK *track;
+  FILE       *afile, *dfile;
+  int         kind;
+
+  int         VERBOSE;
+
+  //  Process arguments
+
+  { int   i, j, k;
+    int   flags[128];
+
+    ARG_INIT("DBbitmap")
+
+    j = 1;
+    for (i = 1; i < argc; i++)
+      if (argv[i][0] == '-')
+        { ARG_FLAGS("v") }
+      else
+        argv[j++] = argv[i];
+    argc = j;
+
+    VERBOSE = flags['v'];
+
+    if (argc != 4)
+      { fprintf(stderr,"Usage: %s %s\n",Prog_Name,Usage);
+        fprintf(stderr,"\n");
+        fprintf(stderr,"      -v: Verbose mode, output statistics as proceed.\n");
+        exit (1);
+      }
+  }
+
+  //  Open .db or .dam and the source track, trimming the DB if the track is for the
+  //    trimmed DB
+
+  { int status;
+
+    status = Open_DB(argv[1],db);
+    if (status < 0)
+      exit (1);
+
+    status = Check_Track(db,argv[2],&kind);
+    if (status == -2)
+      { fprintf(stderr,"%s: Track %s does not exist\n",Prog_Name,argv[2]);
+        exit (1);
+      }
+    else if (status == -1)
+      { fprintf(stderr,"%s: Track %s not sync'd with db.\n",Prog_Name,argv[2]);
+        exit (1);
+      }
+    else if (kind == CUSTOM_TRACK)
+      { fprintf(stderr,"%s: Track %s is neither a mask nor a bitmap track\n",Prog_Name,argv[2]);
+        exit (1);
+      }
+    if (status == 1)
+      Trim_DB(db);
+
+    track = Open_Track(db,argv[2]);
+    if (track == NULL)
+      exit (1);
+  }
+
+  //  Open the target track files (block track files if db is a block)
+
+  { char *pwd, *root, *base;
+    int   size;
+
+    pwd  = PathTo(argv[1]);
+    root = Root(argv[1],".db");
+    base = Strdup(Catenate(pwd,PATHSEP,root,"."),"Allocating track name");
+    if (base == NULL)
+      exit (1);
+
+    afile = Fopen(Catenate(base,argv[3],".","anno"),"w");
+    dfile = Fopen(Catenate(base,argv[3],".","data"),"w");
+    if (afile == NULL || dfile == NULL)
+      exit (1);
+
+    if (kind == MASK_TRACK)
+      size = BITMAP_ANNO;
+    else
+      size = 0;
+    FFWRITE(&(track->nreads),sizeof(int),1,afile)
+    FFWRITE(&size,sizeof(int),1,afile)
+
+    free(base);
+    free(pwd);
+    free(root);
+  }
+
+  //  Convert each read's data
+
+  { int   *src;
+    void  *dst;
+    int64  indx, ibytes;
+    int    i, len, rlen, olen;
+
+    src = (int *) New_Track_Buffer(track);
+    if (kind == MASK_TRACK)
+      dst = Malloc(Bitmap_Max_Size(db->maxlen),"Allocating bitmap buffer");
+    else
+      dst = Malloc(sizeof(int)*(db->maxlen+2),"Allocating interval buffer");
+    if (src == NULL || dst == NULL)
+      exit (1);
+
+    indx   = 0;
+    ibytes = 0;
+    FFWRITE(&indx,sizeof(int64),1,afile)
+    for (i = 0; i < track->nreads; i++)
+      { len  = Load_Track_Data(track,i,src);
+        rlen = db->reads[i].rlen;
+        if (kind == MASK_TRACK)
+          olen = Intervals_To_Bitmap(src,len/sizeof(int),rlen,dst);
+        else if (len > 0)
+          olen = sizeof(int) * Bitmap_To_Intervals(src,dst);
+        else
+          olen = 0;
+        FFWRITE(dst,1,olen,dfile)
+        indx   += olen;
+        ibytes += len;
+        FFWRITE(&indx,sizeof(int64),1,afile)
+      }
+
+    if (VERBOSE)
+      { fprintf(stderr,"  Converted %s track %s to %s track %s: ",
+                       kind == MASK_TRACK ? "mask" : "bitmap",argv[2],
+                       kind == MASK_TRACK ? "bitmap" : "mask",argv[3]);
+        Print_Number(ibytes,0,stderr);
+        fprintf(stderr," -> ");
+        Print_Number(indx,0,stderr);
+        fprintf(stderr," bytes\n");
+      }
+
+    free(dst);
+    free(src);
+  }
+
+  FCLOSE(afile)
+  FCLOSE(dfile)
+
+  Close_DB(db);
+
+  exit (0);
+}
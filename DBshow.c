@@ -480,7 +480,7 @@ int main(int argc, char *argv[])
 
         for (i = b; i < e; i++)
           { int         len;
-            int         fst, lst;
+            int         fst, lst, qfst;
             int         flags, qv;
             float       snr[4];
             DAZZ_READ  *r;
@@ -534,8 +534,17 @@ int main(int argc, char *argv[])
               }
             PRINTF("\n")
 
+            //  Only the QVs of a substring are loaded, at entry[k][0..lst-fst-1]
+
+            qfst = 0;
             if (DOQVS)
-              Load_QVentry(db,i,entry,UPPER);
+              { if (substr)
+                  { Load_QVsubentry(db,i,fst,lst,entry,UPPER);
+                    qfst = fst;
+                  }
+                else
+                  Load_QVentry(db,i,entry,UPPER);
+              }
             if (DOSEQ)
               Load_Read(db,i,read,UPPER);
             if (DOARR)
@@ -570,7 +579,7 @@ int main(int argc, char *argv[])
               { int k;
 
                 for (k = 0; k < 5; k++)
-                  PRINTF("%.*s\n",lst-fst,entry[k]+fst)
+                  PRINTF("%.*s\n",lst-fst,entry[k]+(fst-qfst))
               }
             else if (ARROW)
               { int k;
@@ -589,14 +598,14 @@ int main(int argc, char *argv[])
                       { if (DOSEQ)
                           PRINTF("%.*s\n",WIDTH,read+j)
                         for (k = 0; k < 5; k++)
-                          PRINTF("%.*s\n",WIDTH,entry[k]+j)
+                          PRINTF("%.*s\n",WIDTH,entry[k]+(j-qfst))
                         PRINTF("\n")
                       }
                     if (j < lst)
                       { if (DOSEQ)
                           PRINTF("%.*s\n",lst-j,read+j)
                         for (k = 0; k < 5; k++)
-                          PRINTF("%.*s\n",lst-j,entry[k]+j)
+                          PRINTF("%.*s\n",lst-j,entry[k]+(j-qfst))
                         PRINTF("\n")
                       }
                   }
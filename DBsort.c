@@ -0,0 +1,780 @@
+/*******************************************************************************************
+ *
+ *  Reorder the reads of a .db or .dam:
+ *     Create a copy of a database in which the reads of each block are physically in a new
+ *     order, either longest first or clustered by their smallest k-mer (minimizer) so that
+ *     reads likely from the same region of the genome are adjacent.  The .bps, .idx, .qvs,
+ *     .arw, and every track of the source are rewritten in the new order, and the custom
+ *     track PERM_TRACK gives for each read of the copy its index in the source.
+ *
+ *     Reads are only moved within the intersection of a block and a file (SMRT cell), so
+ *     the stub file, the block partition, and the per-cell QV coding schemes of the copy are
+ *     exactly those of the source.  Moreover the reads of a well (DB) or the contigs of a
+ *     scaffold (DAM) are kept together in their original order and are moved as a unit.
+ *
+ *  Date  :  October 2026
+ *
+ ********************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "DB.h"
+
+#ifdef HIDE_FILES
+#define PATHSEP "/."
+#else
+#define PATHSEP "/"
+#endif
+
+static char *Usage = "[-vm] <source:db|dam> <target:db|dam>";
+
+#define KMER      16         //  Length of the k-mers whose smallest hash is a read's minimizer
+#define COPY_BUF  0x100000   //  Size of the buffer for copying file segments
+
+static int VERBOSE;
+static int ISDAM;
+
+  //  Read r is not the first of its well (DB) or scaffold (DAM)
+
+#define CONTINUES(r)  (ISDAM ? (r)->origin != 0 : ((r)->flags & DB_CCS) != 0)
+
+typedef struct
+  { int    beg;   //  Reads [beg,end) are a well (DB) or a scaffold (DAM)
+    int    end;
+    int    len;   //  Length of the longest read of the group
+    uint64 key;   //  Minimizer of the longest read (-m)
+  } Group;
+
+  //  Longest group first, and otherwise in original order
+
+static int LSORT(const void *l, const void *r)
+{ Group *x = (Group *) l;
+  Group *y = (Group *) r;
+
+  if (x->len != y->len)
+    return (y->len - x->len);
+  return (x->beg - y->beg);
+}
+
+  //  By minimizer, then longest first, and otherwise in original order
+
+static int MSORT(const void *l, const void *r)
+{ Group *x = (Group *) l;
+  Group *y = (Group *) r;
+
+  if (x->key != y->key)
+    return (x->key < y->key ? -1 : 1);
+  if (x->len != y->len)
+    return (y->len - x->len);
+  return (x->beg - y->beg);
+}
+
+  //  Return the smallest hash of the canonical k-mers of the numeric read s[0..len)
+
+static uint64 min_hash(char *s, int len)
+{ uint64 fwd, rev, mask, h, min;
+  int    i, shift;
+
+  mask  = (1ull << (2*KMER)) - 1;
+  shift = 2*(KMER-1);
+  fwd   = 0;
+  rev   = 0;
+  min   = ~0ull;
+  for (i = 0; i < len; i++)
+    { fwd = ((fwd << 2) | s[i]) & mask;
+      rev = (rev >> 2) | (((uint64) (3-s[i])) << shift);
+      if (i >= KMER-1)
+        { h  = (fwd < rev ? fwd : rev);
+          h ^= h >> 33;
+          h *= 0xff51afd7ed558ccdull;
+          h ^= h >> 33;
+          h *= 0xc4ceb9fe1a85ec53ull;
+          h ^= h >> 33;
+          if (h < min)
+            min = h;
+        }
+    }
+  return (min);
+}
+
+  //  Copy the len bytes at offset off of in to the end of out
+
+static void copy_bytes(FILE *in, char *in_name, int64 off, int64 len, FILE *out)
+{ static char *buf = NULL;
+  int64 x;
+
+  if (buf == NULL)
+    { buf = (char *) Malloc(COPY_BUF,"Allocating copy buffer");
+      if (buf == NULL)
+        exit (1);
+    }
+  FSEEKO(in,off,SEEK_SET)
+  while (len > 0)
+    { x = (len < COPY_BUF ? len : COPY_BUF);
+      FFREAD(buf,1,x,in)
+      FFWRITE(buf,1,x,out)
+      len -= x;
+    }
+}
+
+static int64 file_size(FILE *file)
+{ int64 size;
+
+  FSEEKO(file,0,SEEK_END)
+  FTELLO(size,file)
+  return (size);
+}
+
+  //  The source and target names of the file with the given extension, or of the given
+  //    track file if track is not NULL
+
+static char *spath, *sroot;
+static char *tpath, *troot;
+
+static char *db_name(char *path, char *root, char *track, char *exten)
+{ static char *name[2] = { NULL, NULL };
+  static int   nmax[2] = { -1, -1 };
+  int   len, w;
+
+  w   = (path == tpath);
+  len = strlen(path) + strlen(root) + strlen(exten) + 10;
+  if (track != NULL)
+    len += strlen(track);
+  if (len > nmax[w])
+    { nmax[w] = 1.2*len + 100;
+      name[w] = (char *) Realloc(name[w],nmax[w],"Allocating file name");
+      if (name[w] == NULL)
+        exit (1);
+    }
+  if (track == NULL)
+    sprintf(name[w],"%s%s%s%s",path,PATHSEP,root,exten);
+  else
+    sprintf(name[w],"%s%s%s.%s%s",path,PATHSEP,root,track,exten);
+  return (name[w]);
+}
+
+#define source_name(track,exten)  db_name(spath,sroot,track,exten)
+#define target_name(track,exten)  db_name(tpath,troot,track,exten)
+
+  //  Collect the names of the tracks of the source, <block>.<track> for a block track
+
+static char **Tname;
+static int    Ntrack, Tmax;
+
+static void HANDLER(char *path, char *exten)
+{ int len;
+
+  (void) path;
+
+  len = strlen(exten);
+  if (len <= 5 || strcmp(exten+(len-5),".anno") != 0)
+    return;
+  if (Ntrack >= Tmax)
+    { Tmax  = 1.2*Ntrack + 10;
+      Tname = (char **) Realloc(Tname,sizeof(char *)*Tmax,"Allocating track list");
+      if (Tname == NULL)
+        exit (1);
+    }
+  Tname[Ntrack] = Strdup(exten,"Allocating track list");
+  if (Tname[Ntrack] == NULL)
+    exit (1);
+  Tname[Ntrack++][len-5] = '\0';
+}
+
+  //  Rewrite the track "track" of the source, whose reads [first,first+n) are permuted by
+  //    perm (of the untrimmed or trimmed DB), in the new order in the target.  The extras
+  //    at the end of the .anno file are copied verbatim.
+
+static void sort_track(char *track, int *perm, int first, int n, int size)
+{ FILE  *safile, *sdfile, *tafile, *tdfile;
+  char  *safile_name, *sdfile_name;
+  int    esize, nrec;
+  int64  tail, doff, beg, end;
+  int    i, k;
+
+  safile_name = Strdup(source_name(track,".anno"),"Allocating file name");
+  sdfile_name = Strdup(source_name(track,".data"),"Allocating file name");
+  if (safile_name == NULL || sdfile_name == NULL)
+    exit (1);
+
+  safile = Fopen(safile_name,"r");
+  tafile = Fopen(target_name(track,".anno"),"w");
+  if (safile == NULL || tafile == NULL)
+    exit (1);
+  sdfile = fopen(sdfile_name,"r");
+  tdfile = NULL;
+  if (sdfile != NULL)
+    { tdfile = Fopen(target_name(track,".data"),"w");
+      if (tdfile == NULL)
+        exit (1);
+    }
+
+  if (VERBOSE)
+    { fprintf(stderr,"  Reordering track %s\n",track);
+      fflush(stderr);
+    }
+
+  if (size <= 0)
+    esize = 8;
+  else
+    esize = size;
+  if (sdfile != NULL)
+    nrec = n+1;
+  else
+    nrec = n;
+
+  FFWRITE(&n,sizeof(int),1,tafile)
+  FFWRITE(&size,sizeof(int),1,tafile)
+
+  if (sdfile != NULL)
+    { int64 *anno, *nano;
+
+      anno = (int64 *) Malloc(sizeof(int64)*nrec,"Allocating track index");
+      nano = (int64 *) Malloc(sizeof(int64)*nrec,"Allocating track index");
+      if (anno == NULL || nano == NULL)
+        exit (1);
+
+      FSEEKO(safile,2*sizeof(int),SEEK_SET)
+      if (esize == 4)
+        { int *a4 = (int *) nano;
+
+          FFREAD(a4,sizeof(int),nrec,safile)
+          for (i = 0; i < nrec; i++)
+            anno[i] = a4[i];
+        }
+      else
+        FFREAD(anno,sizeof(int64),nrec,safile)
+
+      doff = 0;
+      for (i = 0; i < n; i++)
+        { k   = perm[first+i] - first;
+          beg = anno[k];
+          end = anno[k+1];
+          nano[i] = doff;
+          copy_bytes(sdfile,sdfile_name,beg,end-beg,tdfile);
+          doff += end-beg;
+        }
+      nano[n] = doff;
+
+      if (esize == 4)
+        { int *a4 = (int *) anno;
+
+          for (i = 0; i < nrec; i++)
+            a4[i] = nano[i];
+          FFWRITE(a4,sizeof(int),nrec,tafile)
+        }
+      else
+        FFWRITE(nano,sizeof(int64),nrec,tafile)
+
+      free(nano);
+      free(anno);
+    }
+
+  else
+    { char *anno;
+
+      anno = (char *) Malloc(((int64) esize)*nrec,"Allocating track records");
+      if (anno == NULL)
+        exit (1);
+
+      FSEEKO(safile,2*sizeof(int),SEEK_SET)
+      FFREAD(anno,esize,nrec,safile)
+      for (i = 0; i < n; i++)
+        FFWRITE(anno+((int64) esize)*(perm[first+i]-first),esize,1,tafile)
+
+      free(anno);
+    }
+
+  tail = 2*sizeof(int) + ((int64) esize)*nrec;
+  copy_bytes(safile,safile_name,tail,file_size(safile)-tail,tafile);
+
+  FCLOSE(tafile)
+  fclose(safile);
+  if (sdfile != NULL)
+    { FCLOSE(tdfile)
+      fclose(sdfile);
+    }
+  free(sdfile_name);
+  free(safile_name);
+}
+
+int main(int argc, char *argv[])
+{ DAZZ_DB    db;
+  DAZZ_STUB *stub;
+  DAZZ_READ *reads, *nreads;
+  int        isdam, ureads, treads;
+  char      *suffix;
+
+  int       *uperm, *tperm;
+  Group     *group;
+  int        ngroup;
+
+  int        MINIMIZER;
+
+  //  Process arguments
+
+  { int   i, j, k;
+    int   flags[128];
+
+    ARG_INIT("DBsort")
+
+    j = 1;
+    for (i = 1; i < argc; i++)
+      if (argv[i][0] == '-')
+        { ARG_FLAGS("vm") }
+      else
+        argv[j++] = argv[i];
+    argc = j;
+
+    VERBOSE   = flags['v'];
+    MINIMIZER = flags['m'];
+
+    if (argc != 3)
+      { fprintf(stderr,"Usage: %s %s\n",Prog_Name,Usage);
+        fprintf(stderr,"\n");
+        fprintf(stderr,"      -m: Cluster reads by minimizer, otherwise longest first.\n");
+        fprintf(stderr,"      -v: Verbose mode, report each file as it is written.\n");
+        exit (1);
+      }
+  }
+
+  //  Open the source, read its stub, and check the target does not already exist
+
+  isdam = Open_DB(argv[1],&db);
+  if (isdam < 0)
+    exit (1);
+  ISDAM = isdam;
+  if (db.part > 0)
+    { fprintf(stderr,"%s: Cannot be called on a block: %s\n",Prog_Name,argv[1]);
+      exit (1);
+    }
+  ureads = db.ureads;
+
+  if (isdam)
+    suffix = ".dam";
+  else
+    suffix = ".db";
+  spath = PathTo(argv[1]);
+  sroot = Root(argv[1],suffix);
+  tpath = PathTo(argv[2]);
+  troot = Root(argv[2],suffix);
+  if (spath == NULL || sroot == NULL || tpath == NULL || troot == NULL)
+    exit (1);
+
+  { struct stat B;
+
+    if (stat(Catenate(tpath,"/",troot,".db"),&B) == 0 ||
+        stat(Catenate(tpath,"/",troot,".dam"),&B) == 0)
+      { fprintf(stderr,"%s: Target database %s already exists\n",Prog_Name,troot);
+        exit (1);
+      }
+  }
+
+  stub = Read_DB_Stub(Catenate(spath,"/",sroot,suffix),DB_STUB_NREADS|DB_STUB_BLOCKS);
+  if (stub == NULL)
+    exit (1);
+
+  //  Read the records of the .idx, as is
+
+  reads  = (DAZZ_READ *) Malloc(sizeof(DAZZ_READ)*(ureads+1),"Allocating read records");
+  nreads = (DAZZ_READ *) Malloc(sizeof(DAZZ_READ)*(ureads+1),"Allocating read records");
+  uperm  = (int *) Malloc(sizeof(int)*(ureads+1),"Allocating permutation");
+  tperm  = (int *) Malloc(sizeof(int)*(ureads+1),"Allocating permutation");
+  group  = (Group *) Malloc(sizeof(Group)*(ureads+1),"Allocating groups");
+  if (reads == NULL || nreads == NULL || uperm == NULL || tperm == NULL || group == NULL)
+    exit (1);
+
+  { FILE *ixfile;
+    char *ixfile_name;
+
+    ixfile_name = source_name(NULL,".idx");
+    ixfile      = Fopen(ixfile_name,"r");
+    if (ixfile == NULL)
+      exit (1);
+    FSEEKO(ixfile,sizeof(DAZZ_DB),SEEK_SET)
+    FFREAD(reads,sizeof(DAZZ_READ),ureads,ixfile)
+    fclose(ixfile);
+  }
+
+  //  Divide the reads into groups, breaking at every file and block boundary, and sort the
+  //    groups between consecutive boundaries.  Then the new order of the untrimmed reads is
+  //    uperm and of the trimmed reads is tperm (both giving the old index of each read).
+
+  { char *cut, *read;
+    int  *tidx;
+    int   i, j, g, h, s;
+    int   allflag, cutoff;
+
+    cut = (char *) Malloc(ureads+1,"Allocating boundaries");
+    if (cut == NULL)
+      exit (1);
+    bzero(cut,ureads+1);
+    for (i = 0; i < stub->nfiles; i++)
+      cut[stub->nreads[i]] = 1;
+    for (i = 0; i <= stub->nblocks; i++)
+      cut[stub->ublocks[i]] = 1;
+
+    read = NULL;
+    if (MINIMIZER)
+      { read = New_Read_Buffer(&db);
+        if (read == NULL)
+          exit (1);
+      }
+
+    ngroup = 0;
+    for (i = 0; i < ureads; i = j)
+      { g = i;
+        for (j = i+1; j < ureads && !cut[j] && CONTINUES(reads+j); j++)
+          { if (reads[j].rlen > reads[g].rlen)
+              g = j;
+          }
+        group[ngroup].beg = i;
+        group[ngroup].end = j;
+        group[ngroup].len = reads[g].rlen;
+        group[ngroup].key = 0;
+        if (MINIMIZER)
+          { Load_Read(&db,g,read,0);
+            group[ngroup].key = min_hash(read,reads[g].rlen);
+          }
+        ngroup += 1;
+      }
+
+    //  A block boundary can fall within a well, in which case the two parts of the well
+    //    stay at the end and start of their blocks so they remain adjacent
+
+    for (s = 0, g = 1; g <= ngroup; g++)
+      if (g == ngroup || cut[group[g].beg])
+        { h = g;
+          if (CONTINUES(reads+group[s].beg))
+            s += 1;
+          if (group[h-1].end < ureads && CONTINUES(reads+group[h-1].end))
+            h -= 1;
+          if (h > s)
+            { if (MINIMIZER)
+                qsort(group+s,h-s,sizeof(Group),MSORT);
+              else
+                qsort(group+s,h-s,sizeof(Group),LSORT);
+            }
+          s = g;
+        }
+
+    j = 0;
+    for (g = 0; g < ngroup; g++)
+      for (i = group[g].beg; i < group[g].end; i++)
+        uperm[j++] = i;
+
+    if (stub->all)
+      allflag = 0;
+    else
+      allflag = DB_BEST;
+    cutoff = stub->cutoff;
+
+    tidx = (int *) Malloc(sizeof(int)*(ureads+1),"Allocating trimmed index");
+    if (tidx == NULL)
+      exit (1);
+
+    treads = 0;                         //  tidx[i] is the index of read i in the trimmed DB
+    for (i = 0; i < ureads; i++)        //    or -1 if it is not in it
+      if ((reads[i].flags & DB_BEST) >= allflag && reads[i].rlen >= cutoff)
+        tidx[i] = treads++;
+      else
+        tidx[i] = -1;
+    j = 0;
+    for (i = 0; i < ureads; i++)
+      if (tidx[uperm[i]] >= 0)
+        tperm[j++] = tidx[uperm[i]];
+    free(tidx);
+
+    if (MINIMIZER)
+      free(read-1);
+    free(cut);
+  }
+
+  Close_DB(&db);
+
+  if (VERBOSE)
+    { fprintf(stderr,"  Reordering ");
+      Print_Number(ureads,0,stderr);
+      fprintf(stderr," reads in ");
+      Print_Number(ngroup,0,stderr);
+      fprintf(stderr," %s of %s\n",isdam?"scaffolds":"wells",sroot);
+      fflush(stderr);
+    }
+
+  //  Write the .bps and the .arw (if any) in the new order, their offsets being the same
+
+  { FILE *sbfile, *tbfile;
+    FILE *safile, *tafile;
+    char *sbfile_name, *safile_name;
+    int64 boff, len;
+    int   i;
+
+    sbfile_name = Strdup(source_name(NULL,".bps"),"Allocating file name");
+    safile_name = Strdup(source_name(NULL,".arw"),"Allocating file name");
+    if (sbfile_name == NULL || safile_name == NULL)
+      exit (1);
+
+    sbfile = Fopen(sbfile_name,"r");
+    tbfile = Fopen(target_name(NULL,".bps"),"w");
+    if (sbfile == NULL || tbfile == NULL)
+      exit (1);
+    safile = fopen(safile_name,"r");
+    tafile = NULL;
+    if (safile != NULL)
+      { tafile = Fopen(target_name(NULL,".arw"),"w");
+        if (tafile == NULL)
+          exit (1);
+      }
+
+    boff = 0;
+    for (i = 0; i < ureads; i++)
+      { nreads[i] = reads[uperm[i]];
+        len = COMPRESSED_LEN(nreads[i].rlen);
+        copy_bytes(sbfile,sbfile_name,nreads[i].boff,len,tbfile);
+        if (safile != NULL)
+          copy_bytes(safile,safile_name,nreads[i].boff,len,tafile);
+        nreads[i].boff = boff;
+        boff += len;
+      }
+
+    FCLOSE(tbfile)
+    fclose(sbfile);
+    if (safile != NULL)
+      { FCLOSE(tafile)
+        fclose(safile);
+      }
+    free(safile_name);
+    free(sbfile_name);
+  }
+
+  //  Write the .qvs (if any): for each cell with QVs, its coding scheme and then the QV
+  //    streams of its reads in the new order.  The stream of the first read of a cell is
+  //    immediately after the scheme and the .coff of the first read is that of the scheme.
+
+  { FILE     *sqfile, *tqfile;
+    char     *sqfile_name;
+    QVbuffer *qbuf;
+    QVcoding *coding;
+    int64    *qbeg, qoff, cbeg, cend, qend;
+    int       c, first, last;
+    int       i, u;
+
+    sqfile_name = Strdup(source_name(NULL,".qvs"),"Allocating file name");
+    if (sqfile_name == NULL)
+      exit (1);
+    sqfile = fopen(sqfile_name,"r");
+    if (sqfile != NULL)
+      { tqfile = Fopen(target_name(NULL,".qvs"),"w");
+        qbuf   = New_QVbuffer(Fopen(sqfile_name,"r"));
+        qbeg   = (int64 *) Malloc(sizeof(int64)*(ureads+1),"Allocating QV offsets");
+        if (tqfile == NULL || qbuf == NULL || qbeg == NULL)
+          exit (1);
+
+        if (VERBOSE)
+          { fprintf(stderr,"  Reordering QV streams\n");
+            fflush(stderr);
+          }
+
+        qend = file_size(sqfile);
+        qoff = 0;
+        for (c = 0; c < stub->nfiles; c++)
+          { first = (c == 0 ? 0 : stub->nreads[c-1]);
+            last  = stub->nreads[c];
+            if (first == last)
+              continue;
+            if (reads[first].coff < 0)
+              break;
+
+            cbeg = reads[first].coff;
+            Seek_QVbuffer(qbuf,cbeg);
+            coding = Read_QVcoding(qbuf);
+            if (coding == NULL)
+              exit (1);
+            cend = Tell_QVbuffer(qbuf);
+            Free_QVcoding(coding);
+            free(coding);
+
+            qbeg[first] = cend;
+            for (u = first+1; u < last; u++)
+              qbeg[u] = reads[u].coff;
+            if (last < ureads && reads[last].coff >= 0)
+              qbeg[last] = reads[last].coff;
+            else
+              qbeg[last] = qend;
+
+            copy_bytes(sqfile,sqfile_name,cbeg,cend-cbeg,tqfile);
+            nreads[first].coff = qoff;
+            qoff += cend-cbeg;
+            for (i = first; i < last; i++)
+              { u = uperm[i];
+                if (i > first)
+                  nreads[i].coff = qoff;
+                copy_bytes(sqfile,sqfile_name,qbeg[u],qbeg[u+1]-qbeg[u],tqfile);
+                qoff += qbeg[u+1]-qbeg[u];
+              }
+          }
+
+        FCLOSE(tqfile)
+        fclose(qbuf->file);
+        Free_QVbuffer(qbuf);
+        fclose(sqfile);
+        free(qbeg);
+      }
+    free(sqfile_name);
+  }
+
+  //  Write the .idx: the DB record of the source followed by the reordered read records
+
+  { FILE   *ixfile, *txfile;
+    char   *ixfile_name;
+    DAZZ_DB header;
+
+    ixfile_name = source_name(NULL,".idx");
+    ixfile      = Fopen(ixfile_name,"r");
+    if (ixfile == NULL)
+      exit (1);
+    FFREAD(&header,sizeof(DAZZ_DB),1,ixfile)
+    fclose(ixfile);
+
+    txfile = Fopen(target_name(NULL,".idx"),"w");
+    if (txfile == NULL)
+      exit (1);
+    FFWRITE(&header,sizeof(DAZZ_DB),1,txfile)
+    FFWRITE(nreads,sizeof(DAZZ_READ),ureads,txfile)
+    FCLOSE(txfile)
+  }
+
+  //  Reorder every track of the source that is for the untrimmed or trimmed DB or for one
+  //    of its blocks.  The permutation track of the source, if any, thus becomes that of
+  //    the target relative to the DB originally loaded, otherwise it is created.
+
+  { FILE *afile;
+    char *afile_name;
+    char *name, *eptr;
+    int   tracklen, size;
+    int   t, b, first, n;
+    int   hasperm;
+
+    List_DB_Files(Catenate(spath,"/",sroot,suffix),HANDLER);
+
+    hasperm = 0;
+    for (t = 0; t < Ntrack; t++)
+      { name = Tname[t];
+        b    = 0;
+        if (isdigit(name[0]))
+          { b = strtol(name,&eptr,10);
+            if (*eptr != '.' || b < 1 || b > stub->nblocks)
+              { fprintf(stderr,"%s: Track %s is not for a block of %s, not copied\n",
+                               Prog_Name,name,sroot);
+                continue;
+              }
+          }
+
+        afile_name = source_name(name,".anno");
+        afile      = Fopen(afile_name,"r");
+        if (afile == NULL)
+          exit (1);
+        FFREAD(&tracklen,sizeof(int),1,afile)
+        FFREAD(&size,sizeof(int),1,afile)
+        fclose(afile);
+
+        if (b == 0)
+          { if (tracklen == ureads)
+              sort_track(name,uperm,0,ureads,size);
+            else if (tracklen == treads)
+              sort_track(name,tperm,0,treads,size);
+            else
+              { fprintf(stderr,"%s: Track %s is not the size of %s, not copied\n",
+                               Prog_Name,name,sroot);
+                continue;
+              }
+            if (strcmp(name,PERM_TRACK) == 0)
+              hasperm = (tracklen == ureads && size == sizeof(int));
+          }
+        else
+          { first = stub->ublocks[b-1];
+            n     = stub->ublocks[b] - first;
+            if (tracklen == n)
+              sort_track(name,uperm,first,n,size);
+            else
+              { first = stub->tblocks[b-1];
+                n     = stub->tblocks[b] - first;
+                if (tracklen == n)
+                  sort_track(name,tperm,first,n,size);
+                else
+                  fprintf(stderr,"%s: Track %s is not the size of block %d, not copied\n",
+                                 Prog_Name,name,b);
+              }
+          }
+      }
+
+    if ( ! hasperm)
+      { FILE *pfile;
+
+        if (VERBOSE)
+          { fprintf(stderr,"  Creating track %s\n",PERM_TRACK);
+            fflush(stderr);
+          }
+
+        size  = sizeof(int);
+        pfile = Fopen(target_name(PERM_TRACK,".anno"),"w");
+        if (pfile == NULL)
+          exit (1);
+        FFWRITE(&ureads,sizeof(int),1,pfile)
+        FFWRITE(&size,sizeof(int),1,pfile)
+        FFWRITE(uperm,sizeof(int),ureads,pfile)
+        FCLOSE(pfile)
+      }
+  }
+
+  //  The .hdr of a DAM is unchanged as the .coff of each contig is its scaffold's header.
+  //    Last write the stub, identical to the source's, so the target is complete only now.
+
+  { FILE *sfile, *tfile;
+    char *sfile_name;
+
+    if (isdam)
+      { sfile_name = Strdup(source_name(NULL,".hdr"),"Allocating file name");
+        if (sfile_name == NULL)
+          exit (1);
+        sfile = Fopen(sfile_name,"r");
+        tfile = Fopen(target_name(NULL,".hdr"),"w");
+        if (sfile == NULL || tfile == NULL)
+          exit (1);
+        copy_bytes(sfile,sfile_name,0,file_size(sfile),tfile);
+        FCLOSE(tfile)
+        fclose(sfile);
+        free(sfile_name);
+      }
+
+    sfile_name = Strdup(Catenate(spath,"/",sroot,suffix),"Allocating file name");
+    if (sfile_name == NULL)
+      exit (1);
+    sfile = Fopen(sfile_name,"r");
+    tfile = Fopen(Catenate(tpath,"/",troot,suffix),"w");
+    if (sfile == NULL || tfile == NULL)
+      exit (1);
+    copy_bytes(sfile,sfile_name,0,file_size(sfile),tfile);
+    FCLOSE(tfile)
+    fclose(sfile);
+    free(sfile_name);
+  }
+
+  Free_DB_Stub(stub);
+  free(group);
+  free(tperm);
+  free(uperm);
+  free(nreads);
+  free(reads);
+  free(troot);
+  free(tpath);
+  free(sroot);
+  free(spath);
+
+  exit (0);
+}
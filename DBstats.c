@@ -23,6 +23,7 @@ int main(int argc, char *argv[])
 
   int64   ototal;
   int     oreads;
+  int64   qsize;
   int     nbin, *hist;
   int64  *bsum;
 
@@ -114,6 +115,21 @@ int main(int argc, char *argv[])
     oreads = db->nreads;
     ototal = db->totlen;
 
+    //  If the whole DB has QVs, note the size of its .qvs file
+
+    qsize = 0;
+    if (!dam && db->part == 0 && (db->allarr & DB_ARROW) == 0 && db->nreads > 0
+             && db->reads[db->nreads-1].coff >= 0)
+      { FILE *qvs;
+
+        qvs = fopen(Catenate(db->path,"","",".qvs"),"r");
+        if (qvs != NULL)
+          { if (fseeko(qvs,0,SEEK_END) == 0)
+              qsize = ftello(qvs);
+            fclose(qvs);
+          }
+      }
+
     if (TRIM)
       { Trim_DB(db);
 
@@ -132,6 +148,8 @@ int main(int argc, char *argv[])
   { int        i;
     int64      totlen;
     int        nreads, maxlen;
+    int        ndups;
+    int64      ddups;
     DAZZ_READ *reads;
 
     nreads = db->nreads;
@@ -150,10 +168,16 @@ int main(int argc, char *argv[])
         bsum[i] = 0;
       }
  
+    ndups = 0;
+    ddups = 0;
     for (i = 0; i < nreads; i++)
       { int rlen = reads[i].rlen;
         hist[rlen/BIN] += 1;
         bsum[rlen/BIN] += rlen;
+        if ((reads[i].flags & DB_DUP) != 0)
+          { ndups += 1;
+            ddups += rlen;
+          }
       }
 
     if (dam)
@@ -231,6 +255,21 @@ int main(int argc, char *argv[])
     printf("\n  Base composition: %.3f(A) %.3f(C) %.3f(G) %.3f(T)\n",
            db->freq[0],db->freq[1],db->freq[2],db->freq[3]);
 
+    if (qsize > 0)
+      { printf("\n  QV streams of all wells coded in ");
+        Print_Number(qsize,0,stdout);
+        printf(" bytes: %.2f bits/QV, %.1fx compression\n",
+               (8.*qsize)/(5.*ototal),(5.*ototal)/qsize);
+      }
+
+    if (ndups > 0)
+      { printf("\n  ");
+        Print_Number((int64) ndups,0,stdout);
+        printf(" reads totaling ");
+        Print_Number(ddups,0,stdout);
+        printf(" bases (%.1f%%) are flagged as exact duplicates (DB_DUP)\n",(100.*ddups)/totlen);
+      }
+
     if (!NONE)
       { int64 btot;
         int   cum, skip, avg;
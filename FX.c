@@ -0,0 +1,324 @@
+/*******************************************************************************************
+ *
+ *  Chunked scanning of .fasta and .fastq input: a reader thread fills one chunk buffer
+ *    while the other is processed, the partial record at the end of a chunk being carried
+ *    over to the start of the next one.
+ *
+ *  Date  :  October 2026
+ *
+ ********************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "DB.h"
+#include "FX.h"
+
+#define CHUNK_SIZE  0x2000000   //  Input is read in chunks of at least this many bytes
+
+  //  Does a .fastq record begin at the line starting at b, i.e. is it an @-line with a
+  //    +-line two lines later.  A quality line cannot be mistaken for a header as the line
+  //    two after it is a sequence line.
+
+static int fastq_start(char *buf, int64 b, int64 len)
+{ char *eol;
+
+  if (buf[b] != '@')
+    return (0);
+  eol = memchr(buf+b,'\n',len-b);
+  if (eol == NULL)
+    return (0);
+  b   = (eol-buf)+1;
+  eol = memchr(buf+b,'\n',len-b);
+  if (eol == NULL)
+    return (0);
+  b = (eol-buf)+1;
+  return (b < len && buf[b] == '+');
+}
+
+  //  Return the start of the first record of buf[0..len) that begins after position b,
+  //    or len if there is none.
+
+static int64 next_record(int format, char *buf, int64 b, int64 len)
+{ char *eol;
+
+  while (b < len)
+    { eol = memchr(buf+b,'\n',len-b);
+      if (eol == NULL)
+        return (len);
+      b = (eol-buf)+1;
+      if (b >= len)
+        break;
+      if (format == FX_FASTA)
+        { if (buf[b] == '>')
+            return (b);
+        }
+      else
+        { if (fastq_start(buf,b,len))
+            return (b);
+        }
+    }
+  return (len);
+}
+
+  //  Fill the chunk other than the current one with the partial record at the end of the
+  //    current one (if any) followed by CHUNK_SIZE or more bytes of input, cutting it at
+  //    the start of the last record that begins in the bytes just read.
+
+static void *fill_chunk(void *arg)
+{ FX_Stream *fx   = (FX_Stream *) arg;
+  FX_Chunk  *ch   = fx->chunk + (1-fx->cur);
+  FX_Chunk  *last = NULL;
+  int64      beg, x, i;
+  char      *buf;
+
+  if (!fx->first)
+    last = fx->chunk + fx->cur;
+  ch->len   = 0;
+  ch->cut   = 0;
+  ch->eof   = 0;
+  ch->error = 0;
+  if (last != NULL)
+    ch->len = last->len - last->cut;
+  while (1)
+    { if (ch->len + CHUNK_SIZE > ch->max)
+        { ch->max = 1.2*(ch->len+CHUNK_SIZE) + 1000;
+          ch->buf = (char *) Realloc(ch->buf,ch->max,"Allocating chunk buffer");
+          if (ch->buf == NULL)
+            { ch->error = 1;
+              return (NULL);
+            }
+        }
+      buf = ch->buf;
+      if (last != NULL)
+        { memcpy(buf,last->buf+last->cut,ch->len);
+          last = NULL;
+        }
+
+      beg = ch->len;
+      x   = fread(buf+beg,1,CHUNK_SIZE,fx->input);
+      ch->len += x;
+      if (x < CHUNK_SIZE)
+        { if (ferror(fx->input))
+            { EPRINTF(EPLACE,"%s: System error, read failed\n",Prog_Name);
+              ch->error = 1;
+            }
+          ch->eof = 1;
+          ch->cut = ch->len;
+          return (NULL);
+        }
+
+      if (beg == 0)
+        beg = 1;
+      for (i = ch->len-1; i >= beg; i--)
+        if (buf[i-1] == '\n')
+          { if (fx->format == FX_FASTA)
+              { if (buf[i] == '>')
+                  { ch->cut = i;
+                    return (NULL);
+                  }
+              }
+            else
+              { if (fastq_start(buf,i,ch->len))
+                  { ch->cut = i;
+                    return (NULL);
+                  }
+              }
+          }
+    }
+}
+
+FX_Stream *FX_Open(FILE *input)
+{ FX_Stream *fx;
+  int        c;
+
+  fx = (FX_Stream *) Malloc(sizeof(FX_Stream),"Allocating input scanner");
+  if (fx == NULL)
+    return (NULL);
+
+  c = getc(input);
+  if (c != EOF)
+    ungetc(c,input);
+  if (c == '@')
+    fx->format = FX_FASTQ;
+  else
+    fx->format = FX_FASTA;
+
+  fx->input = input;
+  fx->beg   = NULL;
+  fx->end   = NULL;
+  fx->ptr   = NULL;
+  fx->error = FX_OK;
+  fx->line  = 0;
+  for (c = 0; c < 2; c++)
+    { fx->chunk[c].buf = NULL;
+      fx->chunk[c].max = 0;
+    }
+
+  fx->cur   = 1;
+  fx->first = 1;
+  fill_chunk(fx);
+  fx->cur   = 0;
+  if (fx->chunk[0].error)
+    { free(fx->chunk[0].buf);
+      free(fx);
+      return (NULL);
+    }
+  fx->empty = (fx->chunk[0].len == 0);
+  return (fx);
+}
+
+void FX_Close(FX_Stream *fx)
+{ if (!fx->first && !fx->chunk[fx->cur].eof)
+    pthread_join(fx->reader,NULL);
+  free(fx->chunk[0].buf);
+  free(fx->chunk[1].buf);
+  free(fx);
+}
+
+int FX_Next_Chunk(FX_Stream *fx)
+{ FX_Chunk *ch;
+
+  if (fx->first)
+    fx->first = 0;
+  else
+    { if (fx->chunk[fx->cur].eof)
+        return (0);
+      pthread_join(fx->reader,NULL);
+      fx->cur = 1-fx->cur;
+      if (fx->chunk[fx->cur].error)
+        { fx->chunk[fx->cur].eof = 1;
+          return (-1);
+        }
+    }
+
+  ch = fx->chunk + fx->cur;
+  if (ch->len == 0)
+    return (0);
+  if (!ch->eof)
+    pthread_create(&(fx->reader),NULL,fill_chunk,fx);
+
+  fx->beg = ch->buf;
+  fx->end = ch->buf + ch->cut;
+  fx->ptr = fx->beg;
+  return (1);
+}
+
+void FX_Partition(FX_Stream *fx, int nparts, char **bound)
+{ int64 cut, b, e;
+  int   t;
+
+  cut = fx->end - fx->beg;
+  bound[0] = fx->beg;
+  b = 0;
+  for (t = 1; t < nparts; t++)
+    { e = next_record(fx->format,fx->beg,(t*cut)/nparts,cut);
+      if (e < b)
+        e = b;
+      bound[t] = fx->beg + e;
+      b = e;
+    }
+  bound[nparts] = fx->end;
+}
+
+int FX_Parse(int format, char **ptr, char *end, FX_Record *rec)
+{ char *p, *eol;
+
+  p = *ptr;
+  if (*p != (format == FX_FASTA ? '>' : '@'))
+    return (FX_NOHEAD);
+
+  eol = memchr(p,'\n',end-p);
+  if (eol == NULL || eol-p >= MAX_NAME-1)
+    return (FX_LONG);
+  *eol = '\0';
+  rec->header = p+1;
+  rec->hlen   = eol-(p+1);
+  rec->nline  = 1;
+  p = eol+1;
+
+  if (format == FX_FASTA)
+    { rec->seq  = p;
+      rec->qual = NULL;
+      while (p < end && *p != '>')
+        { eol = memchr(p,'\n',end-p);
+          if (eol == NULL)
+            p = end;
+          else
+            p = eol+1;
+          rec->nline += 1;
+        }
+      rec->slen = p-rec->seq;
+    }
+
+  else
+    { if (p >= end)
+        return (FX_FORMAT);
+      eol = memchr(p,'\n',end-p);
+      if (eol == NULL)
+        return (FX_FORMAT);
+      rec->seq  = p;
+      rec->slen = eol-p;
+      p = eol+1;
+      if (p >= end || *p != '+')
+        return (FX_FORMAT);
+      eol = memchr(p,'\n',end-p);
+      if (eol == NULL)
+        return (FX_FORMAT);
+      p = eol+1;
+      eol = memchr(p,'\n',end-p);
+      if (eol == NULL)
+        eol = end;
+      if (eol-p != rec->slen)
+        return (FX_FORMAT);
+      rec->qual  = p;
+      rec->nline = 4;
+      p = eol+1;
+      if (p > end)
+        p = end;
+    }
+
+  *ptr = p;
+  return (FX_OK);
+}
+
+int FX_Read(FX_Stream *fx, FX_Record *rec)
+{ int x;
+
+  while (fx->ptr >= fx->end)
+    { x = FX_Next_Chunk(fx);
+      if (x <= 0)
+        { if (x < 0)
+            fx->error = FX_SYSTEM;
+          return (x);
+        }
+    }
+  rec->line = fx->line+1;
+  x = FX_Parse(fx->format,&(fx->ptr),fx->end,rec);
+  if (x != FX_OK)
+    { fx->error = x;
+      return (-1);
+    }
+  fx->line += rec->nline;
+  return (1);
+}
+
+int64 FX_Bases(FX_Record *rec, char *dst)
+{ char *p, *e, *eol;
+  char *d;
+
+  p = rec->seq;
+  e = p + rec->slen;
+  d = dst;
+  while (p < e)
+    { eol = memchr(p,'\n',e-p);
+      if (eol == NULL)
+        eol = e;
+      memcpy(d,p,eol-p);
+      d += eol-p;
+      p  = eol+1;
+    }
+  return (d-dst);
+}
@@ -0,0 +1,103 @@
+/*******************************************************************************************
+ *
+ *  Chunked scanning of .fasta and .fastq input.  The input is read CHUNK_SIZE or more bytes
+ *    at a time by a background thread while the previous chunk is being processed.  A chunk
+ *    is cut at the start of its last, possibly partial, record which is carried over to the
+ *    start of the next chunk, so that every chunk handed out consists of complete records.
+ *    Records and lines are found with memchr and the records are presented as views into
+ *    the chunk, i.e. without copying.  Whether the input is .fasta or .fastq is determined by
+ *    its first character ('@' for .fastq), a .fastq record must consist of 4 lines.
+ *
+ *  Date  :  October 2026
+ *
+ ********************************************************************************************/
+
+#ifndef _FX_INPUT
+
+#define _FX_INPUT
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "DB.h"
+
+#define FX_FASTA  0   //  Input formats
+#define FX_FASTQ  1
+
+#define FX_OK      0   //  Kinds of errors, reported by the caller unless noted otherwise
+#define FX_NOHEAD  1   //    Record does not begin with a '>' (.fasta) or '@' (.fastq)
+#define FX_LONG    2   //    Header is longer than MAX_NAME-2 chars (or has no new-line)
+#define FX_FORMAT  3   //    .fastq record does not have a '+' line or a quality line as long
+                       //      as the sequence line
+#define FX_SYSTEM  4   //    Read failed or out of memory (reported by the scanner)
+
+typedef struct
+  { char  *header;   //  The header line less its initial > or @, NUL-terminated in place
+    int    hlen;     //    (i.e. its new-line is replaced with a 0) of length hlen
+    char  *seq;      //  The sequence lines are seq[0..slen-1], including their new-lines
+    int64  slen;
+    char  *qual;     //  .fastq: the quality line is qual[0..slen-1], .fasta: NULL
+    int64  nline;    //  # of lines in the record, including the header
+    int64  line;     //  Line # of the header in the input (set by FX_Read only)
+  } FX_Record;
+
+typedef struct
+  { char  *buf;      //  Chunk is buf[0..len), the complete records of which are in [0,cut)
+    int64  len;
+    int64  cut;
+    int64  max;
+    int    eof;      //  The input is exhausted, i.e. cut = len
+    int    error;    //  Read failed or out of memory
+  } FX_Chunk;
+
+typedef struct
+  { int       format;    //  FX_FASTA or FX_FASTQ
+    int       empty;     //  The input is empty
+    char     *beg;       //  The records of the current chunk are in [beg,end)
+    char     *end;
+    int       error;     //  Kind of the error if FX_Read returns -1
+    int64     line;      //  # of lines returned by FX_Read so far
+
+    FILE     *input;     //  Private
+    FX_Chunk  chunk[2];
+    int       cur;
+    int       first;
+    pthread_t reader;
+    char     *ptr;
+  } FX_Stream;
+
+  //  Start scanning input, reading its first chunk.  NULL is returned if memory cannot be
+  //    allocated or the read fails, having reported the error.  FX_Close stops the scan and
+  //    frees the stream, but does not close input.
+
+FX_Stream *FX_Open(FILE *input);
+void       FX_Close(FX_Stream *fx);
+
+  //  Make the next chunk of fx current, setting fx->beg and fx->end, and start reading the
+  //    one after it.  Return 1 if there is such a chunk, 0 at the end of the input, and -1
+  //    if reading it failed (the error has been reported).
+
+int FX_Next_Chunk(FX_Stream *fx);
+
+  //  Set bound[0..nparts] so that [bound[i],bound[i+1]) is a part of about 1/nparts'th of
+  //    the current chunk that begins and ends at a record boundary.
+
+void FX_Partition(FX_Stream *fx, int nparts, char **bound);
+
+  //  Parse the record in a chunk at *ptr < end, setting rec (save for .line) and advancing
+  //    *ptr to the next record.  Return FX_OK or the kind of error.
+
+int FX_Parse(int format, char **ptr, char *end, FX_Record *rec);
+
+  //  Return the next record of the input in rec: 1 if there is one, 0 at the end of input,
+  //    and -1 if there is an error whose kind is in fx->error and whose line is in rec->line.
+  //    The record remains valid only until the next call.
+
+int FX_Read(FX_Stream *fx, FX_Record *rec);
+
+  //  Copy the bases of rec's sequence, i.e. less the new-lines, to dst (of at least
+  //    rec->slen bytes) and return how many there are.
+
+int64 FX_Bases(FX_Record *rec, char *dst);
+
+#endif // _FX_INPUT
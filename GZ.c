@@ -0,0 +1,402 @@
+/*******************************************************************************************
+ *
+ *  Transparent input of gzip'd files: a plain gzip stream (possibly of several members) is
+ *    inflated by a single thread, and a BGZF stream by nthreads threads that each inflate
+ *    every nthreads'th block of a batch, the batch then being written to the pipe in order.
+ *
+ *  Date  :  October 2026
+ *
+ ********************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "DB.h"
+#include "GZ.h"
+
+#define GZ_CHUNK    0x10000   //  Size of the input and output chunks of a plain gzip stream
+#define BGZF_MAX    0x10000   //  Maximum size of a BGZF block, compressed or not
+#define BGZF_HEAD   18        //  Size of the header of a BGZF block
+#define BGZF_BATCH  16        //  # of blocks per thread in a batch
+
+typedef struct _GZ_Reader
+  { FILE              *pipe;     //  Read end of the pipe handed to the caller
+    FILE              *source;   //  The compressed input
+    int                wfd;      //  Write end of the pipe
+    int                nthreads;
+    int                bgzf;     //  The input is BGZF
+    uint8              head[BGZF_HEAD];   //  The first hlen bytes of source (already read)
+    int                hlen;
+    int                error;    //  Set by the thread if source is corrupted or truncated
+    pthread_t          thread;
+    struct _GZ_Reader *next;
+  } GZ_Reader;
+
+static GZ_Reader *Readers = NULL;   //  The inputs currently being inflated
+
+  //  Write data[0..len-1] to the pipe of gz.  Return non-zero if the reader has gone away.
+
+static int write_pipe(GZ_Reader *gz, uint8 *data, int64 len)
+{ int64 n;
+
+  while (len > 0)
+    { n = write(gz->wfd,data,len);
+      if (n < 0)
+        { if (errno == EINTR)
+            continue;
+          return (1);
+        }
+      data += n;
+      len  -= n;
+    }
+  return (0);
+}
+
+  //  Inflate a plain gzip stream, each member of which is inflated in turn
+
+static void inflate_plain(GZ_Reader *gz)
+{ z_stream z;
+  uint8   *in, *out;
+  size_t   n;
+  int      ret;
+
+  in  = (uint8 *) malloc(2*GZ_CHUNK);
+  if (in == NULL)
+    { gz->error = 1;
+      return;
+    }
+  out = in + GZ_CHUNK;
+
+  memset(&z,0,sizeof(z_stream));
+  if (inflateInit2(&z,15+16) != Z_OK)
+    { free(in);
+      gz->error = 1;
+      return;
+    }
+
+  z.next_in  = gz->head;
+  z.avail_in = gz->hlen;
+  ret = Z_OK;
+  while (1)
+    { if (z.avail_in == 0)
+        { n = fread(in,1,GZ_CHUNK,gz->source);
+          if (n == 0)
+            break;
+          z.next_in  = in;
+          z.avail_in = n;
+        }
+      if (ret == Z_STREAM_END)
+        inflateReset(&z);
+      z.next_out  = out;
+      z.avail_out = GZ_CHUNK;
+      ret = inflate(&z,Z_NO_FLUSH);
+      if (ret != Z_OK && ret != Z_STREAM_END)
+        break;
+      if (write_pipe(gz,out,GZ_CHUNK-z.avail_out))
+        { ret = Z_STREAM_END;
+          break;
+        }
+    }
+  if (ret != Z_STREAM_END || ferror(gz->source))
+    gz->error = 1;
+
+  inflateEnd(&z);
+  free(in);
+}
+
+  //  A BGZF block read into cdata[0..clen-1] is inflated into udata[0..ulen-1]
+
+typedef struct
+  { uint8 *cdata;
+    int    clen;
+    uint8 *udata;
+    int    ulen;
+    int    error;
+  } BGZF_Block;
+
+typedef struct
+  { BGZF_Block *block;
+    int         nblk;
+    int         beg;
+    int         step;
+  } Inflate_Arg;
+
+static void inflate_block(BGZF_Block *b)
+{ z_stream z;
+  uint8   *t;
+  uint32   crc, isize;
+
+  t     = b->cdata + (b->clen-8);
+  crc   = t[0] | (t[1] << 8) | (t[2] << 16) | ((uint32) t[3] << 24);
+  isize = t[4] | (t[5] << 8) | (t[6] << 16) | ((uint32) t[7] << 24);
+  b->error = 1;
+  if (isize > BGZF_MAX)
+    return;
+
+  memset(&z,0,sizeof(z_stream));
+  if (inflateInit2(&z,-15) != Z_OK)
+    return;
+  z.next_in   = b->cdata + BGZF_HEAD;
+  z.avail_in  = b->clen - (BGZF_HEAD+8);
+  z.next_out  = b->udata;
+  z.avail_out = BGZF_MAX;
+  if (inflate(&z,Z_FINISH) == Z_STREAM_END && z.total_out == isize &&
+      crc32(0,b->udata,isize) == crc)
+    { b->ulen  = isize;
+      b->error = 0;
+    }
+  inflateEnd(&z);
+}
+
+static void *inflate_thread(void *arg)
+{ Inflate_Arg *parm = (Inflate_Arg *) arg;
+  int          i;
+
+  for (i = parm->beg; i < parm->nblk; i += parm->step)
+    inflate_block(parm->block+i);
+  return (NULL);
+}
+
+  //  Read the next BGZF block into b, its header being in h if not NULL.  Return 1 if at
+  //    the end of the input, 2 if the next member is gzip'd but not a BGZF block, -1 if
+  //    the input is corrupted, and 0 otherwise.
+
+static int read_block(GZ_Reader *gz, uint8 *h, BGZF_Block *b)
+{ uint8 *c = b->cdata;
+  int    n;
+
+  if (h != NULL)
+    memcpy(c,h,BGZF_HEAD);
+  else
+    { n = fread(c,1,BGZF_HEAD,gz->source);
+      if (n == 0)
+        return (1);
+      if (n < BGZF_HEAD)
+        return (-1);
+    }
+  if (c[0] != 0x1f || c[1] != 0x8b)
+    return (-1);
+  if (c[2] != 8 || (c[3] & 0x4) == 0 ||
+      c[10] != 6 || c[11] != 0 || c[12] != 'B' || c[13] != 'C' || c[14] != 2 || c[15] != 0)
+    return (2);
+  b->clen = (c[16] | (c[17] << 8)) + 1;
+  if (b->clen < BGZF_HEAD+8)
+    return (-1);
+  if (fread(c+BGZF_HEAD,1,b->clen-BGZF_HEAD,gz->source) != (size_t) (b->clen-BGZF_HEAD))
+    return (-1);
+  return (0);
+}
+
+  //  Inflate a BGZF stream a batch of BGZF_BATCH*nthreads blocks at a time.  Should a plain
+  //    gzip member follow, it and the remainder of the input are inflated as a plain stream.
+
+static void inflate_bgzf(GZ_Reader *gz)
+{ int          nthreads = gz->nthreads;
+  int          nmax     = BGZF_BATCH*nthreads;
+  BGZF_Block  *block;
+  Inflate_Arg *parm;
+  pthread_t   *threads;
+  uint8       *data, *head;
+  int          i, n, t, s;
+
+  block   = (BGZF_Block *) malloc(sizeof(BGZF_Block)*nmax);
+  parm    = (Inflate_Arg *) malloc(sizeof(Inflate_Arg)*nthreads);
+  threads = (pthread_t *) malloc(sizeof(pthread_t)*nthreads);
+  data    = (uint8 *) malloc(2*((int64) BGZF_MAX)*nmax);
+  if (block == NULL || parm == NULL || threads == NULL || data == NULL)
+    { gz->error = 1;
+      goto clean;
+    }
+  for (i = 0; i < nmax; i++)
+    { block[i].cdata = data + (2*i)*((int64) BGZF_MAX);
+      block[i].udata = block[i].cdata + BGZF_MAX;
+    }
+
+  head = gz->head;
+  s    = 0;
+  while (s == 0)
+    { for (n = 0; n < nmax; n++)
+        { s = read_block(gz,head,block+n);
+          head = NULL;
+          if (s != 0)
+            break;
+        }
+      if (s < 0)
+        { gz->error = 1;
+          goto clean;
+        }
+
+      if (n < 2 || nthreads == 1)
+        for (i = 0; i < n; i++)
+          inflate_block(block+i);
+      else
+        { for (t = 0; t < nthreads; t++)
+            { parm[t].block = block;
+              parm[t].nblk  = n;
+              parm[t].beg   = t;
+              parm[t].step  = nthreads;
+              pthread_create(threads+t,NULL,inflate_thread,parm+t);
+            }
+          for (t = 0; t < nthreads; t++)
+            pthread_join(threads[t],NULL);
+        }
+
+      for (i = 0; i < n; i++)
+        { if (block[i].error)
+            { gz->error = 1;
+              goto clean;
+            }
+          if (write_pipe(gz,block[i].udata,block[i].ulen))
+            goto clean;
+        }
+    }
+
+  if (s == 2)
+    { memcpy(gz->head,block[n].cdata,BGZF_HEAD);
+      gz->hlen = BGZF_HEAD;
+      inflate_plain(gz);
+    }
+
+clean:
+  free(data);
+  free(threads);
+  free(parm);
+  free(block);
+}
+
+static void *gz_thread(void *arg)
+{ GZ_Reader *gz = (GZ_Reader *) arg;
+
+  if (gz->bgzf)
+    inflate_bgzf(gz);
+  else
+    inflate_plain(gz);
+  close(gz->wfd);
+  if (gz->source != stdin)
+    fclose(gz->source);
+  return (NULL);
+}
+
+FILE *Gz_Input(FILE *input, int nthreads)
+{ GZ_Reader *gz;
+  uint8     *h;
+  int        c, fd[2];
+
+  c = getc(input);
+  if (c != 0x1f)
+    { if (c != EOF)
+        ungetc(c,input);
+      return (input);
+    }
+
+  gz = (GZ_Reader *) Malloc(sizeof(GZ_Reader),"Allocating gzip reader");
+  if (gz == NULL)
+    EXIT(NULL);
+
+  h = gz->head;
+  h[0] = 0x1f;
+  gz->hlen  = 1 + fread(h+1,1,BGZF_HEAD-1,input);
+  gz->bgzf  = (gz->hlen == BGZF_HEAD && h[1] == 0x8b && h[2] == 8 && (h[3] & 0x4) != 0 &&
+               h[10] == 6 && h[11] == 0 && h[12] == 'B' && h[13] == 'C' && h[14] == 2 &&
+               h[15] == 0);
+  gz->source   = input;
+  gz->nthreads = nthreads;
+  if (gz->nthreads < 1)
+    gz->nthreads = 1;
+  gz->error    = 0;
+
+  if (pipe(fd) < 0)
+    { EPRINTF(EPLACE,"%s: System error, could not create pipe for gzip input\n",Prog_Name);
+      free(gz);
+      EXIT(NULL);
+    }
+  gz->pipe = fdopen(fd[0],"r");
+  gz->wfd  = fd[1];
+  if (gz->pipe == NULL)
+    { EPRINTF(EPLACE,"%s: System error, could not open pipe for gzip input\n",Prog_Name);
+      close(fd[0]);
+      close(fd[1]);
+      free(gz);
+      EXIT(NULL);
+    }
+
+  //  The thread sees a write error (and not a signal) if the reader closes early
+
+  signal(SIGPIPE,SIG_IGN);
+
+  if (pthread_create(&(gz->thread),NULL,gz_thread,gz) != 0)
+    { EPRINTF(EPLACE,"%s: System error, could not start gzip input thread\n",Prog_Name);
+      fclose(gz->pipe);
+      close(fd[1]);
+      free(gz);
+      EXIT(NULL);
+    }
+
+  gz->next = Readers;
+  Readers  = gz;
+  return (gz->pipe);
+}
+
+FILE *Gz_Fopen(char *path, char *core, char *suffix, int nthreads)
+{ FILE *input, *gzin;
+  char *name;
+
+  name = Strdup(Catenate(path,"/",core,suffix),"Allocating file name");
+  if (name == NULL)
+    EXIT(NULL);
+  input = fopen(name,"r");
+  if (input == NULL)
+    input = fopen(Catenate(name,".gz","",""),"r");
+  free(name);
+  if (input == NULL)
+    return (NULL);
+
+  gzin = Gz_Input(input,nthreads);
+  if (gzin == NULL)
+    fclose(input);
+  return (gzin);
+}
+
+char *Gz_Root(char *name, char *suffix)
+{ char *gzsuffix, *root;
+  int   len, slen;
+
+  gzsuffix = Strdup(Catenate(suffix,".gz","",""),"Allocating suffix");
+  if (gzsuffix == NULL)
+    EXIT(NULL);
+  len  = strlen(name);
+  slen = strlen(gzsuffix);
+  if (len > slen && strcasecmp(name+(len-slen),gzsuffix) == 0)
+    root = Root(name,gzsuffix);
+  else
+    root = Root(name,suffix);
+  free(gzsuffix);
+  return (root);
+}
+
+int Gz_Close(FILE *input)
+{ GZ_Reader *gz, **p;
+  int        error;
+
+  for (p = &Readers; (gz = *p) != NULL; p = &(gz->next))
+    if (gz->pipe == input)
+      break;
+  if (gz == NULL)
+    { fclose(input);
+      return (0);
+    }
+
+  *p = gz->next;
+  fclose(input);
+  pthread_join(gz->thread,NULL);
+  error = gz->error;
+  free(gz);
+  return (error);
+}
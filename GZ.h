@@ -0,0 +1,40 @@
+/*******************************************************************************************
+ *
+ *  Transparent input of gzip'd files.  A gzip'd input is inflated by a background thread
+ *    into a pipe whose read end is handed to the caller, so that it is read with stdio
+ *    exactly as a plain file would be.  A BGZF file (a series of independently gzip'd
+ *    blocks of at most 64KB, as produced by bgzip) is inflated a batch of blocks at a time
+ *    by a number of threads in parallel.  Whether an input is compressed is determined by
+ *    its first byte and not its name, so pipes (e.g. stdin) are handled as well.
+ *
+ *  Date  :  October 2026
+ *
+ ********************************************************************************************/
+
+#ifndef _GZ_INPUT
+
+#define _GZ_INPUT
+
+#include <stdio.h>
+
+#define GZ_THREADS  4   //  Default # of threads for inflating a BGZF input
+
+  //  Return input if it is not gzip'd, otherwise a stream of its inflated contents that is
+  //    filled by a thread (or nthreads threads if it is BGZF) that takes over input (and
+  //    closes it, unless it is stdin).  NULL is returned if the threads cannot be started.
+
+FILE *Gz_Input(FILE *input, int nthreads);
+
+  //  Open the file path/core<suffix>, or failing that path/core<suffix>.gz, as for
+  //    Gz_Input, returning NULL (and reporting nothing) if neither can be opened.  Gz_Root
+  //    returns the root of name as does Root, but also removes <suffix>.gz if present.
+
+FILE *Gz_Fopen(char *path, char *core, char *suffix, int nthreads);
+char *Gz_Root(char *name, char *suffix);
+
+  //  Close an input returned by one of the routines above.  A non-zero value is returned
+  //    if the input was gzip'd and is corrupted or truncated.
+
+int   Gz_Close(FILE *input);
+
+#endif // _GZ_INPUT
@@ -0,0 +1,740 @@
+/*******************************************************************************************
+ *
+ *  Build a DB from a .daz 1-code file, such as one produced by DB2ONE, i.e. the inverse of
+ *    DB2ONE.  The R-line of each read object gives its sequence, and the optional H, W, Q, N,
+ *    and A lines that follow give its prolog, well and pulse interval, quality, SNRs, and
+ *    pulse widths, where a group line f gives the file the reads following it came from.
+ *    A binary file is read in parallel by -T threads, each of which takes a slice of the read
+ *    objects in turn by means of the object index of the file.  If the sequences of the
+ *    file are of type DNA then their 2-bit coding, which is that of a .bps file, is copied
+ *    directly.
+ *
+ *  Date  :  October 2026
+ *
+ ********************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "DB.h"
+#include "ONElib.h"
+
+#ifdef HIDE_FILES
+#define PATHSEP "/."
+#else
+#define PATHSEP "/"
+#endif
+
+static char *Usage = "[-v] [-T<int(4)>] <path:db> <input:daz>";
+
+static int NTHREADS;   //  # of threads reading the input
+
+#define SLICE_READS  10000   //  # of read objects a thread takes at a time
+
+static char number[128] =
+    { 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 1, 0, 0, 0, 2,
+      0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 3, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 1, 0, 0, 0, 2,
+      0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 3, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0,
+    };
+
+  //  The 16-bit field x of Count4[b] is the # of the 4 bases coded in byte b that are x
+
+static uint64 Count4[256];
+
+static void init_count4()
+{ int b, k;
+
+  for (b = 0; b < 256; b++)
+    { Count4[b] = 0;
+      for (k = 0; k < 8; k += 2)
+        Count4[b] += 1ll << (((b >> k) & 0x3) << 4);
+    }
+}
+
+
+/*******************************************************************************************
+ *
+ *  Reading a slice of read objects: a thread parses the lines of its objects, compressing
+ *    or copying their sequences (and arrows) into its own in-memory buffers, and notes each
+ *    change of file (f line) or prolog (H line) as an event.  The slices of the threads are
+ *    then emitted in order.
+ *
+ ********************************************************************************************/
+
+typedef struct
+  { int    rlen;
+    int    well;    //  -1 if the read has no W line
+    int    beg;
+    int    qv;
+    uint64 snr;     //  SNRs of its N line packed as for the .coff of an arrow DB
+    int    arrow;   //  The read has an A line
+  } One_Read;
+
+typedef struct
+  { int   read;    //  Index in the slice of the read at which the event occurs
+    int   kind;    //  'f' for a new file or 'H' for a new prolog
+    char *name;    //    whose name is name
+  } One_Event;
+
+#define ONE_MEMORY  1   //  Out of memory (reported by Malloc)
+#define ONE_ARROW   2   //  A line is not as long as the sequence of its read
+#define ONE_NAME    3   //  File name or prolog is too long or contains white space
+#define ONE_DAM     4   //  G line, i.e. the file is of a .dam
+#define ONE_SHORT   5   //  Fewer read objects than given in the header of the file
+
+typedef struct
+  { OneFile   *vf;        //  Read objects [beg,end) of vf, going to object beg with the
+    int64      beg;       //    index of the file if seek is set, where end < 0 means all
+    int64      end;       //    the remaining objects.  If pending then the R-line of the
+    int        seek;      //    first object has already been read.
+    int        pending;
+    int        dna;       //  The sequences are of type DNA
+    int        arrow;     //  The file has A lines
+    One_Read  *reads;     //  The reads of the slice are reads[0..nreads-1],
+    int        nreads;
+    int        rmax;
+    char      *bps;       //    their compressed sequences are bps[0..blen-1],
+    int64      blen;
+    int64      bmax;
+    char      *arw;       //    their compressed arrows are arw[0..blen-1] (if arrow),
+    One_Event *evts;      //    and the events within them are evts[0..nevts-1]
+    int        nevts;
+    int        emax;
+    int64      count[4];  //  # of each base in the reads
+    int        eof;       //  The file has no objects beyond the slice
+    int        error;     //  If non-zero the kind of error (ONE_) and the object
+    int64      eobj;      //    at which it occurred
+  } Slice_Arg;
+
+static int add_event(Slice_Arg *parm, int read, int kind, char *name)
+{ One_Event *e;
+  char      *s;
+
+  for (s = name; *s != '\0' && *s != ' ' && *s != '\t'; s++)
+    if (kind == 'H' && *s == '/')
+      break;
+  if ((*s != '\0' && *s != '/') || s-name >= MAX_NAME || s == name)
+    return (ONE_NAME);
+
+  if (parm->nevts >= parm->emax)
+    { parm->emax = 1.2*parm->nevts + 100;
+      parm->evts = (One_Event *) Realloc(parm->evts,sizeof(One_Event)*parm->emax,
+                                         "Allocating event list");
+      if (parm->evts == NULL)
+        return (ONE_MEMORY);
+    }
+  e = parm->evts + parm->nevts;
+  e->name = (char *) Malloc((s-name)+1,"Allocating event list");
+  if (e->name == NULL)
+    return (ONE_MEMORY);
+  memcpy(e->name,name,s-name);
+  e->name[s-name] = '\0';
+  e->read = read;
+  e->kind = kind;
+  parm->nevts += 1;
+  return (0);
+}
+
+static void *slice_thread(void *arg)
+{ Slice_Arg *parm = (Slice_Arg *) arg;
+  OneFile   *vf   = parm->vf;
+  One_Read  *r;
+  int64      obj, len, n, i;
+  char      *s, *d;
+  int        t, x;
+
+  parm->nreads = 0;
+  parm->blen   = 0;
+  parm->nevts  = 0;
+  parm->error  = 0;
+  parm->eof    = 0;
+  for (x = 0; x < 4; x++)
+    parm->count[x] = 0;
+
+  if (parm->seek)
+    { if (!oneGotoObject(vf,parm->beg))
+        { parm->error = ONE_SHORT;
+          parm->eobj  = parm->beg;
+          return (NULL);
+        }
+      t = oneReadLine(vf);
+    }
+  else if (parm->pending)
+    t = vf->lineType;
+  else
+    t = oneReadLine(vf);
+
+  r   = NULL;
+  obj = parm->beg;
+  for ( ; t != 0; t = oneReadLine(vf))
+    switch (t)
+    { case 'R':
+        if (obj == parm->end)
+          { parm->pending = 1;
+            return (NULL);
+          }
+        obj += 1;
+
+        if (parm->nreads >= parm->rmax)
+          { parm->rmax  = 1.2*parm->nreads + 1000;
+            parm->reads = (One_Read *) Realloc(parm->reads,sizeof(One_Read)*parm->rmax,
+                                               "Allocating read records");
+            if (parm->reads == NULL)
+              goto memory;
+          }
+        len = oneLen(vf);
+        if (parm->blen + len + 4 > parm->bmax)
+          { parm->bmax = 1.2*(parm->blen + len) + 10000;
+            parm->bps  = (char *) Realloc(parm->bps,parm->bmax,"Allocating base buffer");
+            if (parm->bps == NULL)
+              goto memory;
+            if (parm->arrow)
+              { parm->arw = (char *) Realloc(parm->arw,parm->bmax,"Allocating arrow buffer");
+                if (parm->arw == NULL)
+                  goto memory;
+              }
+          }
+
+        //  Copy the 2-bit coding of a DNA sequence counting its bases 4 at a time in 16-bit
+        //    fields (the pad of the last byte codes 0's), or else map, count, and compress
+        //    the letters of a string.
+
+        d = parm->bps + parm->blen;
+        n = COMPRESSED_LEN(len);
+        if (parm->dna)
+          { uint64 sum;
+            uint8 *b;
+
+            b = oneDNA2bit(vf);
+            memcpy(d,b,n);
+            sum = 0;
+            for (i = 0; i < n; i++)
+              { sum += Count4[b[i]];
+                if ((i & 0x3fff) == 0x3fff)
+                  { for (x = 0; x < 4; x++)
+                      parm->count[x] += (sum >> (x << 4)) & 0xffff;
+                    sum = 0;
+                  }
+              }
+            for (x = 0; x < 4; x++)
+              parm->count[x] += (sum >> (x << 4)) & 0xffff;
+            parm->count[0] -= 4*n - len;
+          }
+        else
+          { s = oneString(vf);
+            for (i = 0; i < len; i++)
+              { x = number[s[i] & 0x7f];
+                parm->count[x] += 1;
+                d[i] = (char) x;
+              }
+            Compress_Read(len,d);
+          }
+
+        r = parm->reads + parm->nreads;
+        r->rlen  = len;
+        r->well  = -1;
+        r->beg   = 0;
+        r->qv    = 0;
+        r->snr   = 0;
+        r->arrow = 0;
+        parm->nreads += 1;
+        parm->blen   += n;
+        break;
+
+      case 'W':
+        if (r != NULL)
+          { r->well = oneInt(vf,0);
+            r->beg  = oneInt(vf,1);
+          }
+        break;
+
+      case 'Q':
+        if (r != NULL)
+          r->qv = (oneInt(vf,0) & DB_QV);
+        break;
+
+      case 'N':
+        if (r != NULL)
+          r->snr = ((uint64) (oneInt(vf,0) & 0xffff)) << 48 |
+                   ((uint64) (oneInt(vf,1) & 0xffff)) << 32 |
+                   ((uint64) (oneInt(vf,2) & 0xffff)) << 16 |
+                   ((uint64) (oneInt(vf,3) & 0xffff));
+        break;
+
+      case 'A':
+        if (r == NULL || !parm->arrow)
+          break;
+        if (oneLen(vf) != r->rlen)
+          { parm->error = ONE_ARROW;
+            parm->eobj  = obj;
+            return (NULL);
+          }
+        d = parm->arw + (parm->blen - COMPRESSED_LEN(r->rlen));
+        memcpy(d,oneString(vf),r->rlen);
+        d[r->rlen] = '\0';
+        Number_Arrow(d);
+        Compress_Read(r->rlen,d);
+        r->arrow = 1;
+        break;
+
+      case 'H':
+        if (r == NULL)
+          break;
+        if ((x = add_event(parm,parm->nreads-1,'H',oneString(vf))) != 0)
+          { parm->error = x;
+            parm->eobj  = obj;
+            return (NULL);
+          }
+        break;
+
+      case 'f':
+        if ((x = add_event(parm,parm->nreads,'f',oneString(vf))) != 0)
+          { parm->error = x;
+            parm->eobj  = obj+1;
+            return (NULL);
+          }
+        break;
+
+      case 'G':
+        parm->error = ONE_DAM;
+        parm->eobj  = obj;
+        return (NULL);
+
+      default:   //  Quiva vectors and mask tracks are not imported
+        break;
+    }
+
+  parm->eof     = 1;
+  parm->pending = 0;
+  return (NULL);
+
+memory:
+  parm->error = ONE_MEMORY;
+  parm->eobj  = obj;
+  return (NULL);
+}
+
+  //  Return non-zero if line type t of vf is defined but its fields are not those of type
+  //    (a string over i = INT, s = STRING, d = DNA), where an R line may also be DNA.
+
+static int bad_line(OneFile *vf, int t, char *type)
+{ OneInfo *li = vf->info[t];
+  int      i;
+
+  if (li == NULL)
+    return (0);
+  if (li->nField != (int) strlen(type))
+    return (1);
+  for (i = 0; i < li->nField; i++)
+    if (type[i] == 'i')
+      { if (li->fieldType[i] != oneINT)
+          return (1);
+      }
+    else if (li->fieldType[i] != oneSTRING && (t != 'R' || li->fieldType[i] != oneDNA))
+      return (1);
+  return (0);
+}
+
+
+int main(int argc, char *argv[])
+{ char    *dbname, *root, *pwd;
+  char    *core;
+  FILE    *ostub, *bases, *indx, *arrow;
+  OneFile *vf;
+  DAZZ_DB  db;
+
+  int      VERBOSE;
+  int      ARROW, DNA;
+
+  //  Process command line
+
+  { int   i, j, k;
+    int   flags[128];
+    char *eptr;
+
+    ARG_INIT("ONE2DB")
+
+    NTHREADS = 4;
+
+    j = 1;
+    for (i = 1; i < argc; i++)
+      if (argv[i][0] == '-')
+        switch (argv[i][1])
+        { default:
+            ARG_FLAGS("v")
+            break;
+          case 'T':
+            ARG_POSITIVE(NTHREADS,"Number of threads")
+            break;
+        }
+      else
+        argv[j++] = argv[i];
+    argc = j;
+
+    VERBOSE = flags['v'];
+
+    if (argc != 3)
+      { fprintf(stderr,"Usage: %s %s\n",Prog_Name,Usage);
+        fprintf(stderr,"\n");
+        fprintf(stderr,"      -v: verbose mode, report progress.\n");
+        fprintf(stderr,"      -T: Use -T threads to read the input.\n");
+        exit (1);
+      }
+  }
+
+  //  Open the input and check that its lines are as written by DB2ONE
+
+  root   = Root(argv[1],".db");
+  pwd    = PathTo(argv[1]);
+  core   = Root(argv[2],NULL);
+  dbname = Strdup(Catenate(pwd,"/",root,".db"),"Allocating db name");
+  if (dbname == NULL || core == NULL)
+    exit (1);
+  if (access(dbname,F_OK) == 0)
+    { fprintf(stderr,"%s: Database %s.db already exists\n",Prog_Name,root);
+      exit (1);
+    }
+  if (strlen(core) >= MAX_NAME)
+    { fprintf(stderr,"%s: File name over %d chars: '%.200s'\n",Prog_Name,MAX_NAME,core);
+      exit (1);
+    }
+
+  vf = oneFileOpenRead(argv[2],NULL,"daz",NTHREADS);
+  if (vf == NULL)
+    { fprintf(stderr,"%s: Cannot open %s as a .daz 1-code file\n",Prog_Name,argv[2]);
+      exit (1);
+    }
+  if (vf->objectType != 'R' || bad_line(vf,'R',"is") || bad_line(vf,'H',"s")
+                            || bad_line(vf,'W',"iii") || bad_line(vf,'Q',"i")
+                            || bad_line(vf,'N',"iiii") || bad_line(vf,'A',"s")
+                            || bad_line(vf,'f',"is"))
+    { fprintf(stderr,"%s: The lines of %s are not those of a .daz file\n",Prog_Name,argv[2]);
+      exit (1);
+    }
+  DNA   = (vf->info['R']->fieldType[1] == oneDNA);
+  ARROW = (vf->info['A'] != NULL && vf->info['A']->given.count > 0);
+
+  init_count4();
+
+  bases = Fopen(Catenate(pwd,PATHSEP,root,".bps"),"w");
+  indx  = Fopen(Catenate(pwd,PATHSEP,root,".idx"),"w");
+  ostub = Fopen(Catenate(pwd,"/",root,".dbx"),"w");
+  if (ARROW)
+    arrow = Fopen(Catenate(pwd,PATHSEP,root,".arw"),"w");
+  else
+    arrow = NULL;
+  if (bases == NULL || indx == NULL || ostub == NULL || (ARROW && arrow == NULL))
+    goto error;
+
+  bzero(&db,sizeof(DAZZ_DB));
+  FFWRITE(&db,sizeof(DAZZ_DB),1,indx)
+  FPRINTF(ostub,DB_NFILE,0)           //  Will write again with correct value at end
+
+  if (VERBOSE)
+    { fprintf(stderr,"Importing '%s'%s ...\n",argv[2],DNA ? " (2-bit DNA)" : "");
+      fflush(stderr);
+    }
+
+  //  Read the input NTHREADS slices of SLICE_READS objects at a time, or one slice at a time
+  //    if the file has no index, and emit the slices in order.  The cells of the db are
+  //    delimited by the changes of file name and prolog, where the file name is initially
+  //    the core of the input name, and the prolog is that of the file if there are no H lines.
+
+  { Slice_Arg *parm;
+    pthread_t  threads[NTHREADS];
+    int        nthreads, t, c, k, e;
+    int64      nobj, next, count[4];
+    int        ureads, cstart, ocells;
+    int64      offset, totlen;
+    int        maxlen;
+    char       fname[MAX_NAME], prolog[MAX_NAME];
+    DAZZ_READ *prec;
+    int        pmax, pcnt, pwell;
+
+    parm = (Slice_Arg *) Malloc(sizeof(Slice_Arg)*NTHREADS,"Allocating thread records");
+    pmax = 100;
+    prec = (DAZZ_READ *) Malloc(sizeof(DAZZ_READ)*pmax,"Allocating record buffer");
+    if (parm == NULL || prec == NULL)
+      goto error;
+    bzero(parm,sizeof(Slice_Arg)*NTHREADS);
+
+    nobj = vf->info['R']->given.count;
+    if (vf->isIndexIn && nobj > 0)
+      nthreads = NTHREADS;
+    else
+      nthreads = 1;
+    for (t = 0; t < nthreads; t++)
+      { parm[t].vf    = vf+t;
+        parm[t].dna   = DNA;
+        parm[t].arrow = ARROW;
+      }
+
+    strcpy(fname,core);
+    prolog[0] = '\0';
+    for (c = 0; c < 4; c++)
+      count[c] = 0;
+    ureads = 0;
+    cstart = 0;
+    ocells = 0;
+    offset = 0;
+    totlen = 0;
+    maxlen = 0;
+    pcnt   = 0;
+    pwell  = -1;
+
+    next = 0;
+    while (1)
+      { int active;
+
+        active = 0;
+        for (t = 0; t < nthreads; t++)
+          { Slice_Arg *pa = parm+t;
+
+            pa->beg  = next + t*SLICE_READS;
+            pa->seek = (pa->beg > 0 && nthreads > 1);
+            if (nthreads > 1 && pa->beg >= nobj)
+              break;
+            pa->end = pa->beg + SLICE_READS;
+            if (nobj > 0 && pa->end >= nobj)
+              pa->end = -1;
+            pthread_create(threads+t,NULL,slice_thread,pa);
+            active += 1;
+          }
+        for (t = 0; t < active; t++)
+          pthread_join(threads[t],NULL);
+
+        for (t = 0; t < active; t++)
+          { Slice_Arg *pa = parm+t;
+            One_Read  *r;
+            One_Event *ev;
+
+            if (pa->error)
+              { if (pa->error == ONE_ARROW)
+                  fprintf(stderr,"File %s, Read %lld: A line is not as long as the read\n",
+                                 argv[2],pa->eobj);
+                else if (pa->error == ONE_NAME)
+                  fprintf(stderr,"File %s, Read %lld: File name or prolog is empty, too long,"
+                                 " or contains white space\n",argv[2],pa->eobj);
+                else if (pa->error == ONE_DAM)
+                  fprintf(stderr,"%s: %s is the dump of a .dam, which cannot be imported\n",
+                                 Prog_Name,argv[2]);
+                else if (pa->error == ONE_SHORT)
+                  fprintf(stderr,"%s: %s has fewer reads than its header states\n",
+                                 Prog_Name,argv[2]);
+                goto error;
+              }
+
+            if (pa->blen > 0)
+              { FFWRITE(pa->bps,1,pa->blen,bases)
+                if (ARROW)
+                  FFWRITE(pa->arw,1,pa->blen,arrow)
+              }
+            for (c = 0; c < 4; c++)
+              count[c] += pa->count[c];
+
+            //  Emit the reads of the slice grouped by well, noting each change of cell
+
+            ev = pa->evts;
+            e  = 0;
+            for (k = 0; k <= pa->nreads; k++)
+              { for ( ; e < pa->nevts && ev[e].read == k; e++)
+                  { if (ev[e].kind == 'f' ? strcmp(ev[e].name,fname) == 0
+                                          : strcmp(ev[e].name,prolog) == 0)
+                      continue;
+                    if (ureads > cstart)
+                      { FPRINTF(ostub,DB_FDATA,ureads,fname,prolog[0] ? prolog : fname)
+                        ocells += 1;
+                        cstart  = ureads;
+                      }
+                    if (ev[e].kind == 'f')
+                      { strcpy(fname,ev[e].name);
+                        prolog[0] = '\0';
+                      }
+                    else
+                      strcpy(prolog,ev[e].name);
+                  }
+                if (k >= pa->nreads)
+                  break;
+
+                r = pa->reads + k;
+                if (ARROW && !r->arrow)
+                  { fprintf(stderr,"File %s, Read %d: Read has no A line\n",argv[2],ureads+1);
+                    goto error;
+                  }
+                if (r->well < 0)
+                  r->well = ureads;
+
+                bzero(prec+pcnt,sizeof(DAZZ_READ));   //  Zero padding so .idx is reproducible
+                prec[pcnt].origin = r->well;
+                prec[pcnt].fpulse = r->beg;
+                prec[pcnt].rlen   = r->rlen;
+                prec[pcnt].boff   = offset;
+                prec[pcnt].flags  = r->qv;
+                if (ARROW)
+                  *((uint64 *) &(prec[pcnt].coff)) = r->snr;
+                else
+                  prec[pcnt].coff = -1;
+
+                ureads += 1;
+                totlen += r->rlen;
+                if (r->rlen > maxlen)
+                  maxlen = r->rlen;
+                offset += COMPRESSED_LEN(r->rlen);
+
+                if (pwell == r->well)
+                  { prec[pcnt].flags |= DB_CCS;
+                    pcnt += 1;
+                    if (pcnt >= pmax)
+                      { pmax = ((int) (pcnt*1.2)) + 100;
+                        prec = (DAZZ_READ *) Realloc(prec,sizeof(DAZZ_READ)*pmax,
+                                                     "Allocating record buffer");
+                        if (prec == NULL)
+                          goto error;
+                      }
+                  }
+                else if (pcnt == 0)
+                  pcnt += 1;
+                else
+                  { int i, x;
+
+                    x = 0;
+                    for (i = 1; i < pcnt; i++)
+                      if (prec[i].rlen > prec[x].rlen)
+                        x = i;
+                    prec[x].flags |= DB_BEST;
+                    FFWRITE(prec,sizeof(DAZZ_READ),pcnt,indx)
+                    prec[0] = prec[pcnt];
+                    pcnt = 1;
+                  }
+                pwell = r->well;
+              }
+            for (e = 0; e < pa->nevts; e++)
+              free(ev[e].name);
+            next += pa->nreads;
+          }
+
+        if (active == 0 || parm[active-1].eof)
+          break;
+      }
+
+    if (ureads == 0)
+      { fprintf(stderr,"%s: %s contains no reads\n",Prog_Name,argv[2]);
+        goto error;
+      }
+    if (ureads < nobj)
+      { fprintf(stderr,"%s: %s has fewer reads than its header states\n",Prog_Name,argv[2]);
+        goto error;
+      }
+
+    //  Flush the last well group and note the last cell
+
+    { int i, x;
+
+      x = 0;
+      for (i = 1; i < pcnt; i++)
+        if (prec[i].rlen > prec[x].rlen)
+          x = i;
+      prec[x].flags |= DB_BEST;
+      FFWRITE(prec,sizeof(DAZZ_READ),pcnt,indx)
+    }
+    FPRINTF(ostub,DB_FDATA,ureads,fname,prolog[0] ? prolog : fname)
+    ocells += 1;
+
+    for (t = 0; t < nthreads; t++)
+      { free(parm[t].reads);
+        free(parm[t].bps);
+        free(parm[t].arw);
+        free(parm[t].evts);
+      }
+    free(parm);
+    free(prec);
+
+    //  Complete the db record, the partition of the stub (a single block), and the number
+    //    of cells
+
+    for (c = 0; c < 4; c++)
+      db.freq[c] = (float) ((1.*count[c])/totlen);
+    db.ureads = ureads;
+    db.treads = ureads;
+    db.totlen = totlen;
+    db.maxlen = maxlen;
+    db.cutoff = 0;
+    db.allarr = DB_ALL | (ARROW ? DB_ARROW : 0);
+
+    FPRINTF(ostub,DB_NBLOCK,1)
+    FPRINTF(ostub,DB_PARAMS,db.totlen,0,1)
+    FPRINTF(ostub," %9d %9d\n",0,0)
+    FPRINTF(ostub," %9d %9d\n",ureads,ureads)
+    FSEEKO(ostub,0,SEEK_SET)
+    FPRINTF(ostub,DB_NFILE,ocells)
+
+    if (VERBOSE)
+      { fprintf(stderr,"  Imported ");
+        Print_Number(ureads,0,stderr);
+        fprintf(stderr," reads (");
+        Print_Number(totlen,0,stderr);
+        fprintf(stderr,"bp) in ");
+        Print_Number(ocells,0,stderr);
+        fprintf(stderr," cells\n");
+        fflush(stderr);
+      }
+  }
+
+  FSEEKO(indx,0,SEEK_SET)
+  FFWRITE(&db,sizeof(DAZZ_DB),1,indx)   //  Write the finalized db record into .idx
+
+  FCLOSE(indx)
+  FCLOSE(bases)
+  if (arrow != NULL)
+    FCLOSE(arrow)
+  FCLOSE(ostub)
+  oneFileClose(vf);
+
+  rename(Catenate(pwd,"/",root,".dbx"),dbname);   //  The stub is put in place last
+
+  free(dbname);
+  free(core);
+  free(root);
+  free(pwd);
+
+  exit (0);
+
+  //  Error exit: remove all the files created
+
+error:
+  if (indx != NULL)
+    { fclose(indx);
+      unlink(Catenate(pwd,PATHSEP,root,".idx"));
+    }
+  if (bases != NULL)
+    { fclose(bases);
+      unlink(Catenate(pwd,PATHSEP,root,".bps"));
+    }
+  if (arrow != NULL)
+    { fclose(arrow);
+      unlink(Catenate(pwd,PATHSEP,root,".arw"));
+    }
+  if (ostub != NULL)
+    { fclose(ostub);
+      unlink(Catenate(pwd,"/",root,".dbx"));
+    }
+
+  exit (1);
+}
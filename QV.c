@@ -25,6 +25,9 @@
 
 #define HUFF_CUTOFF  16   //  This cannot be larger than 16 !
 
+#define MULTI_BITS   12   //  Width of multi-symbol decoding tables (must be <= 16)
+#define MULTI_MAX     3   //  Maximum # of symbols decoded per multi-symbol table lookup
+
 
 /*******************************************************************************************
  *
@@ -32,19 +35,6 @@
  *
  ********************************************************************************************/
 
-static int LittleEndian;  //  Little-endian machine ?
-                          //     Referred by: Decode & Decode_Run
-static int Flip;          //  Flip endian of all coded shorts and ints
-                          //     Referred by: Decode & Decode_Run & Read_Scheme
-
-static void Set_Endian(int flip)
-{ uint32 x = 3;
-  uint8 *b = (uint8 *) (&x);
-
-  Flip         = flip;
-  LittleEndian = (b[0] == 3);
-}
-
 static void Flip_Long(void *w)
 { uint8 *v = (uint8 *) w;
   uint8  x;
@@ -67,6 +57,157 @@ static void Flip_Short(void *w)
 }
 
 
+/*******************************************************************************************
+ *
+ *  Buffered I/O of compressed QV data
+ *
+ ********************************************************************************************/
+
+#define QV_BUFFER  0x10000   //  Initial size of a QVbuffer
+
+  //  Every buffer has 8 zero bytes beyond its end so the decoders may always fetch a word
+  //    beyond the current one.
+
+static int Grow_QVbuffer(QVbuffer *buf, int64 size)
+{ uint8 *data;
+
+  data = (uint8 *) Realloc(buf->data,size+8,"Enlarging QV buffer");
+  if (data == NULL)
+    EXIT(1);
+  bzero(data+size,8);
+  buf->data = data;
+  buf->size = size;
+  return (0);
+}
+
+QVbuffer *New_QVbuffer(FILE *file)
+{ QVbuffer *buf;
+
+  buf = (QVbuffer *) Malloc(sizeof(QVbuffer),"Allocating QV buffer");
+  if (buf == NULL)
+    EXIT(NULL);
+  buf->data = NULL;
+  if (Grow_QVbuffer(buf,QV_BUFFER))
+    { free(buf);
+      EXIT(NULL);
+    }
+  buf->file = file;
+  buf->ptr  = 0;
+  buf->end  = 0;
+  buf->off  = 0;
+  if (file != NULL)
+    { buf->off = ftello(file);
+      if (buf->off < 0)
+        buf->off = 0;
+    }
+  return (buf);
+}
+
+void Free_QVbuffer(QVbuffer *buf)
+{ free(buf->data);
+  free(buf);
+}
+
+int Flush_QVbuffer(QVbuffer *buf)
+{ if (buf->file == NULL || buf->ptr == 0)
+    return (0);
+  if (fwrite(buf->data,1,buf->ptr,buf->file) != (size_t) buf->ptr)
+    { EPRINTF(EPLACE,"%s: System error, could not write compressed QVs\n",Prog_Name);
+      EXIT(1);
+    }
+  buf->off += buf->ptr;
+  buf->ptr  = 0;
+  return (0);
+}
+
+int64 Tell_QVbuffer(QVbuffer *buf)
+{ return (buf->off + buf->ptr); }
+
+int Seek_QVbuffer(QVbuffer *buf, int64 pos)
+{ if (pos >= buf->off && pos <= buf->off + buf->end)
+    { buf->ptr = pos - buf->off;
+      return (0);
+    }
+  if (buf->file == NULL || fseeko(buf->file,pos,SEEK_SET) < 0)
+    { EPRINTF(EPLACE,"%s: Could not seek to QV data at %lld\n",Prog_Name,pos);
+      EXIT(1);
+    }
+  buf->off = pos;
+  buf->ptr = 0;
+  buf->end = 0;
+  return (0);
+}
+
+  //  Make sure there is room for n more bytes at the write pointer of buf
+
+static int Reserve(QVbuffer *buf, int64 n)
+{ if (buf->ptr + n <= buf->size)
+    return (0);
+  if (buf->file != NULL)
+    { if (Flush_QVbuffer(buf))
+        EXIT(1);
+      if (n <= buf->size)
+        return (0);
+    }
+  return (Grow_QVbuffer(buf,1.2*(buf->ptr+n) + QV_BUFFER));
+}
+
+  //  Make sure n bytes are available at the read pointer of buf, or all the remaining bytes
+  //    if there are fewer than n.
+
+static int Fill(QVbuffer *buf, int64 n)
+{ int64  avail;
+  size_t got;
+
+  avail = buf->end - buf->ptr;
+  if (avail >= n || buf->file == NULL)
+    return (0);
+  if (buf->ptr > 0)
+    { memmove(buf->data,buf->data+buf->ptr,avail);
+      buf->off += buf->ptr;
+      buf->end  = avail;
+      buf->ptr  = 0;
+    }
+  if (n > buf->size)
+    { if (Grow_QVbuffer(buf,n))
+        EXIT(1);
+    }
+  got = fread(buf->data+buf->end,1,buf->size-buf->end,buf->file);
+  if (got == 0 && ferror(buf->file))
+    { EPRINTF(EPLACE,"%s: System error, could not read compressed QVs\n",Prog_Name);
+      EXIT(1);
+    }
+  buf->end += got;
+  bzero(buf->data+buf->end,8);
+  return (0);
+}
+
+static int Write_Bytes(QVbuffer *buf, void *x, int64 n)
+{ if (Reserve(buf,n))
+    EXIT(1);
+  memcpy(buf->data+buf->ptr,x,n);
+  buf->ptr += n;
+  return (0);
+}
+
+int Append_QVbuffer(QVbuffer *buf, QVbuffer *src)
+{ if (Write_Bytes(buf,src->data,src->ptr))
+    EXIT(1);
+  src->ptr = 0;
+  return (0);
+}
+
+static int Read_Bytes(QVbuffer *buf, void *x, int64 n)
+{ if (Fill(buf,n))
+    EXIT(1);
+  if (buf->end - buf->ptr < n)
+    return (1);
+  memcpy(x,buf->data+buf->ptr,n);
+  buf->ptr += n;
+  return (0);
+}
+
+
 /*******************************************************************************************
  *
  *  Routines for computing a Huffman Encoding Scheme
@@ -77,9 +218,19 @@ typedef struct
   { int    type;             //  0 => normal, 1 => normal but has long codes, 2 => truncated
     uint32 codebits[256];    //  If type = 2, then code 255 is the special code for
     int    codelens[256];    //    non-Huffman exceptions
-    int    lookup[0x10000];  //  Lookup table (just for decoding)
+    uint8  lookup[0x10000];  //  Lookup table (just for decoding)
+    uint32 multi[1 << MULTI_BITS];   //  Multi-symbol lookup table (just for decoding)
   } HScheme;
 
+  //  An entry of the multi-symbol table for a MULTI_BITS prefix of the bit stream gives the
+  //    up to MULTI_MAX symbols whose codes lie entirely within the prefix in bytes 0-2, the #
+  //    of such symbols in bits 24-25, and the # of bits they occupy in bits 26-30.  The
+  //    count is zero if the first code is longer than MULTI_BITS or is an exception code,
+  //    in which case the single symbol lookup table must be used.
+
+#define MULTI_COUNT(e)  (((e) >> 24) & 0x3)
+#define MULTI_LEN(e)    ((e) >> 26)
+
 typedef struct _HTree
   { struct _HTree *lft, *rgt; 
     uint64         count;
@@ -198,7 +349,10 @@ static HScheme *Huffman(uint64 *hist, HScheme *inscheme)
       scheme->codelens[i] = 0;
     }
 
-  Build_Table(node+(range-1),0,0,scheme->codebits,scheme->codelens);
+  if (value == 1)                  //  A lone symbol (e.g. of a binned stream) still needs a
+    scheme->codelens[(uint64) (node[0].lft)] = 1;     //  code of 1 bit
+  else if (value > 1)
+    Build_Table(node+(range-1),0,0,scheme->codebits,scheme->codelens);
 
   if (inscheme != NULL)            //  Set scheme type and if truncated (2), map truncated codes
     { scheme->type = 2;            //    to code and length for 255
@@ -297,7 +451,7 @@ static void Print_Histogram(uint64 *hist)
 
   //  Write the code table to out.
 
-static void Write_Scheme(HScheme *scheme, FILE *out)
+static int Write_Scheme(HScheme *scheme, QVbuffer *out)
 { int     i;
   uint8   x;
   uint32 *bits;
@@ -306,22 +460,115 @@ static void Write_Scheme(HScheme *scheme, FILE *out)
   lens = scheme->codelens;
   bits = scheme->codebits;
 
+  if (Reserve(out,1+5*256))
+    EXIT(1);
+
   x = (uint8) (scheme->type);
-  fwrite(&x,1,1,out);
+  Write_Bytes(out,&x,1);
 
   for (i = 0; i < 256; i++)
     { x = (uint8) (lens[i]);
-      fwrite(&x,1,1,out);
+      Write_Bytes(out,&x,1);
       if (x > 0)
-        fwrite(bits+i,sizeof(uint32),1,out);
+        Write_Bytes(out,bits+i,sizeof(uint32));
+    }
+  return (0);
+}
+
+  //  Build the multi-symbol decoding table of scheme from its single symbol lookup table.
+  //    The bits of a prefix beyond MULTI_BITS are unknown (zero), but a code of length at
+  //    most the number of known bits remaining is nevertheless correctly identified.  The
+  //    lookup table has holes for the prefixes of codes truncated to the special code, so
+  //    one must check that the code found is really a prefix of the bits.
+
+#define CODE_AT(s,w,c)  ((s)->codelens[c] == 0 || \
+                           ((uint32) (w) >> (16-(s)->codelens[c])) == (s)->codebits[c])
+
+static void Build_Multi(HScheme *scheme)
+{ uint8  *look;
+  int    *lens;
+  uint32 *multi;
+  int     signal;
+  int     x, w, c, k, used;
+  uint32  e;
+
+  look  = scheme->lookup;
+  lens  = scheme->codelens;
+  multi = scheme->multi;
+  if (scheme->type == 2)
+    signal = 255;
+  else
+    signal = 256;
+
+  for (x = 0; x < (1 << MULTI_BITS); x++)
+    { e    = 0;
+      used = 0;
+      for (k = 0; k < MULTI_MAX; k++)
+        { w = (x << (16-MULTI_BITS+used)) & 0xffff;
+          c = look[w];
+          if (c == signal || lens[c] > MULTI_BITS-used || ! CODE_AT(scheme,w,c))
+            break;
+          e    |= (((uint32) c) << (8*k));
+          used += lens[c];
+        }
+      multi[x] = e | (((uint32) k) << 24) | (((uint32) used) << 26);
+    }
+}
+
+  //  The multi-symbol table of a run length scheme reme is instead used as a table of pairs
+  //    giving, for a MULTI_BITS prefix of the stream, the run length of the first code and
+  //    its length, and if the code of the following non-run symbol (w.r.t. neme) also lies
+  //    within the prefix, that symbol and the total length of the two codes.
+
+#define PAIR_VALID      0x4000000
+#define PAIR_HAS_SYM    0x2000000
+#define PAIR_RUN(e)     ((e) & 0xff)
+#define PAIR_SYM(e)     (((e) >> 8) & 0xff)
+#define PAIR_RLEN(e)    (((e) >> 16) & 0xf)
+#define PAIR_LEN(e)     (((e) >> 20) & 0x1f)
+
+static void Build_Pairs(HScheme *reme, HScheme *neme)
+{ uint8  *rlook, *nlook;
+  int    *rlens, *nlens;
+  uint32 *pair;
+  int     nsignal;
+  int     x, w, r, c, used;
+  uint32  e;
+
+  rlook = reme->lookup;
+  rlens = reme->codelens;
+  nlook = neme->lookup;
+  nlens = neme->codelens;
+  pair  = reme->multi;
+  if (neme->type == 2)
+    nsignal = 255;
+  else
+    nsignal = 256;
+
+  for (x = 0; x < (1 << MULTI_BITS); x++)
+    { w = (x << (16-MULTI_BITS)) & 0xffff;
+      r = rlook[w];
+      if (r == 255 || rlens[r] > MULTI_BITS || ! CODE_AT(reme,w,r))
+        { pair[x] = 0;
+          continue;
+        }
+      used = rlens[r];
+      e    = PAIR_VALID | r | (((uint32) used) << 16);
+      w    = (x << (16-MULTI_BITS+used)) & 0xffff;
+      c    = nlook[w];
+      if (c != nsignal && nlens[c] <= MULTI_BITS-used && CODE_AT(neme,w,c))
+        e |= PAIR_HAS_SYM | (((uint32) c) << 8) | (((uint32) (used+nlens[c])) << 20);
+      pair[x] = e;
     }
 }
 
-  //  Allocate and read a code table from in, and return a pointer to it.
+  //  Allocate and read a code table from in, and return a pointer to it.  If flip is set
+  //    then the table was written on a machine of the opposite endian.
 
-static HScheme *Read_Scheme(FILE *in)
+static HScheme *Read_Scheme(QVbuffer *in, int flip)
 { HScheme *scheme;
-  int     *look, *lens;
+  uint8   *look;
+  int     *lens;
   uint32  *bits, base;
   int      i, j, powr;
   uint8    x;
@@ -333,21 +580,23 @@ static HScheme *Read_Scheme(FILE *in)
   lens = scheme->codelens;
   bits = scheme->codebits;
   look = scheme->lookup;
+  bzero(look,0x10000);
 
-  if (fread(&x,1,1,in) != 1)
+  if (Read_Bytes(in,&x,1))
     { EPRINTF(EPLACE,"Could not read scheme type byte (Read_Scheme)\n");
       free(scheme);
       return (NULL);
     }
   scheme->type = x;
   for (i = 0; i < 256; i++)
-    { if (fread(&x,1,1,in) != 1)
+    { if (Read_Bytes(in,&x,1))
         { EPRINTF(EPLACE,"Could not read length of %d'th code (Read_Scheme)\n",i);
+          free(scheme);
           return (NULL);
         }
       lens[i] = x;
       if (x > 0)
-        { if (fread(bits+i,sizeof(uint32),1,in) != 1)
+        { if (Read_Bytes(in,bits+i,sizeof(uint32)))
             { EPRINTF(EPLACE,"Could not read bit encoding of %d'th code (Read_Scheme)\n",i);
               free(scheme);
               return (NULL);
@@ -357,7 +606,7 @@ static HScheme *Read_Scheme(FILE *in)
         bits[i] = 0;
     }
 
-  if (Flip)
+  if (flip)
     { for (i = 0; i < 256; i++)
         Flip_Long(bits+i);
     }
@@ -367,10 +616,12 @@ static HScheme *Read_Scheme(FILE *in)
         { base = (bits[i] << (16-lens[i]));
           powr = (1 << (16-lens[i]));
           for (j = 0; j < powr; j++)
-            look[base+j] = i;
+            look[base+j] = (uint8) i;
         }
     }
 
+  Build_Multi(scheme);
+
   return (scheme);
 }
 
@@ -381,15 +632,65 @@ static HScheme *Read_Scheme(FILE *in)
  *
  ********************************************************************************************/
 
+  //  Output code C of length L to the word buffer ocode, and when it fills, move it to the
+  //    output buffer at optr.
+
+#define OCODE(L,C)					\
+{ int    len  = olen + (L);				\
+  uint32 code = (C);					\
+							\
+  llen = olen;						\
+  if (len >= 32)					\
+    { olen   = len-32;					\
+      ocode |= (code >> olen);				\
+      memcpy(optr,&ocode,sizeof(uint32));		\
+      optr  += sizeof(uint32);				\
+      if (olen > 0)					\
+        ocode = (code << (32-olen));			\
+      else						\
+        ocode = 0;					\
+    } 							\
+  else							\
+    { olen   = len;					\
+      ocode |= (code << (32-olen));;			\
+    }							\
+}
+
+  //  Tricky: must pad so decoder does not read past last integer int the coded output.
+
+#define OFLUSH						\
+{ if (olen > 0)						\
+    { memcpy(optr,&ocode,sizeof(uint32));		\
+      optr += sizeof(uint32);				\
+      if (llen > 16 && olen > llen)			\
+        { memcpy(optr,&ocode,sizeof(uint32));		\
+          optr += sizeof(uint32);			\
+        }						\
+    }							\
+  else if (llen > 16)					\
+    { memcpy(optr,&ocode,sizeof(uint32));		\
+      optr += sizeof(uint32);				\
+    }							\
+}
+
+  //  The encoding of a stream of rlen symbols occupies at most 5*rlen+16 bytes
+
+#define MAX_CODED(rlen)  (5*((int64) (rlen)) + 16)
+
   //  Encode read[0..rlen-1] according to scheme and write to out
 
-static void Encode(HScheme *scheme, FILE *out, uint8 *read, int rlen)
+static int Encode(HScheme *scheme, QVbuffer *out, uint8 *read, int rlen)
 { uint32  x, c, ocode;
   int     n, k, olen, llen;
   int    *nlens;
   uint32 *nbits;
   uint32  nspec;
   int     nslen;
+  uint8  *optr;
+
+  if (Reserve(out,MAX_CODED(rlen)))
+    EXIT(1);
+  optr = out->data + out->ptr;
 
   nlens = scheme->codelens;
   nbits = scheme->codebits;
@@ -401,26 +702,6 @@ static void Encode(HScheme *scheme, FILE *out, uint8 *read, int rlen)
   else
     nspec = nslen = 0x7fffffff;
 
-#define OCODE(L,C)				\
-{ int    len  = olen + (L);			\
-  uint32 code = (C);				\
-						\
-  llen = olen;					\
-  if (len >= 32)				\
-    { olen   = len-32;				\
-      ocode |= (code >> olen);			\
-      fwrite(&ocode,sizeof(uint32),1,out);	\
-      if (olen > 0)				\
-        ocode = (code << (32-olen));		\
-      else					\
-        ocode = 0;				\
-    } 						\
-  else						\
-    { olen   = len;				\
-      ocode |= (code << (32-olen));;		\
-    }						\
-}
-
   llen  = 0;
   olen  = 0;
   ocode = 0;
@@ -432,26 +713,28 @@ static void Encode(HScheme *scheme, FILE *out, uint8 *read, int rlen)
       if (c == nspec && n == nslen)
         OCODE(8,x);
     }
+  OFLUSH
 
-  if (olen > 0)                              //  Tricky: must pad so decoder does not read past
-    { fwrite(&ocode,sizeof(uint32),1,out);   //    last integer int the coded output.
-      if (llen > 16 && olen > llen)
-        fwrite(&ocode,sizeof(uint32),1,out);
-    }
-  else if (llen > 16)
-    fwrite(&ocode,sizeof(uint32),1,out);
+  out->ptr = optr - out->data;
+  return (0);
 }
 
   //  Encode read[0..rlen-1] according to non-rchar table neme, and run-length table reme for
   //    runs of rchar characters.  Write to out.
 
-static void Encode_Run(HScheme *neme, HScheme *reme, FILE *out, uint8 *read, int rlen, int rchar)
+static int Encode_Run(HScheme *neme, HScheme *reme, QVbuffer *out, uint8 *read,
+                      int rlen, int rchar)
 { uint32  x, c, ocode;
   int     n, h, k, olen, llen;
   int    *nlens, *rlens;
   uint32 *nbits, *rbits;
   uint32  nspec, rspec;
   int     nslen, rslen;
+  uint8  *optr;
+
+  if (Reserve(out,MAX_CODED(rlen)))
+    EXIT(1);
+  optr = out->data + out->ptr;
 
   nlens = neme->codelens;
   nbits = neme->codebits;
@@ -495,133 +778,131 @@ static void Encode_Run(HScheme *neme, HScheme *reme, FILE *out, uint8 *read, int
           k += 1;
         }
     }
+  OFLUSH
 
-  if (olen > 0)
-    { fwrite(&ocode,sizeof(uint32),1,out);
-      if (llen > 16 && olen > llen)
-        fwrite(&ocode,sizeof(uint32),1,out);
-    }
-  else if (llen > 16)
-    fwrite(&ocode,sizeof(uint32),1,out);
+  out->ptr = optr - out->data;
+  return (0);
 }
 
-  //  Read and decode from in, the next rlen symbols into read according to scheme
+  //  The decoders work directly on the buffered words of a stream: PEEK(p) is the 32 bits of
+  //    the stream starting at bit p, obtained from the two words containing them without
+  //    any branching (the buffer always has a readable word beyond the current one).
 
-static int Decode(HScheme *scheme, FILE *in, char *read, int rlen)
-{ int    *look, *lens;
-  int     signal, ilen;
-  uint64  icode;
-  uint32 *ipart;
-  uint16 *xpart;
-  uint8  *cpart;
-  int     j, n, c;
+static inline uint32 Word(uint8 *w)
+{ uint32 x;
 
-  if (LittleEndian)
-    { ipart = ((uint32 *) (&icode));
-      xpart = ((uint16 *) (&icode)) + 2;
-      cpart = ((uint8  *) (&icode)) + 5;
-    }
-  else
-    { ipart = ((uint32 *) (&icode)) + 1;
-      xpart = ((uint16 *) (&icode)) + 1;
-      cpart = ((uint8  *) (&icode)) + 2;
-    }
+  memcpy(&x,w,sizeof(uint32));
+  return (x);
+}
+
+#define WORD(k)       Word(base + 4*(k))
+#define WORDFLIP(k)   __builtin_bswap32(Word(base + 4*(k)))
+
+#define PEEK(p)								\
+  ((uint32) (((((uint64) WORD((p) >> 5)) << 32) | WORD(((p) >> 5) + 1)) << ((p) & 0x1f) >> 32))
+
+#define PEEKFLIP(p)							\
+  ((uint32) (((((uint64) WORDFLIP((p) >> 5)) << 32) | WORDFLIP(((p) >> 5) + 1))		\
+                 << ((p) & 0x1f) >> 32))
+
+  //  The encoder pads a stream so that it extends exactly up to 16 bits beyond the start of
+  //    its last code.  So given the start q of the last code, advance in past the stream.
+
+static void Skip_Stream(QVbuffer *in, int q, int rlen)
+{ if (rlen > 0)
+    in->ptr += 4*((q+47) >> 5);
+}
+
+  //  Read and decode from in, the next rlen symbols into read according to scheme.  If flip
+  //    is set then the words of the stream are of the opposite endian.
+
+static int Decode(HScheme *scheme, int flip, QVbuffer *in, char *read, int rlen)
+{ uint8  *look;
+  int    *lens;
+  uint32 *multi, e, x;
+  int     signal;
+  uint8  *base;
+  int     j, p, q, c, fast;
+
+  if (Fill(in,MAX_CODED(rlen)))
+    EXIT(1);
+  base = in->data + in->ptr;
 
   if (scheme->type == 2)
     signal  = 255;
   else
     signal  = 256;
-  lens = scheme->codelens;
-  look = scheme->lookup;
-
-#define GET								\
-  if (n > ilen)								\
-    { icode <<= ilen;							\
-      if (fread(ipart,sizeof(uint32),1,in) != 1)			\
-        { EPRINTF(EPLACE,"Could not read more bits (Decode)\n");	\
-          return (1);							\
+  lens  = scheme->codelens;
+  look  = scheme->lookup;
+  multi = scheme->multi;
+
+  //  While at least MULTI_MAX symbols remain, decode as many symbols as lie in the next
+  //    MULTI_BITS of the stream with one lookup of the multi-symbol table, falling back
+  //    to the single symbol table for long and exceptional codes.  p is the current bit
+  //    position and q the start of the last code.
+
+#define DECODE(PEEK)							\
+  while (j < rlen)							\
+    { x = PEEK(p);							\
+      e = multi[x >> (32-MULTI_BITS)];					\
+      if (MULTI_COUNT(e) > 0 && j < fast)				\
+        { read[j]   = (char) e;						\
+          read[j+1] = (char) (e >> 8);					\
+          read[j+2] = (char) (e >> 16);					\
+          j += MULTI_COUNT(e);						\
+          q  = p;							\
+          p += MULTI_LEN(e);						\
+        }								\
+      else								\
+        { c  = look[x >> 16];						\
+          q  = p;							\
+          p += lens[c];							\
+          if (c == signal)						\
+            { c  = PEEK(p) >> 24;					\
+              q  = p;							\
+              p += 8;							\
+            }								\
+          read[j++] = (char) c;						\
+          e = 0;							\
         }								\
-      ilen    = n-ilen;							\
-      icode <<= ilen;							\
-      ilen    = 32-ilen;						\
-    }									\
-  else									\
-    { icode <<= n;							\
-      ilen   -= n;							\
     }
 
-#define GETFLIP								\
-  if (n > ilen)								\
-    { icode <<= ilen;							\
-      if (fread(ipart,sizeof(uint32),1,in) != 1)			\
-        { EPRINTF(EPLACE,"Could not read more bits (Decode)\n");	\
-          return (1);							\
-        }								\
-      Flip_Long(ipart);							\
-      ilen    = n-ilen;							\
-      icode <<= ilen;							\
-      ilen    = 32-ilen;						\
-    }									\
-  else									\
-    { icode <<= n;							\
-      ilen   -= n;							\
-    }
-
-  n     = 16;
-  ilen  = 0;
-  icode = 0;
-  if (Flip)
-    for (j = 0; j < rlen; j++)
-      { GETFLIP
-        c = look[*xpart];
-        n = lens[c];
-        if (c == signal)
-          { GETFLIP
-            c = *cpart;
-            n = 8;
-          }
-        read[j] = (char) c;
-      }
+  p    = 0;
+  q    = 0;
+  j    = 0;
+  e    = 0;
+  fast = rlen - (MULTI_MAX-1);
+  if (flip)
+    { DECODE(PEEKFLIP) }
   else
-    for (j = 0; j < rlen; j++)
-      { GET
-        c = look[*xpart];
-        n = lens[c];
-        if (c == signal)
-          { GET
-            c = *cpart;
-            n = 8;
-          }
-        read[j] = (char) c;
-      }
+    { DECODE(PEEK) }
+
+  if (MULTI_COUNT(e) > 1)
+    q += MULTI_LEN(e) - lens[(e >> 8*(MULTI_COUNT(e)-1)) & 0xff];
+  Skip_Stream(in,q,rlen);
 
+  if (in->ptr > in->end)
+    { EPRINTF(EPLACE,"Could not read more bits (Decode)\n");
+      EXIT(1);
+    }
   return (0);
 }
 
   //  Read and decode from in, the next rlen symbols into read according to non-rchar scheme
   //    neme, and the rchar runlength shceme reme
 
-static int Decode_Run(HScheme *neme, HScheme *reme, FILE *in, char *read,
+static int Decode_Run(HScheme *neme, HScheme *reme, int flip, QVbuffer *in, char *read,
                       int rlen, int rchar)
-{ int    *nlook, *nlens;
-  int    *rlook, *rlens;
-  int     nsignal, ilen;
-  uint64  icode;
-  uint32 *ipart;
-  uint16 *xpart;
-  uint8  *cpart;
-  int     j, n, c, k;
-
-  if (LittleEndian)
-    { ipart = ((uint32 *) (&icode));
-      xpart = ((uint16 *) (&icode)) + 2;
-      cpart = ((uint8  *) (&icode)) + 5;
-    }
-  else
-    { ipart = ((uint32 *) (&icode)) + 1;
-      xpart = ((uint16 *) (&icode)) + 1;
-      cpart = ((uint8  *) (&icode)) + 2;
-    }
+{ uint8  *nlook, *rlook;
+  int    *nlens, *rlens;
+  uint32 *pair, e, x;
+  int     nsignal;
+  uint8  *base;
+  int     j, p, q, c;
+
+  if (Fill(in,MAX_CODED(rlen)))
+    EXIT(1);
+  base = in->data + in->ptr;
 
   if (neme->type == 2)
     nsignal = 255;
@@ -632,190 +913,922 @@ static int Decode_Run(HScheme *neme, HScheme *reme, FILE *in, char *read,
 
   rlens = reme->codelens;
   rlook = reme->lookup;
+  pair  = reme->multi;
+
+  //  A run and the symbol following it are decoded with one lookup of the pair table
+  //    whenever both codes lie within the next MULTI_BITS of the stream.
+
+#define DECODE_RUN(PEEK)						\
+  while (j < rlen)							\
+    { x = PEEK(p);							\
+      e = pair[x >> (32-MULTI_BITS)];					\
+      q = p;								\
+      if (e & PAIR_VALID)						\
+        { c  = PAIR_RUN(e);						\
+          p += PAIR_RLEN(e);						\
+        }								\
+      else								\
+        { c  = rlook[x >> 16];						\
+          p += rlens[c];						\
+          if (c == 255)							\
+            { c  = PEEK(p) >> 16;					\
+              q  = p;							\
+              p += 16;							\
+            }								\
+        }								\
+      memset(read+j,rchar,c);						\
+      j += c;								\
+									\
+      if (j < rlen)							\
+        { q = p;							\
+          if (e & PAIR_HAS_SYM)						\
+            { read[j++] = (char) PAIR_SYM(e);				\
+              p += PAIR_LEN(e) - PAIR_RLEN(e);				\
+              continue;							\
+            }								\
+          x  = PEEK(p);							\
+          c  = nlook[x >> 16];						\
+          p += nlens[c];						\
+          if (c == nsignal)						\
+            { c  = PEEK(p) >> 24;					\
+              q  = p;							\
+              p += 8;							\
+            }								\
+          read[j++] = (char) c;						\
+        }								\
+    }
 
-  n     = 16;
-  ilen  = 0;
-  icode = 0;
-  if (Flip)
-    for (j = 0; j < rlen; j++)
-      { GETFLIP
-        c = rlook[*xpart];
-        n = rlens[c];
-        if (c == 255)
-          { GETFLIP
-            c = *xpart;
-            n = 16;
-          }
-        for (k = 0; k < c; k++)
-          read[j++] = (char) rchar;
-
-        if (j < rlen)
-          { GETFLIP
-            c = nlook[*xpart];
-            n = nlens[c];
-            if (c == nsignal)
-              { GETFLIP
-                c = *cpart;
-                n = 8;
-              }
-            read[j] = (char) c;
-          }
-      }
+  p = 0;
+  q = 0;
+  j = 0;
+  if (flip)
+    { DECODE_RUN(PEEKFLIP) }
   else
-    for (j = 0; j < rlen; j++)
-      { GET
-        c = rlook[*xpart];
-        n = rlens[c];
-        if (c == 255)
-          { GET
-            c = *xpart;
-            n = 16;
-          }
-        for (k = 0; k < c; k++)
-          read[j++] = (char) rchar;
-
-        if (j < rlen)
-          { GET
-            c = nlook[*xpart];
-            n = nlens[c];
-            if (c == nsignal)
-              { GET
-                c = *cpart;
-                n = 8;
-              }
-            read[j] = (char) c;
-          }
-      }
+    { DECODE_RUN(PEEK) }
 
+  Skip_Stream(in,q,rlen);
+
+  if (in->ptr > in->end)
+    { EPRINTF(EPLACE,"Could not read more bits (Decode)\n");
+      EXIT(1);
+    }
   return (0);
 }
 
 
 /*******************************************************************************************
  *
- *  Histogrammers
+ *  rANS coding: an alternative to the Huffman schemes that codes each symbol in a fractional
+ *    number of bits.  A scheme quantizes the frequencies of the symbols of a stream so that
+ *    they sum to 1 << RANS_BITS.  The symbols of a stream are coded by RANS_LANES interleaved
+ *    coders (symbol i by coder i % RANS_LANES) sharing one byte stream, so that a decoder can
+ *    work on consecutive symbols in parallel.  The stream starts with the final states of the
+ *    coders, and as it is written byte by byte it does not depend on the machine's endian.
  *
  ********************************************************************************************/
 
-//  Histogram runlengths of symbol runChar in stream[0..rlen-1] into run.
+#define RANS_BITS    14                        //  Frequencies of a scheme sum to 1 << RANS_BITS
+#define RANS_MASK    ((1u << RANS_BITS) - 1)
+#define RANS_LOW     (1u << 23)                //  Coder states are in [RANS_LOW,256*RANS_LOW)
+#define RANS_LANES    4                        //  # of interleaved coders (a power of 2)
+#define RANS_RAW     (RANS_BITS - 8)           //  A raw byte has frequency 1 << RANS_RAW
 
-static void Histogram_Seqs(uint64 *hist, uint8 *stream, int rlen)
-{ int k;
+typedef struct
+  { uint16 freq[256];                //  Quantized frequency of each symbol
+    uint16 cum[256];                 //  Sum of the frequencies of the preceding symbols
+    uint8  sym[1 << RANS_BITS];      //  Symbol of each slot of [0,1 << RANS_BITS) (decoding)
+  } RScheme;
 
-  for (k = 0; k < rlen; k++)
-    hist[stream[k]] += 1;
-}
+  //  Set the cumulative frequencies and the decoding table of scheme from its frequencies
 
-static void Histogram_Runs(uint64 *run, uint8 *stream, int rlen, int runChar)
-{ int k, h;
+static void Rans_Tables(RScheme *scheme)
+{ int i, c;
 
-  k = 0;
-  while (k < rlen)
-    { h = k;
-      while (k < rlen && stream[k] == runChar)
-        k += 1;
-      if (k-h >= 256)
-        run[255] += 1;
-      else
-        run[k-h] += 1;
-      if (k < rlen)
-        k += 1;
+  c = 0;
+  for (i = 0; i < 256; i++)
+    { scheme->cum[i] = (uint16) c;
+      memset(scheme->sym+c,i,scheme->freq[i]);
+      c += scheme->freq[i];
     }
 }
 
+  //  Quantize the symbol frequencies in hist into freq so that they sum to 1 << RANS_BITS,
+  //    every symbol that occurs having a frequency of at least 1
 
-/*******************************************************************************************
- *
- *  Reader
- *
- ********************************************************************************************/
+static void Rans_Quantize(uint64 *hist, uint16 *freq)
+{ uint64 total;
+  int    i, f, big, sum;
+
+  total = 0;
+  for (i = 0; i < 256; i++)
+    total += hist[i];
+
+  sum = 0;
+  big = 0;
+  for (i = 0; i < 256; i++)
+    { if (hist[i] == 0)
+        f = 0;
+      else
+        { f = (int) ((((double) hist[i]) / total) * (1 << RANS_BITS) + .5);
+          if (f == 0)
+            f = 1;
+        }
+      freq[i] = (uint16) f;
+      sum += f;
+      if (hist[i] > hist[big])
+        big = i;
+    }
 
-static char  *Read = NULL;   //  Referred by:  QVentry, Read_Lines, QVcoding_Scan,
-static int    Rmax = -1;     //                Compress_Next_QVentry
+  //  Adjust the frequencies to sum to exactly 1 << RANS_BITS, taking any excess from the
+  //    currently most frequent symbol
 
-static int    Nline;         //  Referred by:  QVcoding_Scan
+  if (sum < (1 << RANS_BITS))
+    freq[big] += (1 << RANS_BITS) - sum;
+  while (sum > (1 << RANS_BITS))
+    { for (i = 0; i < 256; i++)
+        if (freq[i] > freq[big])
+          big = i;
+      f = freq[big]-1;
+      if (f > sum - (1 << RANS_BITS))
+        f = sum - (1 << RANS_BITS);
+      freq[big] -= f;
+      sum -= f;
+    }
+}
 
-char *QVentry()
-{ return (Read); }
+  //  Allocate and return an rANS scheme for the symbol frequencies in hist
 
-void Set_QV_Line(int line)
-{ Nline = line; }
+static RScheme *Rans_Scheme(uint64 *hist)
+{ RScheme *scheme;
 
-int Get_QV_Line()
-{ return (Nline); }
+  scheme = (RScheme *) Malloc(sizeof(RScheme),"Allocating rANS scheme record");
+  if (scheme == NULL)
+    return (NULL);
+  Rans_Quantize(hist,scheme->freq);
+  Rans_Tables(scheme);
+  return (scheme);
+}
 
-//  If nlines == 1 trying to read a single header, nlines = 5 trying to read 5 QV/fasta lines
-//    for a sequence.  Place line j at Read+j*Rmax and the length of every line is returned
-//    unless eof occurs in which case return -1.  If any error occurs return -2.
+static int Write_Rans_Scheme(RScheme *scheme, QVbuffer *out)
+{ if (Write_Bytes(out,scheme->freq,sizeof(uint16)*256))
+    EXIT(1);
+  return (0);
+}
 
-int Read_Lines(FILE *input, int nlines)
-{ int   i, rlen;
-  int   tmax;
-  char *tread;
-  char *other;
+  //  Allocate and read an rANS scheme from in, and return a pointer to it.  If flip is set
+  //    then the scheme was written on a machine of the opposite endian.
 
-  if (Read == NULL)
-    { tmax  = MIN_BUFFER;
-      tread = (char *) Malloc(5*tmax,"Allocating QV entry read buffer");
-      if (tread == NULL)
-        EXIT(-2);
-      Rmax = tmax;
-      Read = tread;
-    }
+static RScheme *Read_Rans_Scheme(QVbuffer *in, int flip)
+{ RScheme *scheme;
+  int      i, sum;
 
-  Nline += 1;
-  if (fgets(Read,Rmax,input) == NULL)
-    return (-1);
+  scheme = (RScheme *) Malloc(sizeof(RScheme),"Allocating rANS scheme record");
+  if (scheme == NULL)
+    return (NULL);
 
-  rlen = strlen(Read);
-  while (Read[rlen-1] != '\n')
-    { tmax  = ((int) 1.4*Rmax) + MIN_BUFFER;
-      tread = (char *) Realloc(Read,5*tmax,"Reallocating QV entry read buffer");
-      if (tread == NULL)
-        EXIT(-2);
-      Rmax = tmax;
-      Read = tread;
-      if (fgets(Read+rlen,Rmax-rlen,input) == NULL)
-        { EPRINTF(EPLACE,"Line %d: Last line does not end with a newline !\n",Nline);
-          EXIT(-2);
-        }
-      rlen += strlen(Read+rlen);
+  if (Read_Bytes(in,scheme->freq,sizeof(uint16)*256))
+    { EPRINTF(EPLACE,"Could not read symbol frequencies (Read_Rans_Scheme)\n");
+      free(scheme);
+      return (NULL);
     }
-  other = Read;
-  for (i = 1; i < nlines; i++)
-    { other += Rmax;
-      Nline += 1;
-      if (fgets(other,Rmax,input) == NULL)
-        { EPRINTF(EPLACE,"Line %d: incomplete last entry of .quiv file\n",Nline);
-          EXIT(-2);
-        }
-      if (rlen != (int) strlen(other))
-        { EPRINTF(EPLACE,"Line %d: Lines for an entry are not the same length\n",Nline);
-          EXIT(-2);
-        }
+  sum = 0;
+  for (i = 0; i < 256; i++)
+    { if (flip)
+        Flip_Short(scheme->freq+i);
+      sum += scheme->freq[i];
+    }
+  if (sum != (1 << RANS_BITS))
+    { EPRINTF(EPLACE,"Symbol frequencies are corrupted (Read_Rans_Scheme)\n");
+      free(scheme);
+      return (NULL);
     }
-  return (rlen-1);
-}
 
+  Rans_Tables(scheme);
+  return (scheme);
+}
 
-/*******************************************************************************************
- *
- *  Tag compression and decompression routines
- *
- ********************************************************************************************/
+  //  Encoders work back to front, pushing the symbol with cumulative frequency s and frequency
+  //    f onto coder state x and writing its renormalization bytes backwards at optr.  The
+  //    final states are then flushed in front of them.
 
-//  Keep only the symbols in tags[0..rlen-1] for which qvs[k] != rchar and
-//    return the # of symbols kept.
+#define RANS_PUT(x,s,f)							\
+{ uint32 _f = (f);							\
+  uint32 _m = ((RANS_LOW >> RANS_BITS) << 8) * _f;			\
+  while (x >= _m)							\
+    { *--optr = (uint8) x;						\
+      x >>= 8;								\
+    }									\
+  x = ((x / _f) << RANS_BITS) + (x % _f) + (s);				\
+}
 
-static int Pack_Tag(char *tags, char *qvs, int rlen, int rchar)
-{ int j, k;
+#define RANS_SYM(x,scheme,c)						\
+{ if ((scheme)->freq[c] == 0)						\
+    goto missing;							\
+  RANS_PUT(x,(scheme)->cum[c],(scheme)->freq[c])			\
+}
 
-  j = 0;
-  for (k = 0; k < rlen; k++)
-    if (qvs[k] != rchar)
-      tags[j++] = tags[k];
-  tags[j] = '\0';
-  return (j);
+#define RANS_FLUSH							\
+{ int _l;								\
+									\
+  for (_l = RANS_LANES-1; _l >= 0; _l--)				\
+    { optr   -= 4;							\
+      optr[0] = (uint8) (x[_l] >> 24);					\
+      optr[1] = (uint8) (x[_l] >> 16);					\
+      optr[2] = (uint8) (x[_l] >> 8);					\
+      optr[3] = (uint8) x[_l];						\
+    }									\
+}
+
+  //  Encode read[0..rlen-1] according to scheme and write to out
+
+static int Encode_Rans(RScheme *scheme, QVbuffer *out, uint8 *read, int rlen)
+{ uint32  x[RANS_LANES];
+  uint8  *optr, *oend;
+  int     k, c;
+
+  if (rlen == 0)
+    return (0);
+  if (Reserve(out,MAX_CODED(rlen)))
+    EXIT(1);
+  oend = out->data + out->ptr + MAX_CODED(rlen);
+  optr = oend;
+
+  for (k = 0; k < RANS_LANES; k++)
+    x[k] = RANS_LOW;
+  for (k = rlen-1; k >= 0; k--)
+    { c = read[k];
+      RANS_SYM(x[k & (RANS_LANES-1)],scheme,c)
+    }
+  RANS_FLUSH
+
+  memmove(out->data + out->ptr,optr,oend-optr);
+  out->ptr += oend-optr;
+  return (0);
+
+missing:
+  EPRINTF(EPLACE,"QV symbol %d is not in the coding scheme (Encode_Rans)\n",c);
+  EXIT(1);
+}
+
+  //  Encode read[0..rlen-1] according to non-rchar scheme neme, and run-length scheme reme for
+  //    runs of rchar characters, exactly as Encode_Run: a run length of 255 or more is coded
+  //    as 255 followed by the length in two raw bytes.  Write to out.
+
+#define RANS_RUN(r)							\
+{ if ((r) >= 255)							\
+    { i -= 1;								\
+      RANS_PUT(x[i & (RANS_LANES-1)],((r) & 0xff) << RANS_RAW,1 << RANS_RAW)		\
+      i -= 1;								\
+      RANS_PUT(x[i & (RANS_LANES-1)],(((r) >> 8) & 0xff) << RANS_RAW,1 << RANS_RAW)	\
+      c  = 255;								\
+    }									\
+  else									\
+    c = (r);								\
+  i -= 1;								\
+  RANS_SYM(x[i & (RANS_LANES-1)],reme,c)				\
+}
+
+static int Encode_Rans_Run(RScheme *neme, RScheme *reme, QVbuffer *out, uint8 *read,
+                           int rlen, int rchar)
+{ uint32  x[RANS_LANES];
+  uint8  *optr, *oend;
+  int     i, k, h, c;
+
+  if (rlen == 0)
+    return (0);
+  if (Reserve(out,MAX_CODED(rlen)))
+    EXIT(1);
+  oend = out->data + out->ptr + MAX_CODED(rlen);
+  optr = oend;
+
+  //  Count the symbols to be coded so that the coder of each is known when working backwards
+
+  i = 0;
+  k = 0;
+  while (k < rlen)
+    { h = k;
+      while (k < rlen && read[k] == rchar)
+        k += 1;
+      if (k-h >= 255)
+        i += 3;
+      else
+        i += 1;
+      if (k < rlen)
+        { i += 1;
+          k += 1;
+        }
+    }
+
+  for (k = 0; k < RANS_LANES; k++)
+    x[k] = RANS_LOW;
+
+  k = rlen;
+  if (read[k-1] == rchar)
+    { h = k;
+      while (h > 0 && read[h-1] == rchar)
+        h -= 1;
+      RANS_RUN(k-h)
+      k = h;
+    }
+  while (k > 0)
+    { c  = read[--k];
+      i -= 1;
+      RANS_SYM(x[i & (RANS_LANES-1)],neme,c)
+      h = k;
+      while (h > 0 && read[h-1] == rchar)
+        h -= 1;
+      RANS_RUN(k-h)
+      k = h;
+    }
+  RANS_FLUSH
+
+  memmove(out->data + out->ptr,optr,oend-optr);
+  out->ptr += oend-optr;
+  return (0);
+
+missing:
+  EPRINTF(EPLACE,"QV symbol %d is not in the coding scheme (Encode_Rans_Run)\n",c);
+  EXIT(1);
+}
+
+  //  Decoders read the coder states and then pop symbols front to back, renormalizing from
+  //    the byte stream at iptr.  A correct stream leaves every coder in its initial state.
+
+#define RANS_INIT							\
+{ int _l;								\
+									\
+  for (_l = 0; _l < RANS_LANES; _l++)					\
+    { x[_l] = (((uint32) iptr[0]) << 24) | (((uint32) iptr[1]) << 16)	\
+            | (((uint32) iptr[2]) << 8) | iptr[3];			\
+      iptr += 4;							\
+      if (x[_l] < RANS_LOW)						\
+        goto corrupt;							\
+    }									\
+}
+
+#define RANS_GET(x,c,scheme)						\
+{ uint32 _m = x & RANS_MASK;						\
+  c = (scheme)->sym[_m];						\
+  x = (scheme)->freq[c] * (x >> RANS_BITS) + _m - (scheme)->cum[c];	\
+  while (x < RANS_LOW)							\
+    x = (x << 8) | *iptr++;						\
+}
+
+#define RANS_GET_RAW(x,c)						\
+{ uint32 _m = x & RANS_MASK;						\
+  c = _m >> RANS_RAW;							\
+  x = (x >> RANS_BITS << RANS_RAW) + (_m & ((1u << RANS_RAW) - 1));	\
+  while (x < RANS_LOW)							\
+    x = (x << 8) | *iptr++;						\
+}
+
+#define RANS_DONE(routine)						\
+{ int _l;								\
+									\
+  in->ptr = iptr - in->data;						\
+  if (in->ptr > in->end)						\
+    { EPRINTF(EPLACE,"Could not read more bits (%s)\n",routine);	\
+      EXIT(1);								\
+    }									\
+  for (_l = 0; _l < RANS_LANES; _l++)					\
+    if (x[_l] != RANS_LOW)						\
+      goto corrupt;							\
+}
+
+  //  Read and decode from in, the next rlen symbols into read according to scheme
+
+static int Decode_Rans(RScheme *scheme, QVbuffer *in, char *read, int rlen)
+{ uint32  x[RANS_LANES];
+  uint32  x0, x1, x2, x3;
+  uint8  *iptr;
+  int     k, c;
+
+  if (rlen == 0)
+    return (0);
+  if (Fill(in,MAX_CODED(rlen)))
+    EXIT(1);
+  iptr = in->data + in->ptr;
+
+  RANS_INIT
+
+  x0 = x[0];
+  x1 = x[1];
+  x2 = x[2];
+  x3 = x[3];
+  for (k = 0; k+4 <= rlen; k += 4)
+    { RANS_GET(x0,c,scheme)
+      read[k] = (char) c;
+      RANS_GET(x1,c,scheme)
+      read[k+1] = (char) c;
+      RANS_GET(x2,c,scheme)
+      read[k+2] = (char) c;
+      RANS_GET(x3,c,scheme)
+      read[k+3] = (char) c;
+    }
+  x[0] = x0;
+  x[1] = x1;
+  x[2] = x2;
+  x[3] = x3;
+  for ( ; k < rlen; k++)
+    { RANS_GET(x[k & (RANS_LANES-1)],c,scheme)
+      read[k] = (char) c;
+    }
+
+  RANS_DONE("Decode_Rans")
+  return (0);
+
+corrupt:
+  EPRINTF(EPLACE,"Compressed QVs are corrupted (Decode_Rans)\n");
+  EXIT(1);
+}
+
+  //  Read and decode from in, the next rlen symbols into read according to non-rchar scheme
+  //    neme, and the rchar runlength scheme reme
+
+static int Decode_Rans_Run(RScheme *neme, RScheme *reme, QVbuffer *in, char *read,
+                           int rlen, int rchar)
+{ uint32  x[RANS_LANES];
+  uint8  *iptr;
+  int     i, j, c, h;
+
+  if (rlen == 0)
+    return (0);
+  if (Fill(in,MAX_CODED(rlen)))
+    EXIT(1);
+  iptr = in->data + in->ptr;
+
+  RANS_INIT
+
+  i = 0;
+  j = 0;
+  while (j < rlen)
+    { RANS_GET(x[i & (RANS_LANES-1)],c,reme)
+      i += 1;
+      if (c == 255)
+        { RANS_GET_RAW(x[i & (RANS_LANES-1)],h)
+          i += 1;
+          RANS_GET_RAW(x[i & (RANS_LANES-1)],c)
+          i += 1;
+          c |= (h << 8);
+          if (c < 255)
+            goto corrupt;
+        }
+      if (c > rlen-j)
+        goto corrupt;
+      memset(read+j,rchar,c);
+      j += c;
+
+      if (j < rlen)
+        { RANS_GET(x[i & (RANS_LANES-1)],c,neme)
+          i += 1;
+          read[j++] = (char) c;
+        }
+    }
+
+  RANS_DONE("Decode_Rans_Run")
+  return (0);
+
+corrupt:
+  EPRINTF(EPLACE,"Compressed QVs are corrupted (Decode_Rans_Run)\n");
+  EXIT(1);
+}
+
+
+/*******************************************************************************************
+ *
+ *  Context-modelled rANS coding: QVs are strongly correlated with their predecessor, so each
+ *    symbol of a stream is coded with the model for the symbol preceding it in the read (an
+ *    order-1 context).  Only preceding symbols that occur often enough to pay for the space
+ *    of their model get one, the remainder and the first symbol of a read using the order-0
+ *    model 0.  The models are static, so every read can still be decoded on its own.
+ *
+ ********************************************************************************************/
+
+#define CTX_MIN     1024            //  Fewest occurrences of a context for it to get its own model
+                                    //    (and at most 255 do)
+#define CTX_SHIFT   (RANS_BITS-8)   //  Slots per entry of the decoding start table (log)
+
+typedef struct
+  { uint16 freq[256];               //  Quantized frequency of each symbol
+    uint16 cum[257];                //  Sum of the frequencies of the preceding symbols
+    uint8  start[256];              //  Symbol of slot i << CTX_SHIFT (decoding)
+  } CModel;
+
+typedef struct
+  { int     nctx;                   //  Number of models
+    uint8   map[256];               //  Model for each preceding symbol
+    CModel *model;                  //  nctx models, model 0 is order-0
+  } CScheme;
+
+  //  Set the cumulative frequencies and the decoding start table of model from its frequencies
+
+static void Context_Tables(CModel *model)
+{ int i, c;
+
+  model->cum[0] = 0;
+  for (i = 0; i < 256; i++)
+    model->cum[i+1] = (uint16) (model->cum[i] + model->freq[i]);
+  c = 0;
+  for (i = 0; i < 256; i++)
+    { while (model->cum[c+1] <= (i << CTX_SHIFT))
+        c += 1;
+      model->start[i] = (uint8) c;
+    }
+}
+
+static CScheme *New_Context_Scheme(int nctx)
+{ CScheme *scheme;
+
+  scheme = (CScheme *) Malloc(sizeof(CScheme) + sizeof(CModel)*nctx,
+                              "Allocating context scheme record");
+  if (scheme == NULL)
+    return (NULL);
+  scheme->nctx  = nctx;
+  scheme->model = (CModel *) (scheme+1);
+  return (scheme);
+}
+
+  //  Allocate and return a context scheme for the symbol frequencies in hist, and those
+  //    following each symbol p in ctxt[256*p..256*p+255]
+
+static CScheme *Context_Scheme(uint64 *hist, uint64 *ctxt)
+{ CScheme *scheme;
+  uint64   total;
+  int      p, c, nctx;
+
+  nctx = 1;
+  for (p = 0; p < 256; p++)
+    { total = 0;
+      for (c = 0; c < 256; c++)
+        total += ctxt[256*p+c];
+      if (total >= CTX_MIN && nctx < 256)
+        nctx += 1;
+    }
+
+  scheme = New_Context_Scheme(nctx);
+  if (scheme == NULL)
+    return (NULL);
+
+  Rans_Quantize(hist,scheme->model[0].freq);
+  Context_Tables(scheme->model);
+
+  nctx = 1;
+  for (p = 0; p < 256; p++)
+    { total = 0;
+      for (c = 0; c < 256; c++)
+        total += ctxt[256*p+c];
+      if (total >= CTX_MIN && nctx < 256)
+        { Rans_Quantize(ctxt+256*p,scheme->model[nctx].freq);
+          Context_Tables(scheme->model+nctx);
+          scheme->map[p] = (uint8) nctx++;
+        }
+      else
+        scheme->map[p] = 0;
+    }
+
+  return (scheme);
+}
+
+  //  A context scheme is written as the number of models, the model map, and then for each
+  //    model the number n of symbols with non-zero frequency, those n symbols, and their n
+  //    frequencies.
+
+static int Write_Context_Scheme(CScheme *scheme, QVbuffer *out)
+{ uint8  sym[256];
+  uint16 freq[256];
+  CModel *model;
+  int     m, c, n;
+
+  if (Write_Bytes(out,&(scheme->nctx),sizeof(int)) || Write_Bytes(out,scheme->map,256))
+    EXIT(1);
+  for (m = 0; m < scheme->nctx; m++)
+    { model = scheme->model + m;
+      n = 0;
+      for (c = 0; c < 256; c++)
+        if (model->freq[c] > 0)
+          { sym[n]  = (uint8) c;
+            freq[n] = model->freq[c];
+            n += 1;
+          }
+      if (Write_Bytes(out,&n,sizeof(int)) || Write_Bytes(out,sym,n)
+                                          || Write_Bytes(out,freq,sizeof(uint16)*n))
+        EXIT(1);
+    }
+  return (0);
+}
+
+  //  Allocate and read a context scheme from in, and return a pointer to it.  If flip is set
+  //    then the scheme was written on a machine of the opposite endian.
+
+static CScheme *Read_Context_Scheme(QVbuffer *in, int flip)
+{ CScheme *scheme;
+  CModel  *model;
+  uint8    sym[256];
+  uint16   freq[256];
+  int      nctx, m, i, n, sum;
+
+  if (Read_Bytes(in,&nctx,sizeof(int)))
+    { EPRINTF(EPLACE,"Could not read number of contexts (Read_Context_Scheme)\n");
+      return (NULL);
+    }
+  if (flip)
+    Flip_Long(&nctx);
+  if (nctx < 1 || nctx > 256)
+    { EPRINTF(EPLACE,"Number of contexts is corrupted (Read_Context_Scheme)\n");
+      return (NULL);
+    }
+
+  scheme = New_Context_Scheme(nctx);
+  if (scheme == NULL)
+    return (NULL);
+
+  if (Read_Bytes(in,scheme->map,256))
+    { EPRINTF(EPLACE,"Could not read context map (Read_Context_Scheme)\n");
+      goto error;
+    }
+  for (i = 0; i < 256; i++)
+    if (scheme->map[i] >= nctx)
+      goto corrupt;
+
+  for (m = 0; m < nctx; m++)
+    { model = scheme->model + m;
+      if (Read_Bytes(in,&n,sizeof(int)))
+        { EPRINTF(EPLACE,"Could not read %d'th context model (Read_Context_Scheme)\n",m);
+          goto error;
+        }
+      if (flip)
+        Flip_Long(&n);
+      if (n < 1 || n > 256)
+        goto corrupt;
+      if (Read_Bytes(in,sym,n) || Read_Bytes(in,freq,sizeof(uint16)*n))
+        { EPRINTF(EPLACE,"Could not read %d'th context model (Read_Context_Scheme)\n",m);
+          goto error;
+        }
+      bzero(model->freq,sizeof(uint16)*256);
+      sum = 0;
+      for (i = 0; i < n; i++)
+        { if (flip)
+            Flip_Short(freq+i);
+          model->freq[sym[i]] = freq[i];
+          sum += freq[i];
+        }
+      if (sum != (1 << RANS_BITS))
+        goto corrupt;
+      Context_Tables(model);
+    }
+
+  return (scheme);
+
+corrupt:
+  EPRINTF(EPLACE,"Context models are corrupted (Read_Context_Scheme)\n");
+error:
+  free(scheme);
+  return (NULL);
+}
+
+  //  Encode read[0..rlen-1] according to context scheme and write to out
+
+static int Encode_Context(CScheme *scheme, QVbuffer *out, uint8 *read, int rlen)
+{ uint32  x[RANS_LANES];
+  uint8  *optr, *oend;
+  CModel *model;
+  int     k, c;
+
+  if (rlen == 0)
+    return (0);
+  if (Reserve(out,MAX_CODED(rlen)))
+    EXIT(1);
+  oend = out->data + out->ptr + MAX_CODED(rlen);
+  optr = oend;
+
+  for (k = 0; k < RANS_LANES; k++)
+    x[k] = RANS_LOW;
+  for (k = rlen-1; k >= 0; k--)
+    { c = read[k];
+      if (k > 0)
+        model = scheme->model + scheme->map[read[k-1]];
+      else
+        model = scheme->model;
+      if (model->freq[c] == 0)
+        goto missing;
+      RANS_PUT(x[k & (RANS_LANES-1)],model->cum[c],model->freq[c])
+    }
+  RANS_FLUSH
+
+  memmove(out->data + out->ptr,optr,oend-optr);
+  out->ptr += oend-optr;
+  return (0);
+
+missing:
+  EPRINTF(EPLACE,"QV symbol %d is not in the context model (Encode_Context)\n",c);
+  EXIT(1);
+}
+
+  //  Read and decode from in, the next rlen symbols into read according to context scheme
+
+static int Decode_Context(CScheme *scheme, QVbuffer *in, char *read, int rlen)
+{ uint32  x[RANS_LANES];
+  uint32  m, y;
+  uint8  *iptr;
+  CModel *model;
+  int     k, c;
+
+  if (rlen == 0)
+    return (0);
+  if (Fill(in,MAX_CODED(rlen)))
+    EXIT(1);
+  iptr = in->data + in->ptr;
+
+  RANS_INIT
+
+  model = scheme->model;
+  for (k = 0; k < rlen; k++)
+    { y = x[k & (RANS_LANES-1)];
+      m = y & RANS_MASK;
+      c = model->start[m >> CTX_SHIFT];
+      while (model->cum[c+1] <= m)
+        c += 1;
+      y = model->freq[c] * (y >> RANS_BITS) + m - model->cum[c];
+      while (y < RANS_LOW)
+        y = (y << 8) | *iptr++;
+      x[k & (RANS_LANES-1)] = y;
+      read[k] = (char) c;
+      model = scheme->model + scheme->map[c];
+    }
+
+  RANS_DONE("Decode_Context")
+  return (0);
+
+corrupt:
+  EPRINTF(EPLACE,"Compressed QVs are corrupted (Decode_Context)\n");
+  EXIT(1);
+}
+
+
+/*******************************************************************************************
+ *
+ *  Histogrammers
+ *
+ ********************************************************************************************/
+
+//  Histogram runlengths of symbol runChar in stream[0..rlen-1] into run.
+
+static void Histogram_Seqs(uint64 *hist, uint8 *stream, int rlen)
+{ int k;
+
+  for (k = 0; k < rlen; k++)
+    hist[stream[k]] += 1;
+}
+
+//  Histogram the symbols of stream[0..rlen-1] following each symbol p into ctxt[256*p..]
+
+static void Histogram_Context(uint64 *ctxt, uint8 *stream, int rlen)
+{ int k;
+
+  for (k = 1; k < rlen; k++)
+    ctxt[(stream[k-1] << 8) | stream[k]] += 1;
+}
+
+static void Histogram_Runs(uint64 *run, uint8 *stream, int rlen, int runChar)
+{ int k, h;
+
+  k = 0;
+  while (k < rlen)
+    { h = k;
+      while (k < rlen && stream[k] == runChar)
+        k += 1;
+      if (k-h >= 256)
+        run[255] += 1;
+      else
+        run[k-h] += 1;
+      if (k < rlen)
+        k += 1;
+    }
+}
+
+
+/*******************************************************************************************
+ *
+ *  Reader
+ *
+ ********************************************************************************************/
+
+  //  All the state of a scan or compression of .quiva entries is kept in a QVcontext so that
+  //    any number of them may be in progress concurrently.
+
+struct QVcontext
+  { char   *read;       //  Buffer for 5 lines of rmax bytes each (NULL until first used)
+    int     rmax;
+    int     nline;      //  # of the last line read from the input (for error messages)
+    uint64  delHist[256], insHist[256], mrgHist[256], subHist[256];   //  Scan statistics
+    uint64  delRun[256], subRun[256];
+    uint64  delCtx[256*256], insCtx[256*256], mrgCtx[256*256], subCtx[256*256];
+    uint64  totChar;
+    int     delChar, subChar;
+  };
+
+QVcontext *New_QVcontext()
+{ QVcontext *ctx;
+
+  ctx = (QVcontext *) Malloc(sizeof(QVcontext),"Allocating QV context");
+  if (ctx == NULL)
+    EXIT(NULL);
+  ctx->read  = NULL;
+  ctx->rmax  = -1;
+  ctx->nline = 0;
+  QVcoding_Scan1(ctx,0,NULL,NULL,NULL,NULL,NULL);
+  return (ctx);
+}
+
+void Free_QVcontext(QVcontext *ctx)
+{ free(ctx->read);
+  free(ctx);
+}
+
+char *QVentry(QVcontext *ctx)
+{ return (ctx->read); }
+
+char *QVline(QVcontext *ctx, int j)
+{ return (ctx->read + j*ctx->rmax); }
+
+void Set_QV_Line(QVcontext *ctx, int line)
+{ ctx->nline = line; }
+
+int Get_QV_Line(QVcontext *ctx)
+{ return (ctx->nline); }
+
+//  If nlines == 1 trying to read a single header, nlines = 5 trying to read 5 QV/fasta lines
+//    for a sequence.  Place line j at ctx->read+j*ctx->rmax and the length of every line is
+//    returned unless eof occurs in which case return -1.  If any error occurs return -2.
+
+int Read_Lines(QVcontext *ctx, FILE *input, int nlines)
+{ int   i, rlen;
+  int   tmax;
+  char *tread;
+  char *other;
+
+  if (ctx->read == NULL)
+    { tmax  = MIN_BUFFER;
+      tread = (char *) Malloc(5*tmax,"Allocating QV entry read buffer");
+      if (tread == NULL)
+        EXIT(-2);
+      ctx->rmax = tmax;
+      ctx->read = tread;
+    }
+
+  ctx->nline += 1;
+  if (fgets(ctx->read,ctx->rmax,input) == NULL)
+    return (-1);
+
+  rlen = strlen(ctx->read);
+  while (ctx->read[rlen-1] != '\n')
+    { tmax  = ((int) 1.4*ctx->rmax) + MIN_BUFFER;
+      tread = (char *) Realloc(ctx->read,5*tmax,"Reallocating QV entry read buffer");
+      if (tread == NULL)
+        EXIT(-2);
+      ctx->rmax = tmax;
+      ctx->read = tread;
+      if (fgets(ctx->read+rlen,ctx->rmax-rlen,input) == NULL)
+        { EPRINTF(EPLACE,"Line %d: Last line does not end with a newline !\n",ctx->nline);
+          EXIT(-2);
+        }
+      rlen += strlen(ctx->read+rlen);
+    }
+  other = ctx->read;
+  for (i = 1; i < nlines; i++)
+    { other += ctx->rmax;
+      ctx->nline += 1;
+      if (fgets(other,ctx->rmax,input) == NULL)
+        { EPRINTF(EPLACE,"Line %d: incomplete last entry of .quiv file\n",ctx->nline);
+          EXIT(-2);
+        }
+      if (rlen != (int) strlen(other))
+        { EPRINTF(EPLACE,"Line %d: Lines for an entry are not the same length\n",ctx->nline);
+          EXIT(-2);
+        }
+    }
+  return (rlen-1);
+}
+
+
+/*******************************************************************************************
+ *
+ *  Tag compression and decompression routines
+ *
+ ********************************************************************************************/
+
+//  Keep only the symbols in tags[0..rlen-1] for which qvs[k] != rchar and
+//    return the # of symbols kept.
+
+static int Pack_Tag(char *tags, char *qvs, int rlen, int rchar)
+{ int j, k;
+
+  j = 0;
+  for (k = 0; k < rlen; k++)
+    if (qvs[k] != rchar)
+      tags[j++] = tags[k];
+  tags[j] = '\0';
+  return (j);
 }
 
   //  Count the # of non-rchar symbols in qvs[0..rlen-1]
@@ -853,184 +1866,374 @@ static void Unpack_Tag(char *tags, int clen, char *qvs, int rlen, int rchar)
  *
  ********************************************************************************************/
 
-  // Read up to the next num entries or until eof from the .quiva file on input and record
-  //   frequency statistics.  Copy these entries to the temporary file temp if != NULL.
-  //   If there is an error then -1 is returned, otherwise the number of entries read.
+  //  Add the streams of an entry to the accumulating histograms of ctx and figure out the
+  //    run chars for the deletion and substition streams
+
+static void Histogram_Entry(QVcontext *ctx, int rlen, char *delQV, char *delTag, char *insQV,
+                            char *mergeQV, char *subQV)
+{ Histogram_Seqs(ctx->delHist,(uint8 *) delQV,rlen);
+  Histogram_Seqs(ctx->insHist,(uint8 *) insQV,rlen);
+  Histogram_Seqs(ctx->mrgHist,(uint8 *) mergeQV,rlen);
+  Histogram_Seqs(ctx->subHist,(uint8 *) subQV,rlen);
+  Histogram_Context(ctx->delCtx,(uint8 *) delQV,rlen);
+  Histogram_Context(ctx->insCtx,(uint8 *) insQV,rlen);
+  Histogram_Context(ctx->mrgCtx,(uint8 *) mergeQV,rlen);
+  Histogram_Context(ctx->subCtx,(uint8 *) subQV,rlen);
+
+  if (ctx->delChar < 0)
+    { int   k;
 
-static uint64   delHist[256], insHist[256], mrgHist[256], subHist[256], delRun[256], subRun[256];
-static uint64   totChar;
-static int      delChar, subChar;
+      for (k = 0; k < rlen; k++)
+        if (delTag[k] == 'n' || delTag[k] == 'N')
+          { ctx->delChar = delQV[k];
+            break;
+          }
+    }
+  if (ctx->delChar >= 0)
+    Histogram_Runs( ctx->delRun,(uint8 *) delQV,rlen,ctx->delChar);
+  ctx->totChar += rlen;
+  if (ctx->subChar < 0)
+    { if (ctx->totChar >= 100000)
+        { int k;
 
-  // Referred by:  QVcoding_Scan, Create_QVcoding
+          ctx->subChar = 0;
+          for (k = 1; k < 256; k++)
+            if (ctx->subHist[k] > ctx->subHist[ctx->subChar])
+              ctx->subChar = k;
+        }
+    }
+  if (ctx->subChar >= 0)
+    Histogram_Runs( ctx->subRun,(uint8 *) subQV,rlen,ctx->subChar);
+}
 
-void QVcoding_Scan1(int rlen, char *delQV, char *delTag, char *insQV, char *mergeQV, char *subQV)
+void QVcoding_Scan1(QVcontext *ctx, int rlen, char *delQV, char *delTag, char *insQV,
+                    char *mergeQV, char *subQV)
 {
   if (rlen == 0)   //  Initialization call
     { int   i;
 
       //  Zero histograms
 
-      bzero(delHist,sizeof(uint64)*256);
-      bzero(mrgHist,sizeof(uint64)*256);
-      bzero(insHist,sizeof(uint64)*256);
-      bzero(subHist,sizeof(uint64)*256);
+      bzero(ctx->delHist,sizeof(uint64)*256);
+      bzero(ctx->mrgHist,sizeof(uint64)*256);
+      bzero(ctx->insHist,sizeof(uint64)*256);
+      bzero(ctx->subHist,sizeof(uint64)*256);
+      bzero(ctx->delCtx,sizeof(uint64)*256*256);
+      bzero(ctx->insCtx,sizeof(uint64)*256*256);
+      bzero(ctx->mrgCtx,sizeof(uint64)*256*256);
+      bzero(ctx->subCtx,sizeof(uint64)*256*256);
 
       for (i = 0; i < 256; i++)
-        delRun[i] = subRun[i] = 1;
+        ctx->delRun[i] = ctx->subRun[i] = 1;
 
-      totChar    = 0;
-      delChar    = -1;
-      subChar    = -1;
+      ctx->totChar    = 0;
+      ctx->delChar    = -1;
+      ctx->subChar    = -1;
       return;
     }
 
-  //  Add streams to accumulating histograms and figure out the run chars
-  //    for the deletion and substition streams
+  Histogram_Entry(ctx,rlen,delQV,delTag,insQV,mergeQV,subQV);
+}
 
-  Histogram_Seqs(delHist,(uint8 *) delQV,rlen);
-  Histogram_Seqs(insHist,(uint8 *) insQV,rlen);
-  Histogram_Seqs(mrgHist,(uint8 *) mergeQV,rlen);
-  Histogram_Seqs(subHist,(uint8 *) subQV,rlen);
+  //  Check that the header line of an entry is properly formatted
 
-  if (delChar < 0)
-    { int   k;
+static int Check_Header(QVcontext *ctx, char *header, int hlen)
+{ char *slash;
+  int   well, beg, end, qv;
 
-      for (k = 0; k < rlen; k++)
-        if (delTag[k] == 'n' || delTag[k] == 'N')
-          { delChar = delQV[k];
-            break;
-          }
+  if (hlen == 0 || header[0] != '@')
+    { EPRINTF(EPLACE,"Line %d: Header in quiva file is missing\n",ctx->nline);
+      EXIT(1);
     }
-  if (delChar >= 0)
-    Histogram_Runs( delRun,(uint8 *) delQV,rlen,delChar);
-  totChar += rlen;
-  if (subChar < 0)
-    { if (totChar >= 100000)
-        { int k;
-
-          subChar = 0;
-          for (k = 1; k < 256; k++)
-            if (subHist[k] > subHist[subChar])
-              subChar = k;
-        }
+  slash = index(header+1,'/');
+  if (slash == NULL)
+    { EPRINTF(EPLACE,"%s: Line %d: Header line incorrectly formatted ?\n",
+                     Prog_Name,ctx->nline);
+      EXIT(1);
     }
-  if (subChar >= 0)
-    Histogram_Runs( subRun,(uint8 *) subQV,rlen,subChar);
-  return;
+  if (sscanf(slash+1,"%d/%d_%d RQ=0.%d\n",&well,&beg,&end,&qv) != 4)
+    { EPRINTF(EPLACE,"%s: Line %d: Header line incorrectly formatted ?\n",
+                     Prog_Name,ctx->nline);
+      EXIT(1);
+    }
+  return (0);
 }
 
-int QVcoding_Scan(FILE *input, int num, FILE *temp)
-{ char *slash;
-  int   rlen;
-  int   i, r;
-
-  //  Zero histograms
+  // Read up to the next num entries or until eof from the .quiva file on input and record
+  //   frequency statistics.  Copy the 5 QV streams of these entries (without newlines) to the
+  //   in-memory buffer save if != NULL, and record their lengths in rlen if != NULL.
+  //   If there is an error then -1 is returned, otherwise the number of entries read.
 
-  bzero(delHist,sizeof(uint64)*256);
-  bzero(mrgHist,sizeof(uint64)*256);
-  bzero(insHist,sizeof(uint64)*256);
-  bzero(subHist,sizeof(uint64)*256);
+int QVcoding_Scan(QVcontext *ctx, FILE *input, int num, QVbuffer *save, int *rlen)
+{ char *read;
+  int   len, rmax;
+  int   i, j, r;
 
-  for (i = 0; i < 256; i++)
-    delRun[i] = subRun[i] = 1;
+  //  Zero histograms
 
-  totChar    = 0;
-  delChar    = -1;
-  subChar    = -1;
+  QVcoding_Scan1(ctx,0,NULL,NULL,NULL,NULL,NULL);
 
   //  Make a sweep through the .quiva entries, histogramming the relevant things
   //    and figuring out the run chars for the deletion and substition streams
 
   r = 0;
   for (i = 0; i < num; i++)
-    { int well, beg, end, qv;
-
-      rlen = Read_Lines(input,1);
-      if (rlen == -2)
+    { len = Read_Lines(ctx,input,1);
+      if (len == -2)
         EXIT(-1);
-      if (rlen < 0)
+      if (len < 0)
         break;
 
-      if (rlen == 0 || Read[0] != '@')
-        { EPRINTF(EPLACE,"Line %d: Header in quiva file is missing\n",Nline);
-          EXIT(-1);
-        }
-      slash = index(Read+1,'/');
-      if (slash == NULL)
-  	{ EPRINTF(EPLACE,"%s: Line %d: Header line incorrectly formatted ?\n",
-                         Prog_Name,Nline);
+      if (Check_Header(ctx,ctx->read,len))
+        EXIT(-1);
+
+      len = Read_Lines(ctx,input,5);
+      if (len < 0)
+        { if (len == -1)
+            EPRINTF(EPLACE,"Line %d: incomplete last entry of .quiv file\n",ctx->nline);
           EXIT(-1);
         }
-      if (sscanf(slash+1,"%d/%d_%d RQ=0.%d\n",&well,&beg,&end,&qv) != 4)
-        { EPRINTF(EPLACE,"%s: Line %d: Header line incorrectly formatted ?\n",
-                         Prog_Name,Nline);
+
+      read = ctx->read;
+      rmax = ctx->rmax;
+      if (save != NULL)
+        for (j = 0; j < 5; j++)
+          if (Write_Bytes(save,read+j*rmax,len))
+            EXIT(-1);
+      if (rlen != NULL)
+        rlen[i] = len;
+
+      Histogram_Entry(ctx,len,read,read+rmax,read+2*rmax,read+3*rmax,read+4*rmax);
+
+      r += 1;
+    }
+
+  return (r);
+}
+
+  //  Return the length of the line starting at text[0] and ending with a newline before
+  //    text[tlen], or -1 if there is no such line.
+
+static int64 Text_Line(char *text, int64 tlen)
+{ char *eol;
+
+  eol = (char *) memchr(text,'\n',tlen);
+  if (eol == NULL)
+    return (-1);
+  return (eol-text);
+}
+
+  // As QVcoding_Scan but the .quiva entries are in the memory text[0..tlen-1] which is
+  //   scanned in place.  The start of the 5 QV lines of the i'th entry read (each line
+  //   followed by a newline) is recorded in lines[i] and their length in rlen[i].  The
+  //   number of bytes of text consumed is returned in *used.
+
+int QVcoding_Scan_Text(QVcontext *ctx, char *text, int64 tlen, int num, char **lines, int *rlen,
+                       int64 *used)
+{ char  *read;
+  int64  p, len, hlen;
+  int    i, j;
+
+  QVcoding_Scan1(ctx,0,NULL,NULL,NULL,NULL,NULL);
+
+  p = 0;
+  for (i = 0; i < num && p < tlen; i++)
+    { ctx->nline += 1;
+      hlen = Text_Line(text+p,tlen-p);
+      if (hlen < 0)
+        { EPRINTF(EPLACE,"Line %d: Last line does not end with a newline !\n",ctx->nline);
           EXIT(-1);
         }
 
-      if (temp != NULL)
-        fputs(Read,temp);
+      //  Copy the header into the line buffer of ctx to check it as a string
 
-      rlen = Read_Lines(input,5);
-      if (rlen < 0)
-        { if (rlen == -1)
-            EPRINTF(EPLACE,"Line %d: incomplete last entry of .quiv file\n",Nline);
-          EXIT(-1);
+      if (hlen+1 > ctx->rmax)
+        { read = (char *) Realloc(ctx->read,5*(hlen+MIN_BUFFER),"Allocating QV entry buffer");
+          if (read == NULL)
+            EXIT(-1);
+          ctx->read = read;
+          ctx->rmax = hlen+MIN_BUFFER;
+        }
+      memcpy(ctx->read,text+p,hlen);
+      ctx->read[hlen] = '\0';
+      if (Check_Header(ctx,ctx->read,hlen))
+        EXIT(-1);
+      p += hlen+1;
+
+      lines[i] = read = text+p;
+      len = -1;
+      for (j = 0; j < 5; j++)
+        { ctx->nline += 1;
+          hlen = Text_Line(text+p,tlen-p);
+          if (hlen < 0)
+            { EPRINTF(EPLACE,"Line %d: incomplete last entry of .quiv file\n",ctx->nline);
+              EXIT(-1);
+            }
+          if (j == 0)
+            len = hlen;
+          else if (hlen != len)
+            { EPRINTF(EPLACE,"Line %d: Lines for an entry are not the same length\n",
+                             ctx->nline);
+              EXIT(-1);
+            }
+          p += hlen+1;
         }
+      rlen[i] = len;
 
-      if (temp != NULL)
-        { fputs(Read,temp);
-          fputs(Read+Rmax,temp);
-          fputs(Read+2*Rmax,temp);
-          fputs(Read+3*Rmax,temp);
-          fputs(Read+4*Rmax,temp);
+      Histogram_Entry(ctx,len,read,read+(len+1),read+2*(len+1),read+3*(len+1),read+4*(len+1));
+    }
+
+  *used = p;
+  return (i);
+}
+
+  //  Lossy binnings of the insertion, merge, and substitution QVs
+
+static void Illumina_Bins(uint8 *map)
+{ static int upper[7] = {  9, 19, 24, 29, 34, 39, 255 };
+  static int level[7] = {  6, 15, 22, 27, 33, 37,  40 };
+  int k, q, b;
+
+  for (k = 0; k < 256; k++)
+    { q = k - '!';
+      if (q < 2)
+        { map[k] = (uint8) k;
+          continue;
         }
+      for (b = 0; q > upper[b]; b++)
+        ;
+      map[k] = (uint8) (level[b] + '!');
+    }
+}
+
+QVbinning *Create_QVbinning(int kind)
+{ QVbinning *bins;
+  int        k;
+
+  if (kind != QV_BIN_DEXQV && kind != QV_BIN_ILLUMINA)
+    { EPRINTF(EPLACE,"Unknown kind of binning %d (Create_QVbinning)\n",kind);
+      EXIT(NULL);
+    }
+
+  bins = (QVbinning *) Malloc(sizeof(QVbinning),"Allocating QV binning");
+  if (bins == NULL)
+    EXIT(NULL);
+
+  if (kind == QV_BIN_DEXQV)
+    for (k = 0; k < 256; k++)
+      { bins->ins[k] = (uint8) ((k >> 1) << 1);
+        bins->mrg[k] = (uint8) ((k >> 2) << 2);
+        bins->sub[k] = (uint8) k;
+      }
+  else
+    { Illumina_Bins(bins->ins);
+      memcpy(bins->mrg,bins->ins,256);
+      memcpy(bins->sub,bins->ins,256);
+    }
+  return (bins);
+}
 
-      Histogram_Seqs(delHist,(uint8 *) (Read),rlen);
-      Histogram_Seqs(insHist,(uint8 *) (Read+2*Rmax),rlen);
-      Histogram_Seqs(mrgHist,(uint8 *) (Read+3*Rmax),rlen);
-      Histogram_Seqs(subHist,(uint8 *) (Read+4*Rmax),rlen);
+QVbinning *Read_QVbinning(char *path)
+{ QVbinning *bins;
+  FILE      *input;
+  char       line[1000], name[1000];
+  int        lo, hi, bin, k, n, nline;
 
-      if (delChar < 0)
-        { int   k;
-          char *del = Read+Rmax;
+  input = Fopen(path,"r");
+  if (input == NULL)
+    EXIT(NULL);
 
-          for (k = 0; k < rlen; k++)
-            if (del[k] == 'n' || del[k] == 'N')
-              { delChar = Read[k];
-                break;
-              }
+  bins = (QVbinning *) Malloc(sizeof(QVbinning),"Allocating QV binning");
+  if (bins == NULL)
+    { fclose(input);
+      EXIT(NULL);
+    }
+  for (k = 0; k < 256; k++)
+    bins->ins[k] = bins->mrg[k] = bins->sub[k] = (uint8) k;
+
+  nline = 0;
+  while (fgets(line,1000,input) != NULL)
+    { nline += 1;
+      if (sscanf(line," %999s%n",name,&n) < 1 || name[0] == '#')
+        continue;
+      if (sscanf(line+n," %d %d %d",&lo,&hi,&bin) != 3)
+        { EPRINTF(EPLACE,"%s: Line %d of binning %s is not <stream> <lo> <hi> <bin>\n",
+                         Prog_Name,nline,path);
+          goto error;
         }
-      if (delChar >= 0)
-        Histogram_Runs( delRun,(uint8 *) (Read),rlen,delChar);
-      totChar += rlen;
-      if (subChar < 0)
-        { if (totChar >= 100000)
-            { int k;
-
-              subChar = 0;
-              for (k = 1; k < 256; k++)
-                if (subHist[k] > subHist[subChar])
-                  subChar = k;
-            }
+      if (lo < 0 || hi > 93 || lo > hi || bin < 0 || bin > 93)
+        { EPRINTF(EPLACE,"%s: Line %d of binning %s has a QV outside of [0,93]\n",
+                         Prog_Name,nline,path);
+          goto error;
+        }
+      if (strcmp(name,"ins") != 0 && strcmp(name,"mrg") != 0 &&
+          strcmp(name,"sub") != 0 && strcmp(name,"all") != 0)
+        { EPRINTF(EPLACE,"%s: Line %d of binning %s: stream %s is not ins, mrg, sub, or all\n",
+                         Prog_Name,nline,path,name);
+          goto error;
+        }
+      for (k = lo + '!'; k <= hi + '!'; k++)
+        { if (strcmp(name,"ins") == 0 || strcmp(name,"all") == 0)
+            bins->ins[k] = (uint8) (bin + '!');
+          if (strcmp(name,"mrg") == 0 || strcmp(name,"all") == 0)
+            bins->mrg[k] = (uint8) (bin + '!');
+          if (strcmp(name,"sub") == 0 || strcmp(name,"all") == 0)
+            bins->sub[k] = (uint8) (bin + '!');
         }
-      if (subChar >= 0)
-        Histogram_Runs( subRun,(uint8 *) (Read+4*Rmax),rlen,subChar);
-
-      r += 1;
     }
 
-  return (r);
+  fclose(input);
+  return (bins);
+
+error:
+  free(bins);
+  fclose(input);
+  EXIT(NULL);
 }
 
-  //   Using the statistics in the global stat tables, create the Huffman schemes and write
-  //   them to output.  If lossy is set, then create a lossy table for the insertion and merge
-  //   QVs.
+  //  Bin the histogram hist, or the context histograms ctxt, of a stream according to map
 
-QVcoding *Create_QVcoding(int lossy)
-{ static QVcoding coding;
+static void Bin_Histogram(uint64 *hist, uint8 *map)
+{ uint64 binned[256];
+  int    k;
 
-  HScheme *delScheme, *insScheme, *mrgScheme, *subScheme;
-  HScheme *dRunScheme, *sRunScheme;
+  for (k = 0; k < 256; k++)
+    binned[k] = 0;
+  for (k = 0; k < 256; k++)
+    binned[map[k]] += hist[k];
+  for (k = 0; k < 256; k++)
+    hist[k] = binned[k];
+}
+
+static void Bin_Context(uint64 *ctxt, uint64 *binned, uint8 *map)
+{ int p, c;
+
+  for (p = 0; p < 256*256; p++)
+    binned[p] = 0;
+  for (p = 0; p < 256; p++)
+    for (c = 0; c < 256; c++)
+      binned[(map[p] << 8) | map[c]] += ctxt[(p << 8) | c];
+  memcpy(ctxt,binned,sizeof(uint64)*256*256);
+}
+
+  //   Using the statistics accumulated in ctx, create the Huffman, rANS, or context schemes
+  //   (as per codec) and return them in a newly allocated coding.  If lossy is not NULL, then
+  //   bin the statistics of the insertion, merge, and substitution QVs as per lossy.
+
+QVcoding *Create_QVcoding(QVcontext *ctx, QVbinning *lossy, int codec)
+{ QVcoding  *coding;
+  QVbinning *bins;
+
+  void    *delScheme, *insScheme, *mrgScheme, *subScheme;
+  void    *dRunScheme, *sRunScheme;
+
+  uint64  *delHist = ctx->delHist;
+  uint64  *insHist = ctx->insHist;
+  uint64  *mrgHist = ctx->mrgHist;
+  uint64  *subHist = ctx->subHist;
+  uint64   totChar = ctx->totChar;
+  int      delChar = ctx->delChar;
+  int      subChar = ctx->subChar;
 
   delScheme  = NULL;
   dRunScheme = NULL;
@@ -1044,64 +2247,99 @@ QVcoding *Create_QVcoding(int lossy)
   if (totChar < 200000 || subHist[subChar] < .5*totChar)
     subChar = -1;
 
-  //  If lossy encryption is enabled then scale insertions and merge QVs.
+  //  If lossy encryption is enabled then bin the insertion, merge, and substitution QVs.  The
+  //    runs of the substitution run char are unchanged if no other QV that occurs falls in
+  //    its bin, otherwise substitution QVs are no longer run-length coded.
 
-  if (lossy)
-    { int k;
+  bins = NULL;
+  if (lossy != NULL)
+    { uint64 *binned;
+      int     k;
 
-      for (k = 0; k < 256; k += 2)
-        { insHist[k] += insHist[k+1];
-          insHist[k+1] = 0;
+      bins = (QVbinning *) Malloc(sizeof(QVbinning),"Allocating QV binning");
+      if (bins == NULL)
+        EXIT(NULL);
+      *bins = *lossy;
+
+      if (subChar >= 0)
+        { for (k = 0; k < 256; k++)
+            if (k != subChar && subHist[k] > 0 && lossy->sub[k] == lossy->sub[subChar])
+              break;
+          if (k < 256)
+            subChar = -1;
+          else
+            subChar = lossy->sub[subChar];
         }
 
-      for (k = 0; k < 256; k += 4)
-        { mrgHist[k] += mrgHist[k+1];
-          mrgHist[k] += mrgHist[k+2];
-          mrgHist[k] += mrgHist[k+3];
-          mrgHist[k+1] = 0;
-          mrgHist[k+2] = 0;
-          mrgHist[k+3] = 0;
+      Bin_Histogram(insHist,lossy->ins);
+      Bin_Histogram(mrgHist,lossy->mrg);
+      Bin_Histogram(subHist,lossy->sub);
+
+      if (codec == QV_CONTEXT)
+        { binned = (uint64 *) Malloc(sizeof(uint64)*256*256,"Allocating binned contexts");
+          if (binned == NULL)
+            { free(bins);
+              EXIT(NULL);
+            }
+          Bin_Context(ctx->insCtx,binned,lossy->ins);
+          Bin_Context(ctx->mrgCtx,binned,lossy->mrg);
+          Bin_Context(ctx->subCtx,binned,lossy->sub);
+          free(binned);
         }
     }
 
-  //  Build a Huffman scheme for each stream entity from the histograms
+  //  Build a Huffman, rANS, or context scheme for each stream entity from the histograms.
+  //    Context models (given by ctxt) are only used for streams that are not run-length coded.
 
-#define SCHEME_MACRO(meme,hist,label,bits)	\
-  scheme = Huffman( (hist), NULL);		\
-  if (scheme == NULL)				\
-    goto error;					\
-  if (scheme->type)				\
-    { (meme) = Huffman( (hist), scheme);	\
-      free(scheme);				\
+#define SCHEME_MACRO(meme,hist,ctxt,label,bits)	\
+  if (codec == QV_CONTEXT && (ctxt) != NULL)	\
+    { (meme) = Context_Scheme(hist,ctxt);	\
+      if ((meme) == NULL)			\
+        goto error;				\
+    }						\
+  else if (codec != QV_HUFFMAN)			\
+    { (meme) = Rans_Scheme(hist);		\
+      if ((meme) == NULL)			\
+        goto error;				\
     }						\
   else						\
-    (meme) = scheme;
+    { scheme = Huffman( (hist), NULL);		\
+      if (scheme == NULL)			\
+        goto error;				\
+      if (scheme->type)				\
+        { (meme) = Huffman( (hist), scheme);	\
+          free(scheme);				\
+        }					\
+      else					\
+        (meme) = scheme;			\
+    }
 
 #ifdef DEBUG
 
-#define MAKE_SCHEME(meme,hist,label,bits)	\
-  SCHEME_MACRO(meme,hist,label,bits)		\
+#define MAKE_SCHEME(meme,hist,ctxt,label,bits)	\
+  SCHEME_MACRO(meme,hist,ctxt,label,bits)	\
   printf("\n%s\n", (label) );			\
   Print_Histogram( (hist));			\
-  Print_Table( (meme), (hist), (bits));	
+  if (codec == QV_HUFFMAN)			\
+    Print_Table( (meme), (hist), (bits));
 
 #else
 
-#define MAKE_SCHEME(meme,hist,label,bits)	\
-  SCHEME_MACRO(meme,hist,label,bits)
+#define MAKE_SCHEME(meme,hist,ctxt,label,bits)	\
+  SCHEME_MACRO(meme,hist,ctxt,label,bits)
 
 #endif
 
   { HScheme *scheme;
 
     if (delChar < 0)
-      { MAKE_SCHEME(delScheme,delHist, "Hisotgram of Deletion QVs", 8);
+      { MAKE_SCHEME(delScheme,delHist,ctx->delCtx, "Hisotgram of Deletion QVs", 8);
         dRunScheme = NULL;
       }
     else
       { delHist[delChar] = 0;
-        MAKE_SCHEME(delScheme,delHist, "Hisotgram of Deletion QVs less run char", 8);
-        MAKE_SCHEME(dRunScheme,delRun, "Histogram of Deletion Runs QVs", 16);
+        MAKE_SCHEME(delScheme,delHist,NULL, "Hisotgram of Deletion QVs less run char", 8);
+        MAKE_SCHEME(dRunScheme,ctx->delRun,NULL, "Histogram of Deletion Runs QVs", 16);
 #ifdef DEBUG
         printf("\nRun char is '%c'\n",delChar);
 #endif
@@ -1118,41 +2356,45 @@ QVcoding *Create_QVcoding(int lossy)
     }
 #endif
 
-    MAKE_SCHEME(insScheme,insHist, "Hisotgram of Insertion QVs", 8);
-    MAKE_SCHEME(mrgScheme,mrgHist, "Hisotgram of Merge QVs", 8);
+    MAKE_SCHEME(insScheme,insHist,ctx->insCtx, "Hisotgram of Insertion QVs", 8);
+    MAKE_SCHEME(mrgScheme,mrgHist,ctx->mrgCtx, "Hisotgram of Merge QVs", 8);
 
     if (subChar < 0)
-      { MAKE_SCHEME(subScheme,subHist, "Hisotgram of Subsitution QVs", 8);
+      { MAKE_SCHEME(subScheme,subHist,ctx->subCtx, "Hisotgram of Subsitution QVs", 8);
         sRunScheme = NULL;
       }
     else
       { subHist[subChar] = 0;
-        MAKE_SCHEME(subScheme,subHist, "Hisotgram of Subsitution QVs less run char", 8);
-        MAKE_SCHEME(sRunScheme,subRun, "Histogram of Substitution Run QVs", 16);
+        MAKE_SCHEME(subScheme,subHist,NULL, "Hisotgram of Subsitution QVs less run char", 8);
+        MAKE_SCHEME(sRunScheme,ctx->subRun,NULL, "Histogram of Substitution Run QVs", 16);
 #ifdef DEBUG
         printf("\nRun char is '%c'\n",subChar);
 #endif
       }
   }
 
-  //  Setup endian handling
-
-  Set_Endian(0);
-
-  coding.delScheme  = delScheme;
-  coding.insScheme  = insScheme;
-  coding.mrgScheme  = mrgScheme;
-  coding.subScheme  = subScheme;
-  coding.dRunScheme = dRunScheme;
-  coding.sRunScheme = sRunScheme;
-  coding.delChar    = delChar;
-  coding.subChar    = subChar;
-  coding.prefix     = NULL;
-  coding.flip       = 0;
+  coding = (QVcoding *) Malloc(sizeof(QVcoding),"Allocating QV coding");
+  if (coding == NULL)
+    goto error;
 
-  return (&coding);
+  coding->delScheme  = delScheme;
+  coding->insScheme  = insScheme;
+  coding->mrgScheme  = mrgScheme;
+  coding->subScheme  = subScheme;
+  coding->dRunScheme = dRunScheme;
+  coding->sRunScheme = sRunScheme;
+  coding->delChar    = delChar;
+  coding->subChar    = subChar;
+  coding->prefix     = NULL;
+  coding->flip       = 0;
+  coding->codec      = codec;
+  coding->block      = 0;
+  coding->lossy      = bins;
+
+  return (coding);
 
 error:
+  free(bins);
   if (delScheme != NULL)
     free(delScheme);
   if (dRunScheme != NULL)
@@ -1168,154 +2410,223 @@ error:
   EXIT(NULL);
 }
 
+  //  The first short of a coding identifies its codec, and whether it was written on a machine
+  //    of the opposite endian (in which case it reads byte-reversed)
+
+#define HUFFMAN_KEY  0x33cc
+#define RANS_KEY     0x3ca5
+#define CONTEXT_KEY  0x3c5a
+#define BLOCK_KEY    0x3cc3   //  Precedes the key of a blocked coding, followed by the block size
+
   // Write the encoding scheme 'coding' to 'output'
 
-void Write_QVcoding(FILE *output, QVcoding *coding)
+int Write_QVcoding(QVbuffer *output, QVcoding *coding)
 {
-  //   Write out the endian key, run chars, and prefix (if not NULL)
+  //   Write out the endian/codec key, run chars, and prefix (if not NULL)
 
   { uint16 half;
     int    len;
 
-    half = 0x33cc;
-    fwrite(&half,sizeof(uint16),1,output);
+    if (coding->block > 0)
+      { half = BLOCK_KEY;
+        if (Write_Bytes(output,&half,sizeof(uint16)) ||
+            Write_Bytes(output,&(coding->block),sizeof(int)))
+          EXIT(1);
+      }
+
+    if (coding->codec == QV_CONTEXT)
+      half = CONTEXT_KEY;
+    else if (coding->codec == QV_RANS)
+      half = RANS_KEY;
+    else
+      half = HUFFMAN_KEY;
+    if (Write_Bytes(output,&half,sizeof(uint16)))
+      EXIT(1);
 
     if (coding->delChar < 0)
       half = 256;
     else
       half = (uint16) (coding->delChar);
-    fwrite(&half,sizeof(uint16),1,output);
+    if (Write_Bytes(output,&half,sizeof(uint16)))
+      EXIT(1);
 
     if (coding->subChar < 0)
       half = 256;
     else
       half = (uint16) (coding->subChar);
-    fwrite(&half,sizeof(uint16),1,output);
+    if (Write_Bytes(output,&half,sizeof(uint16)))
+      EXIT(1);
 
     len = strlen(coding->prefix);
-    fwrite(&len,sizeof(int),1,output);
-    fwrite(coding->prefix,1,len,output);
+    if (Write_Bytes(output,&len,sizeof(int)) || Write_Bytes(output,coding->prefix,len))
+      EXIT(1);
   }
 
   //   Write out the scheme tables
 
-  Write_Scheme(coding->delScheme,output);
+#define WRITE_SCHEME(scheme,context)					\
+  if (coding->codec == QV_CONTEXT && (context))				\
+    { if (Write_Context_Scheme(scheme,output))				\
+        EXIT(1);							\
+    }									\
+  else if (coding->codec != QV_HUFFMAN)					\
+    { if (Write_Rans_Scheme(scheme,output))				\
+        EXIT(1);							\
+    }									\
+  else									\
+    { if (Write_Scheme(scheme,output))					\
+        EXIT(1);							\
+    }
+
+  WRITE_SCHEME(coding->delScheme,coding->delChar < 0)
   if (coding->delChar >= 0)
-    Write_Scheme(coding->dRunScheme,output);
-  Write_Scheme(coding->insScheme,output);
-  Write_Scheme(coding->mrgScheme,output);
-  Write_Scheme(coding->subScheme,output);
+    { WRITE_SCHEME(coding->dRunScheme,0) }
+  WRITE_SCHEME(coding->insScheme,1)
+  WRITE_SCHEME(coding->mrgScheme,1)
+  WRITE_SCHEME(coding->subScheme,coding->subChar < 0)
   if (coding->subChar >= 0)
-    Write_Scheme(coding->sRunScheme,output);
+    { WRITE_SCHEME(coding->sRunScheme,0) }
+  return (0);
 }
 
   // Read the encoding scheme 'coding' to 'output'
 
-QVcoding *Read_QVcoding(FILE *input)
-{ static QVcoding coding;
+QVcoding *Read_QVcoding(QVbuffer *input)
+{ QVcoding *coding;
+
+  coding = (QVcoding *) Malloc(sizeof(QVcoding),"Allocating QV coding");
+  if (coding == NULL)
+    EXIT(NULL);
+  coding->prefix     = NULL;
+  coding->delScheme  = NULL;
+  coding->dRunScheme = NULL;
+  coding->insScheme  = NULL;
+  coding->mrgScheme  = NULL;
+  coding->subScheme  = NULL;
+  coding->sRunScheme = NULL;
+  coding->lossy      = NULL;
 
   // Read endian key, run chars, and short name common to all headers
 
   { uint16 half;
     int    len;
 
-    if (fread(&half,sizeof(uint16),1,input) != 1)
+    if (Read_Bytes(input,&half,sizeof(uint16)))
       { EPRINTF(EPLACE,"Could not read flip byte (Read_QVcoding)\n");
-        EXIT(NULL);
+        goto error;
+      }
+    coding->block = 0;
+    if (half == BLOCK_KEY || half == ((BLOCK_KEY & 0xff) << 8 | BLOCK_KEY >> 8))
+      { if (Read_Bytes(input,&(coding->block),sizeof(int)) ||
+            Read_Bytes(input,&half,sizeof(uint16)))
+          { EPRINTF(EPLACE,"Could not read block size (Read_QVcoding)\n");
+            goto error;
+          }
+        if (half != HUFFMAN_KEY && half != RANS_KEY && half != CONTEXT_KEY)
+          Flip_Long(&(coding->block));
+        if (coding->block <= 0)
+          { EPRINTF(EPLACE,"Block size %d is not positive (Read_QVcoding)\n",coding->block);
+            goto error;
+          }
+      }
+    coding->flip  = (half != HUFFMAN_KEY && half != RANS_KEY && half != CONTEXT_KEY);
+    if (coding->flip)
+      Flip_Short(&half);
+    if (half == HUFFMAN_KEY)
+      coding->codec = QV_HUFFMAN;
+    else if (half == RANS_KEY)
+      coding->codec = QV_RANS;
+    else if (half == CONTEXT_KEY)
+      coding->codec = QV_CONTEXT;
+    else
+      { EPRINTF(EPLACE,"Unrecognized QV coding key %04x (Read_QVcoding)\n",half);
+        goto error;
       }
-    coding.flip = (half != 0x33cc);
 
-    if (fread(&half,sizeof(uint16),1,input) != 1)
+    if (Read_Bytes(input,&half,sizeof(uint16)))
       { EPRINTF(EPLACE,"Could not read deletion char (Read_QVcoding)\n");
-        EXIT(NULL);
+        goto error;
       }
-    if (coding.flip)
+    if (coding->flip)
       Flip_Short(&half);
-    coding.delChar = half;
-    if (coding.delChar >= 256)
-      coding.delChar = -1;
+    coding->delChar = half;
+    if (coding->delChar >= 256)
+      coding->delChar = -1;
 
-    if (fread(&half,sizeof(uint16),1,input) != 1)
+    if (Read_Bytes(input,&half,sizeof(uint16)))
       { EPRINTF(EPLACE,"Could not read substitution char (Read_QVcoding)\n");
-        EXIT(NULL);
+        goto error;
       }
-    if (coding.flip)
+    if (coding->flip)
       Flip_Short(&half);
-    coding.subChar = half;
-    if (coding.subChar >= 256)
-      coding.subChar = -1;
+    coding->subChar = half;
+    if (coding->subChar >= 256)
+      coding->subChar = -1;
 
     //  Read the short name common to all headers
 
-    if (fread(&len,sizeof(int),1,input) != 1)
+    if (Read_Bytes(input,&len,sizeof(int)))
       { EPRINTF(EPLACE,"Could not read header name length (Read_QVcoding)\n");
-        EXIT(NULL);
+        goto error;
       }
-    if (coding.flip)
+    if (coding->flip)
       Flip_Long(&len);
-    coding.prefix = (char *) Malloc(len+1,"Allocating header prefix");
-    if (coding.prefix == NULL)
-      EXIT(NULL);
+    coding->prefix = (char *) Malloc(len+1,"Allocating header prefix");
+    if (coding->prefix == NULL)
+      goto error;
     if (len > 0)
-      { if (fread(coding.prefix,len,1,input) != 1)
+      { if (Read_Bytes(input,coding->prefix,len))
           { EPRINTF(EPLACE,"Could not read header name (Read_QVcoding)\n");
-            EXIT(NULL);
+            goto error;
           }
       }
-    coding.prefix[len] = '\0';
+    coding->prefix[len] = '\0';
   }
 
-  //  Setup endian handling
+  //  Read the Huffman, rANS, or context schemes used to compress the data
 
-  Set_Endian(coding.flip);
-
-  //  Read the Huffman schemes used to compress the data
-
-  coding.delScheme  = NULL;
-  coding.dRunScheme = NULL;
-  coding.insScheme  = NULL;
-  coding.mrgScheme  = NULL;
-  coding.subScheme  = NULL;
-  coding.sRunScheme = NULL;
-
-  coding.delScheme = Read_Scheme(input);
-  if (coding.delScheme == NULL)
+#define READ_SCHEME(scheme,context)					\
+  if (coding->codec == QV_CONTEXT && (context))				\
+    scheme = Read_Context_Scheme(input,coding->flip);			\
+  else if (coding->codec != QV_HUFFMAN)					\
+    scheme = Read_Rans_Scheme(input,coding->flip);			\
+  else									\
+    scheme = Read_Scheme(input,coding->flip);				\
+  if (scheme == NULL)							\
     goto error;
-  if (coding.delChar >= 0)
-    { coding.dRunScheme = Read_Scheme(input);
-      if (coding.dRunScheme == NULL)
-        goto error;
+
+  READ_SCHEME(coding->delScheme,coding->delChar < 0)
+  if (coding->delChar >= 0)
+    { READ_SCHEME(coding->dRunScheme,0)
+      if (coding->codec == QV_HUFFMAN)
+        Build_Pairs(coding->dRunScheme,coding->delScheme);
     }
-  coding.insScheme = Read_Scheme(input);
-  if (coding.insScheme == NULL)
-    goto error;
-  coding.mrgScheme = Read_Scheme(input);
-  if (coding.mrgScheme == NULL)
-    goto error;
-  coding.subScheme = Read_Scheme(input);
-  if (coding.subScheme == NULL)
-    goto error;
-  if (coding.subChar >= 0)
-    { coding.sRunScheme = Read_Scheme(input);
-      if (coding.sRunScheme == NULL)
-        goto error;
+  READ_SCHEME(coding->insScheme,1)
+  READ_SCHEME(coding->mrgScheme,1)
+  READ_SCHEME(coding->subScheme,coding->subChar < 0)
+  if (coding->subChar >= 0)
+    { READ_SCHEME(coding->sRunScheme,0)
+      if (coding->codec == QV_HUFFMAN)
+        Build_Pairs(coding->sRunScheme,coding->subScheme);
     }
 
-  return (&coding);
+  return (coding);
 
 error:
-  if (coding.delScheme != NULL)
-    free(coding.delScheme);
-  if (coding.dRunScheme != NULL)
-    free(coding.dRunScheme);
-  if (coding.insScheme != NULL)
-    free(coding.insScheme);
-  if (coding.mrgScheme != NULL)
-    free(coding.mrgScheme);
-  if (coding.subScheme != NULL)
-    free(coding.subScheme);
-  if (coding.sRunScheme != NULL)
-    free(coding.sRunScheme);
+  if (coding->delScheme != NULL)
+    free(coding->delScheme);
+  if (coding->dRunScheme != NULL)
+    free(coding->dRunScheme);
+  if (coding->insScheme != NULL)
+    free(coding->insScheme);
+  if (coding->mrgScheme != NULL)
+    free(coding->mrgScheme);
+  if (coding->subScheme != NULL)
+    free(coding->subScheme);
+  if (coding->sRunScheme != NULL)
+    free(coding->sRunScheme);
+  free(coding->prefix);
+  free(coding);
   EXIT(NULL);
 }
 
@@ -1331,6 +2642,7 @@ void Free_QVcoding(QVcoding *coding)
     free(coding->dRunScheme);
   free(coding->delScheme);
   free(coding->prefix);
+  free(coding->lossy);
 }
 
 
@@ -1340,142 +2652,315 @@ void Free_QVcoding(QVcoding *coding)
  *
  ********************************************************************************************/
 
-void Compress_Next_QVentry1(int rlen, char *del, char *tag, char *ins, char *mrg, char *sub,
-                            FILE *output, QVcoding *coding, int lossy)
+  //  Code a stream with scheme, or a run-length stream with schemes neme and reme, according
+  //    to the codec of coding.  Run-length streams of a context coding use plain rANS.
+
+static int Encode_Stream(QVcoding *coding, void *scheme, QVbuffer *out, char *read, int rlen)
+{ if (coding->codec == QV_CONTEXT)
+    return (Encode_Context(scheme,out,(uint8 *) read,rlen));
+  else if (coding->codec == QV_RANS)
+    return (Encode_Rans(scheme,out,(uint8 *) read,rlen));
+  else
+    return (Encode(scheme,out,(uint8 *) read,rlen));
+}
+
+static int Encode_Run_Stream(QVcoding *coding, void *neme, void *reme, QVbuffer *out,
+                             char *read, int rlen, int rchar)
+{ if (coding->codec != QV_HUFFMAN)
+    return (Encode_Rans_Run(neme,reme,out,(uint8 *) read,rlen,rchar));
+  else
+    return (Encode_Run(neme,reme,out,(uint8 *) read,rlen,rchar));
+}
+
+static int Decode_Stream(QVcoding *coding, void *scheme, QVbuffer *in, char *read, int rlen)
+{ if (coding->codec == QV_CONTEXT)
+    return (Decode_Context(scheme,in,read,rlen));
+  else if (coding->codec == QV_RANS)
+    return (Decode_Rans(scheme,in,read,rlen));
+  else
+    return (Decode(scheme,coding->flip,in,read,rlen));
+}
+
+static int Decode_Run_Stream(QVcoding *coding, void *neme, void *reme, QVbuffer *in,
+                             char *read, int rlen, int rchar)
+{ if (coding->codec != QV_HUFFMAN)
+    return (Decode_Rans_Run(neme,reme,in,read,rlen,rchar));
+  else
+    return (Decode_Run(neme,reme,coding->flip,in,read,rlen,rchar));
+}
+
+  //  Compress the 5 streams of a read or of a block of a read
+
+static int Compress_Block(int rlen, char *del, char *tag, char *ins, char *mrg, char *sub,
+                          QVbuffer *output, QVcoding *coding, int lossy)
 { int clen;
 
   if (coding->delChar < 0)
-    { Encode(coding->delScheme, output, (uint8 *) del, rlen);
+    { if (Encode_Stream(coding, coding->delScheme, output, del, rlen))
+        EXIT(1);
       clen = rlen;
     }
   else
-    { Encode_Run(coding->delScheme, coding->dRunScheme, output,
-                 (uint8 *) del, rlen, coding->delChar);
+    { if (Encode_Run_Stream(coding, coding->delScheme, coding->dRunScheme, output,
+                            del, rlen, coding->delChar))
+        EXIT(1);
       clen = Pack_Tag(tag,del,rlen,coding->delChar);
     }
   Number_Read(tag);
   Compress_Read(clen,tag);
-  fwrite(tag,1,COMPRESSED_LEN(clen),output);
+  if (Write_Bytes(output,tag,COMPRESSED_LEN(clen)))
+    EXIT(1);
 
-  if (lossy)
+  if (lossy && coding->lossy != NULL)
     { uint8 *insert = (uint8 *) ins;
       uint8 *merge  = (uint8 *) mrg;
+      uint8 *subst  = (uint8 *) sub;
+      uint8 *ibin   = coding->lossy->ins;
+      uint8 *mbin   = coding->lossy->mrg;
+      uint8 *sbin   = coding->lossy->sub;
       int    k;
 
       for (k = 0; k < rlen; k++)
-        { insert[k] = (uint8) ((insert[k] >> 1) << 1);
-          merge[k]  = (uint8) (( merge[k] >> 2) << 2);
+        { insert[k] = ibin[insert[k]];
+          merge[k]  = mbin[merge[k]];
+          subst[k]  = sbin[subst[k]];
         }
     }
 
-  Encode(coding->insScheme, output, (uint8 *) ins, rlen);
-  Encode(coding->mrgScheme, output, (uint8 *) mrg, rlen);
+  if (Encode_Stream(coding, coding->insScheme, output, ins, rlen))
+    EXIT(1);
+  if (Encode_Stream(coding, coding->mrgScheme, output, mrg, rlen))
+    EXIT(1);
   if (coding->subChar < 0)
-    Encode(coding->subScheme, output, (uint8 *) sub, rlen);
+    { if (Encode_Stream(coding, coding->subScheme, output, sub, rlen))
+        EXIT(1);
+    }
   else
-    Encode_Run(coding->subScheme, coding->sRunScheme, output,
-               (uint8 *) sub, rlen, coding->subChar);
-  return;
+    { if (Encode_Run_Stream(coding, coding->subScheme, coding->sRunScheme, output,
+                            sub, rlen, coding->subChar))
+        EXIT(1);
+    }
+  return (0);
 }
 
-int Compress_Next_QVentry(FILE *input, FILE *output, QVcoding *coding, int lossy)
-{ int rlen, clen;
+  //  If coding->block > 0 then a read longer than coding->block is compressed as a sequence
+  //    of independent blocks of coding->block symbols, preceded by an index of the uint32
+  //    offsets, relative to the start of the read, of all but the first block.  Decoding
+  //    can thus start at any block.
+
+int Compress_Next_QVentry1(int rlen, char *del, char *tag, char *ins, char *mrg, char *sub,
+                           QVbuffer *output, QVcoding *coding, int lossy)
+{ int64  ipos, bound;
+  uint32 boff;
+  char   save[4];
+  int    block, nblk, b, e, len;
+
+  block = coding->block;
+  if (block <= 0 || rlen <= block)
+    return (Compress_Block(rlen,del,tag,ins,mrg,sub,output,coding,lossy));
+
+  //  Reserve room for the entire read so the buffer is not flushed before the index is set
+
+  nblk  = (rlen-1)/block + 1;
+  bound = sizeof(uint32)*(nblk-1);
+  for (b = 0; b < rlen; b += block)
+    { len = rlen-b;
+      if (len > block)
+        len = block;
+      bound += 5*MAX_CODED(len);
+    }
+  if (Reserve(output,bound))
+    EXIT(1);
+  ipos = output->ptr;
+  output->ptr += sizeof(uint32)*(nblk-1);
 
-  //  Get all 5 streams, compress each with its scheme, and output
+  //  The tags of a block are compressed in place and terminated, so the 4 symbols following
+  //    a block are saved and restored about its compression (for the last block these are
+  //    the terminator and slack the caller provides).
 
-  rlen = Read_Lines(input,5);
-  if (rlen < 0)
-    { if (rlen == -1)
-        EPRINTF(EPLACE,"Line %d: incomplete last entry of .quiv file\n",Nline);
-      EXIT (-1);
+  for (b = 0; b < rlen; b += block)
+    { if (b > 0)
+        { boff = (uint32) (output->ptr - ipos);
+          memcpy(output->data + ipos + sizeof(uint32)*(b/block-1),&boff,sizeof(uint32));
+        }
+      len = rlen-b;
+      if (len > block)
+        len = block;
+      e = b+len;
+      memcpy(save,tag+e,4);
+      tag[e] = '\0';
+      if (Compress_Block(len,del+b,tag+b,ins+b,mrg+b,sub+b,output,coding,lossy))
+        EXIT(1);
+      memcpy(tag+e,save,4);
     }
+  return (0);
+}
 
-  if (coding->delChar < 0)
-    { Encode(coding->delScheme, output, (uint8 *) Read, rlen);
-      clen = rlen;
-    }
-  else
-    { Encode_Run(coding->delScheme, coding->dRunScheme, output,
-                 (uint8 *) Read, rlen, coding->delChar);
-      clen = Pack_Tag(Read+Rmax,Read,rlen,coding->delChar);
-    }
-  Number_Read(Read+Rmax);
-  Compress_Read(clen,Read+Rmax);
-  fwrite(Read+Rmax,1,COMPRESSED_LEN(clen),output);
+int Compress_Next_QVentry(QVcontext *ctx, FILE *input, QVbuffer *output, QVcoding *coding,
+                          int lossy)
+{ char *read;
+  int   rlen, rmax;
 
-  if (lossy)
-    { uint8 *insert = (uint8 *) (Read+2*Rmax);
-      uint8 *merge  = (uint8 *) (Read+3*Rmax);
-      int    k;
+  //  Get all 5 streams, compress each with its scheme, and output
 
-      for (k = 0; k < rlen; k++)
-        { insert[k] = (uint8) ((insert[k] >> 1) << 1);
-          merge[k]  = (uint8) (( merge[k] >> 2) << 2);
-        }
+  rlen = Read_Lines(ctx,input,5);
+  if (rlen < 0)
+    { if (rlen == -1)
+        EPRINTF(EPLACE,"Line %d: incomplete last entry of .quiv file\n",ctx->nline);
+      EXIT (-1);
     }
 
-  Encode(coding->insScheme, output, (uint8 *) (Read+2*Rmax), rlen);
-  Encode(coding->mrgScheme, output, (uint8 *) (Read+3*Rmax), rlen);
-  if (coding->subChar < 0)
-    Encode(coding->subScheme, output, (uint8 *) (Read+4*Rmax), rlen);
-  else
-    Encode_Run(coding->subScheme, coding->sRunScheme, output,
-               (uint8 *) (Read+4*Rmax), rlen, coding->subChar);
+  read = ctx->read;
+  rmax = ctx->rmax;
+  if (Compress_Next_QVentry1(rlen,read,read+rmax,read+2*rmax,read+3*rmax,read+4*rmax,
+                             output,coding,lossy))
+    EXIT (-1);
 
   return (rlen);
 }
 
-int Uncompress_Next_QVentry(FILE *input, char **entry, QVcoding *coding, int rlen)
-{ int clen, tlen;
+  //  Uncompress the 5 streams of a read or of a block of a read.  Uncompressing the tags
+  //    overwrites up to 4 symbols past them, which for a block may already hold symbols decoded
+  //    for an earlier block, so if guard is set these are restored once the tags are in place
+  //    (the caller must in any case provide these 4 bytes).
+
+static int Uncompress_Block(QVbuffer *input, char **entry, QVcoding *coding, int rlen, int guard)
+{ int  clen, tlen;
+  char save[4];
 
   //  Decode each stream and write to output
 
   if (coding->delChar < 0)
-    { if (Decode(coding->delScheme, input, entry[0], rlen))
+    { if (Decode_Stream(coding, coding->delScheme, input, entry[0], rlen))
         EXIT(1);
       clen = rlen;
       tlen = COMPRESSED_LEN(clen);
       if (tlen > 0)
-        { if (fread(entry[1],tlen,1,input) != 1)
+        { if (Read_Bytes(input,entry[1],tlen))
             { EPRINTF(EPLACE,"Could not read deletions entry (Uncompress_Next_QVentry\n");
               EXIT(1);
             }
         }
+      memcpy(save,entry[1]+rlen,4);
       Uncompress_Read(clen,entry[1]);
       Lower_Read(entry[1]);
+      if (guard)
+        memcpy(entry[1]+rlen,save,4);
     }
   else
-    { if (Decode_Run(coding->delScheme, coding->dRunScheme, input,
-                     entry[0], rlen, coding->delChar))
+    { if (Decode_Run_Stream(coding, coding->delScheme, coding->dRunScheme, input,
+                            entry[0], rlen, coding->delChar))
         EXIT(1);
       clen = Packed_Length(entry[0],rlen,coding->delChar);
       tlen = COMPRESSED_LEN(clen);
       if (tlen > 0)
-        { if (fread(entry[1],tlen,1,input) != 1)
+        { if (Read_Bytes(input,entry[1],tlen))
             { EPRINTF(EPLACE,"Could not read deletions entry (Uncompress_Next_QVentry\n");
               EXIT(1);
             }
         }
+      memcpy(save,entry[1]+rlen,4);
       Uncompress_Read(clen,entry[1]);
       Lower_Read(entry[1]);
       Unpack_Tag(entry[1],clen,entry[0],rlen,coding->delChar);
+      if (guard)
+        memcpy(entry[1]+rlen,save,4);
     }
 
-  if (Decode(coding->insScheme, input, entry[2], rlen))
+  if (Decode_Stream(coding, coding->insScheme, input, entry[2], rlen))
     EXIT(1);
 
-  if (Decode(coding->mrgScheme, input, entry[3], rlen))
+  if (Decode_Stream(coding, coding->mrgScheme, input, entry[3], rlen))
     EXIT(1);
 
   if (coding->subChar < 0)
-    { if (Decode(coding->subScheme, input, entry[4], rlen))
+    { if (Decode_Stream(coding, coding->subScheme, input, entry[4], rlen))
+        EXIT(1);
+    }
+  else
+    { if (Decode_Run_Stream(coding, coding->subScheme, coding->sRunScheme, input,
+                            entry[4], rlen, coding->subChar))
+        EXIT(1);
+    }
+
+  return (0);
+}
+
+  //  Uncompress blocks fblk to lblk of a blocked read of length rlen into entry, where input is
+  //    positioned at the start of the read
+
+static int Uncompress_Blocks(QVbuffer *input, char **entry, QVcoding *coding, int rlen,
+                             int fblk, int lblk)
+{ int64  rpos;
+  uint32 boff;
+  char  *e[5];
+  int    block, nblk;
+  int    b, j, len;
+
+  block = coding->block;
+  nblk  = (rlen-1)/block + 1;
+  rpos  = Tell_QVbuffer(input);
+
+  if (fblk == 0)
+    boff = sizeof(uint32)*(nblk-1);
+  else
+    { if (Seek_QVbuffer(input,rpos + sizeof(uint32)*(fblk-1)))
+        EXIT(1);
+      if (Read_Bytes(input,&boff,sizeof(uint32)))
+        { EPRINTF(EPLACE,"Could not read block index (Uncompress_Blocks)\n");
+          EXIT(1);
+        }
+      if (coding->flip)
+        Flip_Long(&boff);
+    }
+  if (Seek_QVbuffer(input,rpos + boff))
+    EXIT(1);
+
+  for (b = fblk; b <= lblk; b++)
+    { for (j = 0; j < 5; j++)
+        e[j] = entry[j] + (b-fblk)*block;
+      len = rlen - b*block;
+      if (len > block)
+        len = block;
+      if (Uncompress_Block(input,e,coding,len,1))
+        EXIT(1);
+    }
+  return (0);
+}
+
+int Uncompress_Next_QVentry(QVbuffer *input, char **entry, QVcoding *coding, int rlen)
+{ if (coding->block <= 0 || rlen <= coding->block)
+    return (Uncompress_Block(input,entry,coding,rlen,0));
+  else
+    return (Uncompress_Blocks(input,entry,coding,rlen,0,(rlen-1)/coding->block));
+}
+
+int Uncompress_QVsubentry(QVbuffer *input, char **entry, QVcoding *coding, int rlen,
+                          int beg, int end)
+{ int j, fblk, shift;
+
+  if (beg < 0 || end > rlen || beg > end)
+    { EPRINTF(EPLACE,"Interval [%d,%d] is not within [0,%d] (Uncompress_QVsubentry)\n",
+                     beg,end,rlen);
+      EXIT(1);
+    }
+  if (beg == end)
+    return (0);
+
+  if (coding->block <= 0 || rlen <= coding->block)
+    { if (Uncompress_Block(input,entry,coding,rlen,0))
         EXIT(1);
+      shift = beg;
     }
   else
-    { if (Decode_Run(coding->subScheme, coding->sRunScheme, input,
-                     entry[4], rlen, coding->subChar))
+    { fblk = beg/coding->block;
+      if (Uncompress_Blocks(input,entry,coding,rlen,fblk,(end-1)/coding->block))
         EXIT(1);
+      shift = beg - fblk*coding->block;
     }
 
+  if (shift > 0)
+    for (j = 0; j < 5; j++)
+      memmove(entry[j],entry[j]+shift,end-beg);
   return (0);
 }
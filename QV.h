@@ -26,66 +26,164 @@
   //  Below when an error return is described, one should understand that this value is returned
   //    only if the routine was compiled in INTERACTIVE mode.
 
-  //  A PacBio compression scheme
+  //  A lossy binning of the insertion, merge, and substitution QVs: each QV q of a stream is
+  //    replaced by ins[q], mrg[q], or sub[q] respectively before it is coded, so fewer distinct
+  //    values are coded in fewer bits.  The deletion QVs determine which deletion tags are kept,
+  //    and so are never binned.  QV_BIN_DEXQV is the original "-l" scaling of dexqv that halves
+  //    the resolution of insertion QVs and quarters that of merge QVs, and QV_BIN_ILLUMINA bins
+  //    all three streams into the 8 levels Illumina uses, i.e. 0 and 1 are kept, 2-9 -> 6,
+  //    10-19 -> 15, 20-24 -> 22, 25-29 -> 27, 30-34 -> 33, 35-39 -> 37, and 40+ -> 40.
 
 typedef struct
-  { void    *delScheme;   //  Huffman scheme for deletion QVs
-    void    *insScheme;   //  Huffman scheme for insertion QVs
-    void    *mrgScheme;   //  Huffman scheme for merge QVs
-    void    *subScheme;   //  Huffman scheme for substitution QVs
-    void    *dRunScheme;  //  Huffman scheme for deletion run lengths (if delChar > 0)
-    void    *sRunScheme;  //  Huffman scheme for substitution run lengths (if subChar > 0)
+  { unsigned char ins[256];
+    unsigned char mrg[256];
+    unsigned char sub[256];
+  } QVbinning;
+
+#define QV_BIN_DEXQV    1
+#define QV_BIN_ILLUMINA 2
+
+  //  A PacBio compression scheme.  The streams are entropy coded with either Huffman codes
+  //    or rANS (range asymmetric numeral systems) coders, as given by codec.  rANS codes
+  //    each symbol in a fractional number of bits and so compresses the skewed QV streams
+  //    better, while Huffman decoding is somewhat faster.  QV_CONTEXT further codes each
+  //    QV of a stream that is not run-length coded with a model for the QV preceding it.
+
+#define QV_HUFFMAN 0
+#define QV_RANS    1
+#define QV_CONTEXT 2
+
+typedef struct
+  { void    *delScheme;   //  Scheme for deletion QVs
+    void    *insScheme;   //  Scheme for insertion QVs
+    void    *mrgScheme;   //  Scheme for merge QVs
+    void    *subScheme;   //  Scheme for substitution QVs
+    void    *dRunScheme;  //  Scheme for deletion run lengths (if delChar > 0)
+    void    *sRunScheme;  //  Scheme for substitution run lengths (if subChar > 0)
     int      delChar;     //  If > 0, run-encoded deletion value
     int      subChar;     //  If > 0, run-encoded substitution value
     int      flip;        //  Need to flip multi-byte integers
+    int      codec;       //  QV_HUFFMAN, QV_RANS, or QV_CONTEXT
+    int      block;       //  If > 0, longer reads are coded in independent blocks of this size
     char    *prefix;      //  Header line prefix
+    QVbinning *lossy;     //  Binning applied when compressing (NULL if none, not written)
   } QVcoding;
 
-  // Read the next nlines of input, and QVentry returns a pointer to the first line if needed.
-  //   If end-of-input is encountered before any further input, -1 is returned.  If there is
-  //   an error than -2 is returned.  Otherwise the length of the line(s) read is returned.
+  //  Compressed QV data is read and written through a QVbuffer.  If file is not NULL then the
+  //    buffer is a window on it that is refilled from the file when reading and flushed to it
+  //    when writing, otherwise the buffer is simply a block of memory that grows as needed
+  //    when writing, or holds the data data[0..end-1] when reading.
+
+typedef struct
+  { FILE          *file;  //  Underlying file or NULL if in memory
+    unsigned char *data;  //  Buffer of size bytes (followed by 8 bytes of zero padding)
+    long long      size;
+    long long      ptr;   //  Position of the next byte to read or write in data
+    long long      end;   //  End of the valid data in data (when reading)
+    long long      off;   //  Offset in file of data[0]
+  } QVbuffer;
+
+  //  Allocate a buffer for file (positioned at its current offset), or an empty in-memory
+  //    buffer if file is NULL.  Freeing a buffer does not flush it or close its file.
+
+QVbuffer *New_QVbuffer(FILE *file);
+void      Free_QVbuffer(QVbuffer *buf);
+
+  //  Write any pending output of buf to its file.  A non-zero value is returned on error.
+
+int       Flush_QVbuffer(QVbuffer *buf);
 
-int       Read_Lines(FILE *input, int nlines);
-char     *QVentry();
+  //  Write the data written so far to the in-memory buffer src to buf, and empty src for
+  //    reuse.  A non-zero value is returned on error.
+
+int       Append_QVbuffer(QVbuffer *buf, QVbuffer *src);
+
+  //  Return the file offset of the read/write pointer of buf, or reposition it for reading
+  //    at offset pos (which need not access the file if pos is within the buffered data).
+
+long long Tell_QVbuffer(QVbuffer *buf);
+int       Seek_QVbuffer(QVbuffer *buf, long long pos);
+
+  //  The line buffer, line counter, and statistics of a scan and compression of .quiva entries
+  //    are kept in a QVcontext, so that different threads may scan and compress concurrently
+  //    provided each uses its own context.  The library otherwise has no global state.
+
+typedef struct QVcontext QVcontext;
+
+QVcontext *New_QVcontext();
+void       Free_QVcontext(QVcontext *ctx);
+
+  // Read the next nlines of input, and QVentry returns a pointer to the first line if needed,
+  //   and QVline a pointer to the j'th line.  If end-of-input is encountered before any
+  //   further input, -1 is returned.  If there is an error than -2 is returned.  Otherwise
+  //   the length of the line(s) read is returned.
+
+int       Read_Lines(QVcontext *ctx, FILE *input, int nlines);
+char     *QVentry(QVcontext *ctx);
+char     *QVline(QVcontext *ctx, int j);
 
   // Get and set the line counter for error reporting
 
-void      Set_QV_Line(int line);
-int       Get_QV_Line();
+void      Set_QV_Line(QVcontext *ctx, int line);
+int       Get_QV_Line(QVcontext *ctx);
 
   // Read up to the next num entries or until eof from the .quiva file on input and record
-  //   frequency statistics.  Copy these entries to the temporary file temp if != NULL.
-  //   If there is an error then -1 is returned, otherwise the number of entries read.
-
-int       QVcoding_Scan(FILE *input, int num, FILE *temp);
-void      QVcoding_Scan1(int rlen, char *del, char *tag, char *ins, char *mrg, char *sub);
+  //   frequency statistics.  Copy the 5 QV streams of these entries (rlen bytes each without
+  //   newlines) to the in-memory buffer save if != NULL, and record their lengths in
+  //   rlen[0..] if != NULL.  If there is an error then -1 is returned, otherwise the number
+  //   of entries read.  QVcoding_Scan_Text does the same for the .quiva entries in the memory
+  //   text[0..tlen-1], scanning them in place: the 5 QV lines of the i'th entry, each followed
+  //   by a newline, start at lines[i] and are rlen[i] long, and the number of bytes of text
+  //   consumed is returned in *used.  QVcoding_Scan1 adds the 5 given streams to the
+  //   statistics, or resets them if rlen = 0.
+
+int       QVcoding_Scan(QVcontext *ctx, FILE *input, int num, QVbuffer *save, int *rlen);
+int       QVcoding_Scan_Text(QVcontext *ctx, char *text, long long tlen, int num, char **lines,
+                             int *rlen, long long *used);
+void      QVcoding_Scan1(QVcontext *ctx, int rlen, char *del, char *tag, char *ins, char *mrg,
+                         char *sub);
+
+  //  Return a newly allocated binning of the given kind (QV_BIN_DEXQV or QV_BIN_ILLUMINA), or
+  //    one read from the file at path.  Each non-empty line of the file not starting with #
+  //    is of the form "<stream> <lo> <hi> <bin>" where stream is one of ins, mrg, sub, or all,
+  //    and sets the bin of every QV in [lo,hi] of the stream(s) to bin.  QVs are given as
+  //    values between 0 and 93 (i.e. offset by '!' as in a .quiva file), and every QV not
+  //    binned by a line is kept as is.  If there is an error then NULL is returned.
+
+QVbinning *Create_QVbinning(int kind);
+QVbinning *Read_QVbinning(char *path);
 
   // Given QVcoding_Scan has been called at least once, create an encoding scheme based on
-  //   the accumulated statistics and return a pointer to it.  The returned encoding object
-  //   is *statically allocated within the routine.  If lossy is set then use a lossy scaling
-  //   for the insertion and merge streams.  If there is an error, then NULL is returned.
+  //   the statistics accumulated in ctx and return a pointer to it.  The returned encoding
+  //   object is allocated and should be freed with Free_QVcoding and then free.  If lossy is
+  //   not NULL then the scheme codes the insertion, merge, and substitution streams binned
+  //   as per lossy, a copy of which is kept with the coding.  The streams are coded with
+  //   codec (QV_HUFFMAN, QV_RANS, or QV_CONTEXT).  If there is an error, then NULL is returned.
 
-QVcoding *Create_QVcoding(int lossy);
+QVcoding *Create_QVcoding(QVcontext *ctx, QVbinning *lossy, int codec);
 
   //  Read/write a coding scheme to input/output.  The encoding object returned by the reader
-  //    is *statically* allocated within the routine.  If an error occurs while reading then
-  //    NULL is returned.
+  //    is allocated as for Create_QVcoding.  If an error occurs while reading then NULL is
+  //    returned, and if one occurs while writing a non-zero value is returned.
 
-QVcoding *Read_QVcoding(FILE *input);
-void      Write_QVcoding(FILE *output, QVcoding *coding);
+QVcoding *Read_QVcoding(QVbuffer *input);
+int       Write_QVcoding(QVbuffer *output, QVcoding *coding);
 
   //  Free all the auxiliary storage associated with coding (but not the object itself!)
 
 void      Free_QVcoding(QVcoding *coding);
 
   //  Assuming the file pointer is positioned just beyond an entry header line, read the
-  //    next set of 5 QV lines, compress them according to 'coding', and output.  If lossy
-  //    is set then the scheme is a lossy one.  A negative value is returned if an error
-  //    occurred, and the sequence length otherwise.
+  //    next set of 5 QV lines into ctx, compress them according to 'coding', and output.  If lossy
+  //    is set and coding has a binning then the streams are binned (in place) before they are
+  //    coded.  A negative value is returned if an error occurred, and the sequence length
+  //    otherwise.  Compress_Next_QVentry1 compresses the 5 given streams and returns a
+  //    non-zero value if an error occurred.
 
-int      Compress_Next_QVentry(FILE *input, FILE *output, QVcoding *coding, int lossy);
-void     Compress_Next_QVentry1(int rlen, char *del, char *tag, char *ins, char *mrg, char *sub,
-                                FILE *output, QVcoding *coding, int lossy);
+int      Compress_Next_QVentry(QVcontext *ctx, FILE *input, QVbuffer *output,
+                               QVcoding *coding, int lossy);
+int      Compress_Next_QVentry1(int rlen, char *del, char *tag, char *ins, char *mrg, char *sub,
+                                QVbuffer *output, QVcoding *coding, int lossy);
 
   //  Assuming the input is position just beyond the compressed encoding of an entry header,
   //    read the set of compressed encodings for the ensuing 5 QV vectors, decompress them,
@@ -94,6 +192,14 @@ void     Compress_Next_QVentry1(int rlen, char *del, char *tag, char *ins, char
   //    provides the length of each of the 5 vectors.  A non-zero value is return only if an
   //    error occured.
 
-int      Uncompress_Next_QVentry(FILE *input, char **entry, QVcoding *coding, int rlen);
+int      Uncompress_Next_QVentry(QVbuffer *input, char **entry, QVcoding *coding, int rlen);
+
+  //  As above, but place in entry[0..4][0..end-beg-1] only the QVs of the interval [beg,end)
+  //    of the read.  If coding->block > 0 then only the blocks covering the interval are
+  //    decompressed (and input need not be positioned correctly after the call), otherwise
+  //    the entire entry is.
+
+int      Uncompress_QVsubentry(QVbuffer *input, char **entry, QVcoding *coding, int rlen,
+                               int beg, int end);
 
 #endif // _QV_COMPRESSOR
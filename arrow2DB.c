@@ -20,6 +20,8 @@
 #include <unistd.h>
 
 #include "DB.h"
+#include "GZ.h"
+#include "FX.h"
 #include "QV.h"
 
 //  Compiled in INTERACTIVE mode as all routines must return with an error
@@ -90,6 +92,25 @@ int next_file(File_Iterator *it)
   return (1);
 }
 
+  //  Read the next record of fx into rec, returning 1 if there is one, 0 at the end of the
+  //    input, and reporting the error and returning -1 if there is a problem.
+
+static int next_arrow(FX_Stream *fx, FX_Record *rec, char *core)
+{ int x;
+
+  x = FX_Read(fx,rec);
+  if (x < 0)
+    { if (fx->error == FX_NOHEAD)
+        fprintf(stderr,"File %s.arrow, Line %lld: First header in arrow file is missing\n",
+                       core,rec->line);
+      else if (fx->error == FX_LONG)
+        { fprintf(stderr,"File %s.arrow, Line %lld:",core,rec->line);
+          fprintf(stderr," Fasta header line is too long (> %d chars)\n",MAX_NAME-2);
+        }
+    }
+  return (x);
+}
+
 
 int main(int argc, char *argv[])
 { FILE      *istub;
@@ -203,13 +224,16 @@ int main(int argc, char *argv[])
   //    imported, driving the loop with the cell line #
 
   { FILE          *input = NULL;
-    char          *path = NULL;
-    char          *core = NULL;
+    FX_Stream     *fx    = NULL;
+    FX_Record      rec;
+    char          *path  = NULL;
+    char          *core  = NULL;
     char          *read;
-    int            rmax, rlen, eof;
+    int64          rmax;
+    int            rlen, eof;
     File_Iterator *ng = NULL;
     char           lname[MAX_NAME];
-    int            first, last, cline;
+    int            first, last, fresh;
     int            cell;
 
     //  Buffer for accumulating .arrow sequence over multiple lines
@@ -251,13 +275,18 @@ int main(int argc, char *argv[])
                   goto error;
                 }
 
-              input = stdin;
+              input = Gz_Input(stdin,GZ_THREADS);
+              if (input == NULL)
+                goto error;
+              fx = FX_Open(input);
+              if (fx == NULL)
+                goto error;
 
               if (VERBOSE)
                 { fprintf(stderr,"Adding arrows's from stdin ...\n");
                   fflush(stderr);
                 }
-              cline = 0;
+              fresh = 1;
             }
 
           //  First addition, not a pipe: then get first .arrow file name (error if not one) to
@@ -273,9 +302,14 @@ int main(int argc, char *argv[])
               if (ng->name == NULL)
                 goto error;
   
-              core = Root(ng->name,".arrow");
+              core = Gz_Root(ng->name,".arrow");
               path = PathTo(ng->name);
-              if ((input = Fopen(Catenate(path,"/",core,".arrow"),"r")) == NULL)
+              if ((input = Gz_Fopen(path,core,".arrow",GZ_THREADS)) == NULL)
+                { fprintf(stderr,"%s: Cannot open %s/%s.arrow for 'r'\n",Prog_Name,path,core);
+                  goto error;
+                }
+              fx = FX_Open(input);
+              if (fx == NULL)
                 goto error;
   
               first = 0;
@@ -308,7 +342,7 @@ int main(int argc, char *argv[])
                 { fprintf(stderr,"Adding '%s.arrow' ...\n",core);
                   fflush(stderr);
                 }
-              cline = 0;
+              fresh = 1;
             }
 
         //  Not the first addition: get next cell line.  If not a pipe and the file name is new,
@@ -323,10 +357,8 @@ int main(int argc, char *argv[])
                 goto error;
               }
             if (PIPE)
-              { int c;
-                if ((c = fgetc(input)) == EOF)
+              { if (eof)
                   break;
-                ungetc(c,input);
               }
             else if (strcmp(lname,fname) != 0)
               { if ( ! eof)
@@ -335,7 +367,13 @@ int main(int argc, char *argv[])
                     goto error;
                   }
 
-                fclose(input);
+                FX_Close(fx);
+                fx = NULL;
+                if (Gz_Close(input))
+                  { fprintf(stderr,"%s: %s.arrow is not a valid gzip file or is truncated\n",
+                                   Prog_Name,core);
+                    goto error;
+                  }
                 free(path);
                 free(core);
 
@@ -345,8 +383,13 @@ int main(int argc, char *argv[])
                   goto error;
 
                 path = PathTo(ng->name);
-                core = Root(ng->name,".arrow");
-                if ((input = Fopen(Catenate(path,"/",core,".arrow"),"r")) == NULL)
+                core = Gz_Root(ng->name,".arrow");
+                if ((input = Gz_Fopen(path,core,".arrow",GZ_THREADS)) == NULL)
+                  { fprintf(stderr,"%s: Cannot open %s/%s.arrow for 'r'\n",Prog_Name,path,core);
+                    goto error;
+                  }
+                fx = FX_Open(input);
+                if (fx == NULL)
                   goto error;
 
                 if (strcmp(core,fname) != 0)
@@ -359,28 +402,25 @@ int main(int argc, char *argv[])
                   { fprintf(stderr,"Adding '%s.arrow' ...\n",core);
                     fflush(stderr);
                   }
-                cline = 0;
+                fresh = 1;
               }
           }
 
         //  If first cell or source is a new file, then start IO
 
-        if (cline == 0)
+        if (fresh)
           {
-            // Read in first line and make sure it is a header in PACBIO format.
+            // Read in the first record, making sure it has a header
 
-            rlen = 0;
-            eof  = (fgets(read,MAX_NAME,input) == NULL);
-            if (read[strlen(read)-1] != '\n')
-              { fprintf(stderr,"File %s.arrow, Line 1: Fasta line is too long (> %d chars)\n",
-                               core,MAX_NAME-2);
-                goto error;
-              }
-            if (!eof && read[0] != '>')
+            if (fx->format != FX_FASTA)
               { fprintf(stderr,"File %s.arrow, Line 1: First header in arrow file is missing\n",
                                 core);
                 goto error;
               }
+            if ((eof = next_arrow(fx,&rec,core)) < 0)
+              goto error;
+            eof   = (eof == 0);
+            fresh = 0;
           }
 
         //  Compress reads [first..last) from open .arrow appending to .arw and record
@@ -406,54 +446,36 @@ int main(int argc, char *argv[])
                   goto error;
                 }
 
-              find = index(read+(rlen+1),' ');
+              find = index(rec.header,' ');
               if (find == NULL)
-                { fprintf(stderr,"File %s.arrow, Line %d: Pacbio header line format error\n",
-                                 core,cline);
+                { fprintf(stderr,"File %s.arrow, Line %lld: Pacbio header line format error\n",
+                                 core,rec.line);
                   goto error;
                 }
               *find = '\0';
-              if (strcmp(read+(rlen+1),prolog) != 0)
-                { fprintf(stderr,"File %s.arrow, Line %d: Pacbio prolog doesn't match DB entry\n",
-                                 core,cline);
+              if (strcmp(rec.header,prolog) != 0)
+                { fprintf(stderr,"File %s.arrow, Line %lld:",core,rec.line);
+                  fprintf(stderr," Pacbio prolog doesn't match DB entry\n");
                   goto error;
                 }
               *find = ' ';
               x = sscanf(find+1," SN=%f,%f,%f,%f\n",snr,snr+1,snr+2,snr+3);
               if (x != 4)
-                { fprintf(stderr,"File %s.arrow, Line %d: Pacbio header line format error\n",
-                                 core,cline);
+                { fprintf(stderr,"File %s.arrow, Line %lld: Pacbio header line format error\n",
+                                 core,rec.line);
                   goto error;
                 }
 
-              rlen  = 0;
-              while (1)
-                { eof = (fgets(read+rlen,MAX_NAME,input) == NULL);
-                  cline += 1;
-                  x = strlen(read+rlen)-1;
-                  if (read[rlen+x] != '\n')
-                    { if (read[rlen] == '>')
-                        { fprintf(stderr,"File %s.arrow, Line %d:",core,cline);
-                          fprintf(stderr," Fasta header line is too long (> %d chars)\n",
-                                         MAX_NAME-2);
-                          goto error;
-                        }
-                      else
-                        x += 1;
-                    }
-                  if (eof || read[rlen] == '>')
-                    break;
-                  rlen += x;
-                  if (rlen + MAX_NAME > rmax)
-                    { rmax = ((int) (1.2 * rmax)) + 1000 + MAX_NAME;
-                      read = (char *) realloc(read,rmax+1);
-                      if (read == NULL)
-                        { fprintf(stderr,"File %s.arrow, Line %d:",core,cline);
-                          fprintf(stderr," Out of memory (Allocating line buffer)\n");
-                          goto error;
-                        }
+              if (rec.slen + 4 > rmax)
+                { rmax = ((int64) (1.2 * rec.slen)) + 1000 + MAX_NAME;
+                  read = (char *) realloc(read,rmax+1);
+                  if (read == NULL)
+                    { fprintf(stderr,"File %s.arrow, Line %lld:",core,rec.line);
+                      fprintf(stderr," Out of memory (Allocating line buffer)\n");
+                      goto error;
                     }
                 }
+              rlen = FX_Bases(&rec,read);
               read[rlen] = '\0';
 
               for (x = 0; x < 4; x++)
@@ -468,6 +490,10 @@ int main(int argc, char *argv[])
               Compress_Read(rlen,read);
               clen = COMPRESSED_LEN(rlen);
               fwrite(read,1,clen,arrow);
+
+              if ((eof = next_arrow(fx,&rec,core)) < 0)
+                goto error;
+              eof = (eof == 0);
             }
         }
       }
@@ -482,17 +508,25 @@ int main(int argc, char *argv[])
         goto error;
       }
     if ( ! PIPE && cell >= nfiles)
-      { fclose(input);
+      { FX_Close(fx);
+        fx = NULL;
+        if (Gz_Close(input))
+          { fprintf(stderr,"%s: %s.arrow is not a valid gzip file or is truncated\n",
+                           Prog_Name,core);
+            goto error;
+          }
         free(core);
         free(path);
         if (next_file(ng))
           { if (ng->name == NULL)
               goto error;
-            core = Root(ng->name,".arrow");
+            core = Gz_Root(ng->name,".arrow");
             fprintf(stderr,"%s: %s.fasta has never been added to DB\n",Prog_Name,core);
             goto error;
           }
       }
+    if (fx != NULL)
+      FX_Close(fx);
   }
 
   //  Write the db record and read index into .idx and clean up
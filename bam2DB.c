@@ -0,0 +1,1078 @@
+/*******************************************************************************************
+ *
+ *  Adds the given Pacbio .bam files (of subreads or CCS reads) in sequence to a DB "path",
+ *    creating it if necessary.  The sequence, well, pulse interval, and read quality of each
+ *    read are taken directly from the .bam record and, with the -a option, its pulse widths
+ *    and SNRs are imported into the .arw file of an arrow DB, so that the DB is built in a
+ *    single pass without first converting to .fasta and .arrow files.  The BGZF blocks of a
+ *    .bam file are inflated in parallel by -T threads (see GZ.h).
+ *
+ *  Date  :  October 2026
+ *
+ ********************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "DB.h"
+#include "GZ.h"
+
+#ifdef HIDE_FILES
+#define PATHSEP "/."
+#else
+#define PATHSEP "/"
+#endif
+
+static char *Usage[] =
+    { "[-va] [-T<int(4)>] <path:db>",
+      "  ( -f<file> | -i[<name>] | <input:bam> ... )"
+    };
+
+static int NTHREADS;   //  # of threads inflating the input
+
+typedef struct
+  { int    argc;
+    char **argv;
+    FILE  *input;
+    int    count;
+    char  *name;
+  } File_Iterator;
+
+File_Iterator *init_file_iterator(int argc, char **argv, FILE *input, int first)
+{ File_Iterator *it;
+
+  it = Malloc(sizeof(File_Iterator),"Allocating file iterator");
+  if (it == NULL)
+    return (NULL);
+  it->argc  = argc;
+  it->argv  = argv;
+  it->input = input;
+  if (input == NULL)
+    it->count = first;
+  else
+    { it->count = 1;
+      rewind(input);
+    }
+  return (it);
+}
+
+int next_file(File_Iterator *it)
+{ static char nbuffer[MAX_NAME+8];
+
+  if (it->input == NULL)
+    { if (it->count >= it->argc)
+        return (0);
+      it->name = it->argv[it->count++];
+    }
+  else
+    { char *eol;
+
+      if (fgets(nbuffer,MAX_NAME+8,it->input) == NULL)
+        { if (feof(it->input))
+            return (0);
+          fprintf(stderr,"%s: IO error reading line %d of -f file of names\n",Prog_Name,it->count);
+          it->name = NULL;
+          return (1);
+        }
+      if ((eol = index(nbuffer,'\n')) == NULL)
+        { fprintf(stderr,"%s: Line %d in file list is longer than %d chars!\n",
+                         Prog_Name,it->count,MAX_NAME+7);
+          it->name = NULL;
+          return (1);
+        }
+      *eol = '\0';
+      it->count += 1;
+      it->name  = nbuffer;
+    }
+  return (1);
+}
+
+
+/*******************************************************************************************
+ *
+ *  Decoding .bam records: after a header giving the reference sequences (of which there
+ *    are none for unaligned Pacbio data), each record of a .bam is a block of the form
+ *
+ *      int32 block_size, refID, pos;  uint8 l_read_name, mapq;  uint16 bin, n_cigar, flag;
+ *      int32 l_seq, next_refID, next_pos, tlen;  char read_name[l_read_name];
+ *      uint32 cigar[n_cigar];  uint8 seq[(l_seq+1)/2];  uint8 qual[l_seq];  aux tags ...
+ *
+ *    where the bases of seq are 4-bit codes, 2 per byte, high nibble first, and each aux
+ *    tag is a 2-char name, a type char, and a value of that type.  The read name of a Pacbio
+ *    record is <movie>/<well>/<qs>_<qe> or <movie>/<well>/ccs, and its tags include zm (well),
+ *    qs & qe (pulse interval), rq (read quality in [0,1]), sn (the SNR of each of A, C, G,
+ *    and T), and pw (the pulse width of each base, in its native orientation).
+ *
+ ********************************************************************************************/
+
+#define BAM_REVERSE  0x010   //  flag bits: sequence is reverse complemented
+#define BAM_EXTRA    0x900   //             secondary or supplementary alignment
+
+  //  The 2-bit code of the two 4-bit bases packed in a byte ('=ACMGRSVTWYHKDBN' order) where
+  //    anything other than A, C, G, or T maps to 0 as for .fasta input
+
+static char Nt16[16] = { 0, 0, 1, 0, 2, 0, 0, 0, 3, 0, 0, 0, 0, 0, 0, 0 };
+
+static char BamPair[256][2];
+
+static void init_bam_tables()
+{ int i;
+
+  for (i = 0; i < 256; i++)
+    { BamPair[i][0] = Nt16[i >> 4];
+      BamPair[i][1] = Nt16[i & 0xf];
+    }
+}
+
+typedef struct
+  { char  *name;      //  Read name (NUL-terminated)
+    int    flag;
+    int    len;       //  # of bases
+    uint8 *seq;       //  Packed 4-bit bases
+    uint8 *aux;       //  Aux tags are aux[0..end)
+    uint8 *end;
+  } Bam_Record;
+
+static int32 get_int32(uint8 *p)
+{ int32 x;
+  memcpy(&x,p,4);
+  return (x);
+}
+
+static uint16 get_uint16(uint8 *p)
+{ uint16 x;
+  memcpy(&x,p,2);
+  return (x);
+}
+
+  //  Size in bytes of a value of the given .bam type, 0 if variable or unknown
+
+static int type_size(int type)
+{ switch (type)
+  { case 'A': case 'c': case 'C':
+      return (1);
+    case 's': case 'S':
+      return (2);
+    case 'i': case 'I': case 'f':
+      return (4);
+    default:
+      return (0);
+  }
+}
+
+  //  Read the next block (i.e. record) of input into *buf, growing it as necessary.  Return
+  //    the block length, 0 at the end of the input, and -1 if the input is truncated.
+
+static int32 read_block(FILE *input, uint8 **buf, int64 *max)
+{ int32 len;
+  int   x;
+
+  x = fread(&len,1,4,input);
+  if (x == 0)
+    return (0);
+  if (x < 4 || len < 32)
+    return (-1);
+  if (len > *max)
+    { *max = 1.2*len + 10000;
+      *buf = (uint8 *) Realloc(*buf,*max,"Allocating record buffer");
+      if (*buf == NULL)
+        return (-1);
+    }
+  if (fread(*buf,1,len,input) != (size_t) len)
+    return (-1);
+  return (len);
+}
+
+  //  Skip the header of a .bam input, returning non-zero if it is not one
+
+static int skip_header(FILE *input)
+{ uint8 head[8];
+  int32 n, len;
+  int   i;
+
+  if (fread(head,1,8,input) != 8 || memcmp(head,"BAM\1",4) != 0)
+    return (1);
+  len = get_int32(head+4);
+  if (len < 0)
+    return (1);
+  if (fseeko(input,len,SEEK_CUR) < 0)
+    { for (i = 0; i < len; i++)     //  input is a pipe
+        if (getc(input) == EOF)
+          return (1);
+    }
+  if (fread(&n,4,1,input) != 1 || n < 0)
+    return (1);
+  while (n-- > 0)
+    { if (fread(&len,4,1,input) != 1 || len < 0)
+        return (1);
+      for (i = 0; i < len+4; i++)
+        if (getc(input) == EOF)
+          return (1);
+    }
+  return (0);
+}
+
+  //  Parse the block b[0..len) into r, returning non-zero if it is malformed
+
+static int parse_record(uint8 *b, int32 len, Bam_Record *r)
+{ int lname, ncigar;
+  uint8 *p;
+
+  lname   = b[8];
+  ncigar  = get_uint16(b+12);
+  r->flag = get_uint16(b+14);
+  r->len  = get_int32(b+16);
+  r->name = (char *) (b+32);
+  p = b + 32 + lname + 4*ncigar;
+  if (lname < 1 || r->len < 0 || p + (r->len+1)/2 + r->len > b + len)
+    return (1);
+  if (r->name[lname-1] != '\0')
+    return (1);
+  r->seq = p;
+  r->aux = p + (r->len+1)/2 + r->len;
+  r->end = b + len;
+  return (0);
+}
+
+  //  Return a pointer to the type char of the tag of r with the given name, or NULL if
+  //    there is no such tag (or the tags are malformed)
+
+static uint8 *find_tag(Bam_Record *r, char *tag)
+{ uint8 *p, *e, *n;
+  int    s;
+
+  p = r->aux;
+  e = r->end;
+  while (p + 3 <= e)
+    { s = type_size(p[2]);
+      if (s > 0)
+        n = p+3+s;
+      else if (p[2] == 'Z' || p[2] == 'H')
+        { n = memchr(p+3,'\0',e-(p+3));
+          if (n == NULL)
+            return (NULL);
+          n += 1;
+        }
+      else if (p[2] == 'B' && p + 8 <= e)
+        { s = type_size(p[3]);
+          if (s == 0 || get_int32(p+4) < 0)
+            return (NULL);
+          n = p + 8 + s*((int64) get_int32(p+4));
+        }
+      else
+        return (NULL);
+      if (n > e)
+        return (NULL);
+      if (p[0] == tag[0] && p[1] == tag[1])
+        return (p+2);
+      p = n;
+    }
+  return (NULL);
+}
+
+  //  Get the integer or float value of the tag at t into *v, returning non-zero if it is not
+  //    of the appropriate type
+
+static int tag_int(uint8 *t, int64 *v)
+{ switch (t[0])
+  { case 'c': *v = (int8) t[1];             break;
+    case 'C': *v = t[1];                    break;
+    case 's': *v = (int16) get_uint16(t+1); break;
+    case 'S': *v = get_uint16(t+1);         break;
+    case 'i': *v = get_int32(t+1);          break;
+    case 'I': *v = (uint32) get_int32(t+1); break;
+    default:  return (1);
+  }
+  return (0);
+}
+
+static int tag_float(uint8 *t, float *v)
+{ if (t[0] != 'f')
+    return (1);
+  memcpy(v,t+1,4);
+  return (0);
+}
+
+  //  If the tag at t is an array of n values of any integer type, return a pointer to the
+  //    first and set *size to the size of each, otherwise return NULL
+
+static uint8 *tag_array(uint8 *t, int n, int *size)
+{ if (t[0] != 'B' || get_int32(t+2) != n)
+    return (NULL);
+  *size = type_size(t[1]);
+  if (t[1] == 'f' || *size == 0)
+    return (NULL);
+  return (t+6);
+}
+
+
+int main(int argc, char *argv[])
+{ FILE  *istub, *ostub;
+  char  *dbname;
+  char  *root, *pwd;
+
+  FILE  *bases, *indx, *arrow;
+  int64  boff, ioff, aoff;
+
+  int    ifiles, ofiles, ocells;
+  char **flist;
+
+  DAZZ_DB db;
+  int     ureads;
+  int64   offset;
+
+  char   *PIPE;
+  FILE   *IFILE;
+  int     VERBOSE;
+  int     ARROW;
+
+  //   Process command line
+
+  { int   i, j, k;
+    int   flags[128];
+    char *eptr;
+
+    ARG_INIT("bam2DB")
+
+    IFILE    = NULL;
+    PIPE     = NULL;
+    NTHREADS = 4;
+
+    j = 1;
+    for (i = 1; i < argc; i++)
+      if (argv[i][0] == '-')
+        switch (argv[i][1])
+        { default:
+            ARG_FLAGS("va")
+            break;
+          case 'T':
+            ARG_POSITIVE(NTHREADS,"Number of threads")
+            break;
+          case 'f':
+            IFILE = fopen(argv[i]+2,"r");
+            if (IFILE == NULL)
+              { fprintf(stderr,"%s: Cannot open file of inputs '%s'\n",Prog_Name,argv[i]+2);
+                exit (1);
+              }
+            break;
+          case 'i':
+            PIPE = argv[i]+2;
+            break;
+        }
+      else
+        argv[j++] = argv[i];
+    argc = j;
+
+    VERBOSE = flags['v'];
+    ARROW   = flags['a'];
+
+    if (IFILE != NULL && PIPE != NULL)
+      { fprintf(stderr,"%s: Cannot use both -f and -i together\n",Prog_Name);
+        exit (1);
+      }
+
+    if ( (IFILE == NULL && PIPE == NULL && argc <= 2) ||
+        ((IFILE != NULL || PIPE != NULL) && argc != 2))
+      { fprintf(stderr,"Usage: %s %s\n",Prog_Name,Usage[0]);
+        fprintf(stderr,"       %*s %s\n",(int) strlen(Prog_Name),"",Usage[1]);
+        fprintf(stderr,"\n");
+        fprintf(stderr,"      -f: import files listed 1/line in given file.\n");
+        fprintf(stderr,"      -i: import data from stdin, use optional name as data source.\n");
+        fprintf(stderr,"        : otherwise, import sequence of specified files.\n");
+        fprintf(stderr,"      -a: also import pulse widths and SNRs (pw & sn tags) as arrows.\n");
+        fprintf(stderr,"      -T: Use -T threads to inflate the input.\n");
+        exit (1);
+      }
+  }
+
+  init_bam_tables();
+
+  //  Try to open DB file, if present then adding to DB, otherwise creating new DB.  Set up
+  //  variables as follows:
+  //    dbname = full name of db = <pwd>/<root>.db
+  //    istub  = open db file (if adding) or NULL (if creating)
+  //    ostub  = new image of db file (will overwrite old image at end)
+  //    bases  = .bps file positioned for appending
+  //    indx   = .idx file positioned for appending
+  //    arrow  = .arw file positioned for appending if an arrow DB, NULL otherwise
+  //    ureads = # of reads currently in db
+  //    offset = offset in .bps (and .arw) at which to place next sequence
+  //    ioff   = offset in .idx file to truncate to if command fails
+  //    boff   = offset in .bps file to truncate to if command fails
+  //    aoff   = offset in .arw file to truncate to if command fails
+  //    ifiles = # of .bam files to add
+  //    ofiles = # of .bam files added so far
+  //    ocells = # of SMRT cells already in db
+  //    flist  = [0..ifiles+ocells] list of file names (root only) added to db so far
+
+  { int i;
+
+    root   = Root(argv[1],".db");
+    pwd    = PathTo(argv[1]);
+    dbname = Strdup(Catenate(pwd,"/",root,".db"),"Allocating db name");
+    if (dbname == NULL)
+      exit (1);
+
+    if (PIPE != NULL)
+      ifiles = 1;
+    else if (IFILE == NULL)
+      ifiles = argc-2;
+    else
+      { File_Iterator *ng;
+
+        ifiles = 0;
+        ng = init_file_iterator(argc,argv,IFILE,2);
+        if (ng == NULL)
+          exit (1);
+        while (next_file(ng))
+          { if (ng->name == NULL)
+              exit (1);
+            ifiles += 1;
+          }
+        free(ng);
+      }
+
+    bases = NULL;
+    indx  = NULL;
+    arrow = NULL;
+    ostub = NULL;
+    ioff  = 0;
+    boff  = 0;
+    aoff  = 0;
+
+    istub = fopen(dbname,"r");
+    if (istub == NULL)
+      { ocells = 0;
+
+        bases = Fopen(Catenate(pwd,PATHSEP,root,".bps"),"w+");
+        indx  = Fopen(Catenate(pwd,PATHSEP,root,".idx"),"w+");
+        if (ARROW)
+          arrow = Fopen(Catenate(pwd,PATHSEP,root,".arw"),"w+");
+        if (bases == NULL || indx == NULL || (ARROW && arrow == NULL))
+          goto error;
+
+        bzero(&db,sizeof(DAZZ_DB));
+        fwrite(&db,sizeof(DAZZ_DB),1,indx);
+
+        ureads  = 0;
+        offset  = 0;
+      }
+    else
+      { if (fscanf(istub,DB_NFILE,&ocells) != 1)
+          { fprintf(stderr,"%s: %s.db is corrupted, read failed\n",Prog_Name,root);
+            exit (1);
+          }
+
+        bases = Fopen(Catenate(pwd,PATHSEP,root,".bps"),"r+");
+        indx  = Fopen(Catenate(pwd,PATHSEP,root,".idx"),"r+");
+        if (bases == NULL || indx == NULL)
+          exit (1);
+
+        if (fread(&db,sizeof(DAZZ_DB),1,indx) != 1)
+          { if (ferror(indx))
+              fprintf(stderr,"%s: System error, read failed\n",Prog_Name);
+            else
+              fprintf(stderr,"%s: File %s.idx is corrupted\n",Prog_Name,root);
+            exit (1);
+          }
+        if (fseeko(bases,0,SEEK_END) < 0)
+          SYSTEM_READ_ERROR
+        if (fseeko(indx, 0,SEEK_END) < 0)
+          SYSTEM_READ_ERROR
+
+        ureads = db.ureads;
+        offset = ftello(bases);
+        boff   = offset;
+        ioff   = ftello(indx);
+        if (boff < 0 || ioff < 0)
+          SYSTEM_READ_ERROR
+
+        //  Arrows are imported iff the DB is an arrow DB, all of whose reads must then have
+        //    their arrows already
+
+        if (db.allarr & DB_ARROW)
+          { DAZZ_READ last;
+
+            if (ureads > 0)
+              { if (fseeko(indx,-((int64) sizeof(DAZZ_READ)),SEEK_END) < 0)
+                  SYSTEM_READ_ERROR
+                if (fread(&last,sizeof(DAZZ_READ),1,indx) != 1)
+                  SYSTEM_READ_ERROR
+                if (last.coff < 0)
+                  { fprintf(stderr,"%s: Not all the arrows of %s have been added\n",
+                                   Prog_Name,root);
+                    exit (1);
+                  }
+              }
+            arrow = Fopen(Catenate(pwd,PATHSEP,root,".arw"),"r+");
+            if (arrow == NULL)
+              exit (1);
+            if (fseeko(arrow,0,SEEK_END) < 0)
+              SYSTEM_READ_ERROR
+            aoff = ftello(arrow);
+            if (aoff != boff)
+              { fprintf(stderr,"%s: Files %s.arw and %s.bps do not correspond\n",
+                               Prog_Name,root,root);
+                exit (1);
+              }
+            ARROW = 1;
+          }
+        else if (ARROW)
+          { fprintf(stderr,"%s: %s is not an arrow DB (-a)\n",Prog_Name,root);
+            exit (1);
+          }
+      }
+
+    flist  = (char **) Malloc(sizeof(char *)*(ocells+ifiles),"Allocating file list");
+    ostub  = Fopen(Catenate(pwd,"/",root,".dbx"),"w+");
+    if (ostub == NULL || flist == NULL)
+      goto error;
+
+    if (fprintf(ostub,DB_NFILE,ocells+ifiles) < 0)   //  Will write again with correct value at end
+      { fprintf(stderr,"%s: System error, write failed\n",Prog_Name);
+        goto error;
+      }
+    ofiles = 0;
+    for (i = 0; i < ocells; i++)
+      { int  last;
+        char prolog[MAX_NAME], fname[MAX_NAME];
+
+        if (fscanf(istub,DB_FDATA,&last,fname,prolog) != 3)
+          { if (ferror(istub))
+              fprintf(stderr,"%s: System error, read failed\n",Prog_Name);
+            else
+              fprintf(stderr,"%s: File %s.db is corrupted\n",Prog_Name,root);
+            goto error;
+          }
+        if (ofiles == 0 || strcmp(flist[ofiles-1],fname) != 0)
+          if ((flist[ofiles++] = Strdup(fname,"Adding to file list")) == NULL)
+            goto error;
+        if (fprintf(ostub,DB_FDATA,last,fname,prolog) < 0)
+          { fprintf(stderr,"%s: System error, write failed\n",Prog_Name);
+            goto error;
+          }
+      }
+  }
+
+  { int            maxlen;
+    int64          totlen, count[4];
+    int            pmax, c;
+    DAZZ_READ     *prec;
+    uint8         *block;
+    int64          bmax;
+    char          *read, *arw;
+    int64          rmax;
+    File_Iterator *ng = NULL;
+
+    //  Buffers for reads all in the same well, a .bam record, and the bases and arrows of a read
+
+    pmax  = 100;
+    prec  = (DAZZ_READ *) Malloc(sizeof(DAZZ_READ)*pmax,"Allocating record buffer");
+    bmax  = 0;
+    block = NULL;
+    rmax  = 60000;
+    read  = (char *) Malloc(rmax+4,"Allocating read buffer");
+    arw   = (char *) Malloc(rmax+4,"Allocating read buffer");
+    if (prec == NULL || read == NULL || arw == NULL)
+      goto error;
+
+    totlen = 0;              //  total # of bases in new .bam files
+    maxlen = 0;              //  longest read in new .bam files
+    for (c = 0; c < 4; c++)  //  count of acgt in new .bam files
+      count[c] = 0;
+
+    //  For each new input source do
+
+    if (PIPE == NULL)
+      { ng = init_file_iterator(argc,argv,IFILE,2);  //  Setup to read .bam's
+        if (ng == NULL)                              //    from command line or file
+          goto error;
+      }
+
+    while (PIPE != NULL || next_file(ng))
+      { FILE      *input;
+        char       prolog[MAX_NAME];
+        char      *path, *core, *fname;
+        int64      nrec;
+        int32      blen;
+        Bam_Record rec;
+        int        pwell, pcnt, first;
+
+        //  Open it: <path>/<core>.bam if file, stdin otherwise with core = PIPE or "stdout"
+
+        if (PIPE == NULL)
+          { FILE *file;
+
+            if (ng->name == NULL)
+              goto error;
+            path  = PathTo(ng->name);
+            core  = Root(ng->name,".bam");
+            fname = Strdup(Catenate(core,".bam","",""),"Allocating file name");
+            if (path == NULL || core == NULL || fname == NULL)
+              goto error;
+            if ((file = Fopen(Catenate(path,"/",core,".bam"),"r")) == NULL)
+              goto error;
+            free(path);
+            input = Gz_Input(file,NTHREADS);
+            if (input == NULL)
+              { fclose(file);
+                goto error;
+              }
+          }
+        else
+          { if (PIPE[0] == '\0')
+              core  = Strdup("stdout","Allocating file name");
+            else
+              core  = Strdup(PIPE,"Allocating file name");
+            fname = Strdup("standard input","Allocating file name");
+            if (core == NULL || fname == NULL)
+              goto error;
+            input = Gz_Input(stdin,NTHREADS);
+            if (input == NULL)
+              goto error;
+          }
+
+        if (skip_header(input))
+          { if (input != stdin && Gz_Close(input))
+              fprintf(stderr,"%s: %s is not a valid gzip file or is truncated\n",
+                             Prog_Name,fname);
+            else
+              fprintf(stderr,"%s: %s is not a .bam file\n",Prog_Name,fname);
+            goto error;
+          }
+
+        //  Check that core is not too long and name is unique or last source if PIPE'd
+
+        if (strlen(core) >= MAX_NAME)
+          { fprintf(stderr,"%s: File name over %d chars: '%.200s'\n",
+                           Prog_Name,MAX_NAME,core);
+            goto error;
+          }
+
+        { int j;
+
+          if (PIPE == NULL || (strcmp(core,"stdout") != 0 &&
+                 (ofiles == 0 || strcmp(core,flist[ofiles-1]) != 0)))
+            for (j = 0; j < ofiles; j++)
+              if (strcmp(core,flist[j]) == 0)
+                { fprintf(stderr,"%s: File %s is already in database %s.db\n",
+                                 Prog_Name,fname,Root(argv[1],".db"));
+                  goto error;
+                }
+        }
+
+        //   Add the file name to flist
+
+        if (VERBOSE)
+          { if (PIPE != NULL && PIPE[0] == '\0')
+              fprintf(stderr,"Adding reads from stdio ...\n");
+            else
+              fprintf(stderr,"Adding '%s' ...\n",fname);
+            fflush(stderr);
+          }
+        flist[ofiles++] = core;
+
+        //  Read each record, adding the primary ones to the DB grouped by well, and noting
+        //    each change of cell (i.e. movie)
+
+        pcnt  = 0;
+        pwell = -1;
+        first = 1;
+        nrec  = 0;
+        while ((blen = read_block(input,&block,&bmax)) > 0)
+          { char  *find;
+            int    i, x, rlen, well, beg, qv;
+            int64  v;
+            float  rq;
+            uint8 *tag;
+
+            nrec += 1;
+            if (parse_record(block,blen,&rec))
+              { fprintf(stderr,"File %s, Record %lld: Malformed .bam record\n",fname,nrec);
+                goto error;
+              }
+            if (rec.flag & BAM_EXTRA)
+              continue;
+
+            //  Get the prolog, well, and pulse interval from the read name, but prefer the
+            //    zm and qs tags if present, and the read quality from the rq tag
+
+            find = index(rec.name,'/');
+            if (find == NULL || find - rec.name >= MAX_NAME)
+              { fprintf(stderr,"File %s, Record %lld: Pacbio read name format error\n",
+                               fname,nrec);
+                goto error;
+              }
+            *find = '\0';
+            x = sscanf(find+1,"%d/%d_",&well,&beg);
+            if (x < 1)
+              { fprintf(stderr,"File %s, Record %lld: Pacbio read name format error\n",
+                               fname,nrec);
+                goto error;
+              }
+            if (x < 2)
+              beg = 0;
+            if ((tag = find_tag(&rec,"zm")) != NULL && tag_int(tag,&v) == 0)
+              well = v;
+            if ((tag = find_tag(&rec,"qs")) != NULL && tag_int(tag,&v) == 0)
+              beg = v;
+            qv = 0;
+            if ((tag = find_tag(&rec,"rq")) != NULL && tag_float(tag,&rq) == 0 && rq > 0.)
+              { qv = (int) (1000.*rq + .5);
+                if (qv > 999)
+                  qv = 999;
+              }
+
+            //  Unpack, count, and compress the bases, in their native orientation
+
+            rlen = rec.len;
+            if (rlen > rmax)
+              { rmax = 1.2*rlen + 10000;
+                read = (char *) Realloc(read,rmax+4,"Allocating read buffer");
+                arw  = (char *) Realloc(arw,rmax+4,"Allocating read buffer");
+                if (read == NULL || arw == NULL)
+                  goto error;
+              }
+            for (i = 0; i+1 < rlen; i += 2)
+              { read[i]   = BamPair[rec.seq[i>>1]][0];
+                read[i+1] = BamPair[rec.seq[i>>1]][1];
+              }
+            if (i < rlen)
+              read[i] = BamPair[rec.seq[i>>1]][0];
+            if (rec.flag & BAM_REVERSE)
+              for (i = 0; i < rlen/2; i++)
+                { x = read[i];
+                  read[i] = 3-read[rlen-1-i];
+                  read[rlen-1-i] = 3-x;
+                }
+            if ((rec.flag & BAM_REVERSE) && (rlen & 1))
+              read[rlen/2] = 3-read[rlen/2];
+            for (i = 0; i < rlen; i++)
+              count[(int) read[i]] += 1;
+
+            Compress_Read(rlen,read);
+            fwrite(read,1,COMPRESSED_LEN(rlen),bases);
+
+            bzero(prec+pcnt,sizeof(DAZZ_READ));   //  Zero padding so .idx is reproducible
+
+            //  If an arrow DB, then the pulse widths capped to [1,4] are compressed into the
+            //    .arw and the SNRs are recorded in the .coff field as for arrow2DB
+
+            if (ARROW)
+              { uint8  *pw;
+                uint16  cnr[4];
+                float   snr[4];
+                int     size;
+
+                tag = find_tag(&rec,"sn");
+                if (tag == NULL || tag[0] != 'B' || tag[1] != 'f' || get_int32(tag+2) != 4)
+                  { fprintf(stderr,"File %s, Record %lld: No sn tag of 4 SNRs\n",fname,nrec);
+                    goto error;
+                  }
+                memcpy(snr,tag+6,4*sizeof(float));
+                tag = find_tag(&rec,"pw");
+                if (tag == NULL || (pw = tag_array(tag,rlen,&size)) == NULL)
+                  { fprintf(stderr,"File %s, Record %lld: No pw tag of %d pulse widths\n",
+                                   fname,nrec,rlen);
+                    goto error;
+                  }
+                for (i = 0; i < rlen; i++)
+                  { if (size == 1)
+                      x = pw[i];
+                    else if (size == 2)
+                      x = get_uint16(pw+2*i);
+                    else
+                      x = get_int32(pw+4*i);
+                    if (x < 1)
+                      x = 1;
+                    else if (x > 4)
+                      x = 4;
+                    arw[i] = x-1;
+                  }
+                Compress_Read(rlen,arw);
+                fwrite(arw,1,COMPRESSED_LEN(rlen),arrow);
+
+                for (x = 0; x < 4; x++)
+                  cnr[x] = (uint32) (snr[x] * 100.);
+                *((uint64 *) &(prec[pcnt].coff)) = ((uint64) cnr[0]) << 48 |
+                                                   ((uint64) cnr[1]) << 32 |
+                                                   ((uint64) cnr[2]) << 16 |
+                                                   ((uint64) cnr[3]);
+              }
+            else
+              prec[pcnt].coff = -1;
+
+            //  Emit the read record, noting any change of cell
+
+            if (first)
+              { strcpy(prolog,rec.name);
+                first = 0;
+              }
+            else if (strcmp(rec.name,prolog) != 0)
+              { fprintf(ostub,DB_FDATA,ureads,core,prolog);
+                ocells += 1;
+                strcpy(prolog,rec.name);
+              }
+
+            ureads += 1;
+            totlen += rlen;
+            if (rlen > maxlen)
+              maxlen = rlen;
+
+            prec[pcnt].origin = well;
+            prec[pcnt].fpulse = beg;
+            prec[pcnt].rlen   = rlen;
+            prec[pcnt].boff   = offset;
+            prec[pcnt].flags  = qv;
+
+            offset += COMPRESSED_LEN(rlen);
+
+            if (pwell == well)
+              { prec[pcnt].flags |= DB_CCS;
+                pcnt += 1;
+                if (pcnt >= pmax)
+                  { pmax = ((int) (pcnt*1.2)) + 100;
+                    prec = (DAZZ_READ *) Realloc(prec,sizeof(DAZZ_READ)*pmax,
+                                                 "Allocating record buffer");
+                    if (prec == NULL)
+                      goto error;
+                  }
+              }
+            else if (pcnt == 0)
+              pcnt += 1;
+            else
+              { x = 0;
+                for (i = 1; i < pcnt; i++)
+                  if (prec[i].rlen > prec[x].rlen)
+                    x = i;
+                prec[x].flags |= DB_BEST;
+                fwrite(prec,sizeof(DAZZ_READ),pcnt,indx);
+                prec[0] = prec[pcnt];
+                pcnt = 1;
+              }
+            pwell = well;
+          }
+
+        if (blen < 0)
+          { if (input != stdin && Gz_Close(input))
+              fprintf(stderr,"%s: %s is not a valid gzip file or is truncated\n",
+                             Prog_Name,fname);
+            else
+              fprintf(stderr,"File %s, Record %lld: .bam file is truncated\n",fname,nrec+1);
+            goto error;
+          }
+        if (input != stdin && Gz_Close(input))
+          { fprintf(stderr,"%s: %s is not a valid gzip file or is truncated\n",Prog_Name,fname);
+            goto error;
+          }
+
+        //  Complete processing of .bam file: flush last well group and write file line
+        //      in db image.  A file with no primary reads is skipped.
+
+        if (first)
+          { fprintf(stderr,"Skipping '%s', file has no reads!\n",fname);
+            ofiles -= 1;
+          }
+        else
+          { int i, x;
+
+            x = 0;
+            for (i = 1; i < pcnt; i++)
+              if (prec[i].rlen > prec[x].rlen)
+                x = i;
+            prec[x].flags |= DB_BEST;
+            fwrite(prec,sizeof(DAZZ_READ),pcnt,indx);
+
+            fprintf(ostub,DB_FDATA,ureads,core,prolog);
+            ocells += 1;
+          }
+
+        free(fname);
+        if (PIPE != NULL)
+          break;
+      }
+
+    free(block);
+    free(arw);
+    free(read);
+    free(prec);
+
+    //  Finished loading all sequences: update relevant fields in db record
+
+    db.ureads = ureads;
+    if (istub == NULL)
+      { for (c = 0; c < 4; c++)
+          db.freq[c] = (float) ((1.*count[c])/totlen);
+        db.totlen = totlen;
+        db.maxlen = maxlen;
+        db.cutoff = -1;
+        db.allarr = (ARROW ? DB_ARROW : 0);
+      }
+    else
+      { for (c = 0; c < 4; c++)
+          db.freq[c] = (float) ((db.freq[c]*db.totlen + (1.*count[c]))/(db.totlen + totlen));
+        db.totlen += totlen;
+        if (maxlen > db.maxlen)
+          db.maxlen = maxlen;
+      }
+  }
+
+  //  If db has been previously partitioned then calculate additional partition points and
+  //    write to new db file image
+
+  if (db.cutoff >= 0)
+    { int64      totlen, dbpos, size;
+      int        nblock, ireads, tfirst, rlen;
+      int        ufirst, cutoff, allflag;
+      DAZZ_READ  record;
+      int        i;
+
+      if (VERBOSE)
+        { fprintf(stderr,"Updating block partition ...\n");
+          fflush(stderr);
+        }
+
+      //  Read the block portion of the existing db image getting the indices of the first
+      //    read in the last block of the exisiting db as well as the partition parameters.
+      //    Copy the old image block information to the new block information (except for
+      //    the indices of the last partial block)
+
+      if (fscanf(istub,DB_NBLOCK,&nblock) != 1)
+        { fprintf(stderr,"%s: %s.db is corrupted, read failed\n",Prog_Name,root);
+          goto error;
+        }
+      dbpos = ftello(ostub);
+      fprintf(ostub,DB_NBLOCK,0);
+      if (fscanf(istub,DB_PARAMS,&size,&cutoff,&allflag) != 3)
+        { fprintf(stderr,"%s: %s.db is corrupted, read failed\n",Prog_Name,root);
+          goto error;
+        }
+      fprintf(ostub,DB_PARAMS,size,cutoff,allflag);
+      if (allflag)
+        allflag = 0;
+      else
+        allflag = DB_BEST;
+
+      nblock -= 1;
+      for (i = 0; i <= nblock; i++)
+        { if (fscanf(istub,DB_BDATA,&ufirst,&tfirst) != 2)
+            { fprintf(stderr,"%s: %s.db is corrupted, read failed\n",Prog_Name,root);
+              goto error;
+            }
+          fprintf(ostub,DB_BDATA,ufirst,tfirst);
+        }
+
+      //  Seek the first record of the last block of the existing db in .idx, and then
+      //    compute and record partition indices for the rest of the db from this point
+      //    forward.
+
+      fseeko(indx,sizeof(DAZZ_DB)+sizeof(DAZZ_READ)*ufirst,SEEK_SET);
+      totlen = 0;
+      ireads = 0;
+      for (i = ufirst; i < ureads; i++)
+        { if (fread(&record,sizeof(DAZZ_READ),1,indx) != 1)
+            { fprintf(stderr,"%s: %s.idx is corrupted, read failed\n",Prog_Name,root);
+              goto error;
+            }
+          rlen = record.rlen;
+          if (rlen >= cutoff && (record.flags & DB_BEST) >= allflag)
+            { ireads += 1;
+              tfirst += 1;
+              totlen += rlen;
+              if (totlen >= size)
+                { fprintf(ostub," %9d %9d\n",i+1,tfirst);
+                  totlen = 0;
+                  ireads = 0;
+                  nblock += 1;
+                }
+            }
+        }
+
+      if (ireads > 0)
+        { fprintf(ostub,DB_BDATA,ureads,tfirst);
+          nblock += 1;
+        }
+
+      db.treads = tfirst;
+
+      fseeko(ostub,dbpos,SEEK_SET);
+      fprintf(ostub,DB_NBLOCK,nblock);    //  Rewind and record the new number of blocks
+    }
+  else
+    { db.treads = ureads;
+      db.cutoff = 0;
+      db.allarr |= DB_ALL;
+      fprintf(ostub,DB_NBLOCK,1);
+      fprintf(ostub,DB_PARAMS,db.totlen,0,1);
+      fprintf(ostub," %9d %9d\n",0,0);
+      fprintf(ostub," %9d %9d\n",ureads,ureads);
+    }
+
+  rewind(indx);
+  fwrite(&db,sizeof(DAZZ_DB),1,indx);   //  Write the finalized db record into .idx
+
+  rewind(ostub);                        //  Rewrite the number of files actually added
+  fprintf(ostub,DB_NFILE,ocells);
+
+  if (istub != NULL)
+    fclose(istub);
+  fclose(ostub);
+  fclose(indx);
+  fclose(bases);
+  if (arrow != NULL)
+    fclose(arrow);
+
+  rename(Catenate(pwd,"/",root,".dbx"),dbname);   //  New image replaces old image
+
+  exit (0);
+
+  //  Error exit:  Either truncate or remove the .idx, .bps, and .arw files as appropriate.
+  //               Remove the new image file <pwd>/<root>.dbx
+
+error:
+  if (ioff != 0)
+    { fseeko(indx,0,SEEK_SET);
+      if (ftruncate(fileno(indx),ioff) < 0)
+        fprintf(stderr,"%s: Fatal: could not restore %s.idx after error, truncate failed\n",
+                       Prog_Name,root);
+    }
+  if (boff != 0)
+    { fseeko(bases,0,SEEK_SET);
+      if (ftruncate(fileno(bases),boff) < 0)
+        fprintf(stderr,"%s: Fatal: could not restore %s.bps after error, truncate failed\n",
+                       Prog_Name,root);
+    }
+  if (aoff != 0)
+    { fseeko(arrow,0,SEEK_SET);
+      if (ftruncate(fileno(arrow),aoff) < 0)
+        fprintf(stderr,"%s: Fatal: could not restore %s.arw after error, truncate failed\n",
+                       Prog_Name,root);
+    }
+  if (indx != NULL)
+    { fclose(indx);
+      if (ioff == 0)
+        unlink(Catenate(pwd,PATHSEP,root,".idx"));
+    }
+  if (bases != NULL)
+    { fclose(bases);
+      if (boff == 0)
+        unlink(Catenate(pwd,PATHSEP,root,".bps"));
+    }
+  if (arrow != NULL)
+    { fclose(arrow);
+      if (aoff == 0)
+        unlink(Catenate(pwd,PATHSEP,root,".arw"));
+    }
+  if (ostub != NULL)
+    { fclose(ostub);
+      unlink(Catenate(pwd,"/",root,".dbx"));
+    }
+  if (istub != NULL)
+    fclose(istub);
+
+  exit (1);
+}
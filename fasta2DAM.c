@@ -26,8 +26,11 @@
 #include <strings.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "DB.h"
+#include "GZ.h"
+#include "FX.h"
 
 #ifdef HIDE_FILES
 #define PATHSEP "/."
@@ -35,7 +38,9 @@
 #define PATHSEP "/"
 #endif
 
-static char *Usage = "[-v] <path:dam> ( -f<file> | -i[<name>] | <input:fasta> ... )";
+static char *Usage = "[-v] [-T<int(4)>] <path:dam> ( -f<file> | -i[<name>] | <input:fasta> ... )";
+
+static int NTHREADS;   //  # of compression (and inflation) threads
 
 static char number[128] =
     { 0, 0, 0, 0, 0, 0, 0, 0,
@@ -113,6 +118,154 @@ int next_file(File_Iterator *it)
   return (1);
 }
 
+/*******************************************************************************************
+ *
+ *  Splitting a scaffold into contigs: the N-runs of a scaffold are found 8 bytes at a time,
+ *    and then the bases of its contigs are counted and 2-bit compressed directly from the
+ *    ASCII sequence into a single buffer, the compressed contigs being laid out in order.
+ *    If the scaffold is long, the compression is divided among NTHREADS threads, each
+ *    taking an equal share of the scaffold, contigs being cut between threads on a byte
+ *    boundary of the compressed sequence (i.e. at a multiple of 4 bases).
+ *
+ ********************************************************************************************/
+
+#define PAR_LEN  0x100000   //  Scaffolds at least this long are compressed in parallel
+
+#define LOWS  0x7f7f7f7f7f7f7f7full
+#define HIGHS 0x8080808080808080ull
+#define CASE  0x2020202020202020ull
+#define ENNS  0x6e6e6e6e6e6e6e6eull
+
+  //  The high bit of each byte of the result is set iff the corresponding byte of w is an
+  //    N or n (exactly, i.e. there is no carry between bytes).
+
+static inline uint64 n_bytes(uint64 w)
+{ uint64 x;
+
+  x = (w | CASE) ^ ENNS;
+  return (~(((x & LOWS) + LOWS) | x) & HIGHS);
+}
+
+static inline int is_n(char c)
+{ return (c == 'N' || c == 'n'); }
+
+  //  Return the index of the first N in s[i..len), or len if there is none
+
+static int64 next_n(char *s, int64 i, int64 len)
+{ uint64 w;
+
+  while (i + 8 <= len)
+    { memcpy(&w,s+i,8);
+      if (n_bytes(w) != 0)
+        break;
+      i += 8;
+    }
+  while (i < len && !is_n(s[i]))
+    i += 1;
+  return (i);
+}
+
+  //  Return the index of the first non-N in s[i..len), or len if there is none
+
+static int64 next_base(char *s, int64 i, int64 len)
+{ uint64 w;
+
+  while (i + 8 <= len)
+    { memcpy(&w,s+i,8);
+      if (n_bytes(w) != HIGHS)
+        break;
+      i += 8;
+    }
+  while (i < len && is_n(s[i]))
+    i += 1;
+  return (i);
+}
+
+typedef struct
+  { int64 beg;    //  Contig is [beg,end) of the scaffold
+    int64 end;
+    int64 coff;   //  Offset of its compressed bases in the scaffold's buffer
+  } Contig;
+
+typedef struct
+  { char   *seq;        //  Scaffold
+    Contig *ctg;        //  Its contigs
+    int     nctg;
+    int64   lo, hi;     //  Compress the bases of the contigs in [lo,hi)
+    char   *out;        //    into out
+    int64   count[4];   //    counting the number of each base
+  } Pack_Arg;
+
+  //  Compress s[0..len) into t as Compress_Read would, counting bases in count
+
+static void pack_bases(char *s, int64 len, char *t, int64 *count)
+{ int64 i;
+  int   a, b, c, d;
+
+  for (i = 0; i+4 <= len; i += 4)
+    { a = number[s[i]   & 0x7f] & 0x3;
+      b = number[s[i+1] & 0x7f] & 0x3;
+      c = number[s[i+2] & 0x7f] & 0x3;
+      d = number[s[i+3] & 0x7f] & 0x3;
+      count[a] += 1;
+      count[b] += 1;
+      count[c] += 1;
+      count[d] += 1;
+      *t++ = (char) ((a << 6) | (b << 4) | (c << 2) | d);
+    }
+  if (i < len)
+    { a = 0;
+      for (c = 0; c < 4; c++)
+        { a <<= 2;
+          if (i+c < len)
+            { b  = number[s[i+c] & 0x7f] & 0x3;
+              a |= b;
+              count[b] += 1;
+            }
+        }
+      *t = (char) a;
+    }
+}
+
+  //  A group of 4 bases of a contig is compressed by the thread whose [lo,hi) contains the
+  //    first base of the group.
+
+static void *pack_thread(void *arg)
+{ Pack_Arg *parm = (Pack_Arg *) arg;
+  Contig   *ctg  = parm->ctg;
+  int64     lo   = parm->lo;
+  int64     hi   = parm->hi;
+  int64     b, e, s, f;
+  int       l, r, m;
+
+  parm->count[0] = parm->count[1] = parm->count[2] = parm->count[3] = 0;
+
+  l = 0;                   //  Find the first contig ending after lo
+  r = parm->nctg;
+  while (l < r)
+    { m = (l+r)/2;
+      if (ctg[m].end <= lo)
+        l = m+1;
+      else
+        r = m;
+    }
+
+  for ( ; l < parm->nctg && ctg[l].beg < hi; l++)
+    { b = ctg[l].beg;
+      e = ctg[l].end;
+      s = (lo > b ? lo : b);
+      f = (hi < e ? hi : e);
+      s = b + (((s-b)+3) & ~0x3ll);
+      f = b + (((f-b)+3) & ~0x3ll);
+      if (f > e)
+        f = e;
+      if (s < f)
+        pack_bases(parm->seq+s,f-s,parm->out+ctg[l].coff+(s-b)/4,parm->count);
+    }
+
+  return (NULL);
+}
+
 
 int main(int argc, char *argv[])
 { FILE  *istub, *ostub;
@@ -137,11 +290,13 @@ int main(int argc, char *argv[])
 
   { int   i, j, k;
     int   flags[128];
+    char *eptr;
 
     ARG_INIT("fasta2DAM")
 
-    IFILE = NULL;
-    PIPE  = NULL;
+    IFILE    = NULL;
+    PIPE     = NULL;
+    NTHREADS = 4;
 
     j = 1;
     for (i = 1; i < argc; i++)
@@ -150,6 +305,9 @@ int main(int argc, char *argv[])
         { default:
             ARG_FLAGS("v")
             break;
+          case 'T':
+            ARG_POSITIVE(NTHREADS,"Number of threads")
+            break;
           case 'f':
             IFILE = fopen(argv[i]+2,"r");
             if (IFILE == NULL)
@@ -190,6 +348,8 @@ int main(int argc, char *argv[])
         fprintf(stderr,"      -f: import files listed 1/line in given file.\n");
         fprintf(stderr,"      -i: import data from stdin, use optiona name as data source.\n");
         fprintf(stderr,"        : otherwise, import sequence of specified files.\n");
+        fprintf(stderr,"\n");
+        fprintf(stderr,"      -T: Use -T threads to compress long scaffolds and inflate .gz input.\n");
         exit (1);
       }
   }
@@ -325,13 +485,30 @@ int main(int argc, char *argv[])
     int            c;
     File_Iterator *ng = NULL;
 
-    //  Buffer for accumulating .fasta sequence over multiple lines
+    Contig        *ctg;
+    int            cmax;
+    char          *pack;
+    int64          pmax;
+    Pack_Arg       parm[NTHREADS];
+    pthread_t      threads[NTHREADS];
+
+    //  Buffer for accumulating .fasta sequence over multiple lines, and for the contigs
+    //    of a scaffold and their compressed bases
 
     rmax  = MAX_NAME + 10000000;
     read  = (char *) Malloc(rmax+1,"Allocating line buffer");
     if (read == NULL)
       goto error;
 
+    cmax = 1000;
+    ctg  = (Contig *) Malloc(sizeof(Contig)*cmax,"Allocating contig buffer");
+    pmax = rmax/4 + cmax;
+    pack = (char *) Malloc(pmax,"Allocating compression buffer");
+    if (ctg == NULL || pack == NULL)
+      goto error;
+
+    bzero(&prec,sizeof(DAZZ_READ));
+
     totlen = 0;              //  total # of bases in new .fasta files
     maxlen = 0;              //  longest read in new .fasta files
     for (c = 0; c < 4; c++)  //  count of acgt in new .fasta files
@@ -346,9 +523,11 @@ int main(int argc, char *argv[])
       }
 
     while (PIPE != NULL || next_file(ng))
-      { FILE *input;
-        char *path, *core, *fname;
-        int   nline, eof, rlen;
+      { FILE      *input;
+        char      *path, *core, *fname;
+        int64      rlen;
+        FX_Stream *fx;
+        FX_Record  rec;
 
         //  Open it: <path>/<core>.fasta if file, stdin otherwise with core = PIPE or "stdout"
 
@@ -357,14 +536,14 @@ int main(int argc, char *argv[])
           { if (ng->name == NULL) goto error;
 
             path  = PathTo(ng->name);
-            core  = Root(ng->name,".fasta");
+            core  = Gz_Root(ng->name,".fasta");
             fname = Strdup(Catenate(core,".fasta",NULL,NULL),"Allocating file name");
-            if ((input = fopen(Catenate(path,"/",core,".fasta"),"r")) == NULL)
+            if ((input = Gz_Fopen(path,core,".fasta",NTHREADS)) == NULL)
               { free(fname);
                 free(core);
-                core  = Root(ng->name,".fa");
+                core  = Gz_Root(ng->name,".fa");
                 fname = Strdup(Catenate(core,".fa",NULL,NULL),"Allocating file name");
-                if ((input = fopen(Catenate(path,"/",core,".fa"),"r")) == NULL)
+                if ((input = Gz_Fopen(path,core,".fa",NTHREADS)) == NULL)
                   goto error;
               }
             free(path);
@@ -378,7 +557,9 @@ int main(int argc, char *argv[])
               core  = Strdup(PIPE,"Allocating file name");
             if (core == NULL)
               goto error;
-            input = stdin;
+            input = Gz_Input(stdin,NTHREADS);
+            if (input == NULL)
+              goto error;
           }
 
         //  Check that core is not too long and name is unique or last source if PIPE'd
@@ -408,13 +589,14 @@ int main(int argc, char *argv[])
             }
         }
 
-        //  Get the header of the first line.  If the file is empty skip.
+        //  Start scanning the input.  If the file is empty skip.
 
-        rlen  = 0;
-        nline = 1;
-        eof   = (fgets(read,MAX_NAME,input) == NULL);
-        if (eof || strlen(read) < 1)
-          { fclose(input);
+        fx = FX_Open(input);
+        if (fx == NULL)
+          goto error;
+        if (fx->empty)
+          { FX_Close(fx);
+            Gz_Close(input);
             if (PIPE != NULL)
               { fprintf(stderr,"Standard input is empty, terminating!\n");
                 break;
@@ -437,106 +619,144 @@ int main(int argc, char *argv[])
         if (!append)
           flist[ofiles++] = core;
 
-        // Check that the first line is a header line
+        // Check that the first line is a header line (as is checked for every record)
 
-        if (read[0] != '>')
+        if (fx->format != FX_FASTA)
           { fprintf(stderr,"File %s, Line 1: First header in fasta file is missing\n",fname);
             goto error;
           }
-        if (read[strlen(read)-1] != '\n')
-          { fprintf(stderr,"File %s, Line 1: Fasta header line is too long (> %d chars)\n",
-                           fname,MAX_NAME-2);
-            goto error;
-          }
 
         //  Read in all the sequences until end-of-file
 
-        { int i, x, n;
+        { int   x, n, t;
+          int64 i, pbeg, plen, clen;
 
-          while (!eof)
+          while ((x = FX_Read(fx,&rec)) > 0)
             { int hlen;
 
-              read[rlen] = '>';
-              hlen = strlen(read+rlen);
-              fwrite(read+rlen,1,hlen,hdrs);
-
-              rlen = 0;
-              while (1)
-                { eof = (fgets(read+rlen,MAX_NAME,input) == NULL);
-                  x = strlen(read+rlen)-1;
-                  if (read[rlen] == '>')
-                    { if (read[rlen+x] != '\n')
-                        { fprintf(stderr,"File %s, Line %d: Fasta header line",fname,nline);
-                          fprintf(stderr," is too long (> %d chars)\n",MAX_NAME-2);
-                          goto error;
-                        }
-                      nline += 1;
-                      break;
-                    }
-                  if (eof)
-                    break;
-                  if (read[rlen+x] == '\n')
-                    nline += 1;
-                  else
-                    x += 1;
-                  rlen += x;
-                  if (rlen + MAX_NAME > rmax)
-                    { rmax = ((int64) (1.4 * rmax)) + 10000000 + MAX_NAME;
-                      read = (char *) realloc(read,rmax+1);
-                      if (read == NULL)
-                        { fprintf(stderr,"File %s, Line %d:",fname,nline);
-                          fprintf(stderr," Out of memory (Allocating line buffer)\n");
-                          goto error;
-                        }
+              fputc('>',hdrs);
+              fwrite(rec.header,1,rec.hlen,hdrs);
+              fputc('\n',hdrs);
+              hlen = rec.hlen+2;
+
+              if (rec.slen + 4 > rmax)
+                { rmax = ((int64) (1.4 * rec.slen)) + 10000000 + MAX_NAME;
+                  read = (char *) realloc(read,rmax+1);
+                  if (read == NULL)
+                    { fprintf(stderr,"File %s, Line %lld:",fname,rec.line);
+                      fprintf(stderr," Out of memory (Allocating line buffer)\n");
+                      goto error;
                     }
                 }
-              read[rlen] = '\0';
+              rlen = FX_Bases(&rec,read);
 
-              n = 0;
-              i = -1;
+              //  Find the contigs between N-runs (a scaffold that is empty or ends in N's
+              //    yields a final empty contig) and where their compressed bases go
+
+              n    = 0;
+              clen = 0;
+              i    = -1;
               while (i < rlen)
-                { int pbeg, plen, clen;
+                { pbeg = next_base(read,i+1,rlen);
+                  i    = next_n(read,pbeg,rlen);
+                  if (n >= cmax)
+                    { cmax = 1.2*n + 1000;
+                      ctg  = (Contig *) Realloc(ctg,sizeof(Contig)*cmax,
+                                                "Allocating contig buffer");
+                      if (ctg == NULL)
+                        goto error;
+                    }
+                  ctg[n].beg  = pbeg;
+                  ctg[n].end  = i;
+                  ctg[n].coff = clen;
+                  clen += COMPRESSED_LEN(i-pbeg);
+                  n += 1;
+                }
+
+              if (clen > pmax)
+                { pmax = 1.2*clen + 10000;
+                  free(pack);
+                  pack = (char *) Malloc(pmax,"Allocating compression buffer");
+                  if (pack == NULL)
+                    goto error;
+                }
 
-                  while (i < rlen)
-                    if (number[(int) read[++i]] < 4)
-                      break;
+              //  Compress the contigs, in parallel if the scaffold is long
+
+              if (rlen >= PAR_LEN && NTHREADS > 1)
+                { for (t = 0; t < NTHREADS; t++)
+                    { parm[t].seq  = read;
+                      parm[t].ctg  = ctg;
+                      parm[t].nctg = n;
+                      parm[t].lo   = (rlen*t)/NTHREADS;
+                      parm[t].hi   = (rlen*(t+1))/NTHREADS;
+                      parm[t].out  = pack;
+                      pthread_create(threads+t,NULL,pack_thread,parm+t);
+                    }
+                  for (t = 0; t < NTHREADS; t++)
+                    pthread_join(threads[t],NULL);
+                }
+              else
+                { t = 1;
+                  parm[0].seq  = read;
+                  parm[0].ctg  = ctg;
+                  parm[0].nctg = n;
+                  parm[0].lo   = 0;
+                  parm[0].hi   = rlen;
+                  parm[0].out  = pack;
+                  pack_thread(parm);
+                }
+              while (t-- > 0)
+                for (c = 0; c < 4; c++)
+                  count[c] += parm[t].count[c];
 
-                  // if (i >= rlen) break;
+              //  Output the compressed bases and a read record for each contig
+
+              fwrite(pack,1,clen,bases);
+
+              for (t = 0; t < n; t++)
+                { pbeg = ctg[t].beg;
+                  plen = ctg[t].end - pbeg;
 
-                  pbeg = i;
                   prec.fpulse = pbeg;
-                  prec.origin = n++;
-                  prec.boff   = offset;
+                  prec.origin = t;
+                  prec.boff   = offset + ctg[t].coff;
                   prec.coff   = hdrset;
                   prec.flags  = DB_BEST;
-                  while (i < rlen)
-                    { x = number[(int) read[i]];
-                      if (x >= 4) break;
-                      count[x] += 1;
-                      read[i++] = (char) x;
-                    }
-                  prec.rlen = plen = i-pbeg;
+                  prec.rlen   = plen;
                   ureads += 1;
                   totlen += plen;
                   if (plen > maxlen)
                     maxlen = plen;
 
-                  Compress_Read(plen,read+pbeg);
-                  clen = COMPRESSED_LEN(plen);
-                  fwrite(read+pbeg,1,clen,bases);
-                  offset += clen;
-
                   fwrite(&prec,sizeof(DAZZ_READ),1,indx);
                 }
+              offset += clen;
               hdrset += hlen;
             }
+
+          if (x < 0)
+            { if (fx->error == FX_NOHEAD)
+                { fprintf(stderr,"File %s, Line %lld:",fname,rec.line);
+                  fprintf(stderr," First header in fasta file is missing\n");
+                }
+              else if (fx->error == FX_LONG)
+                { fprintf(stderr,"File %s, Line %lld: Fasta header line",fname,rec.line);
+                  fprintf(stderr," is too long (> %d chars)\n",MAX_NAME-2);
+                }
+              FX_Close(fx);
+              goto error;
+            }
+          FX_Close(fx);
         }
 
         fprintf(ostub,DB_FDATA,ureads,core,core);
 
-        if (PIPE == NULL)
-          fclose(input);
-        else
+        if (input != stdin && Gz_Close(input))
+          { fprintf(stderr,"%s: %s is not a valid gzip file or is truncated\n",Prog_Name,core);
+            goto error;
+          }
+        if (PIPE != NULL)
           break;
       }
 
@@ -26,8 +26,11 @@
 #include <strings.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "DB.h"
+#include "GZ.h"
+#include "FX.h"
 
 #ifdef HIDE_FILES
 #define PATHSEP "/."
@@ -35,7 +38,15 @@
 #define PATHSEP "/"
 #endif
 
-static char *Usage = "[-v] <path:db> ( -f<file> | -i[<name>] | <input:fasta> ... )";
+static char *Usage[] =
+    { "[-vqd] [-T<int(4)>] [-P<int(1)>] <path:db>",
+      "  ( -f<file> | -i[<name>] | <input:fasta|fastq> ... )"
+    };
+
+static char *Suffix[] = { ".fasta", ".fa", ".fastq", ".fq" };
+
+static int NTHREADS;   //  # of parsing threads
+static int DEDUP;      //  Hash the bases of each read to find exact duplicates (-d)
 
 static char number[128] =
     { 0, 0, 0, 0, 0, 0, 0, 0,
@@ -113,6 +124,869 @@ int next_file(File_Iterator *it)
   return (1);
 }
 
+/*******************************************************************************************
+ *
+ *  Pipelined input of a .fasta file: while the scanner reads the next chunk of the input
+ *    (see FX.h), the records of the current chunk are divided among NTHREADS threads, each
+ *    of which parses the headers of its records, and counts and 2-bit compresses their
+ *    bases into its own in-memory buffer.  The thread buffers are then appended in order to
+ *    the .bps and the read records are emitted in order so that offsets, cells, and well
+ *    groups are exactly as for a serial read.
+ *
+ ********************************************************************************************/
+
+typedef struct
+  { char  *prolog;   //  NUL-terminated within the chunk
+    int    well;
+    int    beg;
+    int    qv;
+    int    rlen;
+    int    qlen;     //  Length of the coded QVs of the read (if kept)
+    uint64 hash;     //  Hash of its compressed bases (if DEDUP)
+  } Fasta_Read;
+
+typedef struct
+  { int         format;      //  FX_FASTA or FX_FASTQ
+    int         quals;       //  Keep the QVs of .fastq records
+    char       *beg, *end;   //  Parse the records in [beg,end) of a chunk
+    Fasta_Read *reads;       //  The reads parsed are reads[0..nreads-1]
+    int         nreads;
+    int         rmax;
+    char       *bps;         //  Their compressed sequences are bps[0..blen-1]
+    int64       blen;
+    int64       bmax;
+    int64       count[4];    //  # of each base in the reads
+    uint8      *qvs;         //  If quals, their coded QVs are qvs[0..qlen-1]
+    int64       qlen;
+    int64       qmax;
+    int64       hist[QUAL_MAX+1];   //    and the # of bases with each QV
+    int64       nline;       //  # of lines in [beg,end)
+    int         error;       //  If non-zero the kind of error (FX_, PACBIO_FORMAT, or
+    int64       eline;       //    QV_RANGE) at line eline of [beg,end)
+  } Parse_Arg;
+
+#define PACBIO_FORMAT  (FX_SYSTEM+1)
+#define QV_RANGE       (FX_SYSTEM+2)
+
+  //  Parse the Pacbio header of rec into r, returning non-zero if it is not in the format
+  //    <prolog>/<well>/<beg>_<end> [RQ=0.<qv>] or <prolog>/<well>/ccs.  The prolog is
+  //    NUL-terminated in place.
+
+static int pacbio_header(FX_Record *rec, Fasta_Read *r)
+{ char *find, *secn;
+  int   x, end;
+
+  find = index(rec->header,'/');
+  if (find == NULL)
+    return (1);
+  x = sscanf(find+1,"%d/%d_%d RQ=0.%d\n",&r->well,&r->beg,&end,&r->qv);
+  if (x < 3)
+    { secn = index(find+1,'/');
+      x = sscanf(find+1,"%d/ccs\n",&r->well);
+      if (secn == NULL || strncmp(secn+1,"ccs",3) != 0 || x < 1)
+        return (1);
+      r->beg = 0;
+      r->qv  = 0;
+    }
+  else if (x == 3)
+    r->qv = 0;
+  *find = '\0';
+  r->prolog = rec->header;
+  return (0);
+}
+
+  //  Return a 64-bit hash of the compressed bases s of a read of length rlen, taking them
+  //    8 bytes at a time.  The pad bits of the last byte are 0 (see Compress_Read), so equal
+  //    reads have equal hashes.
+
+static inline uint64 mix(uint64 x)
+{ x ^= x >> 31;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 29;
+  x *= 0x94d049bb133111ebull;
+  return (x ^ (x >> 32));
+}
+
+static uint64 read_hash(int rlen, uint8 *s)
+{ uint64 h, w;
+  int    i, n;
+
+  h = 0x9e3779b97f4a7c15ull ^ (uint64) rlen;
+  n = COMPRESSED_LEN(rlen);
+  for (i = 0; i+8 <= n; i += 8)
+    { memcpy(&w,s+i,8);
+      h = (h ^ mix(w)) * 0xff51afd7ed558ccdull;
+    }
+  w = 0;
+  memcpy(&w,s+i,n-i);
+  return (mix(h ^ mix(w)));
+}
+
+static void *parse_thread(void *arg)
+{ Parse_Arg  *parm = (Parse_Arg *) arg;
+  char       *p, *s;
+  Fasta_Read *r;
+  FX_Record   rec;
+  int64       rlen, i;
+  int         x;
+
+  parm->nreads = 0;
+  parm->blen   = 0;
+  parm->qlen   = 0;
+  parm->nline  = 0;
+  parm->error  = 0;
+  for (x = 0; x < 4; x++)
+    parm->count[x] = 0;
+  for (x = 0; x <= QUAL_MAX; x++)
+    parm->hist[x] = 0;
+
+  p = parm->beg;
+  while (p < parm->end)
+    { if (parm->nreads >= parm->rmax)
+        { parm->rmax  = 1.2*parm->nreads + 1000;
+          parm->reads = (Fasta_Read *) Realloc(parm->reads,sizeof(Fasta_Read)*parm->rmax,
+                                               "Allocating read records");
+          if (parm->reads == NULL)
+            { parm->error = FX_SYSTEM;
+              return (NULL);
+            }
+        }
+      r = parm->reads + parm->nreads;
+
+      parm->eline = parm->nline+1;
+      parm->error = FX_Parse(parm->format,&p,parm->end,&rec);
+      if (parm->error != FX_OK)
+        return (NULL);
+      if (pacbio_header(&rec,r))
+        { parm->error = PACBIO_FORMAT;
+          return (NULL);
+        }
+      parm->nline += rec.nline;
+
+      //  Map, count, and compress the bases of the read
+
+      if (parm->blen + rec.slen + 4 > parm->bmax)
+        { parm->bmax = 1.2*(parm->blen + rec.slen) + 10000;
+          parm->bps  = (char *) Realloc(parm->bps,parm->bmax,"Allocating base buffer");
+          if (parm->bps == NULL)
+            { parm->error = FX_SYSTEM;
+              return (NULL);
+            }
+        }
+      s    = parm->bps + parm->blen;
+      rlen = FX_Bases(&rec,s);
+      for (i = 0; i < rlen; i++)
+        { x = number[s[i] & 0x7f];
+          parm->count[x] += 1;
+          s[i] = (char) x;
+        }
+
+      Compress_Read(rlen,s);
+      if (DEDUP)
+        r->hash = read_hash(rlen,(uint8 *) s);
+      parm->blen  += COMPRESSED_LEN(rlen);
+      r->rlen      = rlen;
+      r->qlen      = 0;
+      parm->nreads += 1;
+
+      //  Convert the QVs of a .fastq record from Phred+33, count, and code them
+
+      if (parm->quals && rec.qual != NULL)
+        { uint8 *q = (uint8 *) rec.qual;
+
+          if (parm->qlen + rlen > parm->qmax)
+            { parm->qmax = 1.2*(parm->qlen + rlen) + 10000;
+              parm->qvs  = (uint8 *) Realloc(parm->qvs,parm->qmax,"Allocating QV buffer");
+              if (parm->qvs == NULL)
+                { parm->error = FX_SYSTEM;
+                  return (NULL);
+                }
+            }
+          for (i = 0; i < rlen; i++)
+            { x = q[i] - 33;
+              if (x < 0 || x > QUAL_MAX)
+                { parm->error  = QV_RANGE;
+                  parm->eline += 3;
+                  return (NULL);
+                }
+              parm->hist[x] += 1;
+              q[i] = x;
+            }
+          r->qlen     = Encode_Quality(rlen,q,parm->qvs+parm->qlen);
+          parm->qlen += r->qlen;
+        }
+    }
+  return (NULL);
+}
+
+/*******************************************************************************************
+ *
+ *  Loading an input: a Loader appends the compressed bases, read records, and coded QVs of
+ *    each input given to it to its files, and accumulates the statistics of all the reads
+ *    it has loaded.  The main loader writes to the files of the db itself.  With -P, inputs
+ *    are loaded concurrently each by its own loader into a shard, i.e. temporary .bps, .idx,
+ *    and QV files, that are then stitched onto the db in the order of the inputs.
+ *
+ ********************************************************************************************/
+
+typedef struct
+  { char *prolog;   //  Prolog of the reads of a cell and the index, relative to the first
+    int   last;     //    read of the input, of the read following its last read
+  } Cell_Line;
+
+typedef struct
+  { FILE      *bases;      //  Compressed bases are appended to bases, read records to indx,
+    FILE      *indx;       //    and coded QVs to qdata if it is not NULL
+    FILE      *qdata;
+    int64      offset;     //  Offset in bases of the next read
+    int64      qoff;       //  Offset in qdata of the QVs of the next read
+    int64     *qidx;       //  .qual.anno entries of the reads loaded are qidx[0..nqidx-1]
+    int        nqidx;
+    int        qimax;
+    uint64    *hash;       //  If DEDUP, the hashes of the reads of the db so far and those
+    int        nhash;      //    loaded are hash[0..nhash-1]
+    int        hmax;
+    int64      totlen;     //  Total # of bases of the reads loaded,
+    int        maxlen;     //    the length of the longest one,
+    int64      count[4];   //    the # of each base,
+    int64      hist[QUAL_MAX+1];   //    and the # of bases with each QV
+    int        nreads;     //  # of reads in the last input loaded,
+    Cell_Line *cells;      //    whose cells are cells[0..ncells-1]
+    int        ncells;
+    int        cmax;
+    Parse_Arg *parm;       //  Private: parse thread records
+    DAZZ_READ *prec;       //           buffer for reads all in the same well
+    int        pmax;
+  } Loader;
+
+static int init_loader(Loader *ld, FILE *bases, FILE *indx, FILE *qdata)
+{ int t;
+
+  ld->bases  = bases;
+  ld->indx   = indx;
+  ld->qdata  = qdata;
+  ld->offset = 0;
+  ld->qoff   = 0;
+  ld->qidx   = NULL;
+  ld->nqidx  = 0;
+  ld->qimax  = 0;
+  ld->hash   = NULL;
+  ld->nhash  = 0;
+  ld->hmax   = 0;
+  ld->totlen = 0;
+  ld->maxlen = 0;
+  for (t = 0; t < 4; t++)
+    ld->count[t] = 0;
+  for (t = 0; t <= QUAL_MAX; t++)
+    ld->hist[t] = 0;
+  ld->nreads = 0;
+  ld->cells  = NULL;
+  ld->ncells = 0;
+  ld->cmax   = 0;
+
+  ld->pmax = 100;
+  ld->prec = (DAZZ_READ *) Malloc(sizeof(DAZZ_READ)*ld->pmax,"Allocating record buffer");
+  ld->parm = (Parse_Arg *) Malloc(sizeof(Parse_Arg)*NTHREADS,"Allocating thread records");
+  if (ld->prec == NULL || ld->parm == NULL)
+    { free(ld->prec);
+      free(ld->parm);
+      ld->prec = NULL;
+      ld->parm = NULL;
+      return (1);
+    }
+  for (t = 0; t < NTHREADS; t++)
+    { ld->parm[t].reads = NULL;
+      ld->parm[t].rmax  = 0;
+      ld->parm[t].bps   = NULL;
+      ld->parm[t].bmax  = 0;
+      ld->parm[t].qvs   = NULL;
+      ld->parm[t].qmax  = 0;
+      ld->parm[t].quals = (qdata != NULL);
+    }
+  return (0);
+}
+
+  //  Free the parsing buffers of ld, keeping its statistics, cells, QV index, and hashes
+
+static void release_loader(Loader *ld)
+{ int t;
+
+  if (ld->parm != NULL)
+    for (t = 0; t < NTHREADS; t++)
+      { free(ld->parm[t].reads);
+        free(ld->parm[t].bps);
+        free(ld->parm[t].qvs);
+      }
+  free(ld->parm);
+  free(ld->prec);
+  ld->parm = NULL;
+  ld->prec = NULL;
+}
+
+static void free_loader(Loader *ld)
+{ int c;
+
+  release_loader(ld);
+  for (c = 0; c < ld->ncells; c++)
+    free(ld->cells[c].prolog);
+  free(ld->cells);
+  free(ld->qidx);
+  free(ld->hash);
+}
+
+  //  Note that the cell with the given prolog ends before read last of the current input
+
+static int add_cell(Loader *ld, char *prolog, int last)
+{ Cell_Line *cl;
+
+  if (ld->ncells >= ld->cmax)
+    { ld->cmax  = 1.2*ld->ncells + 20;
+      ld->cells = (Cell_Line *) Realloc(ld->cells,sizeof(Cell_Line)*ld->cmax,
+                                        "Allocating cell list");
+      if (ld->cells == NULL)
+        return (1);
+    }
+  cl = ld->cells + ld->ncells;
+  cl->prolog = Strdup(prolog,"Allocating cell list");
+  if (cl->prolog == NULL)
+    return (1);
+  cl->last = last;
+  ld->ncells += 1;
+  return (0);
+}
+
+  //  Load the input scanned by fx (whose name for error messages is fname) with ld,
+  //    returning non-zero if an error occurred (having reported it).  Every chunk is
+  //    parsed by NTHREADS threads while the next is read, then the compressed bases of
+  //    each thread are appended in order and its read records are emitted grouped by well.
+
+static int load_input(Loader *ld, FX_Stream *fx, char *fname)
+{ char        prolog[MAX_NAME];
+  char       *bound[NTHREADS+1];
+  pthread_t   threads[NTHREADS];
+  int         i, c, t, x;
+  int         pwell, pcnt;
+  int         first, rlen;
+  int64       nline;
+  Parse_Arg  *pa;
+  Fasta_Read *r;
+  DAZZ_READ  *prec;
+
+  for (c = 0; c < ld->ncells; c++)
+    free(ld->cells[c].prolog);
+  ld->ncells = 0;
+  ld->nreads = 0;
+  for (t = 0; t < NTHREADS; t++)
+    ld->parm[t].format = fx->format;
+
+  prec  = ld->prec;
+  pcnt  = 0;
+  nline = 0;
+  pwell = -1;
+  first = 1;
+  while ((x = FX_Next_Chunk(fx)) > 0)
+    { FX_Partition(fx,NTHREADS,bound);
+      for (t = 0; t < NTHREADS; t++)
+        { ld->parm[t].beg = bound[t];
+          ld->parm[t].end = bound[t+1];
+          pthread_create(threads+t,NULL,parse_thread,ld->parm+t);
+        }
+      for (t = 0; t < NTHREADS; t++)
+        pthread_join(threads[t],NULL);
+
+      for (t = 0; t < NTHREADS; t++)
+        { pa = ld->parm+t;
+          if (pa->error)
+            { if (pa->error == FX_LONG)
+                { fprintf(stderr,"File %s, Line %lld: Fasta header line",
+                                 fname,nline+pa->eline);
+                  fprintf(stderr," is too long (> %d chars)\n",MAX_NAME-2);
+                }
+              else if (pa->error == FX_NOHEAD && fx->format == FX_FASTA)
+                { fprintf(stderr,"File %s, Line %lld:",fname,nline+pa->eline);
+                  fprintf(stderr," First header in fasta file is missing\n");
+                }
+              else if (pa->error == FX_NOHEAD || pa->error == FX_FORMAT)
+                fprintf(stderr,"File %s, Line %lld: Fastq record format error\n",
+                               fname,nline+pa->eline);
+              else if (pa->error == QV_RANGE)
+                { fprintf(stderr,"File %s, Line %lld: Quality value",fname,nline+pa->eline);
+                  fprintf(stderr," not in [!-%c] (Phred+33)\n",33+QUAL_MAX);
+                }
+              else if (pa->error != FX_SYSTEM)
+                fprintf(stderr,"File %s, Line %lld: Pacbio header line format error\n",
+                               fname,nline+pa->eline);
+              ld->prec = prec;
+              return (1);
+            }
+          nline += pa->nline;
+
+          if (pa->blen > 0)
+            fwrite(pa->bps,1,pa->blen,ld->bases);
+          for (c = 0; c < 4; c++)
+            ld->count[c] += pa->count[c];
+
+          if (ld->qdata != NULL)
+            { if (pa->qlen > 0)
+                fwrite(pa->qvs,1,pa->qlen,ld->qdata);
+              if (ld->nqidx + pa->nreads > ld->qimax)
+                { ld->qimax = 1.2*(ld->nqidx + pa->nreads) + 1000;
+                  ld->qidx  = (int64 *) Realloc(ld->qidx,sizeof(int64)*ld->qimax,
+                                                "Allocating track index");
+                  if (ld->qidx == NULL)
+                    { ld->prec = prec;
+                      return (1);
+                    }
+                }
+              for (r = pa->reads; r < pa->reads + pa->nreads; r++)
+                { ld->qoff += r->qlen;
+                  ld->qidx[ld->nqidx++] = ld->qoff;
+                }
+              for (c = 0; c <= QUAL_MAX; c++)
+                ld->hist[c] += pa->hist[c];
+            }
+
+          if (DEDUP)
+            { if (ld->nhash + pa->nreads > ld->hmax)
+                { ld->hmax = 1.2*(ld->nhash + pa->nreads) + 1000;
+                  ld->hash = (uint64 *) Realloc(ld->hash,sizeof(uint64)*ld->hmax,
+                                                "Allocating read hashes");
+                  if (ld->hash == NULL)
+                    { ld->prec = prec;
+                      return (1);
+                    }
+                }
+              for (r = pa->reads; r < pa->reads + pa->nreads; r++)
+                ld->hash[ld->nhash++] = r->hash;
+            }
+
+          for (r = pa->reads; r < pa->reads + pa->nreads; r++)
+            { if (first)
+                { strcpy(prolog,r->prolog);
+                  first = 0;
+                }
+              else if (strcmp(r->prolog,prolog) != 0)
+                { if (add_cell(ld,prolog,ld->nreads))
+                    { ld->prec = prec;
+                      return (1);
+                    }
+                  strcpy(prolog,r->prolog);
+                }
+
+              rlen        = r->rlen;
+              ld->nreads += 1;
+              ld->totlen += rlen;
+              if (rlen > ld->maxlen)
+                ld->maxlen = rlen;
+
+              bzero(prec+pcnt,sizeof(DAZZ_READ));   //  Zero padding so .idx is reproducible
+              prec[pcnt].origin = r->well;
+              prec[pcnt].fpulse = r->beg;
+              prec[pcnt].rlen   = rlen;
+              prec[pcnt].boff   = ld->offset;
+              prec[pcnt].coff   = -1;
+              prec[pcnt].flags  = r->qv;
+
+              ld->offset += COMPRESSED_LEN(rlen);
+
+              if (pwell == r->well)
+                { prec[pcnt].flags |= DB_CCS;
+                  pcnt += 1;
+                  if (pcnt >= ld->pmax)
+                    { ld->pmax = ((int) (pcnt*1.2)) + 100;
+                      prec = (DAZZ_READ *) realloc(prec,sizeof(DAZZ_READ)*ld->pmax);
+                      if (prec == NULL)
+                        { fprintf(stderr,"File %s, Line %lld: Out of memory",fname,nline);
+                          fprintf(stderr," (Allocating read records)\n");
+                          return (1);
+                        }
+                    }
+                }
+              else if (pcnt == 0)
+                pcnt += 1;
+              else
+                { x = 0;
+                  for (i = 1; i < pcnt; i++)
+                    if (prec[i].rlen > prec[x].rlen)
+                      x = i;
+                  prec[x].flags |= DB_BEST;
+                  fwrite(prec,sizeof(DAZZ_READ),pcnt,ld->indx);
+                  prec[0] = prec[pcnt];
+                  pcnt = 1;
+                }
+              pwell = r->well;
+            }
+        }
+    }
+  ld->prec = prec;
+  if (x < 0)
+    return (1);
+
+  //  Flush the last well group and note the last cell
+
+  x = 0;
+  for (i = 1; i < pcnt; i++)
+    if (prec[i].rlen > prec[x].rlen)
+      x = i;
+  prec[x].flags |= DB_BEST;
+  fwrite(prec,sizeof(DAZZ_READ),pcnt,ld->indx);
+
+  return (add_cell(ld,prolog,ld->nreads));
+}
+
+  //  Open the input name, i.e. <path>/<core><suffix> for the first suffix in Suffix for
+  //    which the file (or its .gz) exists, setting *core and *fname = <core><suffix>.
+  //    Return NULL if there is no such file or an error occurred, having reported it.
+
+static FILE *open_input(char *name, char **core, char **fname)
+{ FILE *input;
+  char *path;
+  int   k;
+
+  path = PathTo(name);
+  if (path == NULL)
+    return (NULL);
+  input = NULL;
+  for (k = 0; k < 4; k++)
+    { *core  = Gz_Root(name,Suffix[k]);
+      *fname = Strdup(Catenate(*core,Suffix[k],"",""),"Allocating file name");
+      if (*core == NULL || *fname == NULL)
+        break;
+      if ((input = Gz_Fopen(path,*core,Suffix[k],NTHREADS)) != NULL)
+        break;
+      free(*fname);
+      free(*core);
+    }
+  if (k >= 4)
+    fprintf(stderr,"%s: Cannot find %s as a .fasta, .fa, .fastq, or .fq file\n",Prog_Name,name);
+  free(path);
+  return (input);
+}
+
+typedef struct
+  { char   *name;    //  Input as named on the command line or in the -f file
+    char   *core;    //  Its core name and file name once opened
+    char   *fname;
+    int     state;   //  SHARD_TODO, _EMPTY, _DONE, or _ERROR
+    Loader  ld;      //  Its loader, whose files are closed once it is loaded
+  } Shard;
+
+#define SHARD_TODO   0
+#define SHARD_EMPTY  1
+#define SHARD_DONE   2
+#define SHARD_ERROR  3
+
+typedef struct
+  { Shard          *shard;   //  Inputs to load are shard[0..nshard-1], the next being shard[next]
+    int             nshard;
+    int             next;
+    int             quals;   //  Keep the QVs of .fastq inputs
+    int             abort;   //  Stop taking inputs as one has failed
+    char           *pwd;     //  The shard files of shard[i] are <pwd>/.<root>.<i>.shard.*
+    char           *root;
+    pthread_mutex_t lock;    //  Guards the above and calls to Catenate and GZ routines
+  } Shard_Pool;
+
+static char *shard_name(Shard_Pool *pool, int i, char *suffix)
+{ return (Catenate(pool->pwd,PATHSEP,pool->root,Numbered_Suffix(".",i,suffix))); }
+
+static void remove_shard(Shard_Pool *pool, int i)
+{ unlink(shard_name(pool,i,".shard.bps"));
+  unlink(shard_name(pool,i,".shard.idx"));
+  unlink(shard_name(pool,i,".shard.qvs"));
+}
+
+  //  Load inputs of the pool into shards until there are none left, opening and closing the
+  //    input and shard files with the pool locked.
+
+static void *shard_thread(void *arg)
+{ Shard_Pool *pool = (Shard_Pool *) arg;
+  Shard      *s;
+  FX_Stream  *fx;
+  FILE       *input, *bases, *indx, *qdata;
+  int         i, fail;
+
+  while (1)
+    { pthread_mutex_lock(&pool->lock);
+      if (pool->abort || pool->next >= pool->nshard)
+        { pthread_mutex_unlock(&pool->lock);
+          break;
+        }
+      i = pool->next++;
+      s = pool->shard + i;
+      s->state = SHARD_ERROR;
+      fx    = NULL;
+      bases = indx = qdata = NULL;
+      input = open_input(s->name,&s->core,&s->fname);
+      if (input != NULL)
+        { bases = Fopen(shard_name(pool,i,".shard.bps"),"w+");
+          indx  = Fopen(shard_name(pool,i,".shard.idx"),"w+");
+          if (pool->quals)
+            qdata = Fopen(shard_name(pool,i,".shard.qvs"),"w+");
+        }
+      pthread_mutex_unlock(&pool->lock);
+
+      fail = (input == NULL || bases == NULL || indx == NULL || (pool->quals && qdata == NULL));
+      if (!fail)
+        fail = init_loader(&s->ld,bases,indx,qdata);
+      if (!fail)
+        { fx = FX_Open(input);
+          if (fx == NULL)
+            fail = 1;
+          else if (fx->empty)
+            s->state = SHARD_EMPTY;
+          else
+            fail = load_input(&s->ld,fx,s->fname);
+          if (fx != NULL)
+            FX_Close(fx);
+          release_loader(&s->ld);
+        }
+
+      pthread_mutex_lock(&pool->lock);
+      if (input != NULL && Gz_Close(input) && !fail)
+        { fprintf(stderr,"%s: %s is not a valid gzip file or is truncated\n",
+                         Prog_Name,s->core);
+          fail = 1;
+        }
+      if (bases != NULL)
+        fclose(bases);
+      if (indx != NULL)
+        fclose(indx);
+      if (qdata != NULL)
+        fclose(qdata);
+      if (fail)
+        pool->abort = 1;
+      else if (s->state != SHARD_EMPTY)
+        s->state = SHARD_DONE;
+      pthread_mutex_unlock(&pool->lock);
+    }
+  return (NULL);
+}
+
+  //  Append the data of shard i loaded by sl to the files of ld, rebasing its .bps and QV
+  //    offsets, and fold its statistics into those of ld.  Return non-zero on an error.
+
+static int stitch_shard(Shard_Pool *pool, int i, Loader *ld, Loader *sl)
+{ static char buf[0x100000];
+  DAZZ_READ   rec;
+  FILE       *in;
+  int64       n;
+  int         c;
+
+  in = Fopen(shard_name(pool,i,".shard.bps"),"r");
+  if (in == NULL)
+    return (1);
+  while ((n = fread(buf,1,sizeof(buf),in)) > 0)
+    fwrite(buf,1,n,ld->bases);
+  fclose(in);
+
+  in = Fopen(shard_name(pool,i,".shard.idx"),"r");
+  if (in == NULL)
+    return (1);
+  for (c = 0; c < sl->nreads; c++)
+    { if (fread(&rec,sizeof(DAZZ_READ),1,in) != 1)
+        { fprintf(stderr,"%s: System error, read of shard failed\n",Prog_Name);
+          fclose(in);
+          return (1);
+        }
+      rec.boff += ld->offset;
+      fwrite(&rec,sizeof(DAZZ_READ),1,ld->indx);
+    }
+  fclose(in);
+
+  if (ld->qdata != NULL)
+    { in = Fopen(shard_name(pool,i,".shard.qvs"),"r");
+      if (in == NULL)
+        return (1);
+      while ((n = fread(buf,1,sizeof(buf),in)) > 0)
+        fwrite(buf,1,n,ld->qdata);
+      fclose(in);
+
+      if (ld->nqidx + sl->nqidx > ld->qimax)
+        { ld->qimax = 1.2*(ld->nqidx + sl->nqidx) + 1000;
+          ld->qidx  = (int64 *) Realloc(ld->qidx,sizeof(int64)*ld->qimax,
+                                        "Allocating track index");
+          if (ld->qidx == NULL)
+            return (1);
+        }
+      for (c = 0; c < sl->nqidx; c++)
+        ld->qidx[ld->nqidx++] = sl->qidx[c] + ld->qoff;
+      for (c = 0; c <= QUAL_MAX; c++)
+        ld->hist[c] += sl->hist[c];
+      ld->qoff += sl->qoff;
+    }
+
+  if (DEDUP && sl->nhash > 0)
+    { if (ld->nhash + sl->nhash > ld->hmax)
+        { ld->hmax = 1.2*(ld->nhash + sl->nhash) + 1000;
+          ld->hash = (uint64 *) Realloc(ld->hash,sizeof(uint64)*ld->hmax,"Allocating read hashes");
+          if (ld->hash == NULL)
+            return (1);
+        }
+      memcpy(ld->hash+ld->nhash,sl->hash,sizeof(uint64)*sl->nhash);
+      ld->nhash += sl->nhash;
+    }
+
+  ld->offset += sl->offset;
+  ld->totlen += sl->totlen;
+  if (sl->maxlen > ld->maxlen)
+    ld->maxlen = sl->maxlen;
+  for (c = 0; c < 4; c++)
+    ld->count[c] += sl->count[c];
+  return (0);
+}
+
+
+/*******************************************************************************************
+ *
+ *  Duplicate detection (-d): the hash of each read is computed by the parse threads as its
+ *    bases are compressed.  Once every input has been added, the reads of the db are entered
+ *    in order into an open-addressing table of read indices keyed on their hashes, where the
+ *    hashes of the reads that were already in the db are computed from its .bps as they are
+ *    reached.  A read whose hash is that of a read already in the table is an exact duplicate
+ *    if their lengths and compressed bases are equal (so a hash collision is never taken for
+ *    a duplicate).  New reads that are duplicates are flagged DB_DUP in the .idx and are not
+ *    entered in the table, i.e. the first copy of a read is the one that is not flagged.
+ *    The hashes of all the reads are then saved in the track HASH_TRACK (an int64 per read)
+ *    so that the next addition with -d need only compute those of the reads added since.
+ *
+ ********************************************************************************************/
+
+#define DUP_BATCH  10000   //  # of .idx records read and rewritten at a time
+#define HASH_TRACK "hash"  //  Custom track of the hashes of the reads of the db
+
+  //  Read the compressed bases of the read with record r from bases into *buf, enlarging it
+  //    (*bmax is its size) as necessary.  Return non-zero on an error, having reported it.
+
+static int fetch_bases(FILE *bases, DAZZ_READ *r, uint8 **buf, int *bmax)
+{ int n;
+
+  n = COMPRESSED_LEN(r->rlen);
+  if (n >= *bmax)
+    { *bmax = 1.2*n + 1000;
+      *buf  = (uint8 *) Realloc(*buf,*bmax,"Allocating base buffer");
+      if (*buf == NULL)
+        return (1);
+    }
+  if (fseeko(bases,r->boff,SEEK_SET) < 0 || fread(*buf,1,n,bases) != (size_t) n)
+    { fprintf(stderr,"%s: System error, read of .bps failed\n",Prog_Name);
+      return (1);
+    }
+  return (0);
+}
+
+  //  Flag the duplicates among reads first..nreads-1 of the db whose bases and records are in
+  //    ld->bases and ld->indx, where ld->hash[first..nreads-1] are the hashes of these reads,
+  //    ld->hash[0..known-1] are those of the first known reads of the db, and the remainder
+  //    is space for those of the reads in between.  Set dups[0] to
+  //    the # of duplicates, dups[1] to their total length, and dups[2] to the # that are a
+  //    copy of one of reads 0..first-1.  Return non-zero on an error, having reported it.
+
+static int mark_duplicates(Loader *ld, int known, int first, int nreads, int64 *dups)
+{ DAZZ_READ *rec, *r, o;
+  uint64    *hash;
+  int       *table;
+  int64      tsize, slot, pos;
+  uint8     *ibuf, *jbuf;
+  int        imax, jmax;
+  int        i, j, k, n;
+  int        have, dirty;
+
+  for (tsize = 1024; tsize < 2*((int64) nreads); tsize *= 2)
+    continue;
+  hash  = ld->hash;
+  rec   = (DAZZ_READ *) Malloc(sizeof(DAZZ_READ)*DUP_BATCH,"Allocating record buffer");
+  table = (int *) Malloc(sizeof(int)*tsize,"Allocating duplicate table");
+  if (rec == NULL || table == NULL)
+    { free(table);
+      free(rec);
+      return (1);
+    }
+  memset(table,-1,sizeof(int)*tsize);
+  ibuf = jbuf = NULL;
+  imax = jmax = 0;
+
+  dups[0] = dups[1] = dups[2] = 0;
+  for (i = 0; i < nreads; i += n)
+    { n = nreads-i;
+      if (n > DUP_BATCH)
+        n = DUP_BATCH;
+      pos = sizeof(DAZZ_DB) + sizeof(DAZZ_READ)*((int64) i);
+      if (fseeko(ld->indx,pos,SEEK_SET) < 0 || fread(rec,sizeof(DAZZ_READ),n,ld->indx) != (size_t) n)
+        { fprintf(stderr,"%s: System error, read of .idx failed\n",Prog_Name);
+          goto error;
+        }
+
+      dirty = 0;
+      for (k = 0; k < n; k++)
+        { r = rec+k;
+          if (i+k >= known && i+k < first)
+            { if (fetch_bases(ld->bases,r,&ibuf,&imax))
+                goto error;
+              hash[i+k] = read_hash(r->rlen,ibuf);
+              have = 1;
+            }
+          else
+            have = 0;
+
+          slot = hash[i+k] & (tsize-1);
+          while ((j = table[slot]) >= 0)
+            { if (hash[j] == hash[i+k])
+                { if (j >= i)
+                    o = rec[j-i];
+                  else if (fseeko(ld->indx,sizeof(DAZZ_DB)+sizeof(DAZZ_READ)*((int64) j),SEEK_SET) < 0
+                             || fread(&o,sizeof(DAZZ_READ),1,ld->indx) != 1)
+                    { fprintf(stderr,"%s: System error, read of .idx failed\n",Prog_Name);
+                      goto error;
+                    }
+                  if (o.rlen == r->rlen)
+                    { if (!have)
+                        { if (fetch_bases(ld->bases,r,&ibuf,&imax))
+                            goto error;
+                          have = 1;
+                        }
+                      if (fetch_bases(ld->bases,&o,&jbuf,&jmax))
+                        goto error;
+                      if (memcmp(ibuf,jbuf,COMPRESSED_LEN(r->rlen)) == 0)
+                        break;
+                    }
+                }
+              slot = (slot+1) & (tsize-1);
+            }
+
+          if (j < 0)
+            table[slot] = i+k;
+          else if (i+k >= first)
+            { r->flags |= DB_DUP;
+              dirty     = 1;
+              dups[0]  += 1;
+              dups[1]  += r->rlen;
+              if (j < first)
+                dups[2] += 1;
+            }
+        }
+
+      if (dirty)
+        { if (fseeko(ld->indx,pos,SEEK_SET) < 0)
+            SYSTEM_WRITE_ERROR
+          FFWRITE(rec,sizeof(DAZZ_READ),n,ld->indx)
+        }
+    }
+
+  free(jbuf);
+  free(ibuf);
+  free(table);
+  free(rec);
+  return (0);
+
+error:
+  free(jbuf);
+  free(ibuf);
+  free(table);
+  free(rec);
+  return (1);
+}
+
 
 int main(int argc, char *argv[])
 { FILE  *istub, *ostub;
@@ -126,29 +1000,49 @@ int main(int argc, char *argv[])
   char **flist;
 
   DAZZ_DB db;
-  int     ureads;
+  int     ureads, oreads;
+  int     hreads;
   int64   offset;
 
+  FILE       *qanno, *qdata;
+  int64       qoff, doff, aoff;
+  int         qnew, nqext, qhist;
+  DAZZ_EXTRA *qext;
+
+  Loader      load;
+  Shard_Pool  pool;
+
   char   *PIPE;
   FILE   *IFILE;
   int     VERBOSE;
+  int     QUALS;
+  int     PFILES;
 
   //   Process command line
 
   { int   i, j, k;
     int   flags[128];
+    char *eptr;
 
     ARG_INIT("fasta2DB")
 
-    IFILE = NULL;
-    PIPE  = NULL;
+    IFILE    = NULL;
+    PIPE     = NULL;
+    NTHREADS = 4;
+    PFILES   = 1;
 
     j = 1;
     for (i = 1; i < argc; i++)
       if (argv[i][0] == '-')
         switch (argv[i][1])
         { default:
-            ARG_FLAGS("v")
+            ARG_FLAGS("vqd")
+            break;
+          case 'T':
+            ARG_POSITIVE(NTHREADS,"Number of threads")
+            break;
+          case 'P':
+            ARG_POSITIVE(PFILES,"Number of files loaded in parallel")
             break;
           case 'f':
             IFILE = fopen(argv[i]+2,"r");
@@ -179,6 +1073,8 @@ int main(int argc, char *argv[])
     argc = j;
 
     VERBOSE = flags['v'];
+    QUALS   = flags['q'];
+    DEDUP   = flags['d'];
 
     if (IFILE != NULL && PIPE != NULL)
       { fprintf(stderr,"%s: Cannot use both -f and -i together\n",Prog_Name);
@@ -187,11 +1083,19 @@ int main(int argc, char *argv[])
 
     if ( (IFILE == NULL && PIPE == NULL && argc <= 2) || 
         ((IFILE != NULL || PIPE != NULL) && argc != 2))
-      { fprintf(stderr,"Usage: %s %s\n",Prog_Name,Usage);
+      { fprintf(stderr,"Usage: %s %s\n",Prog_Name,Usage[0]);
+        fprintf(stderr,"       %*s %s\n",(int) strlen(Prog_Name),"",Usage[1]);
         fprintf(stderr,"\n");
         fprintf(stderr,"      -f: import files listed 1/line in given file.\n");
         fprintf(stderr,"      -i: import data from stdin, use optiona name as data source.\n");
         fprintf(stderr,"        : otherwise, import sequence of specified files.\n");
+        fprintf(stderr,"      -q: keep the QVs of .fastq input in the track '%s'.\n",QUAL_TRACK);
+        fprintf(stderr,"      -d: flag reads that are exact duplicates of an earlier read.\n");
+        fprintf(stderr,"        : the read hashes are kept in the track '%s' so that a later -d\n",
+                       HASH_TRACK);
+        fprintf(stderr,"        :   addition only hashes the reads added since.\n");
+        fprintf(stderr,"      -T: Use -T threads to parse and compress the input.\n");
+        fprintf(stderr,"      -P: Load -P input files at a time in parallel (each with -T threads).\n");
         exit (1);
       }
   }
@@ -211,6 +1115,13 @@ int main(int argc, char *argv[])
   //    ofiles = # of .fasta files added so far
   //    ocells = # of SMRT cells already in db
   //    flist  = [0..ifiles+ocells] list of file names (root only) added to db so far
+  //    qanno  = .qual.anno file if QVs are being kept, NULL otherwise
+  //    qdata  = .qual.data file positioned for appending
+  //    qoff   = offset in .qual.data at which to place next QVs
+  //    doff   = offset in .qual.data file to truncate to if command fails
+  //    aoff   = offset in .qual.anno of the entry for the first new read
+  //    qnew   = the quality track is being created
+  //    qext   = [0..nqext-1] extras of the quality track, qext[qhist] is its QV histogram
 
   { int i;
 
@@ -241,9 +1152,19 @@ int main(int argc, char *argv[])
 
     bases = NULL;
     indx  = NULL;
+    pool.shard = NULL;
+    pool.next  = 0;
     ostub = NULL;
     ioff  = 0;
     boff  = 0;
+    qanno = NULL;
+    qdata = NULL;
+    qnew  = 0;
+    qoff  = 0;
+    doff  = 0;
+    aoff  = 0;
+    qhist = 0;
+    hreads = 0;
 
     istub = fopen(dbname,"r");
     if (istub == NULL)
@@ -290,6 +1211,101 @@ int main(int argc, char *argv[])
           SYSTEM_READ_ERROR
       }
 
+    //  Open the quality track if it exists, or create it (with empty entries for all the
+    //    reads already in the db) if QVs are to be kept.  The index entries of the new
+    //    reads overwrite the extras of the track, which are kept in qext and rewritten
+    //    after them, all only once every input has been added successfully.
+
+    nqext = 0;
+    qext  = NULL;
+    if (istub != NULL)
+      qanno = fopen(Catenate(pwd,PATHSEP,root,"."QUAL_TRACK".anno"),"r+");
+    if (qanno != NULL)
+      { int qreads, size, emax;
+
+        qdata = Fopen(Catenate(pwd,PATHSEP,root,"."QUAL_TRACK".data"),"r+");
+        if (qdata == NULL)
+          goto error;
+        if (fread(&qreads,sizeof(int),1,qanno) != 1 || fread(&size,sizeof(int),1,qanno) != 1)
+          { fprintf(stderr,"%s: Track %s.%s is corrupted\n",Prog_Name,root,QUAL_TRACK);
+            goto error;
+          }
+        if (qreads != ureads || size != 8)
+          { fprintf(stderr,"%s: Track %s.%s does not correspond to the db\n",
+                           Prog_Name,root,QUAL_TRACK);
+            goto error;
+          }
+        aoff = 2*sizeof(int) + sizeof(int64)*(qreads+1);
+        if (fseeko(qanno,aoff-sizeof(int64),SEEK_SET) < 0)
+          SYSTEM_READ_ERROR
+        if (fread(&qoff,sizeof(int64),1,qanno) != 1)
+          { fprintf(stderr,"%s: Track %s.%s is corrupted\n",Prog_Name,root,QUAL_TRACK);
+            goto error;
+          }
+
+        emax = 0;
+        while (1)
+          { if (nqext >= emax)
+              { emax = 2*emax + 4;
+                qext = (DAZZ_EXTRA *) Realloc(qext,sizeof(DAZZ_EXTRA)*emax,
+                                              "Allocating extras");
+                if (qext == NULL)
+                  goto error;
+              }
+            qext[nqext].nelem = 0;
+            if (Read_Extra(qanno,Catenate(root,".",QUAL_TRACK,".anno"),qext+nqext))
+              break;
+            nqext += 1;
+          }
+        if (fseeko(qdata,0,SEEK_END) < 0)
+          SYSTEM_READ_ERROR
+        doff = ftello(qdata);
+        if (doff < 0)
+          SYSTEM_READ_ERROR
+      }
+    else if (QUALS)
+      { int size, i;
+
+        qanno = Fopen(Catenate(pwd,PATHSEP,root,"."QUAL_TRACK".anno"),"w+");
+        qdata = Fopen(Catenate(pwd,PATHSEP,root,"."QUAL_TRACK".data"),"w+");
+        qnew  = 1;
+        if (qanno == NULL || qdata == NULL)
+          goto error;
+        size = 8;
+        qoff = 0;
+        FFWRITE(&ureads,sizeof(int),1,qanno)
+        FFWRITE(&size,sizeof(int),1,qanno)
+        for (i = 0; i <= ureads; i++)
+          FFWRITE(&qoff,sizeof(int64),1,qanno)
+        aoff = ftello(qanno);
+        doff = 0;
+      }
+
+    if (qanno != NULL)
+      { for (qhist = 0; qhist < nqext; qhist++)
+          if (strcmp(qext[qhist].name,QUAL_HISTOGRAM) == 0)
+            break;
+        if (qhist >= nqext)
+          { int64 *hist;
+
+            qext = (DAZZ_EXTRA *) Realloc(qext,sizeof(DAZZ_EXTRA)*(nqext+1),"Allocating extras");
+            hist = (int64 *) Malloc(sizeof(int64)*(QUAL_MAX+1),"Allocating QV histogram");
+            if (qext == NULL || hist == NULL)
+              goto error;
+            bzero(hist,sizeof(int64)*(QUAL_MAX+1));
+            qext[nqext].vtype = DB_INT;
+            qext[nqext].nelem = QUAL_MAX+1;
+            qext[nqext].accum = DB_SUM;
+            qext[nqext].name  = QUAL_HISTOGRAM;
+            qext[nqext].value = hist;
+            nqext += 1;
+          }
+        else if (qext[qhist].vtype != DB_INT || qext[qhist].nelem != QUAL_MAX+1)
+          { fprintf(stderr,"%s: Track %s.%s is corrupted\n",Prog_Name,root,QUAL_TRACK);
+            goto error;
+          }
+      }
+
     flist  = (char **) Malloc(sizeof(char *)*(ocells+ifiles),"Allocating file list");
     ostub  = Fopen(Catenate(pwd,"/",root,".dbx"),"w+");
     if (ostub == NULL || flist == NULL)
@@ -321,90 +1337,146 @@ int main(int argc, char *argv[])
       }
   }
 
-  { int            maxlen;
-    int64          totlen, count[4];
-    int64          rmax;
-    int            pmax;
-    DAZZ_READ     *prec;
-    char          *read;
-    int            c;
+  { int            c, k;
     File_Iterator *ng = NULL;
 
-    //  Buffer for reads all in the same well
-
-    pmax = 100;
-    prec = (DAZZ_READ *) Malloc(sizeof(DAZZ_READ)*pmax,"Allocating record buffer");
-    if (prec == NULL)
+    if (init_loader(&load,bases,indx,qdata))
       goto error;
+    load.offset = offset;
+    load.qoff   = qoff;
+    oreads      = ureads;
+    if (DEDUP)
+      { load.hmax = ureads + 1000;
+        load.hash = (uint64 *) Malloc(sizeof(uint64)*load.hmax,"Allocating read hashes");
+        if (load.hash == NULL)
+          goto error;
+        load.nhash = ureads;
+
+        //  Take the hashes of the first hreads reads of the db from its hash track, if
+        //    any, where a track that is unreadable or longer than the db is ignored
+
+        if (istub != NULL)
+          { FILE *hanno;
+            int   size;
+
+            hanno = fopen(Catenate(pwd,PATHSEP,root,"."HASH_TRACK".anno"),"r");
+            if (hanno != NULL)
+              { if (fread(&hreads,sizeof(int),1,hanno) != 1
+                     || fread(&size,sizeof(int),1,hanno) != 1
+                     || size != 8 || hreads < 0 || hreads > ureads
+                     || fread(load.hash,sizeof(uint64),hreads,hanno) != (size_t) hreads)
+                  hreads = 0;
+                fclose(hanno);
+              }
+          }
+      }
 
-    //  Buffer for accumulating .fasta sequence over multiple lines
+    //  With -P, load all the named inputs into shards concurrently
 
-    rmax  = MAX_NAME + 10000000;
-    read  = (char *) Malloc(rmax+1,"Allocating line buffer");
-    if (read == NULL)
-      goto error;
+    if (PIPE == NULL && PFILES > 1)
+      { pthread_t threads[PFILES];
+        int       t, nthreads;
 
-    totlen = 0;              //  total # of bases in new .fasta files
-    maxlen = 0;              //  longest read in new .fasta files
-    for (c = 0; c < 4; c++)  //  count of acgt in new .fasta files
-      count[c] = 0;
+        ng = init_file_iterator(argc,argv,IFILE,2);
+        if (ng == NULL)
+          goto error;
+        pool.shard = (Shard *) Malloc(sizeof(Shard)*ifiles,"Allocating shards");
+        if (pool.shard == NULL)
+          goto error;
+        bzero(pool.shard,sizeof(Shard)*ifiles);
+        for (k = 0; next_file(ng); k++)
+          { if (ng->name == NULL)
+              goto error;
+            pool.shard[k].name = Strdup(ng->name,"Allocating file name");
+            if (pool.shard[k].name == NULL)
+              goto error;
+          }
+        free(ng);
+        pool.nshard = k;
+        pool.next   = 0;
+        pool.quals  = (qanno != NULL);
+        pool.abort  = 0;
+        pool.pwd    = pwd;
+        pool.root   = root;
+        pthread_mutex_init(&pool.lock,NULL);
+
+        nthreads = PFILES;
+        if (nthreads > pool.nshard)
+          nthreads = pool.nshard;
+        for (t = 0; t < nthreads; t++)
+          pthread_create(threads+t,NULL,shard_thread,&pool);
+        for (t = 0; t < nthreads; t++)
+          pthread_join(threads[t],NULL);
+        if (pool.abort)
+          goto error;
+      }
 
     //  For each new input source do
 
-    if (PIPE == NULL)
+    else if (PIPE == NULL)
       { ng = init_file_iterator(argc,argv,IFILE,2);  //  Setup to read .fasta's
         if (ng == NULL)                              //    from command line or file
           goto error;
       }
 
-    while (PIPE != NULL || next_file(ng))
-      { FILE *input;
-        char  prolog[MAX_NAME];
-        char *path, *core, *fname;
-        int   eof;
-
-        //  Open it: <path>/<core>.fasta if file, stdin otherwise with core = PIPE or "stdout"
-
-        if (PIPE == NULL)
-
-          { if (ng->name == NULL) goto error;
+    for (k = 0; PIPE != NULL || (pool.shard != NULL ? k < pool.nshard : next_file(ng)); k++)
+      { FILE      *input;
+        char      *core, *fname;
+        FX_Stream *fx;
+        Loader    *ld;
+
+        //  Open it: <path>/<core>.<suffix> for the first suffix in Suffix for which the file
+        //    exists if file, stdin otherwise with core = PIPE or "stdout".  If it is in a
+        //    shard then it has been loaded already.
+
+        input = NULL;
+        fx    = NULL;
+        if (pool.shard != NULL)
+          { core  = pool.shard[k].core;
+            fname = pool.shard[k].fname;
+          }
 
-            path  = PathTo(ng->name);
-            core  = Root(ng->name,".fasta");
-            fname = Strdup(Catenate(core,".fasta",NULL,NULL),"Allocating file name");
-            if ((input = fopen(Catenate(path,"/",core,".fasta"),"r")) == NULL)
-              { free(fname);
-                free(core);
-                core  = Root(ng->name,".fa");
-                fname = Strdup(Catenate(core,".fa",NULL,NULL),"Allocating file name");
-                if ((input = fopen(Catenate(path,"/",core,".fa"),"r")) == NULL)
-                  goto error;
-              }
-            free(path);
+        else if (PIPE == NULL)
+          { if (ng->name == NULL)
+              goto error;
+            input = open_input(ng->name,&core,&fname);
+            if (input == NULL)
+              goto error;
           }
 
         else
-
           { if (PIPE[0] == '\0')
               core  = Strdup("stdout","Allocating file name");
             else
               core  = Strdup(PIPE,"Allocating file name");
             if (core == NULL)
               goto error;
-            input = stdin;
+            input = Gz_Input(stdin,NTHREADS);
+            if (input == NULL)
+              goto error;
           }
 
-        //  Get the header of the first line.  If the file is empty skip.
+        //  Start scanning the input.  If the file is empty skip.
 
-        eof = (fgets(read,MAX_NAME,input) == NULL);
-        if (eof || strlen(read) < 1)
-          { fclose(input);
+        if (input != NULL)
+          { fx = FX_Open(input);
+            if (fx == NULL)
+              goto error;
+          }
+        if (fx != NULL ? fx->empty : pool.shard[k].state == SHARD_EMPTY)
+          { if (fx != NULL)
+              { FX_Close(fx);
+                Gz_Close(input);
+              }
             if (PIPE != NULL)
               { fprintf(stderr,"Standard input is empty, terminating!\n");
                 break;
               }
             fprintf(stderr,"Skipping '%s', file is empty!\n",core);
-            free(core);
+            if (pool.shard == NULL)
+              free(core);
+            else
+              remove_shard(&pool,k);
             continue;
           }
 
@@ -413,18 +1485,21 @@ int main(int argc, char *argv[])
         if (strlen(core) >= MAX_NAME)
           { fprintf(stderr,"%s: File name over %d chars: '%.200s'\n",
                            Prog_Name,MAX_NAME,core);
+            if (fx != NULL)
+              FX_Close(fx);
             goto error;
           }
 
         { int j;
 
- 
           if (PIPE == NULL || (strcmp(core,"stdout") != 0 &&
                  (ofiles == 0 || strcmp(core,flist[ofiles-1]) != 0)))
             for (j = 0; j < ofiles; j++)
               if (strcmp(core,flist[j]) == 0)
                 { fprintf(stderr,"%s: File %s is already in database %s.db\n",
                                  Prog_Name,fname,Root(argv[1],".db"));
+                  if (fx != NULL)
+                    FX_Close(fx);
                   goto error;
                 }
         }
@@ -440,180 +1515,63 @@ int main(int argc, char *argv[])
           }
         flist[ofiles++] = core;
 
-        // Check that the first line is a header and has PACBIO format.
+        //  Load the input, or stitch its shard onto the db
 
-        if (read[0] != '>')
-          { fprintf(stderr,"File %s, Line 1: First header in fasta file is missing\n",fname);
-            goto error;
-          }
-        if (read[strlen(read)-1] != '\n')
-          { fprintf(stderr,"File %s, Line 1: Fasta header line is too long (> %d chars)\n",
-                           fname,MAX_NAME-2);
-            goto error;
+        if (fx != NULL)
+          { ld = &load;
+            c  = load_input(ld,fx,fname);
+            FX_Close(fx);
+            if (c)
+              goto error;
           }
-
-        { char *find;
-          int   well, beg, end, qv;
-
-          find = index(read+1,'/');
-          if (find != NULL && sscanf(find+1,"%d/%d_%d RQ=0.%d\n",&well,&beg,&end,&qv) >= 3)
-            { *find = '\0';
-              strcpy(prolog,read+1);
-              *find = '/';
-            }
-          else if (find != NULL && sscanf(find+1,"%d/ccs\n",&well) >= 1)
-            { *find = '\0';
-              strcpy(prolog,read+1);
-              *find = '/';
-            }
-          else
-            { fprintf(stderr,"File %s, Line 1: Pacbio header line format error\n",fname);
+        else
+          { ld = &(pool.shard[k].ld);
+            if (stitch_shard(&pool,k,&load,ld))
               goto error;
-            }
-        }
-
-        //  Read in all the sequences until end-of-file
-
-        { int i, x;
-          int nline, pwell, rlen, pcnt;
-
-          pcnt  = 0;
-          rlen  = 0;
-          nline = 1;
-          pwell = -1;
-          while (!eof)
-            { int   beg, end, clen;
-              int   well, qv;
-              char *find;
-
-              find = index(read+(rlen+1),'/');
-              if (find == NULL)
-                { fprintf(stderr,"File %s, Line %d: Pacbio header line format error\n",
-                                 fname,nline);
-                  goto error;
-                }
-              *find = '\0';
-              if (strcmp(read+(rlen+1),prolog) != 0)
-                { fprintf(ostub,DB_FDATA,ureads,core,prolog);
-                  ocells += 1;
-                  strcpy(prolog,read+(rlen+1));
-                }
-              *find = '/';
-              x = sscanf(find+1,"%d/%d_%d RQ=0.%d\n",&well,&beg,&end,&qv);
-              if (x < 3)
-                { char *secn = index(find+1,'/');
-                  x = sscanf(find+1,"%d/ccs\n",&well);
-                  if (secn == NULL || strncmp(secn+1,"ccs",3) != 0 || x < 1)
-                    { fprintf(stderr,"File %s, Line %d: Pacbio header line format error\n",
-                                     fname,nline);
-                      goto error;
-                    }
-                  beg = 0;
-                  qv  = 0;
-                }
-              else if (x == 3)
-                qv = 0;
-
-              rlen = 0;
-              while (1)
-                { eof = (fgets(read+rlen,MAX_NAME,input) == NULL);
-                  x = strlen(read+rlen)-1;
-                  if (read[rlen] == '>')
-                    { if (read[rlen+x] != '\n')
-                        { fprintf(stderr,"File %s, Line %d: Fasta header line",fname,nline);
-                          fprintf(stderr," is too long (> %d chars)\n",MAX_NAME-2);
-                          goto error;
-                        }
-                      nline += 1;
-                      break;
-                    }
-                  if (eof)
-                    break;
-                  if (read[rlen+x] == '\n')
-                    nline += 1;
-                  else
-                    x += 1;
-                  rlen += x;
-                  if (rlen + MAX_NAME > rmax)
-                    { rmax = ((int64) (1.4 * rmax)) + 10000000 + MAX_NAME;
-                      read = (char *) realloc(read,rmax+1);
-                      if (read == NULL)
-                        { fprintf(stderr,"File %s, Line %d:",fname,nline);
-                          fprintf(stderr," Out of memory (Allocating line buffer)\n");
-                          goto error;
-                        }
-                    }
-                }
-              read[rlen] = '\0';
-
-              for (i = 0; i < rlen; i++)
-                { x = number[(int) read[i]];
-                  count[x] += 1;
-                  read[i]   = (char) x;
-                }
-              ureads += 1;
-              totlen += rlen;
-              if (rlen > maxlen)
-                maxlen = rlen;
-
-              prec[pcnt].origin = well;
-              prec[pcnt].fpulse = beg;
-              prec[pcnt].rlen   = rlen;
-              prec[pcnt].boff   = offset;
-              prec[pcnt].coff   = -1;
-              prec[pcnt].flags  = qv;
+            remove_shard(&pool,k);
+          }
 
-              Compress_Read(rlen,read);
-              clen = COMPRESSED_LEN(rlen);
-              fwrite(read,1,clen,bases);
-              offset += clen;
+        //  Write the file lines of its cells in the db image
 
-              if (pwell == well)
-                { prec[pcnt].flags |= DB_CCS;
-                  pcnt += 1;
-                  if (pcnt >= pmax)
-                    { pmax = ((int) (pcnt*1.2)) + 100;
-                      prec = (DAZZ_READ *) realloc(prec,sizeof(DAZZ_READ)*pmax);
-                      if (prec == NULL)
-                        { fprintf(stderr,"File %s, Line %d: Out of memory",fname,nline);
-                          fprintf(stderr," (Allocating read records)\n");
-                          goto error;
-                        }
-                    }
-                }
-              else if (pcnt == 0)
-                pcnt += 1;
-              else
-                { x = 0;
-                  for (i = 1; i < pcnt; i++)
-                    if (prec[i].rlen > prec[x].rlen)
-                      x = i;
-                  prec[x].flags |= DB_BEST;
-                  fwrite(prec,sizeof(DAZZ_READ),pcnt,indx);
-                  prec[0] = prec[pcnt];
-                  pcnt = 1;
-                }
-              pwell = well;
-            }
+        for (c = 0; c < ld->ncells; c++)
+          { fprintf(ostub,DB_FDATA,ureads + ld->cells[c].last,core,ld->cells[c].prolog);
+            ocells += 1;
+          }
+        ureads += ld->nreads;
+        if (ld != &load)
+          free_loader(ld);
 
-          //  Complete processing of .fasta file: flush last well group, write file line
-          //      in db image, and close file
+        if (input != NULL && input != stdin && Gz_Close(input))
+          { fprintf(stderr,"%s: %s is not a valid gzip file or is truncated\n",Prog_Name,core);
+            goto error;
+          }
+        if (PIPE != NULL)
+          break;
+      }
 
-          x = 0;
-          for (i = 1; i < pcnt; i++)
-            if (prec[i].rlen > prec[x].rlen)
-              x = i;
-          prec[x].flags |= DB_BEST;
-          fwrite(prec,sizeof(DAZZ_READ),pcnt,indx);
-        }
+    //  Flag the new reads that are duplicates and report how many there are
 
-        fprintf(ostub,DB_FDATA,ureads,core,prolog);
-        ocells += 1;
+    if (DEDUP && ureads > oreads)
+      { int64 dups[3];
 
-        if (input != stdin)
-          fclose(input);
-        else
-          break;
+        if (VERBOSE)
+          { fprintf(stderr,"Finding duplicate reads ...\n");
+            fflush(stderr);
+          }
+        if (mark_duplicates(&load,hreads,oreads,ureads,dups))
+          goto error;
+        fprintf(stderr,"  ");
+        Print_Number(dups[0],0,stderr);
+        fprintf(stderr," of the ");
+        Print_Number(ureads-oreads,0,stderr);
+        fprintf(stderr," reads added are exact duplicates (");
+        Print_Number(dups[1],0,stderr);
+        fprintf(stderr,"bp) and have been flagged\n");
+        if (oreads > 0)
+          { fprintf(stderr,"    ");
+            Print_Number(dups[2],0,stderr);
+            fprintf(stderr," of them are copies of reads already in the db\n");
+          }
       }
 
     //  Finished loading all sequences: update relevant fields in db record
@@ -621,18 +1579,19 @@ int main(int argc, char *argv[])
     db.ureads = ureads;
     if (istub == NULL)
       { for (c = 0; c < 4; c++)
-          db.freq[c] = (float) ((1.*count[c])/totlen);
-        db.totlen = totlen;
-        db.maxlen = maxlen;
+          db.freq[c] = (float) ((1.*load.count[c])/load.totlen);
+        db.totlen = load.totlen;
+        db.maxlen = load.maxlen;
         db.cutoff = -1;
         db.allarr = 0;
       }
     else
       { for (c = 0; c < 4; c++)
-          db.freq[c] = (float) ((db.freq[c]*db.totlen + (1.*count[c]))/(db.totlen + totlen));
-        db.totlen += totlen;
-        if (maxlen > db.maxlen)
-          db.maxlen = maxlen;
+          db.freq[c] = (float) ((db.freq[c]*db.totlen + (1.*load.count[c]))
+                                    /(db.totlen + load.totlen));
+        db.totlen += load.totlen;
+        if (load.maxlen > db.maxlen)
+          db.maxlen = load.maxlen;
       }
   }
 
@@ -739,6 +1698,61 @@ int main(int argc, char *argv[])
   fclose(indx);
   fclose(bases);
 
+  //  Complete the quality track: append the index entries of the new reads followed by
+  //    the updated extras, and record the new number of reads
+
+  if (qanno != NULL)
+    { int64 *hist;
+      int    size = 8;
+      int    c;
+
+      FSEEKO(qanno,aoff,SEEK_SET)
+      hist = (int64 *) qext[qhist].value;
+      for (c = 0; c <= QUAL_MAX; c++)
+        hist[c] += load.hist[c];
+      if (load.nqidx > 0)
+        FFWRITE(load.qidx,sizeof(int64),load.nqidx,qanno)
+      Write_Extras(qanno,qext,nqext);
+      if (fflush(qanno) != 0)
+        SYSTEM_WRITE_ERROR
+      FTELLO(aoff,qanno)
+      if (ftruncate(fileno(qanno),aoff) < 0)
+        SYSTEM_WRITE_ERROR
+      FSEEKO(qanno,0,SEEK_SET)
+      FFWRITE(&ureads,sizeof(int),1,qanno)
+      FFWRITE(&size,sizeof(int),1,qanno)
+      FCLOSE(qanno)
+      FCLOSE(qdata)
+    }
+
+  //  Save the hashes of all the reads in the hash track, appending those not already in it.
+  //    The header is written last so that a track left incomplete is never read as valid.
+
+  if (DEDUP && ureads > oreads)
+    { FILE *hanno;
+      int   size = 8;
+
+      if (hreads > 0)
+        hanno = fopen(Catenate(pwd,PATHSEP,root,"."HASH_TRACK".anno"),"r+");
+      else
+        hanno = fopen(Catenate(pwd,PATHSEP,root,"."HASH_TRACK".anno"),"w");
+      if (hanno == NULL)
+        fprintf(stderr,"%s: Warning: could not save the read hashes in track %s.%s\n",
+                       Prog_Name,root,HASH_TRACK);
+      else
+        { FSEEKO(hanno,2*sizeof(int)+sizeof(uint64)*((int64) hreads),SEEK_SET)
+          FFWRITE(load.hash+hreads,sizeof(uint64),ureads-hreads,hanno)
+          if (fflush(hanno) != 0)
+            SYSTEM_WRITE_ERROR
+          if (ftruncate(fileno(hanno),2*sizeof(int)+sizeof(uint64)*((int64) ureads)) < 0)
+            SYSTEM_WRITE_ERROR
+          FSEEKO(hanno,0,SEEK_SET)
+          FFWRITE(&ureads,sizeof(int),1,hanno)
+          FFWRITE(&size,sizeof(int),1,hanno)
+          FCLOSE(hanno)
+        }
+    }
+
   rename(Catenate(pwd,"/",root,".dbx"),dbname);   //  New image replaces old image
 
   exit (0);
@@ -775,6 +1789,29 @@ error:
     }
   if (istub != NULL)
     fclose(istub);
+  if (pool.shard != NULL)
+    { int i;
+
+      for (i = 0; i < pool.next; i++)
+        remove_shard(&pool,i);
+    }
+  if (qnew)
+    { if (qanno != NULL)
+        fclose(qanno);
+      if (qdata != NULL)
+        fclose(qdata);
+      unlink(Catenate(pwd,PATHSEP,root,"."QUAL_TRACK".anno"));
+      unlink(Catenate(pwd,PATHSEP,root,"."QUAL_TRACK".data"));
+    }
+  else if (qdata != NULL)
+    { fseeko(qdata,0,SEEK_SET);
+      if (ftruncate(fileno(qdata),doff) < 0)
+        fprintf(stderr,"%s: Fatal: could not restore %s.%s.data after error, truncate failed\n",
+                       Prog_Name,root,QUAL_TRACK);
+      fclose(qdata);
+    }
+  if (!qnew && qanno != NULL)
+    fclose(qanno);
 
   exit (1);
 }
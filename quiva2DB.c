@@ -18,8 +18,11 @@
 #include <strings.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
 #include "DB.h"
+#include "GZ.h"
 #include "QV.h"
 
 //  Compiled in INTERACTIVE mode as all routines must return with an error
@@ -31,7 +34,14 @@
 #define PATHSEP "/"
 #endif
 
-static char *Usage = "[-v] <path:db> ( -f<file> | -i | <input:quiva> ... )";
+static char *Usage[] =
+    { "[-vlrc] [-T<int(4)>] [-b<int>] [-L<bins>]",
+      "  <path:db> ( -f<file> | -i | <input:quiva> ... )"
+    };
+
+static int NTHREADS;   //  # of compression threads
+
+#define CHUNK_BASES  1000000   //  Bases of QVs per thread in each chunk of a cell
 
 typedef struct
   { int    argc;
@@ -91,39 +101,214 @@ int next_file(File_Iterator *it)
 }
 
 
+/*******************************************************************************************
+ *
+ *  Input: a regular .quiva file is memory mapped and each cell is scanned in place, otherwise
+ *    (a pipe) the QV streams of a cell are kept in memory as they are scanned.  Either way
+ *    the entries of a cell are then compressed directly from memory.
+ *
+ ********************************************************************************************/
+
+typedef struct
+  { char  *text;   //  Memory map of the input, or NULL if it is not a regular file
+    int64  tlen;
+    int64  tpos;   //  Offset in text of the next entry
+  } Text_Map;
+
+  //  Map input if it is a non-empty regular file.  Return non-zero on error.
+
+static int map_input(FILE *input, Text_Map *map)
+{ struct stat sb;
+  void       *text;
+
+  map->text = NULL;
+  map->tlen = 0;
+  map->tpos = 0;
+  if (fstat(fileno(input),&sb) < 0 || ! S_ISREG(sb.st_mode) || sb.st_size == 0)
+    return (0);
+  text = mmap(NULL,sb.st_size,PROT_READ|PROT_WRITE,MAP_PRIVATE,fileno(input),0);
+  if (text == MAP_FAILED)
+    { fprintf(stderr,"%s: System error: could not map input file\n",Prog_Name);
+      return (1);
+    }
+  madvise(text,sb.st_size,MADV_SEQUENTIAL);
+  map->text = (char *) text;
+  map->tlen = sb.st_size;
+  return (0);
+}
+
+static void unmap_input(Text_Map *map)
+{ if (map->text != NULL)
+    munmap(map->text,map->tlen);
+  map->text = NULL;
+}
+
+/*******************************************************************************************
+ *
+ *  Parallel compression of the entries of a cell: the entries are taken in chunks, each
+ *    chunk divided among the threads which compress their part into their own in-memory
+ *    buffer.  The thread buffers are then appended in order to the .qvs and the .coff of
+ *    each read is set to its offset there.
+ *
+ ********************************************************************************************/
+
+typedef struct
+  { QVcoding  *coding;
+    char     **lines;    //  The 5 QV lines of entry i start at lines[i], each rlen[i] long
+    int       *rlen;     //    and separated by nl (0 or 1) newlines
+    int        nl;
+    DAZZ_READ *reads;    //  The .coff of read i is set to the offset of entry i in buf
+    int        beg, end; //  Compress entries [beg,end)
+    QVbuffer  *buf;      //    into this in-memory buffer
+    char      *tag;      //  Scratch copy of the deletion tags of an entry (NUL terminated)
+    int        tmax;
+    int        error;
+  } Comp_Arg;
+
+static void *compress_thread(void *arg)
+{ Comp_Arg *parm = (Comp_Arg *) arg;
+  int       i, rlen, w;
+  char     *d;
+
+  parm->error = 0;
+  for (i = parm->beg; i < parm->end; i++)
+    { rlen = parm->rlen[i];
+      w    = rlen + parm->nl;
+      d    = parm->lines[i];
+      if (rlen+4 > parm->tmax)
+        { parm->tmax = 1.2*rlen + 1000;
+          parm->tag  = (char *) Realloc(parm->tag,parm->tmax,"Allocating tag buffer");
+          if (parm->tag == NULL)
+            { parm->error = 1;
+              break;
+            }
+        }
+      memcpy(parm->tag,d+w,rlen);
+      parm->tag[rlen] = '\0';
+      parm->reads[i].coff = Tell_QVbuffer(parm->buf);
+      if (Compress_Next_QVentry1(rlen,d,parm->tag,d+2*w,d+3*w,d+4*w,
+                                 parm->buf,parm->coding,1))
+        { parm->error = 1;
+          break;
+        }
+    }
+  return (NULL);
+}
+
+  //  Compress the n entries given by lines, rlen, and nl with coding, appending them to
+  //    qbuf and setting the .coff of reads[0..n-1].  Return non-zero on error.
+
+static int compress_cell(QVbuffer *qbuf, QVcoding *coding, char **lines, int *rlen, int nl,
+                         DAZZ_READ *reads, int n, Comp_Arg *parm)
+{ pthread_t threads[NTHREADS];
+  int       beg, end;
+  int       t, k;
+  int64     dlen, cum, base;
+
+  for (beg = 0; beg < n; beg = end)
+    { dlen = 0;
+      for (end = beg; end < n && dlen < ((int64) CHUNK_BASES)*NTHREADS; end++)
+        dlen += rlen[end];
+
+      k   = beg;
+      cum = 0;
+      for (t = 0; t < NTHREADS; t++)
+        { parm[t].coding = coding;
+          parm[t].lines  = lines;
+          parm[t].rlen   = rlen;
+          parm[t].nl     = nl;
+          parm[t].reads  = reads;
+          parm[t].beg    = k;
+          if (t == NTHREADS-1)
+            k = end;
+          else
+            while (k < end && cum < ((t+1)*dlen)/NTHREADS)
+              cum += rlen[k++];
+          parm[t].end = k;
+          pthread_create(threads+t,NULL,compress_thread,parm+t);
+        }
+
+      for (t = 0; t < NTHREADS; t++)
+        pthread_join(threads[t],NULL);
+
+      for (t = 0; t < NTHREADS; t++)
+        { if (parm[t].error)
+            { fprintf(stderr,"%s",Ebuffer);
+              return (1);
+            }
+          base = Tell_QVbuffer(qbuf);
+          for (k = parm[t].beg; k < parm[t].end; k++)
+            reads[k].coff += base;
+          if (Append_QVbuffer(qbuf,parm[t].buf))
+            { fprintf(stderr,"%s",Ebuffer);
+              return (1);
+            }
+        }
+    }
+  return (0);
+}
+
 int main(int argc, char *argv[])
 { FILE      *istub;
   char      *root, *pwd;
 
   FILE      *quiva, *indx;
+  QVbuffer  *qbuf;
+  QVcontext *qctx;
   int64      coff;
 
   DAZZ_DB    db;
   DAZZ_READ *reads;
   int        nfiles;
 
-  FILE      *temp;
-  char      *tname;
+  Text_Map   map;
+  char     **lines;
+  int       *rlen;
+  int        emax;
+  Comp_Arg  *parm;
 
   int        VERBOSE;
   int        PIPE;
+  int        CODEC;
+  int        BLOCK;
+  QVbinning *BINS;
   FILE      *INFILE;
 
   //  Process command line
 
   { int   i, j, k;
     int   flags[128];
+    char *eptr;
 
     ARG_INIT("quiva2DB")
 
-    INFILE = NULL;
+    INFILE   = NULL;
+    NTHREADS = 4;
+    BLOCK    = 0;
+    BINS     = NULL;
 
     j = 1;
     for (i = 1; i < argc; i++)
       if (argv[i][0] == '-')
         switch (argv[i][1])
         { default:
-            ARG_FLAGS("vli")
+            ARG_FLAGS("vlrci")
+            break;
+          case 'T':
+            ARG_POSITIVE(NTHREADS,"Number of threads")
+            break;
+          case 'b':
+            ARG_POSITIVE(BLOCK,"Block size")
+            break;
+          case 'L':
+            if (strcmp(argv[i]+2,"illumina") == 0)
+              BINS = Create_QVbinning(QV_BIN_ILLUMINA);
+            else
+              BINS = Read_QVbinning(argv[i]+2);
+            if (BINS == NULL)
+              { fprintf(stderr,"%s",Ebuffer);
+                exit (1);
+              }
             break;
           case 'f':
             INFILE = fopen(argv[i]+2,"r");
@@ -139,19 +324,44 @@ int main(int argc, char *argv[])
 
     VERBOSE = flags['v'];
     PIPE    = flags['i'];
+    if (flags['c'])
+      CODEC = QV_CONTEXT;
+    else if (flags['r'])
+      CODEC = QV_RANS;
+    else
+      CODEC = QV_HUFFMAN;
 
     if (INFILE != NULL && PIPE)
       { fprintf(stderr,"%s: Cannot use both -f and -i together\n",Prog_Name);
         exit (1);
       }
 
+    if (flags['l'])
+      { if (BINS != NULL)
+          { fprintf(stderr,"%s: Cannot use both -l and -L together\n",Prog_Name);
+            exit (1);
+          }
+        BINS = Create_QVbinning(QV_BIN_DEXQV);
+        if (BINS == NULL)
+          { fprintf(stderr,"%s",Ebuffer);
+            exit (1);
+          }
+      }
+
     if ( (INFILE == NULL && ! PIPE && argc <= 2) || 
         ((INFILE != NULL || PIPE) && argc != 2))
-      { fprintf(stderr,"Usage: %s %s\n",Prog_Name,Usage);
+      { fprintf(stderr,"Usage: %s %s\n",Prog_Name,Usage[0]);
+        fprintf(stderr,"       %*s %s\n",(int) strlen(Prog_Name),"",Usage[1]);
         fprintf(stderr,"\n");
         fprintf(stderr,"      -f: import files listed 1/line in given file.\n");
         fprintf(stderr,"      -i: import data from stdin.\n");
         fprintf(stderr,"        : otherwise, import sequence of specified files.\n");
+        fprintf(stderr,"      -r: entropy code QVs with rANS instead of Huffman codes.\n");
+        fprintf(stderr,"      -c: as -r but code each QV with a model for the QV before it.\n");
+        fprintf(stderr,"      -T: Number of threads used to compress QVs.\n");
+        fprintf(stderr,"      -b: Code reads in independent blocks of this many QVs.\n");
+        fprintf(stderr,"      -l: Halve insertion and quarter merge QV resolution (as dexqv).\n");
+        fprintf(stderr,"      -L: Bin QVs into Illumina's 8 levels (illumina) or as per file.\n");
         exit (1);
       }
   }
@@ -196,25 +406,51 @@ int main(int argc, char *argv[])
     }
 
   quiva = NULL;
-  temp  = NULL;
+  qbuf  = NULL;
+  qctx  = NULL;
   coff  = 0;
 
+  map.text = NULL;
+  lines    = NULL;
+  rlen     = NULL;
+  emax     = 0;
+
   if (reads[0].coff < 0)
     quiva = Fopen(Catenate(pwd,PATHSEP,root,".qvs"),"w");
   else
     quiva = Fopen(Catenate(pwd,PATHSEP,root,".qvs"),"r+");
 
-  tname = Strdup(Catenate(".",PATHSEP,root,Numbered_Suffix("",getpid(),".tmp")),
-                 "Allocating temporary name");
-  temp = Fopen(tname,"w+");
-
-  if (quiva == NULL || temp == NULL)
+  if (quiva == NULL)
     { fprintf(stderr,"%s",Ebuffer);
       goto error;
     }
   fseeko(quiva,0,SEEK_END);
   coff = ftello(quiva);
 
+  qbuf = New_QVbuffer(quiva);
+  qctx = New_QVcontext();
+  if (qbuf == NULL || qctx == NULL)
+    { fprintf(stderr,"%s",Ebuffer);
+      goto error;
+    }
+
+  parm = (Comp_Arg *) Malloc(sizeof(Comp_Arg)*NTHREADS,"Allocating thread records");
+  if (parm == NULL)
+    { fprintf(stderr,"%s",Ebuffer);
+      goto error;
+    }
+  { int t;
+
+    for (t = 0; t < NTHREADS; t++)
+      { parm[t].tag  = NULL;
+        parm[t].tmax = 0;
+        if ((parm[t].buf = New_QVbuffer(NULL)) == NULL)
+          { fprintf(stderr,"%s",Ebuffer);
+            goto error;
+          }
+      }
+  }
+
   //  Do a merged traversal of cell lines in .db stub file and .quiva files to be
   //    imported, driving the loop with the cell line #
 
@@ -259,7 +495,11 @@ int main(int argc, char *argv[])
                   goto error;
                 }
 
-              input = stdin;
+              input = Gz_Input(stdin,NTHREADS);
+              if (input == NULL)
+                { fprintf(stderr,"%s",Ebuffer);
+                  goto error;
+                }
 
               if (VERBOSE)
                 { fprintf(stderr,"Adding quiva's from stdin ...\n");
@@ -283,12 +523,14 @@ int main(int argc, char *argv[])
                   goto error;
                 }
   
-              core = Root(ng->name,".quiva");
+              core = Gz_Root(ng->name,".quiva");
               path = PathTo(ng->name);
-              if ((input = Fopen(Catenate(path,"/",core,".quiva"),"r")) == NULL)
-                { fprintf(stderr,"%s",Ebuffer);
+              if ((input = Gz_Fopen(path,core,".quiva",NTHREADS)) == NULL)
+                { fprintf(stderr,"%s: Cannot open %s/%s.quiva for 'r'\n",Prog_Name,path,core);
                   goto error;
                 }
+              if (map_input(input,&map))
+                goto error;
   
               first = 0;
               while (cell < nfiles)
@@ -347,7 +589,12 @@ int main(int argc, char *argv[])
                     goto error;
                   }
 
-                fclose(input);
+                unmap_input(&map);
+                if (Gz_Close(input))
+                  { fprintf(stderr,"%s: %s.quiva is not a valid gzip file or is truncated\n",
+                                   Prog_Name,core);
+                    goto error;
+                  }
                 free(path);
                 free(core);
 
@@ -359,11 +606,13 @@ int main(int argc, char *argv[])
                   }
 
                 path = PathTo(ng->name);
-                core = Root(ng->name,".quiva");
-                if ((input = Fopen(Catenate(path,"/",core,".quiva"),"r")) == NULL)
-                  { fprintf(stderr,"%s",Ebuffer);
+                core = Gz_Root(ng->name,".quiva");
+                if ((input = Gz_Fopen(path,core,".quiva",NTHREADS)) == NULL)
+                  { fprintf(stderr,"%s: Cannot open %s/%s.quiva for 'r'\n",Prog_Name,path,core);
                     goto error;
                   }
+                if (map_input(input,&map))
+                  goto error;
 
                 if (strcmp(core,fname) != 0)
                   { fprintf(stderr,"%s: Files not being added in order (expect %s, given %s)\n",
@@ -381,19 +630,54 @@ int main(int argc, char *argv[])
 
         //  Compress reads [first..last) from open .quiva appending to .qvs and record
         //    offset in .coff field of reads (offset of first in a cell is to the compression
-        //    table).
+        //    table).  First scan the entries: in place if the input is mapped, otherwise
+        //    keeping their QV streams in the memory buffer save.
 
         { int64     qpos;
           QVcoding *coding;
-          int       i, s;
+          QVbuffer *save;
+          int       i, s, nl;
+
+          if (last-first > emax)
+            { emax  = 1.2*(last-first) + 1000;
+              lines = (char **) Realloc(lines,sizeof(char *)*emax,"Allocating entry index");
+              rlen  = (int *) Realloc(rlen,sizeof(int)*emax,"Allocating entry index");
+              if (lines == NULL || rlen == NULL)
+                { fprintf(stderr,"%s",Ebuffer);
+                  goto error;
+                }
+            }
 
-          rewind(temp);
-          if (ftruncate(fileno(temp),0) < 0)
-            { fprintf(stderr,"%s: System error: could not truncate temporary file\n",Prog_Name);
-              goto error;
+          Set_QV_Line(qctx,cline);
+          save = NULL;
+          if (map.text != NULL)
+            { int64 used;
+
+              s = QVcoding_Scan_Text(qctx,map.text+map.tpos,map.tlen-map.tpos,last-first,
+                                     lines,rlen,&used);
+              map.tpos += used;
+              fseeko(input,map.tpos,SEEK_SET);
+              nl = 1;
             }
-          Set_QV_Line(cline);
-          s = QVcoding_Scan(input,last-first,temp);
+          else
+            { save = New_QVbuffer(NULL);
+              if (save == NULL)
+                { fprintf(stderr,"%s",Ebuffer);
+                  goto error;
+                }
+              s = QVcoding_Scan(qctx,input,last-first,save,rlen);
+              if (s >= 0)
+                { int64 off;
+
+                  off = 0;
+                  for (i = 0; i < s; i++)
+                    { lines[i] = (char *) save->data + off;
+                      off += 5*rlen[i];
+                    }
+                }
+              nl = 0;
+            }
+          cline = Get_QV_Line(qctx);
           if (s < 0)
             { fprintf(stderr,"%s",Ebuffer);
               goto error;
@@ -407,12 +691,19 @@ int main(int argc, char *argv[])
                                Prog_Name,core,fname);
               goto error;
             }
+          for (i = 0; i < s; i++)
+            if (rlen[i] != reads[first+i].rlen)
+              { fprintf(stderr,"%s: Length of quiva %d is different than fasta in DB\n",
+                               Prog_Name,first+i+1);
+                goto error;
+              }
 
-          coding = Create_QVcoding(0);
+          coding = Create_QVcoding(qctx,BINS,CODEC);
           if (coding == NULL)
             { fprintf(stderr,"%s",Ebuffer);
               goto error;
             }
+          coding->block = BLOCK;
 
           coding->prefix = Strdup(".qvs","Allocating header prefix");
           if (coding->prefix == NULL)
@@ -420,35 +711,41 @@ int main(int argc, char *argv[])
               goto error;
             }
 
-          qpos = ftello(quiva);
-          Write_QVcoding(quiva,coding);
+          qpos = Tell_QVbuffer(qbuf);
+          if (Write_QVcoding(qbuf,coding))
+            { fprintf(stderr,"%s",Ebuffer);
+              goto error;
+            }
 
-          //  Then compress and append to the .qvs each compressed QV entry
+          //  Then compress and append to the .qvs each compressed QV entry, the .coff of
+          //    the first read being the offset of the coding scheme
  
-          rewind(temp);
-          Set_QV_Line(cline);
-          for (i = first; i < last; i++)
-            { s = Read_Lines(temp,1);
-              if (s < -1)
-                { fprintf(stderr,"%s",Ebuffer);
-                  goto error;
-                }
-              reads[i].coff = qpos;
-              s = Compress_Next_QVentry(temp,quiva,coding,0);
-              if (s < 0)
-                { fprintf(stderr,"%s",Ebuffer);
-                  goto error;
-                }
-              if (s != reads[i].rlen)
-                { fprintf(stderr,"%s: Length of quiva %d is different than fasta in DB\n",
-                                 Prog_Name,i+1);
-                  goto error;
-                }
-              qpos = ftello(quiva);
+          if (compress_cell(qbuf,coding,lines,rlen,nl,reads+first,last-first,parm))
+            goto error;
+          if (last > first)
+            reads[first].coff = qpos;
+
+          if (VERBOSE)
+            { int64 qvs;
+
+              qvs = 0;
+              for (i = 0; i < s; i++)
+                qvs += 5*rlen[i];
+              fprintf(stderr,"  ");
+              Print_Number(qvs,0,stderr);
+              fprintf(stderr," QVs compressed to ");
+              Print_Number(Tell_QVbuffer(qbuf)-qpos,0,stderr);
+              if (qvs > 0)
+                fprintf(stderr," bytes (%.2f bits/QV)\n",(8.*(Tell_QVbuffer(qbuf)-qpos))/qvs);
+              else
+                fprintf(stderr," bytes\n");
+              fflush(stderr);
             }
-          cline = Get_QV_Line();
 
           Free_QVcoding(coding);
+          free(coding);
+          if (save != NULL)
+            Free_QVbuffer(save);
         }
       }
 
@@ -462,7 +759,12 @@ int main(int argc, char *argv[])
         goto error;
       }
     if ( ! PIPE && cell >= nfiles)
-      { fclose(input);
+      { unmap_input(&map);
+        if (Gz_Close(input))
+          { fprintf(stderr,"%s: %s.quiva is not a valid gzip file or is truncated\n",
+                           Prog_Name,core);
+            goto error;
+          }
         free(core);
         free(path);
         if (next_file(ng))
@@ -470,7 +772,7 @@ int main(int argc, char *argv[])
               { fprintf(stderr,"%s",Ebuffer);
                 goto error;
               }
-            core = Root(ng->name,".quiva");
+            core = Gz_Root(ng->name,".quiva");
             fprintf(stderr,"%s: %s.fasta has never been added to DB\n",Prog_Name,core);
             goto error;
           }
@@ -479,6 +781,24 @@ int main(int argc, char *argv[])
 
   //  Write the db record and read index into .idx and clean up
 
+  if (Flush_QVbuffer(qbuf))
+    { fprintf(stderr,"%s",Ebuffer);
+      goto error;
+    }
+  Free_QVbuffer(qbuf);
+  Free_QVcontext(qctx);
+  free(BINS);
+  { int t;
+
+    for (t = 0; t < NTHREADS; t++)
+      { Free_QVbuffer(parm[t].buf);
+        free(parm[t].tag);
+      }
+    free(parm);
+    free(lines);
+    free(rlen);
+  }
+
   rewind(indx);
   fwrite(&db,sizeof(DAZZ_DB),1,indx);
   fwrite(reads,sizeof(DAZZ_READ),db.ureads,indx);
@@ -486,8 +806,6 @@ int main(int argc, char *argv[])
   fclose(istub);
   fclose(indx);
   fclose(quiva);
-  fclose(temp);
-  unlink(tname);
 
   exit (0);
 
@@ -500,15 +818,15 @@ error:
         fprintf(stderr,"%s: Fatal: could not restore %s.qvs after error, truncate failed\n",
                        Prog_Name,root);
     }
+  if (qbuf != NULL)
+    Free_QVbuffer(qbuf);
+  if (qctx != NULL)
+    Free_QVcontext(qctx);
   if (quiva != NULL)
     { fclose(quiva);
       if (coff == 0)
         unlink(Catenate(pwd,PATHSEP,root,".qvs"));
     }
-  if (temp != NULL)
-    { fclose(temp);
-      unlink(tname);
-    }
   fclose(istub);
   fclose(indx);
 